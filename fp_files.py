@@ -177,6 +177,29 @@ def sqlite_row_fp(rw):
     # GiST will take parts necessary for the keys
     return (fd, fp)
 
+def sqlite_to_corpus(sconn, corpus_fpath):
+    '''Write every fingerprint in the sqlite ``fingerprints`` table to a
+    ``musicfp.Corpus`` file at ``corpus_fpath``, using the sqlite ``rowid``
+    as the corpus id.  Return the number of fingerprints written.
+
+    Unpickling happens once here; afterwards ``mfp.Corpus(corpus_fpath)``
+    opens instantly and is shared between processes::
+
+      corpus = mfp.Corpus(corpus_fpath)
+      for ix, score in corpus.topk(fp):
+          rowid = corpus.ids[ix]
+
+    '''
+    crsr = sconn.execute('select rowid, fingerprint from fingerprints '
+                         'where fingerprint is not null order by rowid')
+    counter = [0]
+    def rows():
+        for rowid, blob in crsr:
+            counter[0] += 1
+            yield (rowid, s3blob_to_fprint(blob))
+    mfp.write_corpus(corpus_fpath, rows())
+    return counter[0]
+
 CREATE_RESULTS_TABLE = """\
 create table if not exists results (
   cp    REAL NOT NULL,
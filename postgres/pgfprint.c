@@ -24,8 +24,32 @@
 #include "libpq/pqformat.h"
 #include "access/gist.h"
 #include "access/skey.h"
+#include "access/xact.h"
+#include "utils/memutils.h"
+
+#if PG_VERSION_NUM >= 120000
+#include "catalog/pg_opfamily.h"
+#include "catalog/pg_type.h"
+#include "nodes/makefuncs.h"
+#include "nodes/nodeFuncs.h"
+#include "nodes/pathnodes.h"
+#include "nodes/supportnodes.h"
+#include "optimizer/optimizer.h"
+#include "parser/parse_func.h"
+#include "parser/parse_oper.h"
+#include "utils/lsyscache.h"
+#endif
+
+#if PG_VERSION_NUM >= 90500
+#include "access/brin_internal.h"
+#include "access/brin_tuple.h"
+#include "catalog/pg_type.h"
+#include "utils/datum.h"
+#include "utils/typcache.h"
+#endif
 
 #include "fplib.h"
+#include "fpmatch.h"
 
 #ifdef PG_MODULE_MAGIC
 PG_MODULE_MAGIC;
@@ -58,6 +82,8 @@ Datum fprint_neq(PG_FUNCTION_ARGS);
 PG_FUNCTION_INFO_V1(fprint_neq);
 Datum fprint_match(PG_FUNCTION_ARGS);
 PG_FUNCTION_INFO_V1(fprint_match);
+Datum fprint_similar(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(fprint_similar);
 
 typedef struct
 {
@@ -65,7 +91,7 @@ typedef struct
   uint8_t data[1];
 } fprint_gist;
 
-#define MAX_KEY_CP_LEN 240
+#define MAX_KEY_CP_LEN FPMATCH_KEY_CP_LEN
 // #define KEY_CP_END_IX 480
 //  NEW: 704 - 944 (secs 44-59)
 #define KEY_CP_START_IX1 464
@@ -81,6 +107,13 @@ typedef struct
 #define GET_GFP_ARG(argn) \
   (fprint_gist *)PG_DETOAST_DATUM(PG_GETARG_POINTER((argn)))
 
+// Everything in a serialized FPrint before cprint: cprint_len, songlen,
+// bit_rate, num_errors, r and dom.
+#define FP_HEADER_SIZE offsetof(FPrint, cprint)
+// A prefix this long always holds the header and the index key window.
+#define KEY_CP_FETCH_SIZE \
+  (FP_HEADER_SIZE + KEY_CP_END_IX2 * sizeof(((FPrint *)0)->cprint[0]))
+
 // Strategies -- see corresponding numbers in operator class of pgfprint.sql
 #define FPStrategyEQ 3
 #define FPStrategyNEQ 12
@@ -146,6 +179,193 @@ static inline FPrintUnion *check_union_size(FPrintUnion *fp_u, FPrint *fp_n)
   return fp_u;
 }
 
+/* fetch_fprint_slice
+ * Return the first `len` bytes of a (possibly toasted) fprint without
+ * detoasting the rest.  The type is stored with `storage = external` (see
+ * pgfprint.sql), so large values sit uncompressed in TOAST and a prefix
+ * costs only the chunks it covers; a 60 s print spans three chunks and the
+ * header sits in the first.  Values that are not toasted are returned as
+ * is.  The result may be shorter than `len` if the value is; release it
+ * with FREE_FPRINT_SLICE.
+ */
+static inline fprint_gist *fetch_fprint_slice(Datum toasted, size_t len)
+{
+  struct varlena *raw = (struct varlena *)DatumGetPointer(toasted);
+  fprint_gist *gfp = NULL;
+
+  if (raw == NULL)
+    return NULL;
+  if (!VARATT_IS_EXTENDED(raw))
+    gfp = (fprint_gist *)raw;
+  else
+    gfp = (fprint_gist *)PG_DETOAST_DATUM_SLICE(toasted, 0, len);
+
+  if (gfp == NULL || VARSIZE(gfp) < VARHDRSZ + FP_HEADER_SIZE)
+  {
+    if (gfp && (Pointer)gfp != (Pointer)raw)
+      pfree(gfp);
+    return NULL;
+  }
+  if (SERIALIZED_FP(gfp)->cprint_len > 100000)
+  {
+    elog(ERROR, "[%s:%s:%d] detoasted fprint is invalid: cprint_len: " SIZE_T_FMT,
+         __FILE__, __func__, __LINE__, SERIALIZED_FP(gfp)->cprint_len);
+  }
+
+  return gfp;
+}
+
+#define FREE_FPRINT_SLICE(gfp, toasted)                            \
+  do                                                               \
+  {                                                                \
+    if ((gfp) && (Pointer)(gfp) != DatumGetPointer(toasted))       \
+      pfree(gfp);                                                  \
+  } while (0)
+
+/* songlen_may_match
+ * match_cpfm scores 0.0 for fingerprints whose song lengths are too far
+ * apart; check that on the headers alone before detoasting either cprint.
+ */
+static inline bool songlen_may_match(Datum a, Datum b)
+{
+  fprint_gist *ga = fetch_fprint_slice(a, FP_HEADER_SIZE);
+  fprint_gist *gb = NULL;
+  bool retval = false;
+
+  if (ga == NULL)
+    return false;
+  gb = fetch_fprint_slice(b, FP_HEADER_SIZE);
+  if (gb != NULL)
+  {
+    retval = (bool)FP_SONGLEN_MAY_MATCH(SERIALIZED_FP(ga)->songlen,
+                                        SERIALIZED_FP(gb)->songlen);
+  }
+
+  FREE_FPRINT_SLICE(ga, a);
+  FREE_FPRINT_SLICE(gb, b);
+
+  return retval;
+}
+
+/* Score cache
+ * A statement that filters on ~= or fprint_similar and selects fprint_cmp
+ * of the same pair would compute match_cpfm twice per row.  The last score
+ * is kept with the raw datums it came from; a toasted value compares by its
+ * toast pointer, so a hit detoasts nothing.  Toast pointers are only
+ * compared within the statement that saw them.
+ */
+#ifndef VARATT_IS_EXTERNAL_ONDISK
+// before 9.4 every external datum is on disk
+#define VARATT_IS_EXTERNAL_ONDISK(p) VARATT_IS_EXTERNAL(p)
+#endif
+
+typedef struct
+{
+  TimestampTz stmt_start;
+  char *raw[2];
+  Size len[2];
+  Size cap[2];
+  double score;
+  bool valid;
+} ScoreCache;
+
+static ScoreCache score_cache;
+
+static inline bool score_cacheable(Datum d)
+{
+  struct varlena *raw = (struct varlena *)DatumGetPointer(d);
+
+  // in-memory (expanded or indirect) values have no stable identity
+  return !VARATT_IS_EXTERNAL(raw) || VARATT_IS_EXTERNAL_ONDISK(raw);
+}
+
+static inline bool score_cache_holds(int slot, Datum d)
+{
+  struct varlena *raw = (struct varlena *)DatumGetPointer(d);
+  Size len = VARSIZE_ANY(raw);
+
+  return score_cache.len[slot] == len &&
+         memcmp(score_cache.raw[slot], raw, len) == 0;
+}
+
+static void score_cache_put(int slot, Datum d)
+{
+  struct varlena *raw = (struct varlena *)DatumGetPointer(d);
+  Size len = VARSIZE_ANY(raw);
+
+  if (score_cache.cap[slot] < len)
+  {
+    if (score_cache.raw[slot])
+      pfree(score_cache.raw[slot]);
+    score_cache.raw[slot] = MemoryContextAlloc(TopMemoryContext, len);
+    score_cache.cap[slot] = len;
+  }
+  memcpy(score_cache.raw[slot], raw, len);
+  score_cache.len[slot] = len;
+}
+
+/* fprint_score
+ * fpmatch_cpfm of two (possibly toasted) fprints; 0.0 without detoasting
+ * when their song lengths rule a match out.
+ */
+static double fprint_score(Datum a, Datum b)
+{
+  TimestampTz stmt_start = GetCurrentStatementStartTimestamp();
+  bool cacheable = score_cacheable(a) && score_cacheable(b);
+  fprint_gist *ga = NULL;
+  fprint_gist *gb = NULL;
+  double score = 0.0;
+
+  // the score is symmetric
+  if (cacheable && score_cache.valid && score_cache.stmt_start == stmt_start &&
+      ((score_cache_holds(0, a) && score_cache_holds(1, b)) ||
+       (score_cache_holds(0, b) && score_cache_holds(1, a))))
+    return score_cache.score;
+
+  if (songlen_may_match(a, b))
+  {
+    ga = (fprint_gist *)PG_DETOAST_DATUM(a);
+    gb = (fprint_gist *)PG_DETOAST_DATUM(b);
+    score = fpmatch_cpfm(SERIALIZED_FP(ga), SERIALIZED_FP(gb));
+    if ((Pointer)ga != DatumGetPointer(a))
+      pfree(ga);
+    if ((Pointer)gb != DatumGetPointer(b))
+      pfree(gb);
+  }
+
+  if (cacheable)
+  {
+    score_cache.valid = false;
+    score_cache_put(0, a);
+    score_cache_put(1, b);
+    score_cache.stmt_start = stmt_start;
+    score_cache.score = score;
+    score_cache.valid = true;
+  }
+
+  return score;
+}
+
+/* key_cp_window
+ * The part of the chromaprint kept in index keys: returns the start index
+ * and sets key_cp_len (at most MAX_KEY_CP_LEN).
+ */
+static inline size_t key_cp_window(size_t cprint_len, size_t *key_cp_len)
+{
+  *key_cp_len = min_st(MAX_KEY_CP_LEN, cprint_len);
+  if (cprint_len >= KEY_CP_END_IX2)
+  {
+    // secs 44-59
+    return KEY_CP_START_IX2;
+  }
+  else if (cprint_len >= KEY_CP_END_IX1)
+  {
+    // secs 29.36-44.55
+    return KEY_CP_START_IX1;
+  }
+  return 0;
+}
+
 /* deserialize_fprint
  * We decompress (detoast) anything that would have gone through decompress so:
  *  1. we avoid having GiST hold on to memory from another copy of an item
@@ -157,47 +377,38 @@ static inline FPrintUnion *check_union_size(FPrintUnion *fp_u, FPrint *fp_n)
  */
 static inline FPrint *deserialize_fprint(Datum toasted)
 {
-  fprint_gist *gfp = (fprint_gist *)PG_DETOAST_DATUM(toasted);
+  // only the prefix holding the header and key window is detoasted
+  fprint_gist *gfp = fetch_fprint_slice(toasted, KEY_CP_FETCH_SIZE);
   FPrint *fp = NULL;
   FPrint *nfp = NULL;
-  size_t key_cp_len = MAX_KEY_CP_LEN;
-  int start = 0;
+  size_t key_cp_len = 0;
+  size_t start = 0;
 
-  if ((gfp == NULL || VARSIZE(gfp) == 0))
+  if (gfp == NULL)
   {
     return NULL;
   }
 
   fp = SERIALIZED_FP(gfp);
-
-  if (fp && (fp->cprint_len < 100000))
+  start = key_cp_window(fp->cprint_len, &key_cp_len);
+  if (VARSIZE(gfp) - VARHDRSZ <
+      FP_HEADER_SIZE + (start + key_cp_len) * sizeof(fp->cprint[0]))
   {
-    key_cp_len = min_st(key_cp_len, fp->cprint_len);
-    if (fp->cprint_len >= KEY_CP_END_IX2)
-    {
-      // secs 44-99
-      start = KEY_CP_START_IX2;
-    }
-    else if (fp->cprint_len >= KEY_CP_END_IX1)
-    {
-      // secs 29.36-44.55
-      start = KEY_CP_START_IX1;
-    }
-    nfp = checked_malloc(CALC_FP_SIZE(key_cp_len));
-    if (nfp != NULL)
-    {
-      memcpy(nfp, fp, sizeof(*fp) - sizeof(fp->cprint[0]));
-      memcpy(nfp->cprint, &fp->cprint[start],
-             key_cp_len * sizeof(fp->cprint[0]));
-      nfp->cprint_len = key_cp_len;
-    }
+    elog(ERROR, "[%s:%s:%d] detoasted fprint is truncated: cprint_len: " SIZE_T_FMT,
+         __FILE__, __func__, __LINE__, fp->cprint_len);
   }
-  else if (fp->cprint_len > 100000)
+
+  nfp = checked_malloc(CALC_FP_SIZE(key_cp_len));
+  if (nfp != NULL)
   {
-    elog(ERROR, "[%s:%s:%d] detoasted fprint is invalid: cprint_len: " SIZE_T_FMT, __FILE__, __func__, __LINE__, fp->cprint_len);
+    memcpy(nfp, fp, FP_HEADER_SIZE);
+    memcpy(nfp->cprint, &fp->cprint[start],
+           key_cp_len * sizeof(fp->cprint[0]));
+    nfp->cprint_len = key_cp_len;
   }
 
-  // DO NOT PG_FREE_IF_COPY
+  // DO NOT PG_FREE_IF_COPY the argument; the slice is ours
+  FREE_FPRINT_SLICE(gfp, toasted);
 
   return nfp;
 }
@@ -263,8 +474,8 @@ Datum fprint_in(PG_FUNCTION_ARGS)
 
   //   7 for minimum: "(0,0,0,"
   // + 2 ",," after R and DOM
-  // + 2 "0)" for minimum cprint and finishing ')'
-  if ((fp_str_len = strlen(fp_str)) < (11 + 2 * R_SIZE + 2 * DOM_SIZE))
+  // + 1 ")" for an empty cprint and finishing ')'
+  if ((fp_str_len = strlen(fp_str)) < (10 + 2 * R_SIZE + 2 * DOM_SIZE))
   {
     ereport(ERROR, (errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
                     errmsg("invalid string length: %d\n", fp_str_len)));
@@ -333,6 +544,11 @@ Datum fprint_in(PG_FUNCTION_ARGS)
                       errmsg("integer ending at position %d is too wide\n",
                              fp_str_ix - 1)));
     }
+    else if (c == ')' && cp_char_ix == 0 && cprint_ix == 0)
+    {
+      // empty cprint: no chromaprint was extracted
+      break;
+    }
     else if (c == ' ' || c == ')')
     {
       cpn_str[cp_char_ix] = '\0';
@@ -371,11 +587,18 @@ Datum fprint_in(PG_FUNCTION_ARGS)
                              c, fp_str_ix - 1)));
     }
   }
+  // the loop also ends at the terminating NUL, past which nothing is read
+  if (c != ')')
+  {
+    ereport(ERROR, (errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
+                    errmsg("missing ')' at the end of the cprint\n")));
+  }
 
   // based on cprint[cprint_ix++], cprint_ix == n items
   cprint_len = cprint_ix;
 
-  gfp = palloc(CALC_GFP_SIZE(cprint_len));
+  // zeroed: FPrint.missing and the alignment padding are stored as is
+  gfp = palloc0(CALC_GFP_SIZE(cprint_len));
   SET_VARSIZE_GFP(gfp, cprint_len);
   fp = SERIALIZED_FP(gfp);
   fp->cprint_len = cprint_len;
@@ -385,6 +608,12 @@ Datum fprint_in(PG_FUNCTION_ARGS)
   memcpy(fp->r, r, sizeof(r));
   memcpy(fp->dom, dom, sizeof(dom));
   memcpy(fp->cprint, cprint, cprint_len * sizeof(*cprint));
+  // as fprint_from_string: ":<missing>", else the empty parts
+  if (fp_str[fp_str_ix] == ':')
+    fp->missing = (uint16_t)strtoul(&fp_str[fp_str_ix + 1], NULL, 10);
+  else
+    fp->missing = FP_MISSING_FOOID | FP_MISSING_CHROMA;
+  fp->missing = fprint_missing(fp);
 
   if (cprint)
   {
@@ -397,6 +626,8 @@ Datum fprint_in(PG_FUNCTION_ARGS)
 
 // max 24 (10 each for songlen, bit_rate, num_errors) + 3 for "(,," + 1 '\0'
 #define BASE_SIZE 24
+// ":65535\0" after the closing ')' of a partial fingerprint
+#define MISSING_SIZE 7
 
 Datum fprint_out(PG_FUNCTION_ARGS)
 {
@@ -425,7 +656,7 @@ Datum fprint_out(PG_FUNCTION_ARGS)
   base_sz = snprintf(base, BASE_SIZE, BASEFMT,
                      fp->songlen, fp->bit_rate, fp->num_errors);
   // + 2 for following ")\0"; 9 to allow for '-'
-  str_sz = base_sz + (2 * R_SIZE + 1) + (2 * DOM_SIZE + 1) + (12 * cprint_len) + 2;
+  str_sz = base_sz + (2 * R_SIZE + 1) + (2 * DOM_SIZE + 1) + (12 * cprint_len) + 2 + MISSING_SIZE;
 
   tmpstr = palloc(str_sz * sizeof(char));
 
@@ -450,9 +681,15 @@ Datum fprint_out(PG_FUNCTION_ARGS)
     // 32-bit int max size is 10 chars + 2 ("-"? and " \0")
     out_len += snprintf(&tmpstr[out_len], 13, "%d ", cprint[j]);
   }
-  // cheat: pull back from final " "
-  out_len -= 1;
+  // cheat: pull back from final " " (there is none for an empty cprint)
+  if (cprint_len > 0)
+    out_len -= 1;
   strncpy(&tmpstr[out_len++], ")", 2);
+  if (fprint_missing(fp))
+  {
+    out_len += snprintf(&tmpstr[out_len], MISSING_SIZE, ":%u",
+                        fprint_missing(fp));
+  }
 
   // only the input pointer here is checked; otherwise this is a
   // bare call to realloc()
@@ -481,8 +718,8 @@ Datum fprint_compress(PG_FUNCTION_ARGS)
   FPrint *fp_in = NULL;
   fprint_gist *gfp_out = NULL;
   FPrint *fp_out = NULL;
-  size_t key_cp_len = MAX_KEY_CP_LEN;
-  int start = 0;
+  size_t key_cp_len = 0;
+  size_t start = 0;
 
   // entry->leafkey == TRUE if coming from table
   if (!entry->leafkey)
@@ -501,39 +738,36 @@ Datum fprint_compress(PG_FUNCTION_ARGS)
     PG_RETURN_POINTER(retval);
   }
 
-  gfp_in = (fprint_gist *)PG_DETOAST_DATUM(entry->key);
+  gfp_in = fetch_fprint_slice(entry->key, KEY_CP_FETCH_SIZE);
   if (!gfp_in)
   {
-    elog(ERROR, "PG_DETOAST_DATUM(<notnull>) returned NULL");
+    elog(ERROR, "fetch_fprint_slice(<notnull>) returned NULL");
     PG_RETURN_POINTER(entry);
   }
   fp_in = SERIALIZED_FP(gfp_in);
 
-  key_cp_len = min_st(key_cp_len, fp_in->cprint_len);
-  if (fp_in->cprint_len >= KEY_CP_END_IX2)
+  start = key_cp_window(fp_in->cprint_len, &key_cp_len);
+  if (VARSIZE(gfp_in) - VARHDRSZ <
+      FP_HEADER_SIZE + (start + key_cp_len) * sizeof(fp_in->cprint[0]))
   {
-    // secs 44-99
-    start = KEY_CP_START_IX2;
-  }
-  else if (fp_in->cprint_len >= KEY_CP_END_IX1)
-  {
-    // secs 30-45
-    start = KEY_CP_START_IX1;
+    elog(ERROR, "[%s:%s:%d] detoasted fprint is truncated: cprint_len: " SIZE_T_FMT,
+         __FILE__, __func__, __LINE__, fp_in->cprint_len);
   }
   gfp_out = palloc(CALC_GFP_SIZE(key_cp_len));
   SET_VARSIZE_GFP(gfp_out, key_cp_len);
   fp_out = (FPrint *)VARDATA(gfp_out);
-  memcpy(fp_out, fp_in, sizeof(*fp_in) - sizeof(fp_in->cprint[0]));
+  memcpy(fp_out, fp_in, FP_HEADER_SIZE);
   memcpy(fp_out->cprint, &fp_in->cprint[start],
          key_cp_len * sizeof(fp_in->cprint[0]));
+  // checked against the full cprint_len, before it becomes the window's
+  fp_out->missing = fprint_missing(fp_in);
   fp_out->cprint_len = key_cp_len;
 
   gistentryinit(*retval, PointerGetDatum(gfp_out),
                 entry->rel, entry->page, entry->offset, FALSE);
 
   // PG_FREE_IF_COPY
-  if ((Pointer)gfp_in != (Pointer)(entry->key))
-    pfree(gfp_in);
+  FREE_FPRINT_SLICE(gfp_in, entry->key);
 
   PG_RETURN_POINTER(retval);
 }
@@ -618,7 +852,7 @@ Datum fprint_union(PG_FUNCTION_ARGS)
       PG_RETURN_NULL();
     }
 
-    fprint_merge_one_union(ret, v);
+    fpmatch_merge_one_union(ret, v);
 
     if (v)
     {
@@ -755,7 +989,7 @@ int cmp_matches(const void *match1, const void *match2)
     (fp_u) = check_union_size((fp_u), (fpx));  \
     if (!(fp_u))                               \
       goto picksplit_cleanup;                  \
-    fprint_merge_one((fp_u), (fpx));           \
+    fpmatch_merge_one((fp_u), (fpx));          \
   } while (0)
 
 #define ASSIGN_IXU(ix, fpux, fp_u, side, n_side)         \
@@ -765,7 +999,7 @@ int cmp_matches(const void *match1, const void *match2)
     (fp_u) = check_union_size((fp_u), (FPrint *)(fpux)); \
     if (!(fp_u))                                         \
       goto picksplit_cleanup;                            \
-    fprint_merge_one_union((fp_u), (fpux));              \
+    fpmatch_merge_one_union((fp_u), (fpux));             \
   } while (0)
 
 // really doesn't add much; used in contrib/hstore/hstore_gist.c
@@ -979,7 +1213,7 @@ Datum fprint_picksplit(PG_FUNCTION_ARGS)
           m->ix1 = k;
           m->ix2 = l;
           m->songlen_diff = 0;
-          m->val = match_cpfm(fp1, fp2);
+          m->val = fpmatch_cpfm(fp1, fp2);
         }
       }
     }
@@ -996,7 +1230,7 @@ Datum fprint_picksplit(PG_FUNCTION_ARGS)
           m->ix1 = k;
           m->ix2 = l;
           m->songlen_diff = 0;
-          m->val = match_fprint_merge((FPrint *)fpu1, fpu2);
+          m->val = fpmatch_fprint_merge((FPrint *)fpu1, fpu2);
         }
       }
     }
@@ -1316,7 +1550,7 @@ Datum fprint_penalty(PG_FUNCTION_ARGS)
   if (new_size > 0.0f)
     songlen_diff = (float)(new_size - orig_size) / (float)new_size * 2000.0f;
 
-  match = match_fprint_merge(new_fp, orig_fp);
+  match = fpmatch_fprint_merge(new_fp, orig_fp);
   if (match > 0.0f)
   {
     match = (1.0f - match) * 100.0f;
@@ -1424,9 +1658,25 @@ Datum fprint_consistent(PG_FUNCTION_ARGS)
     PG_RETURN_BOOL(retval);
   }
 
+  // a preview (short capture) covers only the start of the song, which the
+  // key window (secs 29-59) does not: narrow by songlen and have the
+  // operator recheck the heap tuple
+  if (fprint_missing(qfp) & FP_MISSING_TAIL)
+  {
+    *recheck = true;
+    if (sn == FPStrategyNEQ)
+      retval = true;
+    else if (GIST_LEAF(entry))
+      retval = FP_SONGLEN_MAY_MATCH(qfp->songlen, fp->songlen);
+    else
+      retval = FP_SONGLEN_LO(qfp->songlen) <= fpu->max_songlen &&
+               fpu->min_songlen <= FP_SONGLEN_HI(qfp->songlen);
+    goto consistent_cleanup;
+  }
+
   if (GIST_LEAF(entry))
   {
-    val = match_cpfm(qfp, fp);
+    val = fpmatch_cpfm(qfp, fp);
     FPDEBUG_M("match_cpfm: %.8f", val);
     switch (sn)
     {
@@ -1466,7 +1716,7 @@ Datum fprint_consistent(PG_FUNCTION_ARGS)
     {
       threshold = 0.03;
     }
-    val = (double)match_fprint_merge(qfp, fpu);
+    val = (double)fpmatch_fprint_merge(qfp, fpu);
     FPDEBUG_M("match_fprint_merge: %.16f", val);
     retval = (bool)(val > threshold);
   }
@@ -1481,7 +1731,7 @@ Datum fprint_consistent(PG_FUNCTION_ARGS)
       if ((qfp->songlen < 30 && songlen_diff < .8f) ||
           (qfp->songlen < 61 && songlen_diff < .6f))
       {
-        val = (double)match_fprint_merge(qfp, fpu);
+        val = (double)fpmatch_fprint_merge(qfp, fpu);
         retval = (bool)(val > threshold);
       }
     }
@@ -1490,7 +1740,7 @@ Datum fprint_consistent(PG_FUNCTION_ARGS)
     {
       if (qfp->songlen > 150)
         threshold = 0.15;
-      val = (double)match_fprint_merge(qfp, fpu);
+      val = (double)fpmatch_fprint_merge(qfp, fpu);
       retval = (bool)(val > threshold);
     }
   }
@@ -1512,34 +1762,14 @@ consistent_cleanup:
 
 Datum fprint_cmp(PG_FUNCTION_ARGS)
 {
-  fprint_gist *g0 = GET_GFP_ARG(0);
-  fprint_gist *g1 = GET_GFP_ARG(1);
-  FPrint *fp1 = SERIALIZED_FP(g0);
-  FPrint *fp2 = SERIALIZED_FP(g1);
-  double res = 0.0;
-
-  res = match_cpfm(fp1, fp2);
-
-  PG_FREE_IF_COPY(g0, 0);
-  PG_FREE_IF_COPY(g1, 1);
-
-  PG_RETURN_FLOAT8(res);
+  PG_RETURN_FLOAT8(fprint_score(PG_GETARG_DATUM(0), PG_GETARG_DATUM(1)));
 }
 
 // Higher degree of certainty;
 // at .98 on our match system this is practically 100%
 Datum fprint_eq(PG_FUNCTION_ARGS)
 {
-  fprint_gist *g0 = GET_GFP_ARG(0);
-  fprint_gist *g1 = GET_GFP_ARG(1);
-  FPrint *fp1 = SERIALIZED_FP(g0);
-  FPrint *fp2 = SERIALIZED_FP(g1);
-  double val = 0.0;
-
-  val = match_cpfm(fp1, fp2);
-
-  PG_FREE_IF_COPY(g0, 0);
-  PG_FREE_IF_COPY(g1, 1);
+  double val = fprint_score(PG_GETARG_DATUM(0), PG_GETARG_DATUM(1));
 
   PG_RETURN_BOOL((bool)FP_ISEQ(val));
 }
@@ -1547,16 +1777,7 @@ Datum fprint_eq(PG_FUNCTION_ARGS)
 // support <>
 Datum fprint_neq(PG_FUNCTION_ARGS)
 {
-  fprint_gist *g0 = GET_GFP_ARG(0);
-  fprint_gist *g1 = GET_GFP_ARG(1);
-  FPrint *fp1 = SERIALIZED_FP(g0);
-  FPrint *fp2 = SERIALIZED_FP(g1);
-  double val = 0.0;
-
-  val = match_cpfm(fp1, fp2);
-
-  PG_FREE_IF_COPY(g0, 0);
-  PG_FREE_IF_COPY(g1, 1);
+  double val = fprint_score(PG_GETARG_DATUM(0), PG_GETARG_DATUM(1));
 
   PG_RETURN_BOOL((bool)FP_ISNEQ(val));
 }
@@ -1565,18 +1786,17 @@ Datum fprint_neq(PG_FUNCTION_ARGS)
 // determined by fplib.h FP_ISMATCH.
 Datum fprint_match(PG_FUNCTION_ARGS)
 {
-  fprint_gist *g0 = GET_GFP_ARG(0);
-  fprint_gist *g1 = GET_GFP_ARG(1);
-  FPrint *fp1 = SERIALIZED_FP(g0);
-  FPrint *fp2 = SERIALIZED_FP(g1);
-  double val = 0.0;
+  double val = fprint_score(PG_GETARG_DATUM(0), PG_GETARG_DATUM(1));
 
-  val = match_cpfm(fp1, fp2);
+  PG_RETURN_BOOL((bool)FP_ISMATCH(val));
+}
 
-  PG_FREE_IF_COPY(g0, 0);
-  PG_FREE_IF_COPY(g1, 1);
+// fprint_cmp(a, b) > threshold; see fprint_similar_support
+Datum fprint_similar(PG_FUNCTION_ARGS)
+{
+  double val = fprint_score(PG_GETARG_DATUM(0), PG_GETARG_DATUM(1));
 
-  PG_RETURN_BOOL((bool)FP_ISMATCH(val));
+  PG_RETURN_BOOL(val > PG_GETARG_FLOAT8(2));
 }
 
 /*  Extra functionality for fprint types
@@ -1588,14 +1808,648 @@ Datum fprint_match(PG_FUNCTION_ARGS)
                                                               \
   Datum func_name(PG_FUNCTION_ARGS)                           \
   {                                                           \
-    fprint_gist *gfp = GET_GFP_ARG(0);                        \
-    FPrint *fp = SERIALIZED_FP(gfp);                          \
-    atype attr = fp->attr;                                    \
+    Datum d = PG_GETARG_DATUM(0);                             \
+    fprint_gist *gfp = fetch_fprint_slice(d, FP_HEADER_SIZE); \
+    atype attr = 0;                                           \
                                                               \
-    PG_FREE_IF_COPY(gfp, 0);                                  \
+    if (gfp == NULL)                                          \
+      PG_RETURN_NULL();                                       \
+    attr = SERIALIZED_FP(gfp)->attr;                          \
+    FREE_FPRINT_SLICE(gfp, d);                                \
                                                               \
     pg_ret_type(attr);                                        \
   }
 
 FPRINT_ATTR_FUNC(fprint_songlen, uint32_t, songlen, PG_RETURN_INT32)
 FPRINT_ATTR_FUNC(fprint_num_errors, int32_t, num_errors, PG_RETURN_INT32)
+
+/*  Songlen range helpers
+ *  ---------------------
+ *  match_cpfm (and so every operator) returns 0.0 for two fingerprints whose
+ *  songlen differ by more than FP_SONGLEN_TOLERANCE of the shorter one, so
+ *  a query can only ever match rows with
+ *
+ *    fprint_songlen_lo(q) <= fprint_songlen(fp) <= fprint_songlen_hi(q)
+ *
+ *  Tables partitioned by RANGE (fprint_songlen(fingerprint)) use that to
+ *  skip every partition outside the window; see pgfprint_partition.sql.
+ */
+
+#define FPRINT_SONGLEN_FUNC(func_name, bound)     \
+  Datum func_name(PG_FUNCTION_ARGS);              \
+  PG_FUNCTION_INFO_V1(func_name);                 \
+                                                  \
+  Datum func_name(PG_FUNCTION_ARGS)               \
+  {                                               \
+    Datum d = PG_GETARG_DATUM(0);                 \
+    fprint_gist *gfp = NULL;                      \
+    uint32_t songlen = 0;                         \
+                                                  \
+    gfp = fetch_fprint_slice(d, FP_HEADER_SIZE);  \
+    if (gfp == NULL)                              \
+      PG_RETURN_NULL();                           \
+    songlen = bound(SERIALIZED_FP(gfp)->songlen); \
+    FREE_FPRINT_SLICE(gfp, d);                    \
+                                                  \
+    PG_RETURN_INT32((int32)songlen);              \
+  }
+
+FPRINT_SONGLEN_FUNC(fprint_songlen_lo, FP_SONGLEN_LO)
+FPRINT_SONGLEN_FUNC(fprint_songlen_hi, FP_SONGLEN_HI)
+
+Datum fprint_match_support(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(fprint_match_support);
+
+#if PG_VERSION_NUM >= 120000
+
+static inline bool is_query_arg(Node *arg)
+{
+  return arg != NULL && (IsA(arg, Const) || IsA(arg, Param));
+}
+
+/* build `fprint_songlen(fp) <op> bound` where bound is either a constant
+ * (query is a Const) or a call to fprint_songlen_lo/hi on the query (query
+ * is a Param, which run-time partition pruning evaluates once per scan).
+ */
+static Expr *songlen_bound_clause(Oid songlen_fn, Oid bound_fn,
+                                  StrategyNumber strategy,
+                                  Node *farg, Node *qarg, uint32_t bound)
+{
+  Expr *left = NULL;
+  Expr *right = NULL;
+  Oid opno = InvalidOid;
+  OpExpr *clause = NULL;
+
+  opno = get_opfamily_member(INTEGER_BTREE_FAM_OID, INT4OID, INT4OID,
+                             strategy);
+  if (!OidIsValid(opno))
+    return NULL;
+
+  left = (Expr *)makeFuncExpr(songlen_fn, INT4OID,
+                              list_make1(copyObject(farg)),
+                              InvalidOid, InvalidOid, COERCE_EXPLICIT_CALL);
+  if (IsA(qarg, Const))
+  {
+    right = (Expr *)makeConst(INT4OID, -1, InvalidOid, sizeof(int32),
+                              Int32GetDatum((int32)bound), false, true);
+  }
+  else
+  {
+    right = (Expr *)makeFuncExpr(bound_fn, INT4OID,
+                                 list_make1(copyObject(qarg)),
+                                 InvalidOid, InvalidOid, COERCE_EXPLICIT_CALL);
+  }
+
+  clause = (OpExpr *)make_opclause(opno, BOOLOID, false, left, right,
+                                   InvalidOid, InvalidOid);
+  set_opfuncid(clause);
+
+  return (Expr *)clause;
+}
+
+/* fprint_match_support
+ * Planner support function for fprint_match (the `~=` operator).
+ *
+ * SupportRequestSimplify: rewrite
+ *
+ *   q ~= fp
+ *
+ * into
+ *
+ *   q ~= fp AND fprint_songlen(fp) >= lo(q) AND fprint_songlen(fp) <= hi(q)
+ *
+ * when q is a Const or Param.  The added predicates are implied by `~=` so
+ * results never change, but the planner (and the executor for Params) can
+ * now prune partitions of a table partitioned on fprint_songlen(fingerprint)
+ * and use a btree index on the same expression.
+ *
+ * Child quals of partitioned tables are run through eval_const_expressions
+ * a second time; we only expand while the planner is still preprocessing
+ * the query (no base rels yet) so the range predicate is not duplicated.
+ */
+Datum fprint_match_support(PG_FUNCTION_ARGS)
+{
+  Node *rawreq = (Node *)PG_GETARG_POINTER(0);
+  SupportRequestSimplify *req = NULL;
+  FuncExpr *fcall = NULL;
+  Node *qarg = NULL;
+  Node *farg = NULL;
+  Oid fprint_type = InvalidOid;
+  Oid songlen_fn, lo_fn, hi_fn, match_op;
+  uint32_t lo = 0;
+  uint32_t hi = 0;
+  Expr *match_clause = NULL;
+  Expr *lo_clause = NULL;
+  Expr *hi_clause = NULL;
+
+  if (!IsA(rawreq, SupportRequestSimplify))
+    PG_RETURN_POINTER(NULL);
+
+  req = (SupportRequestSimplify *)rawreq;
+  fcall = req->fcall;
+  if (req->root == NULL || req->root->simple_rel_array != NULL ||
+      list_length(fcall->args) != 2)
+    PG_RETURN_POINTER(NULL);
+
+  qarg = (Node *)linitial(fcall->args);
+  farg = (Node *)lsecond(fcall->args);
+  if (!is_query_arg(qarg))
+  {
+    Node *tmp = qarg;
+    qarg = farg;
+    farg = tmp;
+  }
+  // both constant: let the call be folded; neither: nothing to prune with
+  if (!is_query_arg(qarg) || is_query_arg(farg))
+    PG_RETURN_POINTER(NULL);
+  if (IsA(qarg, Const) && ((Const *)qarg)->constisnull)
+    PG_RETURN_POINTER(NULL);
+
+  fprint_type = exprType(farg);
+  songlen_fn = LookupFuncName(list_make1(makeString("fprint_songlen")),
+                              1, &fprint_type, true);
+  lo_fn = LookupFuncName(list_make1(makeString("fprint_songlen_lo")),
+                         1, &fprint_type, true);
+  hi_fn = LookupFuncName(list_make1(makeString("fprint_songlen_hi")),
+                         1, &fprint_type, true);
+  match_op = LookupOperName(NULL, list_make1(makeString("~=")),
+                            fprint_type, fprint_type, true, -1);
+  if (!OidIsValid(songlen_fn) || !OidIsValid(lo_fn) ||
+      !OidIsValid(hi_fn) || !OidIsValid(match_op))
+    PG_RETURN_POINTER(NULL);
+
+  if (IsA(qarg, Const))
+  {
+    Datum d = ((Const *)qarg)->constvalue;
+    fprint_gist *gfp = fetch_fprint_slice(d, FP_HEADER_SIZE);
+    if (gfp == NULL)
+      PG_RETURN_POINTER(NULL);
+    lo = FP_SONGLEN_LO(SERIALIZED_FP(gfp)->songlen);
+    hi = FP_SONGLEN_HI(SERIALIZED_FP(gfp)->songlen);
+    FREE_FPRINT_SLICE(gfp, d);
+  }
+
+  match_clause = make_opclause(match_op, BOOLOID, false,
+                               (Expr *)copyObject(linitial(fcall->args)),
+                               (Expr *)copyObject(lsecond(fcall->args)),
+                               InvalidOid, InvalidOid);
+  set_opfuncid((OpExpr *)match_clause);
+  lo_clause = songlen_bound_clause(songlen_fn, lo_fn,
+                                   BTGreaterEqualStrategyNumber,
+                                   farg, qarg, lo);
+  hi_clause = songlen_bound_clause(songlen_fn, hi_fn,
+                                   BTLessEqualStrategyNumber,
+                                   farg, qarg, hi);
+  if (!lo_clause || !hi_clause)
+    PG_RETURN_POINTER(NULL);
+
+  PG_RETURN_POINTER(make_andclause(list_make3(match_clause,
+                                              lo_clause, hi_clause)));
+}
+
+#else
+
+// planner support functions arrived in PostgreSQL 12
+Datum fprint_match_support(PG_FUNCTION_ARGS)
+{
+  PG_RETURN_POINTER(NULL);
+}
+
+#endif
+
+/*  Threshold predicates
+ *  --------------------
+ *  fprint_similar(a, b, t) is fprint_cmp(a, b) > t.  The planner only asks
+ *  the top function of a WHERE clause whether an index can serve it, so
+ *  `fprint_cmp(a, b) > t` (whose top function is float8 >) never uses the
+ *  index; fprint_similar does.  A score above t >= FP_MATCH_CUTOFF makes
+ *  `a ~= b` true, and above t >= FP_EXACT_CUTOFF makes `a = b` true, so
+ *  fprint_similar_support hands the index that operator as a lossy
+ *  condition: the executor rechecks fprint_cmp > t on every row it
+ *  returns, since the GiST leaf test is itself approximate.  The score cache lets an
+ *  fprint_cmp of the same pair in the select list reuse the recheck's
+ *  score.  Below FP_MATCH_CUTOFF no index condition is offered.
+ */
+
+Datum fprint_similar_support(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(fprint_similar_support);
+
+#if PG_VERSION_NUM >= 120000
+
+#if PG_VERSION_NUM >= 140000
+#define PULL_VARNOS(root, node) pull_varnos((root), (node))
+#else
+#define PULL_VARNOS(root, node) pull_varnos((node))
+#endif
+
+Datum fprint_similar_support(PG_FUNCTION_ARGS)
+{
+  Node *rawreq = (Node *)PG_GETARG_POINTER(0);
+  SupportRequestIndexCondition *req = NULL;
+  FuncExpr *fcall = NULL;
+  Node *farg = NULL;
+  Node *qarg = NULL;
+  Node *targ = NULL;
+  const char *opname = NULL;
+  double threshold = 0.0;
+  Oid fprint_type = InvalidOid;
+  Oid opno = InvalidOid;
+  Expr *clause = NULL;
+
+  if (!IsA(rawreq, SupportRequestIndexCondition))
+    PG_RETURN_POINTER(NULL);
+
+  req = (SupportRequestIndexCondition *)rawreq;
+  if (!is_funcclause(req->node))
+    PG_RETURN_POINTER(NULL);
+  fcall = (FuncExpr *)req->node;
+  if (list_length(fcall->args) != 3 || req->indexarg > 1)
+    PG_RETURN_POINTER(NULL);
+
+  farg = (Node *)list_nth(fcall->args, req->indexarg);
+  qarg = (Node *)list_nth(fcall->args, 1 - req->indexarg);
+  targ = (Node *)lthird(fcall->args);
+
+  // the threshold picks the operator, so it must be known when planning
+  if (!IsA(targ, Const) || ((Const *)targ)->constisnull)
+    PG_RETURN_POINTER(NULL);
+  threshold = DatumGetFloat8(((Const *)targ)->constvalue);
+  if (threshold >= FP_EXACT_CUTOFF)
+    opname = "=";
+  else if (threshold >= FP_MATCH_CUTOFF)
+    opname = "~=";
+  else
+    PG_RETURN_POINTER(NULL);
+
+  // the other fingerprint is fixed during the scan: a constant, a
+  // parameter or a column of another table
+  if (contain_volatile_functions(qarg) ||
+      bms_is_member(req->index->rel->relid, PULL_VARNOS(req->root, qarg)))
+    PG_RETURN_POINTER(NULL);
+
+  fprint_type = exprType(farg);
+  opno = LookupOperName(NULL, list_make1(makeString((char *)opname)),
+                        fprint_type, fprint_type, true, -1);
+  if (!OidIsValid(opno) || !op_in_opfamily(opno, req->opfamily))
+    PG_RETURN_POINTER(NULL);
+
+  clause = make_opclause(opno, BOOLOID, false,
+                         (Expr *)copyObject(farg), (Expr *)copyObject(qarg),
+                         InvalidOid, InvalidOid);
+  set_opfuncid((OpExpr *)clause);
+  // the leaf test only scores the cprint key window, so even at the
+  // operator's own cutoff its answer is not fprint_cmp's
+  req->lossy = true;
+
+  PG_RETURN_POINTER(list_make1(clause));
+}
+
+#else
+
+// planner support functions arrived in PostgreSQL 12
+Datum fprint_similar_support(PG_FUNCTION_ARGS)
+{
+  PG_RETURN_POINTER(NULL);
+}
+
+#endif
+
+/*  BRIN support
+ *  ------------
+ *  fprint_brin_ops summarizes each block range with what bounds match_cpfm
+ *  for every fingerprint in it:
+ *
+ *    - the smallest and largest songlen and cprint_len,
+ *    - the FP_MISSING_* bits and the dom bits of all of them or'ed,
+ *    - for each of the first FPRINT_BRIN_CP_LEN cprint positions, the
+ *      lowest set bits seen there or'ed.
+ *
+ *  match_chromab counts the positions where two lowest set bits agree, so
+ *  a position can count for some fingerprint of the range only if the
+ *  query's lowest set bit is among those seen (or the query value is 0:
+ *  zeros are not recorded).  Positions past the window may all count.
+ *  match_fooid_fp differs by at least the dom bits the query has and no
+ *  fingerprint of the range has.  fprint_brin_consistent skips a range
+ *  whose bound cannot pass the operator.
+ *
+ *  The songlen range does most of the pruning, for tables loaded in
+ *  roughly songlen order; the or'ed bits fill up as ranges grow and only
+ *  prune small ones (a low pages_per_range).  See pgfprint_brin.sql.
+ */
+
+#define FPRINT_BRIN_CP_LEN FPMATCH_KEY_CP_LEN
+#define FPRINT_BRIN_FETCH_SIZE \
+  (FP_HEADER_SIZE + FPRINT_BRIN_CP_LEN * sizeof(((FPrint *)0)->cprint[0]))
+// the bound is exact arithmetic; this covers the rounding of the scores
+// it stands for
+#define FPRINT_BRIN_SLACK 1e-9
+
+typedef struct
+{
+  int32 vl_len_;
+  uint32_t min_songlen;
+  uint32_t max_songlen;
+  uint32_t min_cprint_len;
+  uint32_t max_cprint_len;
+  uint16_t missing;
+  uint8_t dom[DOM_SIZE];
+  // lowest set bits seen at cprint[p], or'ed
+  uint32_t low_bits[FPRINT_BRIN_CP_LEN];
+} fprint_brin;
+
+Datum fprint_brin_opcinfo(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(fprint_brin_opcinfo);
+Datum fprint_brin_add_value(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(fprint_brin_add_value);
+Datum fprint_brin_consistent(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(fprint_brin_consistent);
+Datum fprint_brin_union(PG_FUNCTION_ARGS);
+PG_FUNCTION_INFO_V1(fprint_brin_union);
+
+#if PG_VERSION_NUM >= 90500
+
+static inline uint32_t brin_low_bit(int32_t x)
+{
+  uint32_t u = (uint32_t)x;
+  return u & (-u);
+}
+
+/* fetch_brin_slice
+ * The header and the first cprint values (window of them) of an fprint.
+ */
+static fprint_gist *fetch_brin_slice(Datum d, size_t *window)
+{
+  fprint_gist *gfp = fetch_fprint_slice(d, FPRINT_BRIN_FETCH_SIZE);
+  size_t n = 0;
+
+  if (gfp == NULL)
+    return NULL;
+  n = min_st(SERIALIZED_FP(gfp)->cprint_len, FPRINT_BRIN_CP_LEN);
+  if (VARSIZE(gfp) < VARHDRSZ + FP_HEADER_SIZE + n * sizeof(int32_t))
+  {
+    elog(ERROR, "[%s:%s:%d] detoasted fprint is invalid: cprint_len: " SIZE_T_FMT,
+         __FILE__, __func__, __LINE__, SERIALIZED_FP(gfp)->cprint_len);
+  }
+  *window = n;
+
+  return gfp;
+}
+
+static void brin_summarize(fprint_brin *s, const FPrint *fp, size_t window)
+{
+  memset(s, 0, sizeof(*s));
+  SET_VARSIZE(s, sizeof(*s));
+  s->min_songlen = s->max_songlen = fp->songlen;
+  s->min_cprint_len = s->max_cprint_len = fp->cprint_len;
+  s->missing = fprint_missing(fp);
+  memcpy(s->dom, fp->dom, DOM_SIZE);
+  for (size_t p = 0; p < window; p++)
+    s->low_bits[p] = brin_low_bit(fp->cprint[p]);
+}
+
+// widen a to cover b; returns whether a changed
+static bool brin_merge(fprint_brin *a, const fprint_brin *b)
+{
+  uint32_t changed = 0;
+
+  if (b->min_songlen < a->min_songlen)
+  {
+    a->min_songlen = b->min_songlen;
+    changed = 1;
+  }
+  if (b->max_songlen > a->max_songlen)
+  {
+    a->max_songlen = b->max_songlen;
+    changed = 1;
+  }
+  if (b->min_cprint_len < a->min_cprint_len)
+  {
+    a->min_cprint_len = b->min_cprint_len;
+    changed = 1;
+  }
+  if (b->max_cprint_len > a->max_cprint_len)
+  {
+    a->max_cprint_len = b->max_cprint_len;
+    changed = 1;
+  }
+  changed |= b->missing & ~a->missing;
+  a->missing |= b->missing;
+  for (size_t i = 0; i < DOM_SIZE; i++)
+  {
+    changed |= b->dom[i] & ~a->dom[i];
+    a->dom[i] |= b->dom[i];
+  }
+  for (size_t p = 0; p < FPRINT_BRIN_CP_LEN; p++)
+  {
+    changed |= b->low_bits[p] & ~a->low_bits[p];
+    a->low_bits[p] |= b->low_bits[p];
+  }
+
+  return changed != 0;
+}
+
+/* brin_score_bound
+ * At least fpmatch_cpfm(q, fp) for every fp summarized in s, given the
+ * first window cprint values of q.
+ */
+static double brin_score_bound(const FPrint *q, size_t window,
+                               const fprint_brin *s)
+{
+  const double maxdiff = (double)FPMATCH_MAX_TOTDIFF;
+  uint16_t missing = fprint_missing(q) | s->missing;
+  size_t n_hi = min_st(q->cprint_len, s->max_cprint_len);
+  size_t w = min_st(window, n_hi);
+  uint32_t sm = 0;
+  uint32_t diff_dom = 0;
+  uint32_t bit = 0;
+  double fm = 0.0;
+  double cp = 0.0;
+  double cp_tail = 0.0;
+  double bound = 0.0;
+
+  for (size_t p = 0; p < w; p++)
+  {
+    bit = brin_low_bit(q->cprint[p]);
+    sm += bit == 0 || (bit & s->low_bits[p]) != 0;
+  }
+  sm += n_hi - w;
+  if (sm > 0)
+  {
+    // match_chromab divides by the longer cprint, or by the shorter one
+    // for captures missing their tail
+    cp = fmin((double)sm / (double)max_st(q->cprint_len, s->min_cprint_len), 1.0);
+    cp_tail = fmin((double)sm / (double)max_st(min_st(q->cprint_len, s->min_cprint_len), 1), 1.0);
+  }
+
+  for (size_t i = 0; i < DOM_SIZE; i++)
+    diff_dom += fpmatch_pop32((uint32_t)(q->dom[i] & ~s->dom[i] & 0xff));
+  fm = fmax(fmin(((1.0 - (double)diff_dom / maxdiff) - 0.5) * 2.0, 1.0), 0.0);
+
+  // match_cpfm_combine is convex in cp: largest at one end
+  bound = fmax(fpmatch_cpfm_combine(fm, 0.0), fpmatch_cpfm_combine(fm, cp));
+  // partial fingerprints score on fooid or chromab alone, through
+  // fpmatch_cpfm_one_part: convex too, and its value at 0 is covered above
+  if (missing)
+    bound = fmax(bound, fpmatch_cpfm_one_part(fmax(fm, cp_tail)));
+
+  return bound + FPRINT_BRIN_SLACK;
+}
+
+Datum fprint_brin_opcinfo(PG_FUNCTION_ARGS)
+{
+  BrinOpcInfo *result = palloc0(MAXALIGN(SizeofBrinOpcInfo(1)));
+
+  result->oi_nstored = 1;
+#if PG_VERSION_NUM >= 140000
+  result->oi_regular_nulls = true;
+#endif
+  result->oi_typcache[0] = lookup_type_cache(BYTEAOID, 0);
+
+  PG_RETURN_POINTER(result);
+}
+
+Datum fprint_brin_add_value(PG_FUNCTION_ARGS)
+{
+  BrinValues *column = (BrinValues *)PG_GETARG_POINTER(1);
+  Datum newval = PG_GETARG_DATUM(2);
+  fprint_brin *s = NULL;
+  fprint_brin one;
+  fprint_gist *gfp = NULL;
+  size_t window = 0;
+  bool updated = false;
+
+#if PG_VERSION_NUM < 140000
+  if (PG_GETARG_BOOL(3))
+  {
+    if (column->bv_hasnulls)
+      PG_RETURN_BOOL(false);
+    column->bv_hasnulls = true;
+    PG_RETURN_BOOL(true);
+  }
+#endif
+
+  gfp = fetch_brin_slice(newval, &window);
+  if (gfp == NULL)
+    PG_RETURN_BOOL(false);
+  brin_summarize(&one, SERIALIZED_FP(gfp), window);
+  FREE_FPRINT_SLICE(gfp, newval);
+
+  if (column->bv_allnulls)
+  {
+    s = palloc(sizeof(*s));
+    memcpy(s, &one, sizeof(*s));
+    column->bv_allnulls = false;
+    updated = true;
+  }
+  else
+  {
+    s = (fprint_brin *)PG_DETOAST_DATUM(column->bv_values[0]);
+    updated = brin_merge(s, &one);
+  }
+  column->bv_values[0] = PointerGetDatum(s);
+
+  PG_RETURN_BOOL(updated);
+}
+
+Datum fprint_brin_consistent(PG_FUNCTION_ARGS)
+{
+  BrinValues *column = (BrinValues *)PG_GETARG_POINTER(1);
+  ScanKey key = (ScanKey)PG_GETARG_POINTER(2);
+  fprint_brin *s = NULL;
+  fprint_gist *gq = NULL;
+  FPrint *q = NULL;
+  size_t window = 0;
+  double bound = 0.0;
+  bool retval = false;
+
+#if PG_VERSION_NUM < 140000
+  if (key->sk_flags & SK_ISNULL)
+  {
+    if (key->sk_flags & SK_SEARCHNULL)
+      PG_RETURN_BOOL(column->bv_allnulls || column->bv_hasnulls);
+    if (key->sk_flags & SK_SEARCHNOTNULL)
+      PG_RETURN_BOOL(!column->bv_allnulls);
+    PG_RETURN_BOOL(false);
+  }
+  if (column->bv_allnulls)
+    PG_RETURN_BOOL(false);
+#endif
+
+  // <> holds for nearly every row; not worth a bound
+  if (key->sk_strategy == FPStrategyNEQ)
+    PG_RETURN_BOOL(true);
+
+  gq = fetch_brin_slice(key->sk_argument, &window);
+  if (gq == NULL)
+    PG_RETURN_BOOL(false);
+  q = SERIALIZED_FP(gq);
+  s = (fprint_brin *)PG_DETOAST_DATUM(column->bv_values[0]);
+
+  if (FP_SONGLEN_LO(q->songlen) <= s->max_songlen &&
+      s->min_songlen <= FP_SONGLEN_HI(q->songlen))
+  {
+    bound = brin_score_bound(q, window, s);
+    FPDEBUG_M("brin bound: %.8f", bound);
+    if (key->sk_strategy == FPStrategyEQ)
+      retval = (bool)FP_ISEQ(bound);
+    else
+      retval = (bool)FP_ISMATCH(bound);
+  }
+  FREE_FPRINT_SLICE(gq, key->sk_argument);
+
+  PG_RETURN_BOOL(retval);
+}
+
+Datum fprint_brin_union(PG_FUNCTION_ARGS)
+{
+  BrinValues *col_a = (BrinValues *)PG_GETARG_POINTER(1);
+  BrinValues *col_b = (BrinValues *)PG_GETARG_POINTER(2);
+  fprint_brin *a = NULL;
+  fprint_brin *b = NULL;
+
+#if PG_VERSION_NUM < 140000
+  if (col_b->bv_hasnulls)
+    col_a->bv_hasnulls = true;
+  if (col_b->bv_allnulls)
+    PG_RETURN_VOID();
+  if (col_a->bv_allnulls)
+  {
+    col_a->bv_allnulls = false;
+    col_a->bv_values[0] = datumCopy(col_b->bv_values[0], false, -1);
+    PG_RETURN_VOID();
+  }
+#endif
+
+  a = (fprint_brin *)PG_DETOAST_DATUM(col_a->bv_values[0]);
+  b = (fprint_brin *)PG_DETOAST_DATUM(col_b->bv_values[0]);
+  brin_merge(a, b);
+  col_a->bv_values[0] = PointerGetDatum(a);
+
+  PG_RETURN_VOID();
+}
+
+#else
+
+// BRIN arrived in PostgreSQL 9.5
+Datum fprint_brin_opcinfo(PG_FUNCTION_ARGS)
+{
+  elog(ERROR, "fprint_brin_ops needs PostgreSQL 9.5 or later");
+  PG_RETURN_NULL();
+}
+
+Datum fprint_brin_add_value(PG_FUNCTION_ARGS)
+{
+  PG_RETURN_BOOL(false);
+}
+
+Datum fprint_brin_consistent(PG_FUNCTION_ARGS)
+{
+  PG_RETURN_BOOL(true);
+}
+
+Datum fprint_brin_union(PG_FUNCTION_ARGS)
+{
+  PG_RETURN_VOID();
+}
+
+#endif
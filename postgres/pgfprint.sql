@@ -24,11 +24,17 @@ CREATE OR REPLACE FUNCTION fprint_out(fprint)
        AS '$libdir/pgfprint.so', 'fprint_out'
        LANGUAGE C IMMUTABLE STRICT;
 
+-- storage = external: toasted fprints are kept uncompressed (chromaprint
+-- data hardly compresses anyway) so the index and the operators can fetch
+-- just the header or the index key window with PG_DETOAST_DATUM_SLICE.
+-- Columns created before this change keep their old setting; convert with
+--   ALTER TABLE fingerprints ALTER COLUMN fingerprint SET STORAGE EXTERNAL;
+-- (applies to newly written rows; rewrite old ones to move them).
 CREATE TYPE fprint (
        internallength = variable,
        input = fprint_in,
        output = fprint_out,
-       storage = extended,
+       storage = external,
        alignment = double
 );
 
@@ -72,6 +78,13 @@ CREATE OR REPLACE FUNCTION fprint_cmp(fprint, fprint)
        AS '$libdir/pgfprint.so', 'fprint_cmp'
        LANGUAGE C IMMUTABLE STRICT;
 
+-- fprint_similar(a, b, t) = fprint_cmp(a, b) > t; on PostgreSQL 12+ it
+-- can use the index for t >= 0.6 (see fprint_similar_support below)
+CREATE OR REPLACE FUNCTION fprint_similar(fprint, fprint, float8)
+       RETURNS bool
+       AS '$libdir/pgfprint.so', 'fprint_similar'
+       LANGUAGE C IMMUTABLE STRICT;
+
 CREATE OR REPLACE FUNCTION fprint_eq(fprint, fprint)
        RETURNS bool
        AS '$libdir/pgfprint.so', 'fprint_eq'
@@ -130,6 +143,25 @@ CREATE OPERATOR CLASS fprint_gist_ops
         FUNCTION   6  fprint_picksplit (internal, internal),
         FUNCTION   7  fprint_same (fprint, fprint, internal);
 
+-- fprint_similar(fp, q, t) with t >= 0.6 (FP_MATCH_CUTOFF) can be answered
+-- by an index on fp (PostgreSQL 12+): fprint_similar_support gives the
+-- index `fp ~= q`, or `fp = q` for t >= 0.98, and the executor rechecks
+-- fprint_cmp > t on every row the index returns.  Write threshold
+-- predicates as
+--
+--   WHERE fprint_similar(fingerprint, q, 0.9)
+--
+-- rather than `fprint_cmp(q, fingerprint) > 0.9`, which the planner cannot
+-- hand to an index.  An fprint_cmp of the same pair in the select list
+-- reuses the score the recheck computed.
+
+CREATE OR REPLACE FUNCTION fprint_similar_support(internal)
+       RETURNS internal
+       AS '$libdir/pgfprint.so', 'fprint_similar_support'
+       LANGUAGE C IMMUTABLE STRICT;
+
+ALTER FUNCTION fprint_similar(fprint, fprint, float8) SUPPORT fprint_similar_support;
+
 -- Extra attribute functionality
 
 CREATE OR REPLACE FUNCTION fprint_songlen(fprint)
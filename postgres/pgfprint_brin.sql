@@ -0,0 +1,56 @@
+-------------------------------------------------------------------------------
+--
+-- fprint BRIN operator class (PostgreSQL 9.5+)
+--
+--  Load after pgfprint.sql.
+--
+--  fprint_brin_ops summarizes each block range of a table with the songlen
+--  range of its fingerprints and the or'ed bits of their dom and of the
+--  first 240 chromaprint values, about 1 kB per range.  `fingerprint ~= q`
+--  and `fingerprint = q` skip every range whose summary shows no row can
+--  score high enough; the remaining ranges are rechecked row by row.
+--
+--  It suits append-mostly tables loaded in roughly songlen order, where
+--  each range covers a narrow songlen band:
+--
+--    CREATE INDEX fingerprints_brin ON fingerprints
+--           USING BRIN (fingerprint fprint_brin_ops)
+--           WITH (pages_per_range = 4);
+--
+--  The or'ed bits fill up as ranges grow, so past a few dozen rows per
+--  range only the songlen range prunes.  Rows appended after the index was
+--  built are summarized by VACUUM or brin_summarize_new_values().
+--
+-------------------------------------------------------------------------------
+
+SET search_path = public;
+
+CREATE OR REPLACE FUNCTION fprint_brin_opcinfo(internal)
+       RETURNS internal
+       AS '$libdir/pgfprint.so', 'fprint_brin_opcinfo'
+       LANGUAGE C IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION fprint_brin_add_value(internal, internal, internal, internal)
+       RETURNS bool
+       AS '$libdir/pgfprint.so', 'fprint_brin_add_value'
+       LANGUAGE C IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION fprint_brin_consistent(internal, internal, internal)
+       RETURNS bool
+       AS '$libdir/pgfprint.so', 'fprint_brin_consistent'
+       LANGUAGE C IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION fprint_brin_union(internal, internal, internal)
+       RETURNS bool
+       AS '$libdir/pgfprint.so', 'fprint_brin_union'
+       LANGUAGE C IMMUTABLE STRICT;
+
+CREATE OPERATOR CLASS fprint_brin_ops
+    FOR TYPE fprint USING BRIN AS
+        STORAGE bytea,
+        OPERATOR   3  = (fprint, fprint),
+        OPERATOR   6  ~= (fprint, fprint),
+        FUNCTION   1  fprint_brin_opcinfo (internal),
+        FUNCTION   2  fprint_brin_add_value (internal, internal, internal, internal),
+        FUNCTION   3  fprint_brin_consistent (internal, internal, internal),
+        FUNCTION   4  fprint_brin_union (internal, internal, internal);
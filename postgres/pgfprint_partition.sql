@@ -0,0 +1,113 @@
+-------------------------------------------------------------------------------
+--
+-- fprint songlen partitioning and planner support (PostgreSQL 12+)
+--
+--  Load after pgfprint.sql.
+--
+--  `q ~= fp` can only be true when fprint_songlen(fp) is within
+--  FP_SONGLEN_TOLERANCE (10%) of fprint_songlen(q).  Tables partitioned by
+--  RANGE (fprint_songlen(fingerprint)) let the planner skip every partition
+--  outside that window: fprint_match_support rewrites
+--
+--    WHERE fingerprint ~= q
+--
+--  into
+--
+--    WHERE fingerprint ~= q
+--      AND fprint_songlen(fingerprint) BETWEEN fprint_songlen_lo(q)
+--                                          AND fprint_songlen_hi(q)
+--
+--  when q is a constant or a parameter.  Each partition carries its own GiST
+--  index, so each ~= probe searches a much smaller tree.
+--
+-------------------------------------------------------------------------------
+
+SET search_path = public;
+
+CREATE OR REPLACE FUNCTION fprint_songlen_lo(fprint)
+       RETURNS int4
+       AS '$libdir/pgfprint.so', 'fprint_songlen_lo'
+       LANGUAGE C IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION fprint_songlen_hi(fprint)
+       RETURNS int4
+       AS '$libdir/pgfprint.so', 'fprint_songlen_hi'
+       LANGUAGE C IMMUTABLE STRICT;
+
+CREATE OR REPLACE FUNCTION fprint_match_support(internal)
+       RETURNS internal
+       AS '$libdir/pgfprint.so', 'fprint_match_support'
+       LANGUAGE C IMMUTABLE STRICT;
+
+ALTER FUNCTION fprint_match(fprint, fprint) SUPPORT fprint_match_support;
+
+-- fprint_create_partitioned('fingerprints')
+--
+-- creates
+--   fingerprints (soid text, fingerprint fprint)
+--     PARTITION BY RANGE (fprint_songlen(fingerprint))
+-- with one partition per `width` seconds up to `max_songlen` and a default
+-- partition for anything longer.  Creating the GiST index on the parent
+-- creates it on every partition, including ones added later.
+
+CREATE OR REPLACE FUNCTION fprint_create_partitioned(
+       tbl text,
+       width int4 DEFAULT 30,
+       max_songlen int4 DEFAULT 900)
+       RETURNS void
+       AS $$
+DECLARE
+       lo int4 := 0;
+BEGIN
+       IF width <= 0 THEN
+          RAISE EXCEPTION 'fprint_create_partitioned: width must be > 0';
+       END IF;
+
+       EXECUTE format('CREATE TABLE %I (soid text, fingerprint fprint) '
+                      'PARTITION BY RANGE (fprint_songlen(fingerprint))',
+                      tbl);
+
+       WHILE lo < max_songlen LOOP
+          EXECUTE format('CREATE TABLE %I PARTITION OF %I '
+                         'FOR VALUES FROM (%s) TO (%s)',
+                         tbl || '_' || lo, tbl, lo, lo + width);
+          lo := lo + width;
+       END LOOP;
+
+       EXECUTE format('CREATE TABLE %I PARTITION OF %I DEFAULT',
+                      tbl || '_default', tbl);
+       EXECUTE format('CREATE INDEX %I ON %I USING GIST (fingerprint)',
+                      tbl || '_fingerprint_idx', tbl);
+       EXECUTE format('CREATE INDEX %I ON %I (soid)',
+                      tbl || '_soid_idx', tbl);
+END;
+$$ LANGUAGE plpgsql VOLATILE STRICT;
+
+-- fprint_add_partition('fingerprints', 900, 960)
+--
+-- split [lo, hi) out of the default partition, moving any rows already in
+-- that range.  Use this when the catalogue grows a long tail of long songs.
+
+CREATE OR REPLACE FUNCTION fprint_add_partition(tbl text, lo int4, hi int4)
+       RETURNS void
+       AS $$
+DECLARE
+       part text := tbl || '_' || lo;
+       dflt text := tbl || '_default';
+BEGIN
+       EXECUTE format('ALTER TABLE %I DETACH PARTITION %I', tbl, dflt);
+       EXECUTE format('CREATE TABLE %I PARTITION OF %I '
+                      'FOR VALUES FROM (%s) TO (%s)',
+                      part, tbl, lo, hi);
+       EXECUTE format('INSERT INTO %I SELECT * FROM %I '
+                      'WHERE fprint_songlen(fingerprint) >= %s '
+                      'AND fprint_songlen(fingerprint) < %s',
+                      part, dflt, lo, hi);
+       EXECUTE format('DELETE FROM %I '
+                      'WHERE fprint_songlen(fingerprint) >= %s '
+                      'AND fprint_songlen(fingerprint) < %s',
+                      dflt, lo, hi);
+       EXECUTE format('ALTER TABLE %I ATTACH PARTITION %I DEFAULT',
+                      tbl, dflt);
+END;
+$$ LANGUAGE plpgsql VOLATILE STRICT;
@@ -11,6 +11,7 @@ cdef extern from "fplib.h" nogil:
         uint32_t  num_errors
         uint8_t   r[R_SIZE]
         uint8_t   dom[DOM_SIZE]
+        uint16_t  missing
         int32_t   cprint[1]
 
     ctypedef struct FPrintUnion:
@@ -20,12 +21,32 @@ cdef extern from "fplib.h" nogil:
         uint32_t  max_songlen
         uint8_t   r[R_SIZE]
         uint8_t   dom[DOM_SIZE]
+        uint16_t  missing
         int32_t   cprint[1]
 
+    ctypedef struct FPOptions:
+        int       extractors
+        int       duration
+
+    enum:
+        FP_EXTRACT_FOOID
+        FP_EXTRACT_CHROMA
+        FP_EXTRACT_ALL
+        FP_MISSING_FOOID
+        FP_MISSING_CHROMA
+        FP_MISSING_TAIL
+        FP_DEFAULT_DURATION
+        FP_MIN_DURATION
+        FP_PREVIEW_DURATION
+
     void ffmpeg_init()
     FPrint* new_fprint(int cprint_len)
     void free_fprint(FPrint* fp)
     FPrint* get_fingerprint(char* filename, int* error, int verbose)
+    void fp_options_init(FPOptions* opts)
+    void fp_options_preview(FPOptions* opts)
+    FPrint* get_fingerprint_opts(char* filename, FPOptions* opts,
+                                 int* error, int verbose)
     unsigned int hdist_r(uint8_t* r_a, uint8_t* r_b)
     unsigned int hdist_dom(uint8_t* dom_a, uint8_t* dom_b)
     double match_fooid_fp(uint8_t* r_a, uint8_t* dom_a, 
@@ -40,6 +61,7 @@ cdef extern from "fplib.h" nogil:
                          int32_t* cp2, size_t cp2_len)
     double match_chromat(int32_t* cp1, size_t cp1_len,
                          int32_t* cp2, size_t cp2_len)
+    double FP_MATCH_CUTOFF
     double match_cpfm(FPrint* a, FPrint* b)
     void fprint_merge(FPrintUnion* u, FPrint* a, FPrint* b)
     void fprint_merge_one(FPrintUnion* u, FPrint* a)
@@ -48,3 +70,44 @@ cdef extern from "fplib.h" nogil:
     float try_match_merges(FPrintUnion* u1, FPrintUnion* u2, FPrint* a)
     char* fprint_to_string(FPrint* fp)
     FPrint* fprint_from_string(char* fp_str)
+    uint8_t* fprint_to_bytes(FPrint* fp)
+    FPrint* fprint_from_bytes(uint8_t* bytes)
+    size_t PACKED_FP_SIZE(size_t cprint_len)
+
+cdef extern from "fpcorpus.h" nogil:
+    ctypedef struct FPCorpus:
+        uint64_t   count
+        uint64_t*  ids
+        uint32_t*  songlen
+        int32_t*   bit_rate
+        int32_t*   num_errors
+        uint64_t*  cprint_off
+        uint8_t*   r
+        uint8_t*   dom
+        int32_t*   cprint
+
+    ctypedef struct FPCorpusHit:
+        uint64_t  ix
+        double    score
+
+    ctypedef struct FPCorpusPair:
+        uint64_t  a
+        uint64_t  b
+        double    score
+
+    ctypedef struct FPCorpusWriter:
+        pass
+
+    FPCorpus* fpcorpus_open(char* path, int* error)
+    void fpcorpus_close(FPCorpus* c)
+    FPrint* fpcorpus_get(FPCorpus* c, uint64_t i)
+    double fpcorpus_match(FPCorpus* c, FPrint* q, uint64_t i)
+    void fpcorpus_match_all(FPCorpus* c, FPrint* q, double* scores)
+    size_t fpcorpus_topk(FPCorpus* c, FPrint* q, size_t k,
+                         double min_score, FPCorpusHit* hits)
+    FPCorpusPair* fpcorpus_self_join(FPCorpus* c, double min_score,
+                                     size_t* n_pairs, int* error)
+    FPCorpusWriter* fpcorpus_writer_new(char* path, int* error)
+    int fpcorpus_writer_add(FPCorpusWriter* w, uint64_t id, FPrint* fp)
+    int fpcorpus_writer_close(FPCorpusWriter* w)
+    void fpcorpus_writer_abort(FPCorpusWriter* w)
@@ -20,6 +20,19 @@ ctypedef np.uint8_t UINT8_t
 DEF R_SIZE = 348
 DEF DOM_SIZE = 66
 
+# fingerprint(extractors=...): which parts of the fingerprint to compute
+EXTRACT_FOOID = FP_EXTRACT_FOOID
+EXTRACT_CHROMA = FP_EXTRACT_CHROMA
+EXTRACT_ALL = FP_EXTRACT_ALL
+# Fingerprint.missing bits
+MISSING_FOOID = FP_MISSING_FOOID
+MISSING_CHROMA = FP_MISSING_CHROMA
+MISSING_TAIL = FP_MISSING_TAIL
+# fingerprint(duration=...), in seconds
+DEFAULT_DURATION = FP_DEFAULT_DURATION
+MIN_DURATION = FP_MIN_DURATION
+PREVIEW_DURATION = FP_PREVIEW_DURATION
+
 cdef class Fingerprint:
     cdef public int errn
     cdef FPrint* fp
@@ -174,6 +187,16 @@ cdef class Fingerprint:
         def __set__(self, num_errors):
             self.set_num_errors(num_errors)
 
+    property missing:
+        def __get__(self):
+            if self.fp is not NULL:
+                return self.fp.missing
+
+        def __set__(self, missing):
+            if self.fp is NULL:
+                self.init_fingerprint()
+            self.fp.missing = missing
+
     property r:
         def __get__(self):
             return self.get_r()
@@ -213,26 +236,53 @@ cdef class Fingerprint:
             struct.pack('<3I', self.songlen, self.bit_rate, self.num_errors),
             self.r.tostring(),
             self.dom.tostring(),
-            self.cprint.tostring()
+            self.cprint.tostring(),
+            self.missing
             )
         return (from_pickle, t)
 
     def __str__(self):
         return fprint_to_string(self.fp)
 
-cpdef Fingerprint fingerprint(char* fpath, int verbose=0):
+    def to_bytes(self):
+        """PackedFP bytes (native byte order), the BLOB format of the
+        sqlfprint SQLite extension"""
+        cdef uint8_t* packed = fprint_to_bytes(self.fp)
+        if packed == NULL:
+            raise MemoryError()
+        try:
+            return (<char*>packed)[:PACKED_FP_SIZE(self.fp.cprint_len)]
+        finally:
+            free(packed)
+
+cdef Fingerprint _fingerprint_opts(char* fpath, FPOptions* opts, int verbose):
     cdef int errn = 0
     cdef FPrint* t_fp = NULL
     cdef Fingerprint fp = Fingerprint()
-    cdef char* msg = NULL
     fp.errn = errn
-    t_fp = get_fingerprint(fpath, &errn, verbose)
+    t_fp = get_fingerprint_opts(fpath, opts, &errn, verbose)
     if errn != 0 or t_fp == NULL:
         raise Exception('Error %d reading file %s' % (errn, fpath))
     fp.fp = t_fp
     return fp
 
-def from_pickle(s_vars, s_r, s_dom, s_cprint):
+cpdef Fingerprint fingerprint(char* fpath, int verbose=0,
+                              int extractors=FP_EXTRACT_ALL,
+                              int duration=FP_DEFAULT_DURATION):
+    cdef FPOptions opts
+    fp_options_init(&opts)
+    opts.extractors = extractors
+    opts.duration = duration
+    return _fingerprint_opts(fpath, &opts, verbose)
+
+cpdef Fingerprint preview(char* fpath, int verbose=0):
+    """chromaprint of the first PREVIEW_DURATION seconds only; matches
+    full fingerprints of the same song"""
+    cdef FPOptions opts
+    fp_options_preview(&opts)
+    return _fingerprint_opts(fpath, &opts, verbose)
+
+def from_pickle(s_vars, s_r, s_dom, s_cprint, missing=0):
     fp = Fingerprint()
     songlen, bit_rate, num_errors = struct.unpack('<3I', s_vars)
     # do this here as it initializes the FPrint to cprint size
@@ -244,6 +294,7 @@ def from_pickle(s_vars, s_r, s_dom, s_cprint):
     fp.num_errors = num_errors
     fp.r = np.fromstring(s_r, dtype=np.uint8)
     fp.dom = np.fromstring(s_dom, dtype=np.uint8)
+    fp.missing = missing
     return fp
 
 cpdef Fingerprint from_string(char* fp_str):
@@ -255,6 +306,19 @@ cpdef Fingerprint from_string(char* fp_str):
     fp.fp = t_fp
     return fp
 
+def from_bytes(s):
+    """Fingerprint of Fingerprint.to_bytes output"""
+    cdef FPrint* t_fp = NULL
+    if (len(s) < PACKED_FP_SIZE(0) or
+            len(s) != PACKED_FP_SIZE(struct.unpack('=I', s[:4])[0])):
+        raise ValueError('not a packed fingerprint')
+    t_fp = fprint_from_bytes(<uint8_t*><char*>s)
+    if t_fp == NULL:
+        raise MemoryError()
+    fp = Fingerprint()
+    fp.fp = t_fp
+    return fp
+
 def hamming_r(Fingerprint a not None, Fingerprint b not None):
     cdef FPrint* fp_a = NULL
     cdef FPrint* fp_b = NULL
@@ -395,4 +459,181 @@ def try_match_unions(
         return 1.0
     return try_match_merges(<FPrintUnion*>fp_u1, <FPrintUnion*>fp_u2, fp_a)
 
+cdef object corpus_view(object owner, void* data, int nd,
+                        np.npy_intp* dims, int typenum):
+    '''Return a read-only ndarray over ``data`` that keeps ``owner`` (and so
+    the mapping) alive
+    '''
+    cdef np.ndarray arr = np.PyArray_SimpleNewFromData(nd, dims, typenum, data)
+    arr.flags.writeable = False
+    np.set_array_base(arr, owner)
+    return arr
+
+cdef class Corpus:
+    '''A memory-mapped fingerprint corpus written by ``write_corpus``.
+
+    Metadata columns (``ids``, ``songlen``, ``bit_rate``, ``num_errors``) are
+    1-D numpy arrays and ``r``/``dom`` are 2-D ``(len(corpus), R_SIZE)`` and
+    ``(len(corpus), DOM_SIZE)`` arrays, all views onto the mapping; nothing
+    is copied or unpickled on open.  ``match``, ``topk`` and ``self_join`` run
+    without the GIL.  The mapping is shared, so any number of processes can
+    open the same file for the cost of one copy in the page cache.
+    '''
+    cdef FPCorpus* c
+
+    def __cinit__(self, path):
+        cdef int errn = 0
+        cdef bytes bpath = path.encode() if isinstance(path, unicode) else path
+        self.c = fpcorpus_open(bpath, &errn)
+        if self.c is NULL:
+            raise IOError(errn, 'unable to open fingerprint corpus', path)
+
+    def __dealloc__(self):
+        if self.c is not NULL:
+            fpcorpus_close(self.c)
+
+    def __len__(self):
+        return self.c.count
+
+    cdef Py_ssize_t check_ix(self, Py_ssize_t i) except -1:
+        if i < 0:
+            i += self.c.count
+        if i < 0 or <uint64_t>i >= self.c.count:
+            raise IndexError('corpus index out of range')
+        return i
+
+    cdef column(self, void* data, int typenum, Py_ssize_t width=0):
+        cdef np.npy_intp dims[2]
+        dims[0] = <np.npy_intp>self.c.count
+        dims[1] = width
+        return corpus_view(self, data, 2 if width else 1, dims, typenum)
+
+    property ids:
+        def __get__(self):
+            return self.column(self.c.ids, np.NPY_UINT64)
+
+    property songlen:
+        def __get__(self):
+            return self.column(self.c.songlen, np.NPY_UINT32)
+
+    property bit_rate:
+        def __get__(self):
+            return self.column(self.c.bit_rate, np.NPY_INT32)
+
+    property num_errors:
+        def __get__(self):
+            return self.column(self.c.num_errors, np.NPY_INT32)
+
+    property r:
+        def __get__(self):
+            return self.column(self.c.r, np.NPY_UINT8, R_SIZE)
+
+    property dom:
+        def __get__(self):
+            return self.column(self.c.dom, np.NPY_UINT8, DOM_SIZE)
+
+    def cprint(self, Py_ssize_t i):
+        '''Return a view of the chromaprint of entry ``i``'''
+        cdef np.npy_intp dims[1]
+        i = self.check_ix(i)
+        dims[0] = <np.npy_intp>(self.c.cprint_off[i + 1] - self.c.cprint_off[i])
+        return corpus_view(self, &self.c.cprint[self.c.cprint_off[i]], 1,
+                           dims, np.NPY_INT32)
+
+    def __getitem__(self, Py_ssize_t i):
+        '''Return a copy of entry ``i`` as a ``Fingerprint``'''
+        cdef Fingerprint fp = Fingerprint()
+        i = self.check_ix(i)
+        fp.fp = fpcorpus_get(self.c, <uint64_t>i)
+        if fp.fp is NULL:
+            exc.PyErr_NoMemory()
+        return fp
+
+    def match(self, Fingerprint q not None):
+        '''Return a float64 array of ``q.match`` against every entry'''
+        cdef np.ndarray[np.float64_t] scores
+        cdef double* out
+        if q.fp is NULL:
+            raise ValueError("Fingerprint has not been initialized")
+        scores = np.zeros(self.c.count, dtype=np.float64)
+        out = <double*>scores.data
+        with nogil:
+            fpcorpus_match_all(self.c, q.fp, out)
+        return scores
+
+    def topk(self, Fingerprint q not None, size_t k=10,
+             double min_score=FP_MATCH_CUTOFF):
+        '''Return up to ``k`` ``(index, score)`` pairs scoring above
+        ``min_score``, best first; ``corpus.ids[index]`` gives the id
+        '''
+        cdef FPCorpusHit* hits = NULL
+        cdef size_t n = 0
+        cdef size_t i
+        if q.fp is NULL:
+            raise ValueError("Fingerprint has not been initialized")
+        if k == 0:
+            return []
+        hits = <FPCorpusHit*>malloc(k * sizeof(FPCorpusHit))
+        if hits is NULL:
+            exc.PyErr_NoMemory()
+        try:
+            with nogil:
+                n = fpcorpus_topk(self.c, q.fp, k, min_score, hits)
+            return [(hits[i].ix, hits[i].score) for i in range(n)]
+        finally:
+            free(hits)
+
+    def self_join(self, double min_score=FP_MATCH_CUTOFF):
+        '''Return ``(a, b, score)`` arrays of every pair of entries
+        ``a < b`` scoring above ``min_score``
+        '''
+        cdef FPCorpusPair* pairs = NULL
+        cdef size_t n = 0
+        cdef size_t i
+        cdef int errn = 0
+        cdef np.ndarray[np.uint64_t] a
+        cdef np.ndarray[np.uint64_t] b
+        cdef np.ndarray[np.float64_t] score
+        with nogil:
+            pairs = fpcorpus_self_join(self.c, min_score, &n, &errn)
+        if errn != 0:
+            exc.PyErr_NoMemory()
+        try:
+            a = np.empty(n, dtype=np.uint64)
+            b = np.empty(n, dtype=np.uint64)
+            score = np.empty(n, dtype=np.float64)
+            for i in range(n):
+                a[i] = pairs[i].a
+                b[i] = pairs[i].b
+                score[i] = pairs[i].score
+            return a, b, score
+        finally:
+            free(pairs)
+
+def write_corpus(path, items):
+    '''Write ``items``, an iterable of ``(id, Fingerprint)`` pairs with
+    integer ids, to a corpus file at ``path`` for ``Corpus``
+    '''
+    cdef int errn = 0
+    cdef FPCorpusWriter* w = NULL
+    cdef Fingerprint fp
+    cdef bytes bpath = path.encode() if isinstance(path, unicode) else path
+    w = fpcorpus_writer_new(bpath, &errn)
+    if w is NULL:
+        raise IOError(errn, 'unable to create fingerprint corpus', path)
+    try:
+        for fid, fp in items:
+            if fp.fp is NULL:
+                raise ValueError("Fingerprint has not been initialized")
+            errn = fpcorpus_writer_add(w, <uint64_t>fid, fp.fp)
+            if errn != 0:
+                raise IOError(errn, 'unable to write fingerprint corpus', path)
+    except:
+        fpcorpus_writer_abort(w)
+        raise
+    errn = fpcorpus_writer_close(w)
+    if errn != 0:
+        raise IOError(errn, 'unable to write fingerprint corpus', path)
+
+np.import_array()
 init_ffmpeg()
@@ -0,0 +1,624 @@
+/*
+ *  sqlfprint.c
+ *  loadable SQLite extension: fingerprint functions and a similarity index
+ *
+ *  Copyright 2010 Zatisfi, LLC. MIT License, 2025
+ *
+ *  Fingerprints are BLOBs in the PackedFP format of fprint_to_bytes (native
+ *  byte order; musicfp's Fingerprint.to_bytes).  Loading the extension
+ *  (".load ./sqlfprint" or sqlite3_load_extension) adds
+ *
+ *    fprint_cmp(a, b)          match_cpfm of two fingerprint BLOBs
+ *    fprint_from_string(text)  the BLOB of fprint_to_string output
+ *    fprint_to_string(blob)
+ *
+ *  and the fprint_index virtual table, which answers top-k queries from a
+ *  corpus file (mapped read-only, every entry scored) or an fpindex
+ *  directory (mapped segments and an in-memory segment for new entries,
+ *  only the candidates sharing the most cprint terms scored):
+ *
+ *    CREATE VIRTUAL TABLE songs_ix USING fprint_index(corpus=songs.fpc);
+ *    CREATE VIRTUAL TABLE songs_ix USING fprint_index(index=songs.ix);
+ *    INSERT INTO songs_ix(id, fp) SELECT rowid, fp FROM songs;
+ *
+ *    SELECT id, score FROM songs_ix WHERE fp MATCH ?;
+ *    SELECT id, score FROM songs_ix WHERE fp MATCH ? AND k = 50
+ *                                     AND score > 0.8;
+ *    SELECT s.title, x.score FROM songs_ix(?) x JOIN songs s ON s.rowid = x.id;
+ *
+ *  A query returns the k (default 10) best entries scoring above
+ *  min_score (default FP_MATCH_CUTOFF), best first; a LIMIT stands in for
+ *  k.  Only an index takes inserts, and they are not transactional: an
+ *  entry stays added if the transaction rolls back.  Relative paths are
+ *  taken from the working directory of the process opening the database.
+ */
+
+#include <errno.h>
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sqlite3ext.h"
+SQLITE_EXTENSION_INIT1
+
+#include "fplib.h"
+#include "fpmatch.h"
+#include "fpcorpus.h"
+#include "fpindex.h"
+
+#ifndef SQLITE_DETERMINISTIC
+#define SQLITE_DETERMINISTIC 0
+#endif
+
+#define DEFAULT_K 10
+#define MAX_K 10000
+
+// fprint_index columns; fp, k and min_score are the arguments of the
+// table-valued form, songs_ix(fp, k, min_score)
+#define INDEX_SCHEMA                                                    \
+  "CREATE TABLE x(id INTEGER, score REAL, fp BLOB HIDDEN, k INTEGER HIDDEN," \
+  " min_score REAL HIDDEN)"
+#define COL_ID 0
+#define COL_SCORE 1
+#define COL_FP 2
+#define COL_K 3
+#define COL_MIN_SCORE 4
+
+// constraints a plan passes to xFilter, in this order
+#define PLAN_FP 0x01
+#define PLAN_K 0x02
+#define PLAN_MIN_SCORE 0x04
+#define PLAN_SCORE_GT 0x08
+#define PLAN_SCORE_GE 0x10
+#define PLAN_LIMIT 0x20
+#define N_PLAN_ARGS 6
+
+typedef struct
+{
+  sqlite3_vtab base;
+  // one of
+  FPCorpus *corpus;
+  FPIndex *index;
+} IndexTab;
+
+typedef struct
+{
+  sqlite3_vtab_cursor base;
+  FPIndexHit *hits;
+  size_t n_hits;
+  size_t pos;
+} IndexCursor;
+
+////////////////////////////////////////////////////////////
+// BLOBs
+////////////////////////////////////////////////////////////
+
+/* The PackedFP in a BLOB value, or NULL if it is not one.  The matching
+ * kernels read r, dom and cprint a word at a time, so a BLOB that is not
+ * word aligned (one read from a table page, say) is copied to *copy, to be
+ * freed with sqlite3_free; bound parameters are aligned and used in place.
+ */
+static const PackedFP *blob_packed(sqlite3_value *v, void **copy)
+{
+  const uint8_t *b = NULL;
+  uint32_t cprint_len = 0;
+  int len = 0;
+
+  *copy = NULL;
+  if (sqlite3_value_type(v) != SQLITE_BLOB)
+    return NULL;
+  b = (const uint8_t *)sqlite3_value_blob(v);
+  len = sqlite3_value_bytes(v);
+  if (!b || len < (int)PACKED_FP_SIZE(0))
+    return NULL;
+  memcpy(&cprint_len, b + offsetof(PackedFP, cprint_len), sizeof(cprint_len));
+  if (cprint_len > (uint32_t)len || PACKED_FP_SIZE(cprint_len) != (size_t)len)
+    return NULL;
+  if ((uintptr_t)b % sizeof(uint32_t) == 0)
+    return (const PackedFP *)b;
+
+  if (!(*copy = sqlite3_malloc(len)))
+    return NULL;
+  memcpy(*copy, b, len);
+  return (const PackedFP *)*copy;
+}
+
+// a new FPrint of a fingerprint BLOB, or NULL
+static FPrint *blob_fprint(sqlite3_value *v)
+{
+  void *copy = NULL;
+  const PackedFP *p = blob_packed(v, &copy);
+  FPrint *fp = p ? fprint_from_bytes((const uint8_t *)p) : NULL;
+
+  sqlite3_free(copy);
+  return fp;
+}
+
+static void fn_cmp(sqlite3_context *ctx, int argc, sqlite3_value **argv)
+{
+  const PackedFP *a = NULL;
+  const PackedFP *b = NULL;
+  void *copy_a = NULL;
+  void *copy_b = NULL;
+
+  if (sqlite3_value_type(argv[0]) == SQLITE_NULL ||
+      sqlite3_value_type(argv[1]) == SQLITE_NULL)
+  {
+    sqlite3_result_null(ctx);
+    return;
+  }
+  a = blob_packed(argv[0], &copy_a);
+  b = blob_packed(argv[1], &copy_b);
+  if (!a || !b)
+  {
+    sqlite3_result_error(ctx, "fprint_cmp: argument is not a fingerprint", -1);
+  }
+  else
+  {
+    // the BLOB's missing bits are fprint_missing of the fingerprint
+    sqlite3_result_double(
+        ctx, fpmatch_cpfm_partial(a->missing | b->missing,
+                                  a->songlen, a->r, a->dom, a->cprint,
+                                  a->cprint_len,
+                                  b->songlen, b->r, b->dom, b->cprint,
+                                  b->cprint_len));
+  }
+  sqlite3_free(copy_a);
+  sqlite3_free(copy_b);
+}
+
+static void fn_from_string(sqlite3_context *ctx, int argc, sqlite3_value **argv)
+{
+  const char *s = (const char *)sqlite3_value_text(argv[0]);
+  FPrint *fp = NULL;
+  uint8_t *bytes = NULL;
+
+  if (!s)
+  {
+    sqlite3_result_null(ctx);
+    return;
+  }
+  if (!(fp = fprint_from_string(s)))
+  {
+    sqlite3_result_error(ctx, "fprint_from_string: not a fingerprint", -1);
+    return;
+  }
+  if (!(bytes = fprint_to_bytes(fp)))
+    sqlite3_result_error_nomem(ctx);
+  else
+    sqlite3_result_blob(ctx, bytes, (int)PACKED_FP_SIZE(fp->cprint_len), free);
+  free_fprint(fp);
+}
+
+static void fn_to_string(sqlite3_context *ctx, int argc, sqlite3_value **argv)
+{
+  FPrint *fp = NULL;
+  char *s = NULL;
+
+  if (sqlite3_value_type(argv[0]) == SQLITE_NULL)
+  {
+    sqlite3_result_null(ctx);
+    return;
+  }
+  if (!(fp = blob_fprint(argv[0])))
+  {
+    sqlite3_result_error(ctx, "fprint_to_string: not a fingerprint", -1);
+    return;
+  }
+  if (!(s = fprint_to_string(fp)))
+    sqlite3_result_error_nomem(ctx);
+  else
+    sqlite3_result_text(ctx, s, -1, free);
+  free_fprint(fp);
+}
+
+////////////////////////////////////////////////////////////
+// fprint_index
+////////////////////////////////////////////////////////////
+
+static void tab_error(sqlite3_vtab *vtab, const char *msg)
+{
+  sqlite3_free(vtab->zErrMsg);
+  vtab->zErrMsg = sqlite3_mprintf("%s", msg);
+}
+
+// the value of "name=value" in a module argument, unquoted; NULL if arg
+// is not for name.  Free with sqlite3_free.
+static char *module_arg(const char *arg, const char *name)
+{
+  size_t name_len = strlen(name);
+  size_t len = 0;
+
+  while (*arg == ' ')
+    arg++;
+  if (strncmp(arg, name, name_len) != 0)
+    return NULL;
+  arg += name_len;
+  while (*arg == ' ')
+    arg++;
+  if (*arg++ != '=')
+    return NULL;
+  while (*arg == ' ')
+    arg++;
+  len = strlen(arg);
+  while (len > 0 && arg[len - 1] == ' ')
+    len--;
+  if (len >= 2 && (arg[0] == '\'' || arg[0] == '"') && arg[len - 1] == arg[0])
+  {
+    arg++;
+    len -= 2;
+  }
+  return sqlite3_mprintf("%.*s", (int)len, arg);
+}
+
+static int ix_connect(sqlite3 *db, void *aux, int argc, const char *const *argv,
+                      sqlite3_vtab **vtab, char **err)
+{
+  IndexTab *t = NULL;
+  char *corpus_path = NULL;
+  char *index_path = NULL;
+  char *v = NULL;
+  int errn = 0;
+  int rc = SQLITE_OK;
+
+  // argv[0..2] are the module, database and table names
+  for (int i = 3; i < argc; i++)
+  {
+    if ((v = module_arg(argv[i], "corpus")) != NULL)
+    {
+      sqlite3_free(corpus_path);
+      corpus_path = v;
+    }
+    else if ((v = module_arg(argv[i], "index")) != NULL)
+    {
+      sqlite3_free(index_path);
+      index_path = v;
+    }
+    else
+    {
+      *err = sqlite3_mprintf("fprint_index: unknown argument %s", argv[i]);
+      rc = SQLITE_ERROR;
+      goto cleanup;
+    }
+  }
+  if (!corpus_path == !index_path)
+  {
+    *err = sqlite3_mprintf("fprint_index: needs one of corpus=PATH or "
+                           "index=DIR");
+    rc = SQLITE_ERROR;
+    goto cleanup;
+  }
+
+  if ((rc = sqlite3_declare_vtab(db, INDEX_SCHEMA)) != SQLITE_OK)
+    goto cleanup;
+  if (!(t = sqlite3_malloc(sizeof(*t))))
+  {
+    rc = SQLITE_NOMEM;
+    goto cleanup;
+  }
+  memset(t, 0, sizeof(*t));
+  if (corpus_path)
+    t->corpus = fpcorpus_open(corpus_path, &errn);
+  else
+    t->index = fpindex_open(index_path, &errn);
+  if (!t->corpus && !t->index)
+  {
+    *err = sqlite3_mprintf("fprint_index: error %d opening %s", errn,
+                           corpus_path ? corpus_path : index_path);
+    sqlite3_free(t);
+    t = NULL;
+    rc = SQLITE_ERROR;
+    goto cleanup;
+  }
+  *vtab = &t->base;
+
+cleanup:
+  sqlite3_free(corpus_path);
+  sqlite3_free(index_path);
+  return rc;
+}
+
+static int ix_disconnect(sqlite3_vtab *vtab)
+{
+  IndexTab *t = (IndexTab *)vtab;
+
+  fpcorpus_close(t->corpus);
+  if (t->index)
+    fpindex_close(t->index);
+  sqlite3_free(t);
+  return SQLITE_OK;
+}
+
+static int ix_best_index(sqlite3_vtab *vtab, sqlite3_index_info *info)
+{
+  IndexTab *t = (IndexTab *)vtab;
+  int slot[N_PLAN_ARGS];
+  int best_first = 0;
+  int offset = 0;
+  int plan = 0;
+  int n_args = 0;
+
+  for (int b = 0; b < N_PLAN_ARGS; b++)
+    slot[b] = -1;
+  for (int i = 0; i < info->nConstraint; i++)
+  {
+    const struct sqlite3_index_constraint *c = &info->aConstraint[i];
+    if (!c->usable)
+      continue;
+    if (c->iColumn == COL_FP && (c->op == SQLITE_INDEX_CONSTRAINT_EQ ||
+                                 c->op == SQLITE_INDEX_CONSTRAINT_MATCH))
+      slot[0] = i;
+    else if (c->iColumn == COL_K && c->op == SQLITE_INDEX_CONSTRAINT_EQ)
+      slot[1] = i;
+    else if (c->iColumn == COL_MIN_SCORE && c->op == SQLITE_INDEX_CONSTRAINT_EQ)
+      slot[2] = i;
+    else if (c->iColumn == COL_SCORE && c->op == SQLITE_INDEX_CONSTRAINT_GT)
+      slot[3] = i;
+    else if (c->iColumn == COL_SCORE && c->op == SQLITE_INDEX_CONSTRAINT_GE)
+      slot[4] = i;
+#ifdef SQLITE_INDEX_CONSTRAINT_LIMIT
+    else if (c->op == SQLITE_INDEX_CONSTRAINT_LIMIT)
+      slot[5] = i;
+    else if (c->op == SQLITE_INDEX_CONSTRAINT_OFFSET)
+      offset = 1;
+#endif
+  }
+  // one lower bound on score is enough; SQLite checks any other
+  if (slot[3] >= 0)
+    slot[4] = -1;
+
+  // hits come best first
+  best_first = info->nOrderBy == 0 ||
+               (info->nOrderBy == 1 && info->aOrderBy[0].iColumn == COL_SCORE &&
+                info->aOrderBy[0].desc);
+  if (info->nOrderBy > 0 && best_first)
+    info->orderByConsumed = 1;
+  // so the first LIMIT of them are the top LIMIT, unless they are sorted
+  // some other way or an OFFSET skips some first
+  if (!best_first || offset || slot[1] >= 0)
+    slot[5] = -1;
+
+  for (int b = 0; b < N_PLAN_ARGS; b++)
+  {
+    if (slot[b] < 0)
+      continue;
+    plan |= 1 << b;
+    info->aConstraintUsage[slot[b]].argvIndex = ++n_args;
+    // the filter is exact, so SQLite need not check again
+    info->aConstraintUsage[slot[b]].omit = 1;
+  }
+  info->idxNum = plan;
+  if (!(plan & PLAN_FP))
+  {
+    // xFilter refuses this plan; make it the last resort
+    info->estimatedCost = 1e99;
+    return SQLITE_OK;
+  }
+  // a corpus scores every entry, an index a few candidates per segment
+  info->estimatedCost = t->corpus ? (double)t->corpus->count + 1.0
+                                  : (double)FPINDEX_MAX_CANDIDATES * 16.0;
+  info->estimatedRows = DEFAULT_K;
+  return SQLITE_OK;
+}
+
+static int ix_open(sqlite3_vtab *vtab, sqlite3_vtab_cursor **cur)
+{
+  IndexCursor *c = sqlite3_malloc(sizeof(*c));
+
+  if (!c)
+    return SQLITE_NOMEM;
+  memset(c, 0, sizeof(*c));
+  *cur = &c->base;
+  return SQLITE_OK;
+}
+
+static int ix_close(sqlite3_vtab_cursor *cur)
+{
+  IndexCursor *c = (IndexCursor *)cur;
+
+  sqlite3_free(c->hits);
+  sqlite3_free(c);
+  return SQLITE_OK;
+}
+
+static int ix_filter(sqlite3_vtab_cursor *cur, int plan, const char *plan_str,
+                     int argc, sqlite3_value **argv)
+{
+  IndexCursor *c = (IndexCursor *)cur;
+  IndexTab *t = (IndexTab *)cur->pVtab;
+  FPCorpusHit *corpus_hits = NULL;
+  FPrint *q = NULL;
+  sqlite3_int64 k = DEFAULT_K;
+  double min_score = FP_MATCH_CUTOFF;
+  double v = 0.0;
+  int arg = 0;
+  int rc = SQLITE_OK;
+
+  sqlite3_free(c->hits);
+  c->hits = NULL;
+  c->n_hits = 0;
+  c->pos = 0;
+
+  if (!(plan & PLAN_FP))
+  {
+    tab_error(cur->pVtab, "fprint_index: a query needs fp MATCH ?");
+    return SQLITE_ERROR;
+  }
+  if (sqlite3_value_type(argv[arg]) == SQLITE_NULL)
+    return SQLITE_OK;
+  if (!(q = blob_fprint(argv[arg++])))
+  {
+    tab_error(cur->pVtab, "fprint_index: fp is not a fingerprint");
+    return SQLITE_ERROR;
+  }
+  if (plan & PLAN_K)
+    k = sqlite3_value_int64(argv[arg++]);
+  if (plan & PLAN_MIN_SCORE)
+    min_score = sqlite3_value_double(argv[arg++]);
+  if (plan & (PLAN_SCORE_GT | PLAN_SCORE_GE))
+  {
+    // hits score above min_score: score >= v is score > the double below v
+    v = sqlite3_value_double(argv[arg++]);
+    if (plan & PLAN_SCORE_GE)
+      v = nextafter(v, -INFINITY);
+    if (v > min_score)
+      min_score = v;
+  }
+  if (plan & PLAN_LIMIT)
+    k = sqlite3_value_int64(argv[arg++]);
+  if (k < 0)
+    k = 0;
+  if (k > MAX_K)
+    k = MAX_K;
+  if (k == 0)
+    goto cleanup;
+
+  if (!(c->hits = sqlite3_malloc64(k * sizeof(*c->hits))))
+  {
+    rc = SQLITE_NOMEM;
+    goto cleanup;
+  }
+  if (t->index)
+  {
+    c->n_hits = fpindex_query(t->index, q, (size_t)k, min_score, c->hits);
+  }
+  else
+  {
+    if (!(corpus_hits = sqlite3_malloc64(k * sizeof(*corpus_hits))))
+    {
+      rc = SQLITE_NOMEM;
+      goto cleanup;
+    }
+    c->n_hits = fpcorpus_topk(t->corpus, q, (size_t)k, min_score, corpus_hits);
+    for (size_t i = 0; i < c->n_hits; i++)
+    {
+      c->hits[i].id = t->corpus->ids[corpus_hits[i].ix];
+      c->hits[i].score = corpus_hits[i].score;
+    }
+  }
+
+cleanup:
+  sqlite3_free(corpus_hits);
+  free_fprint(q);
+  return rc;
+}
+
+static int ix_next(sqlite3_vtab_cursor *cur)
+{
+  ((IndexCursor *)cur)->pos++;
+  return SQLITE_OK;
+}
+
+static int ix_eof(sqlite3_vtab_cursor *cur)
+{
+  IndexCursor *c = (IndexCursor *)cur;
+  return c->pos >= c->n_hits;
+}
+
+static int ix_column(sqlite3_vtab_cursor *cur, sqlite3_context *ctx, int col)
+{
+  IndexCursor *c = (IndexCursor *)cur;
+
+  if (col == COL_ID)
+    sqlite3_result_int64(ctx, (sqlite3_int64)c->hits[c->pos].id);
+  else if (col == COL_SCORE)
+    sqlite3_result_double(ctx, c->hits[c->pos].score);
+  else
+    sqlite3_result_null(ctx);
+  return SQLITE_OK;
+}
+
+static int ix_rowid(sqlite3_vtab_cursor *cur, sqlite3_int64 *rowid)
+{
+  IndexCursor *c = (IndexCursor *)cur;
+
+  *rowid = (sqlite3_int64)c->hits[c->pos].id;
+  return SQLITE_OK;
+}
+
+// INSERT INTO songs_ix(id, fp): id, or the rowid if id is NULL
+static int ix_update(sqlite3_vtab *vtab, int argc, sqlite3_value **argv,
+                     sqlite3_int64 *rowid)
+{
+  IndexTab *t = (IndexTab *)vtab;
+  sqlite3_value *id = NULL;
+  FPrint *fp = NULL;
+  int errn = 0;
+
+  if (!t->index)
+  {
+    tab_error(vtab, "fprint_index: a corpus is read-only");
+    return SQLITE_READONLY;
+  }
+  if (argc == 1 || sqlite3_value_type(argv[0]) != SQLITE_NULL)
+  {
+    tab_error(vtab, "fprint_index: entries cannot be changed or deleted");
+    return SQLITE_ERROR;
+  }
+  id = argv[2 + COL_ID];
+  if (sqlite3_value_type(id) == SQLITE_NULL)
+    id = argv[1];
+  if (sqlite3_value_type(id) == SQLITE_NULL)
+  {
+    tab_error(vtab, "fprint_index: an entry needs an id");
+    return SQLITE_CONSTRAINT;
+  }
+  if (!(fp = blob_fprint(argv[2 + COL_FP])))
+  {
+    tab_error(vtab, "fprint_index: fp is not a fingerprint");
+    return SQLITE_MISMATCH;
+  }
+  *rowid = sqlite3_value_int64(id);
+  errn = fpindex_add(t->index, (uint64_t)*rowid, fp);
+  free_fprint(fp);
+  if (errn)
+  {
+    sqlite3_free(vtab->zErrMsg);
+    vtab->zErrMsg = sqlite3_mprintf("fprint_index: error %d adding %lld",
+                                    errn, (long long)*rowid);
+    return SQLITE_ERROR;
+  }
+  return SQLITE_OK;
+}
+
+static sqlite3_module index_module = {
+    0,             // iVersion
+    ix_connect,    // xCreate
+    ix_connect,    // xConnect
+    ix_best_index, // xBestIndex
+    ix_disconnect, // xDisconnect
+    ix_disconnect, // xDestroy: the files outlive the table
+    ix_open,       // xOpen
+    ix_close,      // xClose
+    ix_filter,     // xFilter
+    ix_next,       // xNext
+    ix_eof,        // xEof
+    ix_column,     // xColumn
+    ix_rowid,      // xRowid
+    ix_update,     // xUpdate
+};
+
+#ifdef _WIN32
+__declspec(dllexport)
+#endif
+int sqlite3_sqlfprint_init(sqlite3 *db, char **err,
+                           const sqlite3_api_routines *api)
+{
+  int flags = SQLITE_UTF8 | SQLITE_DETERMINISTIC;
+  int rc = SQLITE_OK;
+
+  SQLITE_EXTENSION_INIT2(api);
+  rc = sqlite3_create_function(db, "fprint_cmp", 2, flags, NULL, fn_cmp,
+                               NULL, NULL);
+  if (rc == SQLITE_OK)
+    rc = sqlite3_create_function(db, "fprint_from_string", 1, flags, NULL,
+                                 fn_from_string, NULL, NULL);
+  if (rc == SQLITE_OK)
+    rc = sqlite3_create_function(db, "fprint_to_string", 1, flags, NULL,
+                                 fn_to_string, NULL, NULL);
+  if (rc == SQLITE_OK)
+    rc = sqlite3_create_module(db, "fprint_index", &index_module, NULL);
+  return rc;
+}
@@ -35,6 +35,7 @@ extern "C"
 
 #include <errno.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "chromaw.h"
 
@@ -42,19 +43,144 @@ extern "C"
 }
 #endif
 
-#include <chromaprint/fingerprinter.h>
+#include <chromaprint/audio_processor.h>
+#include <chromaprint/chroma.h>
+#include <chromaprint/chroma_filter.h>
+#include <chromaprint/chroma_normalizer.h>
+#include <chromaprint/classifier.h>
+#include <chromaprint/fft.h>
+#include <chromaprint/fingerprint_calculator.h>
+#include <chromaprint/image.h>
+#include <chromaprint/image_builder.h>
 
 using namespace Chromaprint;
 
+// Chromaprint::Fingerprinter keeps its chroma image private, so we build
+// the same pipeline here with the image exposed.  Parameters and
+// classifiers are copied from chromaprint's fingerprinter.cpp; keep them in
+// sync (or tune them here) -- see requirements/chromaprint/src.
+
+static const int SAMPLE_RATE = 11025;
+static const int FRAME_SIZE = 4096;
+static const int OVERLAP = FRAME_SIZE - FRAME_SIZE / 3;
+static const int MIN_FREQ = 28;
+static const int MAX_FREQ = 3520;
+
+static const int kChromaFilterSize = 5;
+static const double kChromaFilterCoefficients[] = {0.25, 0.75, 1.0, 0.75, 0.25};
+
+static const int kNumClassifiers = 16;
+static const Classifier kClassifiers[] = {
+    Classifier(Filter(0, 0, 3, 15), Quantizer(2.10543, 2.45354, 2.69414)),
+    Classifier(Filter(1, 0, 4, 14), Quantizer(-0.345922, 0.0463746, 0.446251)),
+    Classifier(Filter(1, 4, 4, 11), Quantizer(-0.392132, 0.0291077, 0.443391)),
+    Classifier(Filter(3, 0, 4, 14), Quantizer(-0.192851, 0.00583535, 0.204053)),
+    Classifier(Filter(2, 8, 2, 4), Quantizer(-0.0771619, -0.00991999, 0.0575406)),
+    Classifier(Filter(5, 6, 2, 15), Quantizer(-0.710437, -0.518954, -0.330402)),
+    Classifier(Filter(1, 9, 2, 16), Quantizer(-0.353724, -0.0189719, 0.289768)),
+    Classifier(Filter(3, 4, 2, 10), Quantizer(-0.128418, -0.0285697, 0.0591791)),
+    Classifier(Filter(3, 9, 2, 16), Quantizer(-0.139052, -0.0228468, 0.0879723)),
+    Classifier(Filter(2, 1, 3, 6), Quantizer(-0.133562, 0.00669205, 0.155012)),
+    Classifier(Filter(3, 3, 6, 2), Quantizer(-0.0267, 0.00804829, 0.0459773)),
+    Classifier(Filter(2, 8, 1, 10), Quantizer(-0.0972417, 0.0152227, 0.129003)),
+    Classifier(Filter(3, 4, 4, 14), Quantizer(-0.141434, 0.00374515, 0.149935)),
+    Classifier(Filter(5, 4, 2, 15), Quantizer(-0.64035, -0.466999, -0.285493)),
+    Classifier(Filter(5, 9, 2, 3), Quantizer(-0.322792, -0.254258, -0.174278)),
+    Classifier(Filter(2, 1, 8, 4), Quantizer(-0.0741375, -0.00590933, 0.0600357)),
+};
+
+class ChromaPipeline
+{
+public:
+    ChromaPipeline()
+        : m_image(CHROMA_IMAGE_COLUMNS),
+          m_image_builder(&m_image),
+          m_chroma_normalizer(&m_image_builder),
+          m_chroma_filter(kChromaFilterCoefficients, kChromaFilterSize,
+                          &m_chroma_normalizer),
+          m_chroma(MIN_FREQ, MAX_FREQ, FRAME_SIZE, SAMPLE_RATE, &m_chroma_filter),
+          m_fft(FRAME_SIZE, OVERLAP, &m_chroma),
+          m_audio_processor(SAMPLE_RATE, &m_fft)
+    {
+    }
+
+    bool Init(int sample_rate, int num_channels)
+    {
+        if (!m_audio_processor.Reset(sample_rate, num_channels))
+            return false;
+        m_fft.Reset();
+        m_chroma.Reset();
+        m_chroma_filter.Reset();
+        m_chroma_normalizer.Reset();
+        m_image = Image(CHROMA_IMAGE_COLUMNS);
+        m_image_builder.Reset(&m_image);
+        return true;
+    }
+
+    void Consume(short *samples, int length)
+    {
+        m_audio_processor.Consume(samples, length);
+    }
+
+    Image &image()
+    {
+        return m_image;
+    }
+
+private:
+    // declaration order is construction order: each stage feeds the one
+    // declared above it
+    Image m_image;
+    ImageBuilder m_image_builder;
+    ChromaNormalizer m_chroma_normalizer;
+    ChromaFilter m_chroma_filter;
+    Chroma m_chroma;
+    FFT m_fft;
+    AudioProcessor m_audio_processor;
+};
+
+static int32_t *copy_fingerprint(const std::vector<int32_t> &cpr_fp,
+                                 int *errn,
+                                 size_t *outlen)
+{
+    int32_t *cprint = NULL;
+    size_t cpr_len = static_cast<size_t>(cpr_fp.size());
+
+    if (cpr_len == 0)
+    {
+        *errn = 1;
+        return NULL;
+    }
+
+    // every element is written: no need to zero it first
+    cprint = (int32_t *)malloc(cpr_len * sizeof(*cprint));
+    if (!cprint)
+    {
+        *errn = ENOMEM;
+        return NULL;
+    }
+    memcpy(cprint, cpr_fp.data(), cpr_len * sizeof(*cprint));
+
+    *errn = 0;
+    *outlen = cpr_len;
+    return cprint;
+}
+
 ChromaFingerprinter chroma_init(int sample_rate, int num_channels)
 {
-    Fingerprinter *cpr = new Fingerprinter();
+    ChromaPipeline *cpr = NULL;
     try
     {
-        cpr->Fingerprinter::Init(sample_rate, num_channels);
+        cpr = new ChromaPipeline();
+        if (!cpr->Init(sample_rate, num_channels))
+        {
+            delete cpr;
+            return NULL;
+        }
     }
     catch (...)
     {
+        delete cpr;
         return NULL;
     }
     return static_cast<ChromaFingerprinter>(cpr);
@@ -66,7 +192,7 @@ int chroma_feed(ChromaFingerprinter cpr, int16_t *data, int32_t len)
         return 0;
     try
     {
-        (static_cast<Fingerprinter *>(cpr))->Fingerprinter::Consume(data, len);
+        (static_cast<ChromaPipeline *>(cpr))->Consume(data, len);
     }
     catch (...)
     {
@@ -80,13 +206,12 @@ int32_t *chroma_calculate(ChromaFingerprinter cpr,
                           size_t *outlen)
 {
     std::vector<int32_t> cpr_fp;
-    int32_t *cprint = NULL;
-    size_t cpr_len = 0;
 
     *outlen = 0;
     try
     {
-        cpr_fp = (static_cast<Fingerprinter *>(cpr))->Fingerprinter::Calculate();
+        FingerprintCalculator calculator(kClassifiers, kNumClassifiers);
+        cpr_fp = calculator.Calculate(&(static_cast<ChromaPipeline *>(cpr))->image());
     }
     catch (...)
     {
@@ -94,35 +219,63 @@ int32_t *chroma_calculate(ChromaFingerprinter cpr,
         return NULL;
     }
 
-    cpr_len = static_cast<size_t>(cpr_fp.size());
-    if (cpr_len == 0)
-    {
-        *errn = 1;
-        return NULL;
-    }
+    return copy_fingerprint(cpr_fp, errn, outlen);
+}
 
-    cprint = (int32_t *)calloc(cpr_len, sizeof(*cprint));
-    if (!cprint)
+double *chroma_get_image(ChromaFingerprinter cpr,
+                         int *errn,
+                         size_t *n_rows)
+{
+    Image &image = (static_cast<ChromaPipeline *>(cpr))->image();
+    size_t rows = static_cast<size_t>(image.NumRows());
+    double *out = NULL;
+
+    *n_rows = 0;
+    out = (double *)malloc((rows ? rows : 1) * CHROMA_IMAGE_COLUMNS * sizeof(*out));
+    if (!out)
     {
         *errn = ENOMEM;
         return NULL;
     }
-    for (size_t j = 0; j < cpr_len; j++)
+    for (size_t i = 0; i < rows; i++)
     {
-        cprint[j] = cpr_fp[j];
+        const double *row = image.Row(static_cast<int>(i));
+        for (size_t j = 0; j < CHROMA_IMAGE_COLUMNS; j++)
+        {
+            out[i * CHROMA_IMAGE_COLUMNS + j] = row[j];
+        }
     }
 
     *errn = 0;
-    *outlen = cpr_len;
-    return cprint;
+    *n_rows = rows;
+    return out;
 }
 
-void chroma_destroy(ChromaFingerprinter cpr)
+int32_t *chroma_calculate_image(const double *image,
+                                size_t n_rows,
+                                int *errn,
+                                size_t *outlen)
 {
-    Fingerprinter *fcpr = static_cast<Fingerprinter *>(cpr);
-    if (fcpr)
+    std::vector<int32_t> cpr_fp;
+
+    *outlen = 0;
+    try
+    {
+        Image img(CHROMA_IMAGE_COLUMNS, image,
+                  image + n_rows * CHROMA_IMAGE_COLUMNS);
+        FingerprintCalculator calculator(kClassifiers, kNumClassifiers);
+        cpr_fp = calculator.Calculate(&img);
+    }
+    catch (...)
     {
-        fcpr->Fingerprinter::~Fingerprinter();
-        cpr = NULL;
+        *errn = -1;
+        return NULL;
     }
+
+    return copy_fingerprint(cpr_fp, errn, outlen);
+}
+
+void chroma_destroy(ChromaFingerprinter cpr)
+{
+    delete static_cast<ChromaPipeline *>(cpr);
 }
@@ -49,6 +49,26 @@ int32_t* chroma_calculate(ChromaFingerprinter cpr,
 
 void chroma_destroy(ChromaFingerprinter cpr);
 
+/* the chroma image has one row of this many bands per analysis frame */
+#define CHROMA_IMAGE_COLUMNS 12
+
+/* chroma_get_image
+ * copy of the chroma image built from the audio fed so far: *n_rows rows of
+ * CHROMA_IMAGE_COLUMNS normalized values in [0, 1].  Free with free().
+ */
+double* chroma_get_image(ChromaFingerprinter cpr,
+                         int* errn,
+                         size_t* n_rows);
+
+/* chroma_calculate_image
+ * the chromaprint of an image returned by chroma_get_image, without any
+ * audio: lets the classifiers be re-run over cached images
+ */
+int32_t* chroma_calculate_image(const double* image,
+                                size_t n_rows,
+                                int* errn,
+                                size_t* outsize);
+
 #ifdef __cplusplus
 }
 #endif
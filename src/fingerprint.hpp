@@ -0,0 +1,380 @@
+/*
+ *  fingerprint.hpp
+ *
+ *  C++17 interface to libfingerprint
+ *
+ *  Fingerprint owns an FPrint (freed with free_fprint) and can only be
+ *  moved, never copied by accident.  FingerprintView is a non-owning view of
+ *  the fields match_cpfm reads, over an FPrint or straight over an entry of
+ *  a mapped FPCorpus, so matching corpus entries copies nothing.  r, dom and
+ *  cprint are returned as Span views of the underlying arrays, with no
+ *  CALC_FP_SIZE arithmetic or cprint[1] indexing left to the caller.
+ *
+ *  Context holds the FPOptions (and the feature cache, if any) shared by
+ *  every fingerprint extracted through it.  Failures are thrown as
+ *  std::system_error carrying the value the C call returned: an errno value
+ *  in std::generic_category, or a negative FFmpeg one in ffmpeg_category.
+ *
+ *  Header only: link with -lfingerprint as for the C interface.
+ *
+ *  Copyright 2010 Zatisfi, LLC. MIT License, 2025
+ */
+
+#ifndef _FINGERPRINT_HPP
+#define _FINGERPRINT_HPP
+
+#if __cplusplus < 201703L
+#error "fingerprint.hpp requires C++17"
+#endif
+
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <system_error>
+#include <utility>
+
+// the C headers use C99 restrict, which C++ spells __restrict
+#ifndef restrict
+#define restrict __restrict
+#define _FINGERPRINT_HPP_RESTRICT
+#endif
+
+#include "fplib.h"
+#include "fpcache.h"
+#include "fpcorpus.h"
+
+#ifdef _FINGERPRINT_HPP_RESTRICT
+#undef restrict
+#undef _FINGERPRINT_HPP_RESTRICT
+#endif
+
+namespace fingerprint
+{
+
+// contiguous run of T owned by someone else (std::span before C++20)
+template <typename T>
+class Span
+{
+public:
+    constexpr Span() noexcept : m_data(nullptr), m_size(0) {}
+    constexpr Span(T *data, size_t size) noexcept : m_data(data), m_size(size) {}
+    // a Span<T> is also a Span<const T>
+    template <typename U>
+    constexpr Span(const Span<U> &other) noexcept
+        : m_data(other.data()), m_size(other.size())
+    {
+    }
+
+    constexpr T *data() const noexcept { return m_data; }
+    constexpr size_t size() const noexcept { return m_size; }
+    constexpr size_t size_bytes() const noexcept { return m_size * sizeof(T); }
+    constexpr bool empty() const noexcept { return m_size == 0; }
+    constexpr T &operator[](size_t i) const noexcept { return m_data[i]; }
+    constexpr T *begin() const noexcept { return m_data; }
+    constexpr T *end() const noexcept { return m_data + m_size; }
+
+    constexpr Span first(size_t n) const noexcept
+    {
+        return Span(m_data, n < m_size ? n : m_size);
+    }
+
+    constexpr Span subspan(size_t offset) const noexcept
+    {
+        return offset < m_size ? Span(m_data + offset, m_size - offset) : Span();
+    }
+
+private:
+    T *m_data;
+    size_t m_size;
+};
+
+// negative error values are FFmpeg's (AVERROR), not errno values
+class FFmpegCategory : public std::error_category
+{
+public:
+    const char *name() const noexcept override { return "ffmpeg"; }
+    std::string message(int errn) const override
+    {
+        return "FFmpeg error " + std::to_string(errn);
+    }
+};
+
+inline const std::error_category &ffmpeg_category() noexcept
+{
+    static const FFmpegCategory category;
+    return category;
+}
+
+[[noreturn]] inline void throw_error(int errn, const char *what)
+{
+    if (errn < 0)
+        throw std::system_error(errn, ffmpeg_category(), what);
+    throw std::system_error(errn, std::generic_category(), what);
+}
+
+// what match_cpfm reads of a fingerprint; valid as long as what it views
+class FingerprintView
+{
+public:
+    FingerprintView() noexcept = default;
+
+    // missing is read through fprint_missing, as match_cpfm does
+    FingerprintView(const FPrint &fp) noexcept
+        : m_songlen(fp.songlen),
+          m_missing(fprint_missing(&fp)),
+          m_r(fp.r, R_SIZE),
+          m_dom(fp.dom, DOM_SIZE),
+          m_cprint(fp.cprint, fp.cprint_len)
+    {
+    }
+
+    // entry i of a corpus, which only holds complete fingerprints
+    FingerprintView(const FPCorpus &c, uint64_t i) noexcept
+        : m_songlen(c.songlen[i]),
+          m_missing(0),
+          m_r(&c.r[i * R_SIZE], R_SIZE),
+          m_dom(&c.dom[i * DOM_SIZE], DOM_SIZE),
+          m_cprint(fpcorpus_cprint(&c, i), fpcorpus_cprint_len(&c, i))
+    {
+    }
+
+    uint32_t songlen() const noexcept { return m_songlen; }
+    uint16_t missing() const noexcept { return m_missing; }
+    Span<const uint8_t> r() const noexcept { return m_r; }
+    Span<const uint8_t> dom() const noexcept { return m_dom; }
+    Span<const int32_t> cprint() const noexcept { return m_cprint; }
+
+private:
+    uint32_t m_songlen = 0;
+    uint16_t m_missing = FP_MISSING_ALL;
+    Span<const uint8_t> m_r;
+    Span<const uint8_t> m_dom;
+    Span<const int32_t> m_cprint;
+};
+
+// buffer from the C library, released with free()
+struct FreeDeleter
+{
+    void operator()(void *p) const noexcept { std::free(p); }
+};
+
+using Bytes = std::unique_ptr<uint8_t[], FreeDeleter>;
+
+class Fingerprint
+{
+public:
+    Fingerprint() noexcept = default;
+
+    // takes ownership of fp (from new_fprint or any call returning one)
+    explicit Fingerprint(FPrint *fp) noexcept : m_fp(fp) {}
+
+    // room for cprint_len values, all fields zeroed
+    static Fingerprint with_cprint_len(size_t cprint_len)
+    {
+        if (cprint_len > INT32_MAX)
+            throw_error(EOVERFLOW, "new_fprint");
+        FPrint *fp = new_fprint(static_cast<int>(cprint_len));
+        if (!fp)
+            throw_error(ENOMEM, "new_fprint");
+        return Fingerprint(fp);
+    }
+
+    static Fingerprint from_string(const char *str)
+    {
+        FPrint *fp = fprint_from_string(str);
+        if (!fp)
+            throw_error(EINVAL, "fprint_from_string");
+        return Fingerprint(fp);
+    }
+
+    static Fingerprint from_string(const std::string &str)
+    {
+        return from_string(str.c_str());
+    }
+
+    // bytes is fprint_to_bytes output
+    static Fingerprint from_bytes(const uint8_t *bytes)
+    {
+        FPrint *fp = fprint_from_bytes(bytes);
+        if (!fp)
+            throw_error(ENOMEM, "fprint_from_bytes");
+        return Fingerprint(fp);
+    }
+
+    // a copy of entry i of c, for when it must outlive the mapping
+    static Fingerprint from_corpus(const FPCorpus &c, uint64_t i)
+    {
+        FPrint *fp = fpcorpus_get(&c, i);
+        if (!fp)
+            throw_error(ENOMEM, "fpcorpus_get");
+        return Fingerprint(fp);
+    }
+
+    Fingerprint(Fingerprint &&) noexcept = default;
+    Fingerprint &operator=(Fingerprint &&) noexcept = default;
+    Fingerprint(const Fingerprint &) = delete;
+    Fingerprint &operator=(const Fingerprint &) = delete;
+
+    explicit operator bool() const noexcept { return m_fp != nullptr; }
+
+    FPrint *get() const noexcept { return m_fp.get(); }
+    // hand the FPrint back to C code, which must free_fprint it
+    FPrint *release() noexcept { return m_fp.release(); }
+
+    FingerprintView view() const noexcept
+    {
+        return m_fp ? FingerprintView(*m_fp) : FingerprintView();
+    }
+    operator FingerprintView() const noexcept { return view(); }
+
+    uint32_t songlen() const noexcept { return m_fp->songlen; }
+    void set_songlen(uint32_t songlen) noexcept { m_fp->songlen = songlen; }
+    int32_t bit_rate() const noexcept { return m_fp->bit_rate; }
+    int32_t num_errors() const noexcept { return m_fp->num_errors; }
+    uint16_t missing() const noexcept { return fprint_missing(m_fp.get()); }
+
+    Span<uint8_t> r() noexcept { return Span<uint8_t>(m_fp->r, R_SIZE); }
+    Span<const uint8_t> r() const noexcept
+    {
+        return Span<const uint8_t>(m_fp->r, R_SIZE);
+    }
+    Span<uint8_t> dom() noexcept { return Span<uint8_t>(m_fp->dom, DOM_SIZE); }
+    Span<const uint8_t> dom() const noexcept
+    {
+        return Span<const uint8_t>(m_fp->dom, DOM_SIZE);
+    }
+    Span<int32_t> cprint() noexcept
+    {
+        return Span<int32_t>(m_fp->cprint, m_fp->cprint_len);
+    }
+    Span<const int32_t> cprint() const noexcept
+    {
+        return Span<const int32_t>(m_fp->cprint, m_fp->cprint_len);
+    }
+
+    std::string to_string() const
+    {
+        std::unique_ptr<char, FreeDeleter> str(fprint_to_string(m_fp.get()));
+        if (!str)
+            throw_error(ENOMEM, "fprint_to_string");
+        return std::string(str.get());
+    }
+
+    // PACKED_FP_SIZE(cprint().size()) bytes
+    Bytes to_bytes() const
+    {
+        Bytes bytes(fprint_to_bytes(m_fp.get()));
+        if (!bytes)
+            throw_error(ENOMEM, "fprint_to_bytes");
+        return bytes;
+    }
+
+    size_t packed_size() const noexcept
+    {
+        return PACKED_FP_SIZE(m_fp->cprint_len);
+    }
+
+private:
+    struct Deleter
+    {
+        void operator()(FPrint *fp) const noexcept { free_fprint(fp); }
+    };
+
+    std::unique_ptr<FPrint, Deleter> m_fp;
+};
+
+// extraction settings, and the feature cache they use, shared by every
+// fingerprint taken through one Context.  Safe to share between threads
+// as far as the cache is (see fpcache.h).
+class Context
+{
+public:
+    Context() noexcept { fp_options_init(&m_opts); }
+
+    // preview tier: FP_PREVIEW_DURATION seconds, chromaprint only
+    static Context preview() noexcept
+    {
+        Context ctx;
+        fp_options_preview(&ctx.m_opts);
+        return ctx;
+    }
+
+    // open (or create) the feature cache at path for this context
+    void open_cache(const char *path)
+    {
+        int errn = 0;
+        FPCache *cache = fpcache_open(path, &errn);
+        if (!cache)
+            throw_error(errn ? errn : EIO, "fpcache_open");
+        m_cache.reset(cache);
+        m_opts.cache = cache;
+    }
+
+    void set_extractors(int extractors) noexcept { m_opts.extractors = extractors; }
+    void set_duration(int seconds) noexcept { m_opts.duration = seconds; }
+    const FPOptions &options() const noexcept { return m_opts; }
+
+    Fingerprint fingerprint(const char *filename) const
+    {
+        int errn = 0;
+        FPrint *fp = get_fingerprint_opts(filename, &m_opts, &errn, 0);
+        if (!fp)
+            throw_error(errn ? errn : EIO, filename);
+        return Fingerprint(fp);
+    }
+
+    Fingerprint fingerprint(const std::string &filename) const
+    {
+        return fingerprint(filename.c_str());
+    }
+
+    // as fingerprint, but an empty Fingerprint and *error instead of a throw
+    Fingerprint try_fingerprint(const char *filename, int *error) const noexcept
+    {
+        return Fingerprint(get_fingerprint_opts(filename, &m_opts, error, 0));
+    }
+
+private:
+    struct CacheDeleter
+    {
+        void operator()(FPCache *cache) const noexcept { fpcache_close(cache); }
+    };
+
+    FPOptions m_opts;
+    std::unique_ptr<FPCache, CacheDeleter> m_cache;
+};
+
+// match_cpfm of two views
+inline double match(const FingerprintView &a, const FingerprintView &b) noexcept
+{
+    return match_cpfm_partial(a.missing() | b.missing(),
+                              a.songlen(), a.r().data(), a.dom().data(),
+                              a.cprint().data(), a.cprint().size(),
+                              b.songlen(), b.r().data(), b.dom().data(),
+                              b.cprint().data(), b.cprint().size());
+}
+
+inline double match_fooid(const FingerprintView &a,
+                          const FingerprintView &b) noexcept
+{
+    return match_fooid_fp(a.r().data(), a.dom().data(),
+                          b.r().data(), b.dom().data());
+}
+
+inline double match_chromab(Span<const int32_t> a, Span<const int32_t> b) noexcept
+{
+    return ::match_chromab(a.data(), a.size(), b.data(), b.size());
+}
+
+inline bool is_match(const FingerprintView &a, const FingerprintView &b) noexcept
+{
+    return FP_ISMATCH(match(a, b));
+}
+
+} // namespace fingerprint
+
+#endif /* _FINGERPRINT_HPP */
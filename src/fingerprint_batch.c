@@ -0,0 +1,215 @@
+/*
+ *  fingerprint_batch.c
+ *  executable to fingerprint many audio files on all cores
+ *
+ *  Copyright 2010 Zatisfi, LLC. MIT License, 2025
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+
+#include "fplib.h"
+#include "fpbatch.h"
+
+#define PATH_INIT_CAP 1024
+
+// read one path per line from f; returns the number read, or -1
+static long read_paths(FILE *f, char ***paths)
+{
+  char *line = NULL;
+  size_t line_cap = 0;
+  ssize_t len = 0;
+  size_t n = 0;
+  size_t cap = 0;
+  char **tmp = NULL;
+
+  while ((len = getline(&line, &line_cap, f)) > 0)
+  {
+    while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+      line[--len] = '\0';
+    if (len == 0)
+      continue;
+    if (n == cap)
+    {
+      cap = cap ? cap * 2 : PATH_INIT_CAP;
+      if (!(tmp = realloc(*paths, cap * sizeof(*tmp))))
+        goto error;
+      *paths = tmp;
+    }
+    if (!((*paths)[n] = strdup(line)))
+      goto error;
+    n++;
+  }
+  free(line);
+  return (long)n;
+
+error:
+  free(line);
+  for (size_t i = 0; i < n; i++)
+    free((*paths)[i]);
+  free(*paths);
+  *paths = NULL;
+  return -1;
+}
+
+static double total_seconds(const FPBatchJob *jobs, size_t n)
+{
+  double t = 0.0;
+  for (size_t i = 0; i < n; i++)
+    t += jobs[i].seconds;
+  return t;
+}
+
+static void free_results(FPBatchJob *jobs, size_t n)
+{
+  for (size_t i = 0; i < n; i++)
+  {
+    free_fprint(jobs[i].fp);
+    jobs[i].fp = NULL;
+  }
+}
+
+int main(int argc, const char *argv[])
+{
+  const char *usage_fmt =
+      "Usage: %s [-h] [-t THREADS] [-fifo | -compare] [-pipe [-decode N -dsp N]]\n"
+      "          [-numa] [-v] [FILE ...]\n"
+      "fingerprint audio files (one path per line on stdin if none are\n"
+      "given) and write \"path<TAB>fingerprint\" lines to stdout\n\n"
+      "  -t        number of worker threads (default: one per CPU)\n"
+      "  -fifo     start files in the order given instead of longest first\n"
+      "  -compare  run the batch in order, then longest first, and report both\n"
+      "            makespans (the first run also warms the page cache)\n"
+      "  -pipe     decode and run the DSP on separate workers, moving workers\n"
+      "            to whichever stage is behind\n"
+      "  -decode   with -pipe: number of decode workers\n"
+      "  -dsp      with -pipe: number of DSP workers (with -decode: fixed pools)\n"
+      "  -numa     pin worker groups to NUMA nodes\n"
+      "  -v        verbose: print metadata to stderr, keeping stdout to the\n"
+      "            result lines\n"
+      "  -h        print this message\n";
+  FPBatchOptions opts;
+  FPBatchJob *jobs = NULL;
+  char **stdin_paths = NULL;
+  long n_jobs = 0;
+  int compare = 0;
+  int n_failed = 0;
+  int errn = 0;
+  int i = 1;
+  double makespan = 0.0;
+  double fifo_makespan = 0.0;
+  char *fp_str = NULL;
+
+  ffmpeg_init();
+  fpbatch_options_init(&opts);
+
+  for (; i < argc && argv[i][0] == '-' && argv[i][1] != '\0'; i++)
+  {
+    if (strcmp(argv[i], "-h") == 0)
+    {
+      printf(usage_fmt, argv[0]);
+      return 0;
+    }
+    else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc)
+      opts.n_threads = atoi(argv[++i]);
+    else if (strcmp(argv[i], "-fifo") == 0)
+      opts.order = FPBATCH_FIFO;
+    else if (strcmp(argv[i], "-compare") == 0)
+      compare = 1;
+    else if (strcmp(argv[i], "-pipe") == 0)
+      opts.pipeline = 1;
+    else if (strcmp(argv[i], "-decode") == 0 && i + 1 < argc)
+      opts.n_decode = atoi(argv[++i]);
+    else if (strcmp(argv[i], "-dsp") == 0 && i + 1 < argc)
+      opts.n_dsp = atoi(argv[++i]);
+    else if (strcmp(argv[i], "-numa") == 0)
+      opts.numa = 1;
+    else if (strcmp(argv[i], "-v") == 0)
+      opts.verbose = 1;
+    else
+    {
+      fprintf(stderr, usage_fmt, argv[0]);
+      return EINVAL;
+    }
+  }
+
+  if (i < argc && strcmp(argv[i], "-") != 0)
+  {
+    n_jobs = argc - i;
+  }
+  else if ((n_jobs = read_paths(stdin, &stdin_paths)) < 0)
+  {
+    fprintf(stderr, "ERROR: unable to read file list\n");
+    return ENOMEM;
+  }
+  if (n_jobs == 0)
+  {
+    fprintf(stderr, usage_fmt, argv[0]);
+    return ENOENT;
+  }
+
+  jobs = calloc(n_jobs, sizeof(*jobs));
+  if (!jobs)
+  {
+    errn = ENOMEM;
+    goto cleanup;
+  }
+  for (long j = 0; j < n_jobs; j++)
+    jobs[j].path = stdin_paths ? stdin_paths[j] : argv[i + j];
+
+  if (compare)
+  {
+    opts.order = FPBATCH_FIFO;
+    if ((errn = fpbatch_run(jobs, n_jobs, &opts, &fifo_makespan)) != 0)
+      goto cleanup;
+    fprintf(stderr, "fifo: makespan %.2f s, %.2f s of work\n",
+            fifo_makespan, total_seconds(jobs, n_jobs));
+    free_results(jobs, n_jobs);
+    opts.order = FPBATCH_LJF;
+  }
+
+  if ((errn = fpbatch_run(jobs, n_jobs, &opts, &makespan)) != 0)
+    goto cleanup;
+
+  for (long j = 0; j < n_jobs; j++)
+  {
+    if (!jobs[j].fp)
+    {
+      fprintf(stderr, "ERROR: %d: unable to fingerprint %s\n",
+              jobs[j].error, jobs[j].path);
+      n_failed++;
+      continue;
+    }
+    if (!(fp_str = fprint_to_string(jobs[j].fp)))
+    {
+      errn = ENOMEM;
+      goto cleanup;
+    }
+    printf("%s\t%s\n", jobs[j].path, fp_str);
+    free(fp_str);
+  }
+
+  fprintf(stderr, "%s%s: makespan %.2f s, %.2f s of work, %ld files, %d failed\n",
+          opts.order == FPBATCH_FIFO ? "fifo" : "ljf",
+          opts.pipeline ? " pipeline" : "", makespan,
+          total_seconds(jobs, n_jobs), n_jobs, n_failed);
+  if (compare && makespan > 0.0)
+    fprintf(stderr, "ljf vs fifo: %.2fx\n", fifo_makespan / makespan);
+
+cleanup:
+  if (errn)
+    fprintf(stderr, "ERROR: %d: batch failed\n", errn);
+  if (jobs)
+    free_results(jobs, n_jobs);
+  free(jobs);
+  if (stdin_paths)
+  {
+    for (long j = 0; j < n_jobs; j++)
+      free(stdin_paths[j]);
+    free(stdin_paths);
+  }
+
+  return errn ? errn : (n_failed ? 1 : 0);
+}
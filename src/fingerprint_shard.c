@@ -0,0 +1,495 @@
+/*
+ *  fingerprint_shard.c
+ *  executable to split a corpus into shards, serve them from worker
+ *  processes and query them through a coordinator, and to merge corpora
+ *
+ *  Copyright 2010 Zatisfi, LLC. MIT License, 2025
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "fplib.h"
+#include "fpcorpus.h"
+#include "fpmerge.h"
+#include "fpshard.h"
+#include "fpsnap.h"
+
+#define DEFAULT_K 10
+#define DEFAULT_QUERIES 100
+#define LOCAL_PREFIX_FMT "/tmp/fpshard-%d"
+
+static const char *usage_fmt =
+    "Usage: %s split CORPUS N PREFIX [-hash]\n"
+    "       %s serve SHARD_CORPUS ADDR [-reload SECONDS]\n"
+    "       %s query [-k K] ADDR ...\n"
+    "       %s local CORPUS N [-hash] [-q QUERIES]\n"
+    "       %s merge [-map MAP] OUT CORPUS ...\n\n"
+    "  split  write the entries of CORPUS into PREFIX.0.fpc .. PREFIX.<N-1>.fpc,\n"
+    "         by songlen range (default) or by a hash of the id\n"
+    "  serve  answer queries against SHARD_CORPUS on ADDR: a Unix socket path\n"
+    "         (containing a '/') or [HOST]:PORT; with -reload, check SHARD_CORPUS\n"
+    "         every SECONDS and switch to a new file without dropping queries\n"
+    "  query  read fingerprints (fprint_to_string, one per line) on stdin, query\n"
+    "         the shards at ADDR ... and print \"line<TAB>id<TAB>score\" per hit;\n"
+    "         per-shard latency goes to stderr\n"
+    "  local  split CORPUS into N shards under /tmp, serve each from its own\n"
+    "         process, query with QUERIES of its entries (default %d) and\n"
+    "         check the results against a single-process scan\n"
+    "  merge  write the entries of every CORPUS to OUT, similar fingerprints next\n"
+    "         to each other and without exact duplicates, renumbered from 0;\n"
+    "         MAP gets \"input<TAB>old_id<TAB>new_id\" for every entry\n";
+
+static double now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static char *shard_name(const char *prefix, int shard, const char *ext)
+{
+  size_t len = strlen(prefix) + strlen(ext) + 16;
+  char *name = malloc(len);
+
+  if (name)
+    snprintf(name, len, "%s.%d.%s", prefix, shard, ext);
+  return name;
+}
+
+static void usage(const char *prog)
+{
+  printf(usage_fmt, prog, prog, prog, prog, prog, DEFAULT_QUERIES);
+}
+
+// per query, or averaged over sent[s] queries if total is set
+static void print_stats(const FPShardStats *stats, int n_shards,
+                        const double *total, const double *match,
+                        const int *sent)
+{
+  for (int s = 0; s < n_shards; s++)
+  {
+    if (total)
+      fprintf(stderr, "shard %d: %d queries, %.3f ms round trip, %.3f ms matching\n",
+              s, sent[s], 1e3 * total[s] / (sent[s] ? sent[s] : 1),
+              1e3 * match[s] / (sent[s] ? sent[s] : 1));
+    else if (stats[s].error)
+      fprintf(stderr, "shard %d: error %d\n", s, stats[s].error);
+    else if (stats[s].skipped)
+      fprintf(stderr, "shard %d: skipped\n", s);
+    else
+      fprintf(stderr, "shard %d: %zu hits, %.3f ms round trip, %.3f ms matching\n",
+              s, stats[s].n_hits, 1e3 * stats[s].seconds,
+              1e3 * stats[s].match_seconds);
+  }
+}
+
+typedef struct
+{
+  FPSnap *snap;
+  const char *path;
+  int seconds;
+  struct stat st;
+} Reloader;
+
+// corpus writers rename a finished file into place, so a new corpus is a
+// new inode (or at least a new mtime or size)
+static int same_file(const struct stat *a, const struct stat *b)
+{
+  return a->st_dev == b->st_dev && a->st_ino == b->st_ino &&
+         a->st_size == b->st_size && a->st_mtime == b->st_mtime;
+}
+
+static void *reload_corpus(void *arg)
+{
+  Reloader *rl = (Reloader *)arg;
+  struct stat st;
+  int errn = 0;
+
+  for (;;)
+  {
+    sleep(rl->seconds);
+    if (stat(rl->path, &st) != 0 || same_file(&st, &rl->st))
+      continue;
+    if ((errn = fpsnap_reload_corpus(rl->snap, rl->path)) != 0)
+    {
+      // possibly caught mid-write: keep serving the old one, retry later
+      fprintf(stderr, "ERROR: %d: unable to reload %s\n", errn, rl->path);
+      continue;
+    }
+    rl->st = st;
+    fprintf(stderr, "reloaded %s (version %llu)\n", rl->path,
+            (unsigned long long)fpsnap_version(rl->snap));
+  }
+  return NULL;
+}
+
+static int run_serve(const char *corpus_path, const char *addr, int reload)
+{
+  FPCorpus *c = NULL;
+  FPSnap *snap = NULL;
+  Reloader rl;
+  pthread_t thread;
+  int fd = -1;
+  int errn = 0;
+
+  memset(&rl, 0, sizeof(rl));
+  // stat first: a file swapped in before the open is then seen as new
+  if (stat(corpus_path, &rl.st) != 0)
+    return errno;
+  if (!(c = fpcorpus_open(corpus_path, &errn)))
+    return errn;
+  if (!(snap = fpsnap_new(c, fpsnap_free_corpus)))
+  {
+    fpcorpus_close(c);
+    return ENOMEM;
+  }
+  if ((fd = fpshard_listen(addr, &errn)) < 0)
+    goto cleanup;
+  fprintf(stderr, "serving %llu entries of %s on %s\n",
+          (unsigned long long)c->count, corpus_path, addr);
+
+  if (reload > 0)
+  {
+    rl.snap = snap;
+    rl.path = corpus_path;
+    rl.seconds = reload;
+    if ((errn = pthread_create(&thread, NULL, reload_corpus, &rl)) != 0)
+    {
+      fprintf(stderr, "ERROR: %d: unable to start the reload thread\n", errn);
+      goto cleanup;
+    }
+    pthread_detach(thread);
+  }
+  errn = fpshard_serve_snap(snap, fd);
+  // the process exits next; connection and reload threads may still run
+  close(fd);
+  return errn;
+
+cleanup:
+  if (fd >= 0)
+    close(fd);
+  fpsnap_free(snap);
+  return errn;
+}
+
+static int run_query(const char *const *addrs, int n_shards, int k)
+{
+  FPShardClient *cl = NULL;
+  FPShardHit *hits = NULL;
+  FPShardStats *stats = NULL;
+  FPrint *q = NULL;
+  char *line = NULL;
+  size_t line_cap = 0;
+  ssize_t len = 0;
+  long line_no = 0;
+  size_t n = 0;
+  int errn = 0;
+
+  if (!(cl = fpshard_connect(addrs, n_shards, &errn)))
+    return errn;
+  hits = calloc(k, sizeof(*hits));
+  stats = calloc(n_shards, sizeof(*stats));
+  if (!hits || !stats)
+  {
+    errn = ENOMEM;
+    goto cleanup;
+  }
+
+  while ((len = getline(&line, &line_cap, stdin)) > 0)
+  {
+    line_no++;
+    while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+      line[--len] = '\0';
+    if (len == 0)
+      continue;
+    if (!(q = fprint_from_string(line)))
+    {
+      fprintf(stderr, "ERROR: line %ld is not a fingerprint\n", line_no);
+      continue;
+    }
+    n = fpshard_query(cl, q, k, FP_MATCH_CUTOFF, hits, stats);
+    for (size_t i = 0; i < n; i++)
+      printf("%ld\t%llu\t%f\n", line_no, (unsigned long long)hits[i].id,
+             hits[i].score);
+    fprintf(stderr, "line %ld:\n", line_no);
+    print_stats(stats, n_shards, NULL, NULL, NULL);
+    free_fprint(q);
+  }
+
+cleanup:
+  free(line);
+  free(hits);
+  free(stats);
+  fpshard_disconnect(cl);
+  return errn;
+}
+
+// split, fork a worker per shard on a Unix socket, query, compare with
+// fpcorpus_topk over the whole corpus
+static int run_local(const char *corpus_path, int n_shards, int mode,
+                     int n_queries)
+{
+  char prefix[64];
+  char **paths = NULL;
+  char **addrs = NULL;
+  pid_t *pids = NULL;
+  FPCorpus *c = NULL;
+  FPShardClient *cl = NULL;
+  FPShardHit hits[DEFAULT_K];
+  FPCorpusHit expect[DEFAULT_K];
+  FPShardStats *stats = NULL;
+  double *total = NULL;
+  double *match = NULL;
+  int *sent = NULL;
+  FPrint *q = NULL;
+  double t0 = 0.0;
+  double t_sharded = 0.0;
+  double t_single = 0.0;
+  size_t n = 0;
+  size_t n_expect = 0;
+  int n_started = 0;
+  int n_wrong = 0;
+  int errn = 0;
+  int fd = -1;
+
+  snprintf(prefix, sizeof(prefix), LOCAL_PREFIX_FMT, (int)getpid());
+  if ((errn = fpshard_split(corpus_path, n_shards, mode, prefix)) != 0)
+    return errn;
+  if (!(c = fpcorpus_open(corpus_path, &errn)))
+    goto cleanup;
+  if (c->count == 0)
+  {
+    fprintf(stderr, "ERROR: %s is empty\n", corpus_path);
+    errn = EINVAL;
+    goto cleanup;
+  }
+
+  paths = calloc(n_shards, sizeof(*paths));
+  addrs = calloc(n_shards, sizeof(*addrs));
+  pids = calloc(n_shards, sizeof(*pids));
+  stats = calloc(n_shards, sizeof(*stats));
+  total = calloc(n_shards, sizeof(*total));
+  match = calloc(n_shards, sizeof(*match));
+  sent = calloc(n_shards, sizeof(*sent));
+  if (!paths || !addrs || !pids || !stats || !total || !match || !sent)
+  {
+    errn = ENOMEM;
+    goto cleanup;
+  }
+
+  for (; n_started < n_shards; n_started++)
+  {
+    int s = n_started;
+    if (!(paths[s] = shard_name(prefix, s, "fpc")) ||
+        !(addrs[s] = shard_name(prefix, s, "sock")))
+    {
+      errn = ENOMEM;
+      goto cleanup;
+    }
+    // listen before forking, so the coordinator can connect at once
+    if ((fd = fpshard_listen(addrs[s], &errn)) < 0)
+      goto cleanup;
+    if ((pids[s] = fork()) < 0)
+    {
+      errn = errno;
+      close(fd);
+      goto cleanup;
+    }
+    if (pids[s] == 0)
+    {
+      FPCorpus *shard = fpcorpus_open(paths[s], &errn);
+      if (!shard)
+        _exit(errn);
+      _exit(fpshard_serve(shard, fd));
+    }
+    close(fd);
+  }
+
+  if (!(cl = fpshard_connect((const char *const *)addrs, n_shards, &errn)))
+    goto cleanup;
+  fprintf(stderr, "%d shards, %llu entries\n", n_shards,
+          (unsigned long long)fpshard_count(cl));
+
+  for (int i = 0; i < n_queries; i++)
+  {
+    if (!(q = fpcorpus_get(c, c->count * i / n_queries)))
+    {
+      errn = ENOMEM;
+      goto cleanup;
+    }
+
+    t0 = now();
+    n = fpshard_query(cl, q, DEFAULT_K, FP_MATCH_CUTOFF, hits, stats);
+    t_sharded += now() - t0;
+    t0 = now();
+    n_expect = fpcorpus_topk(c, q, DEFAULT_K, FP_MATCH_CUTOFF, expect);
+    t_single += now() - t0;
+    free_fprint(q);
+
+    for (int s = 0; s < n_shards; s++)
+    {
+      total[s] += stats[s].seconds;
+      match[s] += stats[s].match_seconds;
+      sent[s] += !stats[s].skipped;
+      if (stats[s].error)
+        errn = stats[s].error;
+    }
+    // ties may come back in another order; the scores must agree
+    if (n != n_expect)
+      n_wrong++;
+    for (size_t j = 0; j < n && n == n_expect; j++)
+    {
+      if (hits[j].score != expect[j].score)
+      {
+        n_wrong++;
+        break;
+      }
+    }
+    if (errn)
+      goto cleanup;
+  }
+
+  print_stats(stats, n_shards, total, match, sent);
+  fprintf(stderr, "%d queries: %.3f ms sharded, %.3f ms in one process, %d mismatched\n",
+          n_queries, 1e3 * t_sharded / n_queries, 1e3 * t_single / n_queries,
+          n_wrong);
+  if (n_wrong)
+    errn = EIO;
+
+cleanup:
+  fpshard_disconnect(cl);
+  for (int s = 0; s < n_started; s++)
+  {
+    if (pids[s] > 0)
+    {
+      kill(pids[s], SIGTERM);
+      waitpid(pids[s], NULL, 0);
+    }
+  }
+  for (int s = 0; s < n_shards; s++)
+  {
+    char path[96];
+    // the split writes every shard, even if a worker never started
+    snprintf(path, sizeof(path), "%s.%d.fpc", prefix, s);
+    unlink(path);
+    if (addrs && addrs[s])
+      unlink(addrs[s]);
+    if (paths)
+      free(paths[s]);
+    if (addrs)
+      free(addrs[s]);
+  }
+  free(paths);
+  free(addrs);
+  free(pids);
+  free(stats);
+  free(total);
+  free(match);
+  free(sent);
+  fpcorpus_close(c);
+  if (errn)
+    fprintf(stderr, "ERROR: %d: local run failed\n", errn);
+  return errn;
+}
+
+static int run_merge(const char *out_path, const char *const *inputs,
+                     int n_inputs, const char *map_path)
+{
+  FPMergeStats st;
+  double t0 = now();
+  int errn = fpmerge_corpora(inputs, n_inputs, out_path, map_path, &st);
+
+  if (!errn)
+    fprintf(stderr, "%llu entries in, %llu written, %llu duplicates dropped, %.3f s\n",
+            (unsigned long long)st.n_in, (unsigned long long)st.n_out,
+            (unsigned long long)st.n_dups, now() - t0);
+  return errn;
+}
+
+int main(int argc, const char *argv[])
+{
+  int mode = FPSHARD_BY_SONGLEN;
+  int n_queries = DEFAULT_QUERIES;
+  int k = DEFAULT_K;
+  int reload = 0;
+  int i = 2;
+
+  if (argc < 2 || strcmp(argv[1], "-h") == 0)
+  {
+    usage(argv[0]);
+    return argc < 2 ? EINVAL : 0;
+  }
+
+  // a coordinator that hangs up must not kill a worker
+  signal(SIGPIPE, SIG_IGN);
+
+  if (strcmp(argv[1], "split") == 0 && argc >= 5)
+  {
+    if (argc > 5 && strcmp(argv[5], "-hash") == 0)
+      mode = FPSHARD_BY_HASH;
+    return fpshard_split(argv[2], atoi(argv[3]), mode, argv[4]);
+  }
+  else if (strcmp(argv[1], "serve") == 0 && (argc == 4 || argc == 6))
+  {
+    if (argc == 6)
+    {
+      if (strcmp(argv[4], "-reload") != 0 || atoi(argv[5]) <= 0)
+      {
+        usage(argv[0]);
+        return EINVAL;
+      }
+      reload = atoi(argv[5]);
+    }
+    return run_serve(argv[2], argv[3], reload);
+  }
+  else if (strcmp(argv[1], "query") == 0 && argc >= 3)
+  {
+    if (strcmp(argv[2], "-k") == 0 && argc >= 5)
+    {
+      k = atoi(argv[3]);
+      i = 4;
+    }
+    if (k <= 0 || k > FPSHARD_MAX_K)
+    {
+      usage(argv[0]);
+      return EINVAL;
+    }
+    return run_query(&argv[i], argc - i, k);
+  }
+  else if (strcmp(argv[1], "local") == 0 && argc >= 4 && atoi(argv[3]) > 0)
+  {
+    for (i = 4; i < argc; i++)
+    {
+      if (strcmp(argv[i], "-hash") == 0)
+        mode = FPSHARD_BY_HASH;
+      else if (strcmp(argv[i], "-q") == 0 && i + 1 < argc)
+        n_queries = atoi(argv[++i]);
+    }
+    if (n_queries <= 0)
+    {
+      usage(argv[0]);
+      return EINVAL;
+    }
+    return run_local(argv[2], atoi(argv[3]), mode, n_queries);
+  }
+  else if (strcmp(argv[1], "merge") == 0 && argc >= 4)
+  {
+    if (strcmp(argv[2], "-map") == 0)
+      i = 4;
+    if (argc - i >= 2)
+      return run_merge(argv[i], &argv[i + 1], argc - i - 1,
+                       i == 4 ? argv[3] : NULL);
+  }
+
+  usage(argv[0]);
+  return EINVAL;
+}
@@ -0,0 +1,1135 @@
+/*
+ *  fpbatch.c
+ *  fingerprint many files on a pool of worker threads
+ *
+ *  Copyright 2010 Zatisfi, LLC. MIT License, 2025
+ *
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <libavutil/common.h>
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+
+#include "fplib.h"
+#include "fpbatch.h"
+#include "fpnuma.h"
+#include "fpstage.h"
+
+// cost model, in seconds of 44.1 kHz stereo MP3 decoding: opening the
+// file, probing the streams and computing the prints ...
+#define COST_FIXED 2.0
+// ... plus reading the part of the file that is decoded ...
+#define COST_BYTES_PER_UNIT (512.0 * 1024.0)
+// ... plus decoding it, scaled by codec_weight and the sample rate
+#define COST_REF_SAMPLES (44100.0 * 2.0)
+
+typedef struct
+{
+  pthread_mutex_t lock;
+  // job indices, most expensive first; jobs[ix[head .. tail)] are queued
+  size_t *ix;
+  size_t head;
+  size_t tail;
+  double cost;
+} Queue;
+
+typedef struct
+{
+  FPBatchJob *jobs;
+  Queue *queues;
+  int n_queues;
+  const FPBatchOptions *opts;
+} Pool;
+
+typedef struct
+{
+  Pool *pool;
+  int id;
+  int node;
+} Worker;
+
+static pthread_once_t lockmgr_once = PTHREAD_ONCE_INIT;
+
+static double now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+////////////////////////////////////////////////////////////
+// Cost estimates
+////////////////////////////////////////////////////////////
+
+// decoding time per second of audio relative to MP3
+static double codec_weight(enum CodecID id)
+{
+  switch (id)
+  {
+  case CODEC_ID_PCM_S16LE:
+    return 0.1;
+  case CODEC_ID_FLAC:
+  case CODEC_ID_ALAC:
+  case CODEC_ID_WAVPACK:
+    return 0.6;
+  case CODEC_ID_MP2:
+  case CODEC_ID_AC3:
+    return 0.8;
+  case CODEC_ID_AAC:
+  case CODEC_ID_WMAV2:
+    return 1.2;
+  case CODEC_ID_VORBIS:
+    return 1.3;
+  case CODEC_ID_APE:
+    return 2.5;
+  default:
+    return 1.0;
+  }
+}
+
+double fpbatch_estimate_cost(const char *path, int duration)
+{
+  struct stat st;
+  AVFormatContext *ic = NULL;
+  AVCodecContext *cxt = NULL;
+  double size = 0.0;
+  double seconds = 0.0;
+  double decoded = 0.0;
+  double bytes = 0.0;
+  double samples = COST_REF_SAMPLES;
+
+  if (stat(path, &st) != 0)
+    return COST_FIXED;
+  size = (double)st.st_size;
+  if (duration <= 0 || duration > FP_DEFAULT_DURATION)
+    duration = FP_DEFAULT_DURATION;
+
+  // the header only: avformat_find_stream_info would decode frames
+  if (avformat_open_input(&ic, path, NULL, NULL) != 0 || !ic)
+    return COST_FIXED + size / COST_BYTES_PER_UNIT;
+
+  for (unsigned int i = 0; i < ic->nb_streams; i++)
+  {
+    if (ic->streams[i]->codec->codec_type == AVMEDIA_TYPE_AUDIO)
+    {
+      cxt = ic->streams[i]->codec;
+      break;
+    }
+  }
+
+  if (ic->duration > 0)
+    seconds = (double)ic->duration / AV_TIME_BASE;
+  else if (ic->bit_rate > 0)
+    seconds = size * 8.0 / ic->bit_rate;
+
+  // get_fingerprint stops after duration seconds
+  if (seconds > 0.0)
+  {
+    decoded = FFMIN(seconds, (double)duration);
+    bytes = size * decoded / seconds;
+  }
+  else
+  {
+    decoded = duration;
+    bytes = size;
+  }
+  if (cxt && cxt->sample_rate > 0 && cxt->channels > 0)
+    samples = (double)cxt->sample_rate * cxt->channels;
+
+  avformat_close_input(&ic);
+
+  return COST_FIXED + bytes / COST_BYTES_PER_UNIT +
+         decoded * (cxt ? codec_weight(cxt->codec_id) : 1.0) *
+             samples / COST_REF_SAMPLES;
+}
+
+////////////////////////////////////////////////////////////
+// Worker pool
+////////////////////////////////////////////////////////////
+
+// avcodec_open2 and avcodec_close are not thread-safe without a lock manager
+static int lockmgr(void **mutex, enum AVLockOp op)
+{
+  switch (op)
+  {
+  case AV_LOCK_CREATE:
+    *mutex = malloc(sizeof(pthread_mutex_t));
+    if (!*mutex)
+      return 1;
+    return pthread_mutex_init((pthread_mutex_t *)*mutex, NULL) != 0;
+  case AV_LOCK_OBTAIN:
+    return pthread_mutex_lock((pthread_mutex_t *)*mutex) != 0;
+  case AV_LOCK_RELEASE:
+    return pthread_mutex_unlock((pthread_mutex_t *)*mutex) != 0;
+  case AV_LOCK_DESTROY:
+    pthread_mutex_destroy((pthread_mutex_t *)*mutex);
+    free(*mutex);
+    *mutex = NULL;
+    return 0;
+  }
+  return 1;
+}
+
+static void register_lockmgr(void)
+{
+  if (av_lockmgr_register(lockmgr) != 0)
+    fprintf(stderr, "WARNING: unable to register an FFmpeg lock manager\n");
+}
+
+// the next job from the head (or tail) of q, or (size_t)-1 if it is empty
+static size_t queue_pop(Pool *p, Queue *q, int from_tail)
+{
+  size_t ix = (size_t)-1;
+
+  pthread_mutex_lock(&q->lock);
+  if (q->head < q->tail)
+  {
+    ix = from_tail ? q->ix[--q->tail] : q->ix[q->head++];
+    q->cost -= p->jobs[ix].cost;
+  }
+  pthread_mutex_unlock(&q->lock);
+
+  return ix;
+}
+
+// the cheapest job of the queue with the most work left
+static size_t queue_steal(Pool *p, int self)
+{
+  int victim = -1;
+  double most = 0.0;
+  double cost = 0.0;
+  size_t ix = (size_t)-1;
+
+  // a victim may drain between the scan and the pop, so retry until every
+  // queue is empty
+  do
+  {
+    victim = -1;
+    most = 0.0;
+    for (int i = 0; i < p->n_queues; i++)
+    {
+      if (i == self)
+        continue;
+      pthread_mutex_lock(&p->queues[i].lock);
+      cost = p->queues[i].head < p->queues[i].tail ? p->queues[i].cost : -1.0;
+      pthread_mutex_unlock(&p->queues[i].lock);
+      if (cost >= 0.0 && (victim < 0 || cost > most))
+      {
+        victim = i;
+        most = cost;
+      }
+    }
+    if (victim < 0)
+      return (size_t)-1;
+  } while ((ix = queue_pop(p, &p->queues[victim], 1)) == (size_t)-1);
+
+  return ix;
+}
+
+static void *worker_run(void *arg)
+{
+  Worker *w = (Worker *)arg;
+  Pool *p = w->pool;
+  int own = w->id % p->n_queues;
+  FPBatchJob *job = NULL;
+  size_t ix;
+  double t0;
+
+  if (w->node != FPNUMA_ANY_NODE && fpnuma_bind_thread(w->node) != 0)
+    fprintf(stderr, "WARNING: unable to bind worker %d to node %d\n",
+            w->id, w->node);
+
+  for (;;)
+  {
+    ix = queue_pop(p, &p->queues[own], 0);
+    if (ix == (size_t)-1 && p->n_queues > 1)
+      ix = queue_steal(p, own);
+    if (ix == (size_t)-1)
+      break;
+
+    job = &p->jobs[ix];
+    t0 = now();
+    job->fp = get_fingerprint_opts(job->path, p->opts->fp, &job->error,
+                                   p->opts->verbose);
+    job->seconds = now() - t0;
+    if (job->fp && job->error != 0)
+    {
+      free_fprint(job->fp);
+      job->fp = NULL;
+    }
+  }
+
+  return NULL;
+}
+
+typedef struct
+{
+  double cost;
+  size_t ix;
+} CostIx;
+
+static int cmp_cost_desc(const void *a, const void *b)
+{
+  const CostIx *x = (const CostIx *)a;
+  const CostIx *y = (const CostIx *)b;
+  if (x->cost != y->cost)
+    return (x->cost < y->cost) - (x->cost > y->cost);
+  return (x->ix > y->ix) - (x->ix < y->ix);
+}
+
+////////////////////////////////////////////////////////////
+// Pipeline
+////////////////////////////////////////////////////////////
+
+// a block holds whole frames; it is handed on once it has less room left
+// than the largest frame a codec may decode into
+#define PIPE_BLOCK_BYTES (512 * 1024)
+#define PIPE_BLOCK_FRAMES 512
+#define PIPE_BLOCKS_PER_THREAD 4
+// blocks queued on one stream (a power of two)
+#define PIPE_STREAM_BLOCKS 8
+// frames start on this boundary in a block
+#define PIPE_FRAME_ALIGN 16
+
+#define PIPE_DECODE 0
+#define PIPE_DSP 1
+
+// Stream.state
+#define STREAM_SCHEDULED 0x1
+#define STREAM_DECODED 0x2
+
+typedef struct
+{
+  uint32_t start;
+  int32_t size;
+  int32_t channels;
+  int32_t bit_rate;
+  int32_t num_errors;
+} FrameRec;
+
+// decoded frames of one file; owned by one thread at a time: the decoder
+// filling it, the stream's ring, the DSP worker reading it, or the pool
+typedef struct
+{
+  uint8_t *data;
+  size_t cap;
+  size_t used;
+  int n_frames;
+  FrameRec frames[PIPE_BLOCK_FRAMES];
+} Block;
+
+typedef struct
+{
+  size_t seq;
+  void *item;
+} Cell;
+
+// bounded multi-producer, multi-consumer queue of pointers: a cell's seq
+// says whether it is free for the push at position seq or holds the item
+// for the pop at seq - 1
+typedef struct
+{
+  Cell *cells;
+  size_t mask;
+  size_t head __attribute__((aligned(64)));
+  size_t tail __attribute__((aligned(64)));
+} Ring;
+
+// one file on its way through the pipeline.  The decoder pushes blocks
+// into the ring and schedules the stream for a DSP worker; the worker that
+// holds STREAM_SCHEDULED is the only one feeding it.  The decoder holds a
+// reference until it is done, and each scheduling one until the DSP
+// worker it went to lets go of the stream.
+typedef struct
+{
+  FPBatchJob *job;
+  FPStagePlan plan;
+  FPStreamInfo info;
+  FPDsp *dsp;
+  Block *blocks[PIPE_STREAM_BLOCKS];
+  size_t head;
+  size_t tail;
+  int state;
+  int refs;
+  // set on the DSP side once no more frames are wanted
+  int stop;
+  // the decoder's error, read once STREAM_DECODED is set
+  int error;
+  int dsp_error;
+  double t0;
+} Stream;
+
+typedef struct
+{
+  FPBatchJob *jobs;
+  size_t n_jobs;
+  const CostIx *order;
+  const FPBatchOptions *opts;
+  // next index into order to decode, and jobs finished
+  size_t next;
+  size_t n_done;
+  Block *pool;
+  size_t n_blocks;
+  Ring free;
+  Ring ready;
+  int adaptive;
+  // workers in the decode role
+  int n_decode;
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  uint64_t gen;
+} Pipe;
+
+typedef struct
+{
+  Pipe *pipe;
+  int id;
+  int node;
+  int role;
+  // the file being decoded, and the block being filled
+  Stream *stream;
+  FPDecoder *dec;
+  Block *block;
+  int ending;
+  // seconds spent in each role, of them seconds a decoder spent on the
+  // DSP side while it waited, and role changes
+  double since;
+  double role_seconds[2];
+  double lent;
+  int switches;
+} PipeWorker;
+
+static size_t pow2_at_least(size_t n)
+{
+  size_t p = 1;
+  while (p < n)
+    p <<= 1;
+  return p;
+}
+
+static int ring_init(Ring *r, size_t n)
+{
+  size_t cap = pow2_at_least(n);
+
+  if (!(r->cells = malloc(cap * sizeof(*r->cells))))
+    return ENOMEM;
+  for (size_t i = 0; i < cap; i++)
+    r->cells[i].seq = i;
+  r->mask = cap - 1;
+  r->head = 0;
+  r->tail = 0;
+  return 0;
+}
+
+// 0 if r is full
+static int ring_push(Ring *r, void *item)
+{
+  size_t pos = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+  Cell *cell = NULL;
+  intptr_t dif;
+
+  for (;;)
+  {
+    cell = &r->cells[pos & r->mask];
+    dif = (intptr_t)__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) -
+          (intptr_t)pos;
+    if (dif == 0)
+    {
+      if (__atomic_compare_exchange_n(&r->head, &pos, pos + 1, 1,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        break;
+    }
+    else if (dif < 0)
+      return 0;
+    else
+      pos = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+  }
+  cell->item = item;
+  __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+  return 1;
+}
+
+// NULL if r is empty
+static void *ring_pop(Ring *r)
+{
+  size_t pos = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+  Cell *cell = NULL;
+  void *item = NULL;
+  intptr_t dif;
+
+  for (;;)
+  {
+    cell = &r->cells[pos & r->mask];
+    dif = (intptr_t)__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) -
+          (intptr_t)(pos + 1);
+    if (dif == 0)
+    {
+      if (__atomic_compare_exchange_n(&r->tail, &pos, pos + 1, 1,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        break;
+    }
+    else if (dif < 0)
+      return NULL;
+    else
+      pos = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+  }
+  item = cell->item;
+  __atomic_store_n(&cell->seq, pos + r->mask + 1, __ATOMIC_RELEASE);
+  return item;
+}
+
+// about how many items r holds
+static size_t ring_count(Ring *r)
+{
+  size_t head = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+  size_t tail = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+  return head > tail ? head - tail : 0;
+}
+
+static void pipe_wake(Pipe *p)
+{
+  pthread_mutex_lock(&p->lock);
+  __atomic_add_fetch(&p->gen, 1, __ATOMIC_RELEASE);
+  pthread_cond_broadcast(&p->wake);
+  pthread_mutex_unlock(&p->lock);
+}
+
+// sleep until something happened since gen was seen
+static void pipe_wait(Pipe *p, uint64_t seen)
+{
+  pthread_mutex_lock(&p->lock);
+  while (__atomic_load_n(&p->gen, __ATOMIC_RELAXED) == seen &&
+         __atomic_load_n(&p->n_done, __ATOMIC_ACQUIRE) < p->n_jobs)
+    pthread_cond_wait(&p->wake, &p->lock);
+  pthread_mutex_unlock(&p->lock);
+}
+
+static void block_put(Pipe *p, Block *b)
+{
+  b->used = 0;
+  b->n_frames = 0;
+  // the pool ring holds every block, so this cannot fail
+  ring_push(&p->free, b);
+  pipe_wake(p);
+}
+
+static int block_full(const Block *b)
+{
+  return b->n_frames == PIPE_BLOCK_FRAMES ||
+         b->cap - b->used < AVCODEC_MAX_AUDIO_FRAME_SIZE + PIPE_FRAME_ALIGN;
+}
+
+static int block_append(Block *b, const FPFrame *f)
+{
+  size_t start = (b->used + PIPE_FRAME_ALIGN - 1) &
+                 ~(size_t)(PIPE_FRAME_ALIGN - 1);
+  uint8_t *data = NULL;
+  FrameRec *rec = NULL;
+
+  // only a frame larger than the codec's maximum gets here
+  if (start + f->size > b->cap)
+  {
+    if (!(data = realloc(b->data, start + f->size)))
+      return ENOMEM;
+    b->data = data;
+    b->cap = start + f->size;
+  }
+  if (f->size > 0)
+    memcpy(b->data + start, f->pcm, f->size);
+  rec = &b->frames[b->n_frames++];
+  rec->start = (uint32_t)start;
+  rec->size = f->size;
+  rec->channels = f->channels;
+  rec->bit_rate = f->bit_rate;
+  rec->num_errors = f->num_errors;
+  b->used = start + f->size;
+
+  return 0;
+}
+
+// the decoder's side of the stream's ring; 0 if it is full
+static int stream_push(Stream *s, Block *b)
+{
+  size_t head = s->head;
+
+  if (head - __atomic_load_n(&s->tail, __ATOMIC_ACQUIRE) == PIPE_STREAM_BLOCKS)
+    return 0;
+  s->blocks[head & (PIPE_STREAM_BLOCKS - 1)] = b;
+  __atomic_store_n(&s->head, head + 1, __ATOMIC_RELEASE);
+  return 1;
+}
+
+// the scheduled DSP worker's side
+static Block *stream_pop(Stream *s)
+{
+  size_t tail = s->tail;
+  Block *b = NULL;
+
+  if (tail == __atomic_load_n(&s->head, __ATOMIC_ACQUIRE))
+    return NULL;
+  b = s->blocks[tail & (PIPE_STREAM_BLOCKS - 1)];
+  __atomic_store_n(&s->tail, tail + 1, __ATOMIC_RELEASE);
+  return b;
+}
+
+static int stream_pending(Stream *s)
+{
+  return __atomic_load_n(&s->head, __ATOMIC_ACQUIRE) !=
+         __atomic_load_n(&s->tail, __ATOMIC_ACQUIRE);
+}
+
+static void stream_unref(Stream *s)
+{
+  if (__atomic_sub_fetch(&s->refs, 1, __ATOMIC_ACQ_REL) != 0)
+    return;
+  fpstage_dsp_free(s->dsp);
+  free(s);
+}
+
+static void job_done(Pipe *p)
+{
+  __atomic_add_fetch(&p->n_done, 1, __ATOMIC_RELEASE);
+  pipe_wake(p);
+}
+
+static void stream_feed(Pipe *p, Stream *s, Block *b)
+{
+  FPFrame frame;
+  int full = 0;
+
+  for (int i = 0; i < b->n_frames && !s->stop; i++)
+  {
+    if (!s->dsp &&
+        !(s->dsp = fpstage_dsp_new(&s->plan, &s->info, &s->dsp_error)))
+      break;
+    frame.pcm = (const int16_t *)(b->data + b->frames[i].start);
+    frame.size = b->frames[i].size;
+    frame.channels = b->frames[i].channels;
+    frame.bit_rate = b->frames[i].bit_rate;
+    frame.num_errors = b->frames[i].num_errors;
+    if ((s->dsp_error = fpstage_dsp_feed(s->dsp, &frame, &full)) != 0 ||
+        full)
+      break;
+  }
+  // the decoder stops at its next block
+  if (s->dsp_error != 0 || full)
+    __atomic_store_n(&s->stop, 1, __ATOMIC_RELEASE);
+  block_put(p, b);
+}
+
+static void stream_finish(Pipe *p, Stream *s)
+{
+  FPBatchJob *job = s->job;
+
+  if (s->error != 0 || s->dsp_error != 0)
+    job->error = s->error != 0 ? s->error : s->dsp_error;
+  else if (s->dsp)
+    job->fp = fpstage_dsp_finish(s->dsp, &s->plan, &s->info, job->path,
+                                 &job->error);
+  else
+    job->error = 1;
+  if (job->fp && job->error != 0)
+  {
+    free_fprint(job->fp);
+    job->fp = NULL;
+  }
+  fpstage_dsp_free(s->dsp);
+  s->dsp = NULL;
+  job->seconds = now() - s->t0;
+  job_done(p);
+}
+
+// feed s everything queued; the caller holds STREAM_SCHEDULED and the
+// reference stream_schedule took
+static void stream_run(Pipe *p, Stream *s)
+{
+  Block *b = NULL;
+
+  for (;;)
+  {
+    while ((b = stream_pop(s)) != NULL)
+      stream_feed(p, s, b);
+    if (__atomic_load_n(&s->state, __ATOMIC_ACQUIRE) & STREAM_DECODED)
+    {
+      if (stream_pending(s))
+        continue;
+      stream_finish(p, s);
+      break;
+    }
+    __atomic_and_fetch(&s->state, ~STREAM_SCHEDULED, __ATOMIC_ACQ_REL);
+    // a block or the end may have come in since the ring was found empty;
+    // if so, feed it unless the decoder has rescheduled the stream
+    if (!stream_pending(s) &&
+        !(__atomic_load_n(&s->state, __ATOMIC_ACQUIRE) & STREAM_DECODED))
+      break;
+    if (__atomic_fetch_or(&s->state, STREAM_SCHEDULED, __ATOMIC_ACQ_REL) &
+        STREAM_SCHEDULED)
+      break;
+  }
+  stream_unref(s);
+}
+
+// hand s, which the caller has just scheduled, to a DSP worker, with a
+// reference of its own: the decoder may be done with s before it runs
+static void stream_schedule(Pipe *p, Stream *s)
+{
+  __atomic_add_fetch(&s->refs, 1, __ATOMIC_ACQ_REL);
+  if (ring_push(&p->ready, s))
+    pipe_wake(p);
+  else
+    stream_run(p, s);
+}
+
+static void set_role(PipeWorker *w, int role)
+{
+  double t = now();
+
+  if (w->role == role)
+    return;
+  w->role_seconds[w->role] += t - w->since;
+  w->since = t;
+  w->switches++;
+  if (role == PIPE_DECODE)
+    __atomic_add_fetch(&w->pipe->n_decode, 1, __ATOMIC_RELAXED);
+  else
+    __atomic_sub_fetch(&w->pipe->n_decode, 1, __ATOMIC_RELAXED);
+  w->role = role;
+}
+
+// a decoder between files: open the next one, or give up the decode role
+// if the DSP side is behind or no files are left; 0 if it has no file
+static int decode_start(Pipe *p, PipeWorker *w)
+{
+  FPBatchJob *job = NULL;
+  Stream *s = NULL;
+  size_t ix;
+
+  // fewer than a quarter of the blocks free: the DSP workers are behind
+  if (__atomic_load_n(&p->adaptive, __ATOMIC_RELAXED) &&
+      ring_count(&p->free) < p->n_blocks / 4 &&
+      __atomic_load_n(&p->n_decode, __ATOMIC_RELAXED) > 1)
+  {
+    set_role(w, PIPE_DSP);
+    return 0;
+  }
+  ix = __atomic_fetch_add(&p->next, 1, __ATOMIC_RELAXED);
+  if (ix >= p->n_jobs)
+  {
+    set_role(w, PIPE_DSP);
+    return 0;
+  }
+
+  job = &p->jobs[p->order[ix].ix];
+  if (!(s = calloc(1, sizeof(*s))))
+  {
+    job->error = ENOMEM;
+    job_done(p);
+    return 0;
+  }
+  s->job = job;
+  s->refs = 1;
+  s->t0 = now();
+  job->fp = fpstage_plan(job->path, p->opts->fp, &s->plan, &job->error);
+  if (!job->fp && job->error == 0)
+    w->dec = fpstage_decoder_open(job->path, p->opts->verbose, &s->info,
+                                  &job->error);
+  if (!w->dec)
+  {
+    // a cache hit, or a file that cannot be decoded
+    job->seconds = now() - s->t0;
+    free(s);
+    job_done(p);
+    return 0;
+  }
+  w->stream = s;
+  w->ending = 0;
+
+  return 1;
+}
+
+static void decode_end(Pipe *p, PipeWorker *w)
+{
+  Stream *s = w->stream;
+
+  fpstage_decoder_close(w->dec);
+  w->dec = NULL;
+  w->stream = NULL;
+  if (!(__atomic_fetch_or(&s->state, STREAM_DECODED | STREAM_SCHEDULED,
+                          __ATOMIC_ACQ_REL) &
+        STREAM_SCHEDULED))
+    stream_schedule(p, s);
+  stream_unref(s);
+}
+
+// decode a block's worth of w's file and queue it; EAGAIN if that has to
+// wait for a free block or for room in the stream's ring
+static int decode_step(Pipe *p, PipeWorker *w)
+{
+  Stream *s = w->stream;
+  Block *b = w->block;
+  FPFrame frame;
+  int eof = 0;
+  int errn = 0;
+
+  if (b && (w->ending || block_full(b)))
+  {
+    if (b->n_frames == 0)
+      block_put(p, b);
+    else if (!stream_push(s, b))
+      return EAGAIN;
+    else if (!(__atomic_fetch_or(&s->state, STREAM_SCHEDULED,
+                                 __ATOMIC_ACQ_REL) &
+               STREAM_SCHEDULED))
+      stream_schedule(p, s);
+    w->block = b = NULL;
+  }
+  if (w->ending)
+  {
+    decode_end(p, w);
+    return 0;
+  }
+  if (__atomic_load_n(&s->stop, __ATOMIC_ACQUIRE))
+  {
+    w->ending = 1;
+    return 0;
+  }
+  if (!b && !(b = w->block = ring_pop(&p->free)))
+    return EAGAIN;
+
+  while (!block_full(b))
+  {
+    if ((errn = fpstage_decode(w->dec, &frame, &eof)) != 0 ||
+        (errn = block_append(b, &frame)) != 0)
+    {
+      s->error = errn;
+      w->ending = 1;
+      break;
+    }
+    if (eof)
+    {
+      w->ending = 1;
+      break;
+    }
+  }
+
+  return 0;
+}
+
+static void *pipe_worker_run(void *arg)
+{
+  PipeWorker *w = (PipeWorker *)arg;
+  Pipe *p = w->pipe;
+  Stream *s = NULL;
+  uint64_t seen = 0;
+  double t = 0.0;
+
+  if (w->node != FPNUMA_ANY_NODE && fpnuma_bind_thread(w->node) != 0)
+    fprintf(stderr, "WARNING: unable to bind worker %d to node %d\n",
+            w->id, w->node);
+
+  w->since = now();
+  while (__atomic_load_n(&p->n_done, __ATOMIC_ACQUIRE) < p->n_jobs)
+  {
+    seen = __atomic_load_n(&p->gen, __ATOMIC_ACQUIRE);
+    if (w->role == PIPE_DECODE)
+    {
+      if (!w->stream && !decode_start(p, w))
+        continue;
+      if (decode_step(p, w) == 0)
+        continue;
+      // the DSP side is behind: help it, unless the pools are fixed
+      if (__atomic_load_n(&p->adaptive, __ATOMIC_RELAXED) &&
+          (s = ring_pop(&p->ready)) != NULL)
+      {
+        t = now();
+        stream_run(p, s);
+        w->lent += now() - t;
+      }
+      else
+        pipe_wait(p, seen);
+      continue;
+    }
+
+    if ((s = ring_pop(&p->ready)) != NULL)
+      stream_run(p, s);
+    // idle with files left: decode one, unless the blocks are taken by
+    // streams other workers are feeding (with some slack, so workers do
+    // not flip between the stages)
+    else if (__atomic_load_n(&p->adaptive, __ATOMIC_RELAXED) &&
+             __atomic_load_n(&p->next, __ATOMIC_RELAXED) < p->n_jobs &&
+             ring_count(&p->free) >= p->n_blocks / 2)
+      set_role(w, PIPE_DECODE);
+    else
+      pipe_wait(p, seen);
+  }
+  w->role_seconds[w->role] += now() - w->since;
+
+  return NULL;
+}
+
+static int pipe_run(FPBatchJob *jobs, size_t n_jobs, const CostIx *order,
+                    const FPBatchOptions *opts, int n_nodes)
+{
+  Pipe pipe;
+  PipeWorker *workers = NULL;
+  pthread_t *threads = NULL;
+  int n_decode = opts->n_decode;
+  int n_dsp = opts->n_dsp;
+  int n_threads = 0;
+  int started = 0;
+  int switches = 0;
+  int errn = 0;
+  double role_seconds[2] = {0.0, 0.0};
+  double t0 = now();
+
+  memset(&pipe, 0, sizeof(pipe));
+  pipe.jobs = jobs;
+  pipe.n_jobs = n_jobs;
+  pipe.order = order;
+  pipe.opts = opts;
+  pipe.adaptive = n_decode <= 0 || n_dsp <= 0;
+
+  if (pipe.adaptive)
+  {
+    n_threads = opts->n_threads;
+    if (n_threads <= 0)
+    {
+      long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+      n_threads = cpus > 0 ? (int)cpus : 1;
+    }
+    // one decoder and one DSP worker can overlap a single file
+    if ((size_t)n_threads > 2 * n_jobs)
+      n_threads = (int)(2 * n_jobs);
+    n_decode = n_decode > 0 && n_decode < n_threads ? n_decode
+                                                    : (n_threads + 1) / 2;
+    n_dsp = n_threads - n_decode;
+  }
+  n_threads = n_decode + n_dsp;
+
+  pipe.n_blocks = (size_t)n_threads * PIPE_BLOCKS_PER_THREAD;
+  pipe.pool = calloc(pipe.n_blocks, sizeof(*pipe.pool));
+  workers = calloc(n_threads, sizeof(*workers));
+  threads = calloc(n_threads, sizeof(*threads));
+  if (!pipe.pool || !workers || !threads ||
+      ring_init(&pipe.free, pipe.n_blocks) != 0 ||
+      ring_init(&pipe.ready, pipe.n_blocks + n_threads) != 0)
+  {
+    errn = ENOMEM;
+    goto cleanup;
+  }
+  for (size_t i = 0; i < pipe.n_blocks; i++)
+  {
+    if (!(pipe.pool[i].data = malloc(PIPE_BLOCK_BYTES)))
+    {
+      errn = ENOMEM;
+      goto cleanup;
+    }
+    pipe.pool[i].cap = PIPE_BLOCK_BYTES;
+    ring_push(&pipe.free, &pipe.pool[i]);
+  }
+  pthread_mutex_init(&pipe.lock, NULL);
+  pthread_cond_init(&pipe.wake, NULL);
+
+  for (; started < n_threads; started++)
+  {
+    workers[started].pipe = &pipe;
+    workers[started].id = started;
+    workers[started].node = n_nodes > 1 ? started * n_nodes / n_threads
+                                        : FPNUMA_ANY_NODE;
+    workers[started].role = started < n_decode ? PIPE_DECODE : PIPE_DSP;
+    if (workers[started].role == PIPE_DECODE)
+      __atomic_add_fetch(&pipe.n_decode, 1, __ATOMIC_RELAXED);
+    if ((errn = pthread_create(&threads[started], NULL, pipe_worker_run,
+                               &workers[started])) != 0)
+    {
+      fprintf(stderr, "ERROR: %d: unable to start worker %d\n", errn, started);
+      if (workers[started].role == PIPE_DECODE)
+        __atomic_sub_fetch(&pipe.n_decode, 1, __ATOMIC_RELAXED);
+      // the workers already running finish the batch, switching stages
+      // as needed
+      if (started > 0)
+      {
+        errn = 0;
+        __atomic_store_n(&pipe.adaptive, 1, __ATOMIC_RELAXED);
+      }
+      break;
+    }
+  }
+  for (int i = 0; i < started; i++)
+  {
+    pthread_join(threads[i], NULL);
+    role_seconds[PIPE_DECODE] +=
+        workers[i].role_seconds[PIPE_DECODE] - workers[i].lent;
+    role_seconds[PIPE_DSP] +=
+        workers[i].role_seconds[PIPE_DSP] + workers[i].lent;
+    switches += workers[i].switches;
+  }
+  pthread_cond_destroy(&pipe.wake);
+  pthread_mutex_destroy(&pipe.lock);
+
+  if (opts->verbose && errn == 0)
+    fprintf(stderr, "pipeline: %.1f decode and %.1f DSP workers on average, "
+                    "%d role changes\n",
+            role_seconds[PIPE_DECODE] / (now() - t0),
+            role_seconds[PIPE_DSP] / (now() - t0), switches);
+
+cleanup:
+  if (pipe.pool)
+  {
+    for (size_t i = 0; i < pipe.n_blocks; i++)
+      free(pipe.pool[i].data);
+  }
+  free(pipe.pool);
+  free(pipe.free.cells);
+  free(pipe.ready.cells);
+  free(workers);
+  free(threads);
+
+  return errn;
+}
+
+void fpbatch_options_init(FPBatchOptions *opts)
+{
+  memset(opts, 0, sizeof(*opts));
+  opts->order = FPBATCH_LJF;
+}
+
+int fpbatch_run(FPBatchJob *jobs, size_t n_jobs, const FPBatchOptions *opts,
+                double *makespan)
+{
+  FPBatchOptions defaults;
+  Pool pool;
+  Worker *workers = NULL;
+  pthread_t *threads = NULL;
+  CostIx *order = NULL;
+  int n_threads = 0;
+  int n_nodes = 1;
+  int started = 0;
+  int errn = 0;
+  double t0 = now();
+
+  *makespan = 0.0;
+  memset(&pool, 0, sizeof(pool));
+  if (!opts)
+  {
+    fpbatch_options_init(&defaults);
+    opts = &defaults;
+  }
+  if (n_jobs == 0)
+    return 0;
+
+  pthread_once(&lockmgr_once, register_lockmgr);
+
+  n_threads = opts->n_threads;
+  if (n_threads <= 0)
+  {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    n_threads = cpus > 0 ? (int)cpus : 1;
+  }
+  if ((size_t)n_threads > n_jobs)
+    n_threads = (int)n_jobs;
+  if (opts->numa)
+    n_nodes = fpnuma_num_nodes();
+
+  pool.jobs = jobs;
+  pool.opts = opts;
+  pool.n_queues = opts->order == FPBATCH_FIFO ? 1 : n_threads;
+  pool.queues = calloc(pool.n_queues, sizeof(*pool.queues));
+  order = malloc(n_jobs * sizeof(*order));
+  workers = calloc(n_threads, sizeof(*workers));
+  threads = calloc(n_threads, sizeof(*threads));
+  if (!pool.queues || !order || !workers || !threads)
+  {
+    errn = ENOMEM;
+    goto cleanup;
+  }
+
+  for (size_t i = 0; i < n_jobs; i++)
+  {
+    jobs[i].fp = NULL;
+    jobs[i].error = 0;
+    jobs[i].seconds = 0.0;
+    if (opts->order != FPBATCH_FIFO && jobs[i].cost <= 0.0)
+      jobs[i].cost = fpbatch_estimate_cost(
+          jobs[i].path, opts->fp ? opts->fp->duration : FP_DEFAULT_DURATION);
+    order[i].cost = jobs[i].cost;
+    order[i].ix = i;
+  }
+  if (opts->order != FPBATCH_FIFO)
+    qsort(order, n_jobs, sizeof(*order), cmp_cost_desc);
+
+  if (opts->pipeline)
+  {
+    if ((errn = pipe_run(jobs, n_jobs, order, opts, n_nodes)) == 0)
+      *makespan = now() - t0;
+    goto cleanup;
+  }
+
+  // deal the jobs round-robin, so every queue is sorted most expensive first
+  // and holds about the same cost
+  for (int i = 0; i < pool.n_queues; i++)
+  {
+    Queue *q = &pool.queues[i];
+    q->ix = malloc((n_jobs / pool.n_queues + 1) * sizeof(*q->ix));
+    if (!q->ix)
+    {
+      errn = ENOMEM;
+      goto cleanup;
+    }
+    pthread_mutex_init(&q->lock, NULL);
+  }
+  for (size_t i = 0; i < n_jobs; i++)
+  {
+    Queue *q = &pool.queues[i % pool.n_queues];
+    q->ix[q->tail++] = order[i].ix;
+    q->cost += order[i].cost;
+  }
+
+  for (; started < n_threads; started++)
+  {
+    workers[started].pool = &pool;
+    workers[started].id = started;
+    workers[started].node = n_nodes > 1 ? started * n_nodes / n_threads
+                                        : FPNUMA_ANY_NODE;
+    if ((errn = pthread_create(&threads[started], NULL, worker_run,
+                               &workers[started])) != 0)
+    {
+      fprintf(stderr, "ERROR: %d: unable to start worker %d\n", errn, started);
+      // the workers already running finish the batch
+      if (started > 0)
+        errn = 0;
+      break;
+    }
+  }
+  for (int i = 0; i < started; i++)
+    pthread_join(threads[i], NULL);
+
+  *makespan = now() - t0;
+
+cleanup:
+  if (pool.queues)
+  {
+    for (int i = 0; i < pool.n_queues; i++)
+    {
+      if (pool.queues[i].ix)
+        pthread_mutex_destroy(&pool.queues[i].lock);
+      free(pool.queues[i].ix);
+    }
+  }
+  free(pool.queues);
+  free(order);
+  free(workers);
+  free(threads);
+
+  return errn;
+}
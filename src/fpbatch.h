@@ -0,0 +1,104 @@
+/*
+ *  fpbatch.h
+ *
+ *  fingerprint many files on a pool of worker threads
+ *
+ *  A batch is done when its slowest worker is done, so a long FLAC that
+ *  starts last keeps one core busy while the others sit idle.  The default
+ *  schedule estimates what each file will cost from a header probe (size,
+ *  container duration, codec) and starts the most expensive files first;
+ *  workers that run out of work take the cheapest files left in another
+ *  worker's queue.
+ *
+ *  A worker that runs all of get_fingerprint is held up by whichever half
+ *  of the work dominates the file: decoding for FLAC or high-bitrate AAC,
+ *  resampling and the extractors for long low-bitrate MP3s.  With
+ *  FPBatchOptions.pipeline the two halves (fpstage.h) run on separate
+ *  workers: decode workers demux and decode files into blocks of PCM and
+ *  pass them through bounded lock-free queues to DSP workers, which
+ *  resample them and run fooid and chromaprint.  A decoder waits when
+ *  every block is in flight, so memory stays bounded however far the DSP
+ *  side falls behind.  Unless both pool sizes are given, workers move to
+ *  the stage that is behind: a decoder becomes a DSP worker when most
+ *  blocks are waiting, and a DSP worker with nothing to do starts decoding
+ *  the next file.
+ *
+ *  Copyright 2010 Zatisfi, LLC. MIT License, 2025
+ */
+
+#ifndef _FPBATCH_H
+#define _FPBATCH_H
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#include <stddef.h>
+
+#include "fplib.h"
+
+// FPBatchOptions.order
+// longest (estimated) job first, dealt to per-worker queues, with stealing
+#define FPBATCH_LJF 0
+// input order from one shared queue
+#define FPBATCH_FIFO 1
+
+  typedef struct FPBatchJob
+  {
+    const char *path;
+    // estimated cost, in seconds of 44.1 kHz stereo MP3 decoding; jobs
+    // with cost <= 0 are probed by fpbatch_run
+    double cost;
+    // results: the fingerprint (NULL on error), get_fingerprint's error and
+    // the wall time the job took
+    FPrint *fp;
+    int error;
+    double seconds;
+  } FPBatchJob;
+
+  typedef struct FPBatchOptions
+  {
+    // worker threads; 0 for one per CPU
+    int n_threads;
+    int order;
+    // pin worker groups to NUMA nodes (see fpnuma.h)
+    int numa;
+    // passed to get_fingerprint_opts; NULL for the defaults
+    const FPOptions *fp;
+    int verbose;
+    // decode and DSP on separate workers
+    int pipeline;
+    // with pipeline: decode and DSP workers to start with.  If both are
+    // set the pools keep these sizes while files are left to decode;
+    // otherwise n_threads are split between them and rebalanced.
+    int n_decode;
+    int n_dsp;
+  } FPBatchOptions;
+
+  /*! fpbatch_options_init
+   *  \brief one thread per CPU, FPBATCH_LJF, no pinning, default FPOptions
+   */
+  void fpbatch_options_init(FPBatchOptions *opts);
+
+  /*! fpbatch_estimate_cost
+   *  \brief cost of fingerprinting the first duration seconds of path, from
+   *  its size and a probe of the container header (no decoding); a file
+   *  that cannot be probed is costed by size alone
+   */
+  double fpbatch_estimate_cost(const char *path, int duration);
+
+  /*! fpbatch_run
+   *  \brief fingerprint every job, filling in fp, error and seconds, and set
+   *  *makespan to the wall time of the whole batch (including the probes).
+   *  A job's failure is recorded in the job; returns 0, or an errno value
+   *  if the pool itself could not run.
+   */
+  int fpbatch_run(FPBatchJob *jobs, size_t n_jobs, const FPBatchOptions *opts,
+                  double *makespan);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _FPBATCH_H */
@@ -0,0 +1,544 @@
+/*
+ *  fpbench.c
+ *  executable to measure corpus scan bandwidth, with and without NUMA
+ *  placement, the bit-sliced cprint scan and the half-print first stage;
+ *  optionally reports hardware counters of the matchers and of fingerprint
+ *  extraction as JSON
+ *
+ *  Copyright 2010 Zatisfi, LLC. MIT License, 2025
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "fplib.h"
+#include "fpcorpus.h"
+#include "fphalf.h"
+#include "fpnuma.h"
+#include "fpperf.h"
+#include "fpslice.h"
+
+#define DEFAULT_QUERIES 16
+// hits per query of the half-print comparison
+#define HALF_K 10
+
+typedef struct
+{
+  const FPCorpus *c;
+  FPrint **queries;
+  int n_queries;
+  uint64_t lo;
+  uint64_t hi;
+  int node;
+  double *scores;
+  pthread_barrier_t *start;
+} Worker;
+
+static double now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void *worker_run(void *arg)
+{
+  Worker *w = (Worker *)arg;
+
+  if (w->node != FPNUMA_ANY_NODE && fpnuma_bind_thread(w->node) != 0)
+    fprintf(stderr, "WARNING: unable to bind worker to node %d\n", w->node);
+
+  pthread_barrier_wait(w->start);
+  for (int q = 0; q < w->n_queries; q++)
+    fpcorpus_match_range(w->c, w->queries[q], w->lo, w->hi, w->scores);
+
+  return NULL;
+}
+
+// run the workers, which are set up except for start; returns seconds
+static double run_workers(Worker *workers, int n)
+{
+  pthread_t *threads = calloc(n, sizeof(*threads));
+  pthread_barrier_t start;
+  double t0 = 0.0;
+  int started = 0;
+
+  if (!threads)
+    return -1.0;
+
+  pthread_barrier_init(&start, NULL, n + 1);
+  for (; started < n; started++)
+  {
+    workers[started].start = &start;
+    if (pthread_create(&threads[started], NULL, worker_run, &workers[started]) != 0)
+    {
+      fprintf(stderr, "ERROR: unable to start worker %d\n", started);
+      exit(EAGAIN);
+    }
+  }
+  pthread_barrier_wait(&start);
+  t0 = now();
+  for (int i = 0; i < n; i++)
+    pthread_join(threads[i], NULL);
+  t0 = now() - t0;
+
+  pthread_barrier_destroy(&start);
+  free(threads);
+
+  return t0;
+}
+
+// bytes a scan of every query has to read: the songlen column, and the
+// rest of each entry that passes the songlen gate
+static double scan_bytes(const FPCorpus *c, FPrint **queries, int n_queries)
+{
+  double bytes = 0.0;
+
+  for (int q = 0; q < n_queries; q++)
+  {
+    bytes += c->count * sizeof(uint32_t);
+    for (uint64_t i = 0; i < c->count; i++)
+    {
+      if (FP_SONGLEN_MAY_MATCH(queries[q]->songlen, c->songlen[i]))
+        bytes += R_SIZE + DOM_SIZE + fpcorpus_cprint_len(c, i) * sizeof(int32_t);
+    }
+  }
+
+  return bytes;
+}
+
+// one thread: match_chromab entry by entry against the sliced scan
+static int slice_bench(const FPCorpus *c, FPrint **queries, int n_queries,
+                       double *scores)
+{
+  FPSlices *s = NULL;
+  double *sliced = NULL;
+  double t_build, t_scalar, t_sliced;
+  uint64_t mismatches = 0;
+  int errn = 0;
+
+  if (!(sliced = calloc(c->count, sizeof(*sliced))))
+    return ENOMEM;
+  t_build = now();
+  if (!(s = fpslice_build(c, &errn)))
+  {
+    free(sliced);
+    return errn;
+  }
+  t_build = now() - t_build;
+
+  t_scalar = now();
+  for (int q = 0; q < n_queries; q++)
+  {
+    for (uint64_t i = 0; i < c->count; i++)
+      scores[i] = match_chromab(queries[q]->cprint, queries[q]->cprint_len,
+                                fpcorpus_cprint(c, i), fpcorpus_cprint_len(c, i));
+  }
+  t_scalar = now() - t_scalar;
+
+  t_sliced = now();
+  for (int q = 0; q < n_queries; q++)
+    fpslice_match_chromab(s, queries[q]->cprint, queries[q]->cprint_len, sliced);
+  t_sliced = now() - t_sliced;
+
+  // the last query's scores must agree exactly
+  for (uint64_t i = 0; i < c->count; i++)
+  {
+    if (scores[i] != sliced[i])
+      mismatches++;
+  }
+
+  printf("slice build: %.3f s\n", t_build);
+  printf("chromab:     %.3f s scalar, %.3f s sliced, %.2fx, %llu mismatches\n",
+         t_scalar, t_sliced, t_scalar / t_sliced,
+         (unsigned long long)mismatches);
+
+  fpslice_free(s);
+  free(sliced);
+
+  return mismatches ? EINVAL : 0;
+}
+
+// ix of the k best scores above min_score, best first; returns how many
+static size_t best_k(const double *scores, uint64_t count, size_t k,
+                     double min_score, uint64_t *ix)
+{
+  size_t n = 0;
+  size_t j = 0;
+
+  for (uint64_t i = 0; i < count; i++)
+  {
+    if (scores[i] <= min_score || (n == k && scores[i] <= scores[ix[n - 1]]))
+      continue;
+    j = n < k ? n++ : n - 1;
+    for (; j > 0 && scores[ix[j - 1]] < scores[i]; j--)
+      ix[j] = ix[j - 1];
+    ix[j] = i;
+  }
+  return n;
+}
+
+/* one thread: top-k above FP_MATCH_CUTOFF by fpcorpus_topk against the
+ * half-print scan, which must agree exactly, and the recall of ranking by
+ * the half-prints alone, without reading any full cprint
+ */
+static int half_bench(const FPCorpus *c, FPrint **queries, int n_queries,
+                      double *scores)
+{
+  FPHalf *h = NULL;
+  FPHalfStats st;
+  FPCorpusHit full[HALF_K];
+  FPCorpusHit half[HALF_K];
+  uint64_t first[HALF_K];
+  uint64_t scanned = 0;
+  uint64_t rescored = 0;
+  uint64_t mismatches = 0;
+  size_t n_full, n_half, n_first;
+  size_t n_relevant = 0;
+  size_t n_found = 0;
+  double t_build, t_full = 0.0, t_half = 0.0, t0;
+  int errn = 0;
+
+  t_build = now();
+  if (!(h = fphalf_build(c, &errn)))
+    return errn;
+  t_build = now() - t_build;
+
+  for (int q = 0; q < n_queries; q++)
+  {
+    t0 = now();
+    n_full = fpcorpus_topk(c, queries[q], HALF_K, FP_MATCH_CUTOFF, full);
+    t_full += now() - t0;
+    t0 = now();
+    n_half = fphalf_topk(h, c, queries[q], HALF_K, FP_MATCH_CUTOFF, half, &st);
+    t_half += now() - t0;
+    scanned += st.scanned;
+    rescored += st.rescored;
+    if (n_full != n_half)
+      mismatches++;
+    for (size_t j = 0; j < n_full && j < n_half; j++)
+    {
+      if (full[j].ix != half[j].ix || full[j].score != half[j].score)
+        mismatches++;
+    }
+
+    fphalf_match_all(h, c, queries[q], scores);
+    n_first = best_k(scores, c->count, HALF_K, FP_MATCH_CUTOFF, first);
+    n_relevant += n_full;
+    for (size_t j = 0; j < n_full; j++)
+    {
+      for (size_t m = 0; m < n_first; m++)
+      {
+        if (first[m] == full[j].ix)
+        {
+          n_found++;
+          break;
+        }
+      }
+    }
+  }
+
+  printf("half build:  %.3f s, %.0f%% of the cprint bytes\n", t_build,
+         100.0 * sizeof(uint16_t) / sizeof(int32_t));
+  printf("top-%d:      %.3f s full, %.3f s half-print, %.2fx, %llu mismatches\n",
+         HALF_K, t_full, t_half, t_full / t_half,
+         (unsigned long long)mismatches);
+  printf("             %.4f%% of scanned entries read the full cprint\n",
+         scanned ? 100.0 * rescored / scanned : 0.0);
+  printf("             recall@%d of the half-prints alone: %.4f\n", HALF_K,
+         n_relevant ? (double)n_found / n_relevant : 1.0);
+
+  fphalf_close(h);
+
+  return mismatches ? EINVAL : 0;
+}
+
+// the calling thread alone, so its counters cover all of the work
+static int perf_bench(const FPCorpus *c, FPrint **queries, int n_queries,
+                      double *scores, int slices, const char **files,
+                      int n_files, FILE *out)
+{
+  FPPerf perf;
+  FPPerfCounts counts;
+  FPSlices *s = NULL;
+  FPrint *fp = NULL;
+  uint64_t pairs = c->count * (uint64_t)n_queries;
+  int errn = 0;
+  int n_prints = 0;
+
+  if ((errn = fpperf_open(&perf)) != 0)
+    fprintf(stderr, "WARNING: %d: no hardware counters, reporting time only\n",
+            errn);
+  errn = 0;
+
+  fprintf(out, "{\"corpus_entries\": %llu, \"queries\": %d, \"benchmarks\": [\n",
+          (unsigned long long)c->count, n_queries);
+
+  fpperf_start(&perf);
+  for (int q = 0; q < n_queries; q++)
+    fpcorpus_match_all(c, queries[q], scores);
+  fpperf_stop(&perf, &counts);
+  fpperf_json(out, "match_cpfm", &counts, pairs, "pair");
+
+  fpperf_start(&perf);
+  for (int q = 0; q < n_queries; q++)
+  {
+    for (uint64_t i = 0; i < c->count; i++)
+      scores[i] = match_chromab(queries[q]->cprint, queries[q]->cprint_len,
+                                fpcorpus_cprint(c, i), fpcorpus_cprint_len(c, i));
+  }
+  fpperf_stop(&perf, &counts);
+  fprintf(out, ",\n");
+  fpperf_json(out, "match_chromab", &counts, pairs, "pair");
+
+  if (slices)
+  {
+    if (!(s = fpslice_build(c, &errn)))
+      goto cleanup;
+    fpperf_start(&perf);
+    for (int q = 0; q < n_queries; q++)
+      fpslice_match_chromab(s, queries[q]->cprint, queries[q]->cprint_len,
+                            scores);
+    fpperf_stop(&perf, &counts);
+    fprintf(out, ",\n");
+    fpperf_json(out, "fpslice_match_chromab", &counts, pairs, "pair");
+  }
+
+  // decoding, chromaprint's FFT and fooid's feature extraction together
+  if (n_files)
+  {
+    fpperf_start(&perf);
+    for (int f = 0; f < n_files; f++)
+    {
+      if ((fp = get_fingerprint(files[f], &errn, 0)))
+        n_prints++;
+      else
+        fprintf(stderr, "WARNING: %d: unable to fingerprint %s\n", errn,
+                files[f]);
+      free_fprint(fp);
+    }
+    fpperf_stop(&perf, &counts);
+    fprintf(out, ",\n");
+    fpperf_json(out, "get_fingerprint", &counts, n_prints, "fingerprint");
+    errn = 0;
+  }
+
+cleanup:
+  fprintf(out, "\n]}\n");
+  fpslice_free(s);
+  fpperf_close(&perf);
+
+  return errn;
+}
+
+int main(int argc, const char *argv[])
+{
+  const char *usage_fmt =
+      "Usage: %s [-h] CORPUS [-q QUERIES] [-t THREADS] [-H] [-s] [-r] [-p JSON]\n"
+      "       [-f AUDIO ...]\n"
+      "scan a fingerprint corpus with its own entries as queries and report\n"
+      "the bandwidth of a plain mmap scan and of a NUMA-sharded one\n\n"
+      "  -q   number of queries (default %d)\n"
+      "  -t   number of worker threads (default: every CPU)\n"
+      "  -H   put the shards on huge pages (hugetlbfs if reserved, else THP)\n"
+      "  -s   also compare the cprint scan with the bit-sliced one\n"
+      "  -r   also compare top-k over the corpus with the half-print first\n"
+      "       stage, and report the recall of the half-prints alone\n"
+      "  -p   run the matchers on one thread and write their cycles,\n"
+      "       instructions, cache and branch misses to JSON ('-' for stdout)\n"
+      "  -f   with -p, also count fingerprinting AUDIO (repeatable)\n"
+      "  -h   print this message\n";
+  const char *path = NULL;
+  int n_queries = DEFAULT_QUERIES;
+  int n_threads = 0;
+  int flags = 0;
+  int slices = 0;
+  int halves = 0;
+  const char *perf_path = NULL;
+  const char **files = NULL;
+  int n_files = 0;
+  FILE *perf_out = NULL;
+  int n_nodes = fpnuma_num_nodes();
+  int errn = 0;
+  FPCorpus *c = NULL;
+  FPCorpus **shards = NULL;
+  FPrint **queries = NULL;
+  Worker *workers = NULL;
+  double *scores = NULL;
+  double bytes, t_mmap, t_numa;
+  int w = 0;
+
+  if (!(files = calloc(argc, sizeof(*files))))
+    return ENOMEM;
+  for (int i = 1; i < argc; i++)
+  {
+    if (strcmp(argv[i], "-h") == 0)
+    {
+      printf(usage_fmt, argv[0], DEFAULT_QUERIES);
+      free(files);
+      return 0;
+    }
+    else if (strcmp(argv[i], "-q") == 0 && i + 1 < argc)
+      n_queries = atoi(argv[++i]);
+    else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc)
+      n_threads = atoi(argv[++i]);
+    else if (strcmp(argv[i], "-H") == 0)
+      flags = FPNUMA_HUGE | FPNUMA_HUGETLB;
+    else if (strcmp(argv[i], "-s") == 0)
+      slices = 1;
+    else if (strcmp(argv[i], "-r") == 0)
+      halves = 1;
+    else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc)
+      perf_path = argv[++i];
+    else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc)
+      files[n_files++] = argv[++i];
+    else
+      path = argv[i];
+  }
+  if (!path || n_queries <= 0 || n_threads < 0)
+  {
+    printf(usage_fmt, argv[0], DEFAULT_QUERIES);
+    free(files);
+    return ENOENT;
+  }
+  if (n_threads == 0)
+  {
+    for (int node = 0; node < n_nodes; node++)
+      n_threads += fpnuma_node_cpus(node);
+    if (n_threads == 0)
+      n_threads = 1;
+  }
+  // at least one worker per node
+  if (n_threads < n_nodes)
+    n_threads = n_nodes;
+
+  if (!(c = fpcorpus_open(path, &errn)))
+  {
+    free(files);
+    return errn;
+  }
+  if (c->count == 0)
+  {
+    fprintf(stderr, "ERROR: %s is empty\n", path);
+    fpcorpus_close(c);
+    free(files);
+    return EINVAL;
+  }
+
+  queries = calloc(n_queries, sizeof(*queries));
+  workers = calloc(n_threads, sizeof(*workers));
+  scores = calloc(c->count, sizeof(*scores));
+  shards = calloc(n_nodes, sizeof(*shards));
+  if (!queries || !workers || !scores || !shards)
+  {
+    errn = ENOMEM;
+    goto cleanup;
+  }
+  for (int q = 0; q < n_queries; q++)
+  {
+    if (!(queries[q] = fpcorpus_get(c, c->count * q / n_queries)))
+    {
+      errn = ENOMEM;
+      goto cleanup;
+    }
+  }
+  bytes = scan_bytes(c, queries, n_queries);
+
+  // baseline: the shared mapping, threads wherever the scheduler puts them
+  for (w = 0; w < n_threads; w++)
+  {
+    workers[w].c = c;
+    workers[w].queries = queries;
+    workers[w].n_queries = n_queries;
+    workers[w].lo = c->count * w / n_threads;
+    workers[w].hi = c->count * (w + 1) / n_threads;
+    workers[w].node = FPNUMA_ANY_NODE;
+    workers[w].scores = &scores[workers[w].lo];
+  }
+  // once to fault the mapping in, then timed
+  run_workers(workers, n_threads);
+  t_mmap = run_workers(workers, n_threads);
+
+  // one shard per node, in node-local memory, scanned by that node's workers
+  for (int node = 0; node < n_nodes; node++)
+  {
+    if (!(shards[node] = fpcorpus_load_shard(path, node, n_nodes, node, flags,
+                                             &errn)))
+    {
+      goto cleanup;
+    }
+  }
+  w = 0;
+  for (int node = 0; node < n_nodes; node++)
+  {
+    const FPCorpus *s = shards[node];
+    int per_node = n_threads * (node + 1) / n_nodes - n_threads * node / n_nodes;
+
+    for (int k = 0; k < per_node; k++, w++)
+    {
+      workers[w].c = s;
+      workers[w].lo = s->count * k / per_node;
+      workers[w].hi = s->count * (k + 1) / per_node;
+      workers[w].node = n_nodes > 1 ? node : FPNUMA_ANY_NODE;
+      workers[w].scores = &scores[s->first + workers[w].lo];
+    }
+  }
+  run_workers(workers, n_threads);
+  t_numa = run_workers(workers, n_threads);
+
+  printf("corpus:      %s, %llu entries, %d queries, %d threads, %d nodes\n",
+         path, (unsigned long long)c->count, n_queries, n_threads, n_nodes);
+  printf("mmap:        %.3f s, %.2f GB/s\n", t_mmap, bytes / t_mmap * 1e-9);
+  printf("%-13s%.3f s, %.2f GB/s\n", flags ? "numa+huge:" : "numa:",
+         t_numa, bytes / t_numa * 1e-9);
+  printf("speedup:     %.2fx\n", t_mmap / t_numa);
+
+  if (slices && (errn = slice_bench(c, queries, n_queries, scores)) != 0)
+    goto cleanup;
+  if (halves && (errn = half_bench(c, queries, n_queries, scores)) != 0)
+    goto cleanup;
+
+  if (perf_path)
+  {
+    if (n_files)
+      ffmpeg_init();
+    if (strcmp(perf_path, "-") == 0)
+      perf_out = stdout;
+    else if (!(perf_out = fopen(perf_path, "w")))
+    {
+      errn = errno;
+      fprintf(stderr, "ERROR: %d: unable to create %s\n", errn, perf_path);
+      goto cleanup;
+    }
+    errn = perf_bench(c, queries, n_queries, scores, slices, files, n_files,
+                      perf_out);
+    if (perf_out != stdout && fclose(perf_out) != 0 && !errn)
+      errn = errno;
+  }
+
+cleanup:
+  if (errn)
+    fprintf(stderr, "ERROR: %d: benchmark failed\n", errn);
+  if (shards)
+  {
+    for (int node = 0; node < n_nodes; node++)
+      fpcorpus_close(shards[node]);
+  }
+  if (queries)
+  {
+    for (int q = 0; q < n_queries; q++)
+      free_fprint(queries[q]);
+  }
+  free(shards);
+  free(files);
+  free(queries);
+  free(workers);
+  free(scores);
+  fpcorpus_close(c);
+
+  return errn;
+}
@@ -0,0 +1,637 @@
+/*
+ *  fpcache.c
+ *  append-only file of FPFeatures keyed by audio file identity
+ *
+ *  Copyright 2010 Zatisfi, LLC. MIT License, 2025
+ *
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "chromaw.h"
+#include "fpcache.h"
+
+#define CACHE_MAGIC "FPFCACHE"
+// version 2 added fingerprint records, version 3 skip records; older files
+// are upgraded in place, since an older reader would cut the file at the
+// first record it does not know
+#define CACHE_VERSION 3
+#define RECORD_MAGIC 0x52465046 /* "FPFR" */
+#define RECORD_MAGIC_FPRINT 0x52505046 /* "FPPR" */
+// covers the space of a record whose write failed
+#define RECORD_MAGIC_SKIP 0x52535046 /* "FPSR" */
+// bytes read at a time while looking for the next record after damage
+#define RESYNC_CHUNK 65536
+
+#define FNV64_OFFSET 0xcbf29ce484222325ULL
+#define FNV64_PRIME 0x100000001b3ULL
+
+// open-addressing table; grown at 1/2 load
+#define TABLE_INIT_CAP 1024
+
+typedef struct
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t reserved;
+} CacheHeader;
+
+typedef struct
+{
+  uint32_t magic;
+  uint32_t payload_len;
+  uint64_t key;
+} RecordHeader;
+
+typedef struct
+{
+  uint32_t version;
+  uint32_t songlen;
+  int32_t bit_rate;
+  int32_t num_errors;
+  int32_t fooid_len;
+  int32_t fooid_soundfound;
+  uint32_t fooid_n_samples;
+  uint32_t chroma_rows;
+} FeatureHeader;
+
+typedef struct
+{
+  uint64_t key;
+  // offset of the RecordHeader; 0 marks an empty slot (the file header
+  // is always at 0)
+  uint64_t offset;
+} Slot;
+
+typedef struct
+{
+  Slot *slots;
+  size_t cap;
+  size_t used;
+} Table;
+
+struct FPCache
+{
+  int fd;
+  uint64_t end;
+  // features by file identity, fingerprints by audio hash
+  Table features;
+  Table prints;
+  pthread_mutex_t lock;
+};
+
+static inline uint64_t fnv1a64(uint64_t h, const void *data, size_t len)
+{
+  const uint8_t *p = (const uint8_t *)data;
+  for (size_t i = 0; i < len; i++)
+  {
+    h ^= p[i];
+    h *= FNV64_PRIME;
+  }
+  return h;
+}
+
+static inline size_t slot_ix(uint64_t key, size_t cap)
+{
+  // keys are already hashes
+  return (size_t)(key & (cap - 1));
+}
+
+static Slot *table_find(Table *t, uint64_t key)
+{
+  size_t i = slot_ix(key, t->cap);
+  while (t->slots[i].offset != 0)
+  {
+    if (t->slots[i].key == key)
+      return &t->slots[i];
+    i = (i + 1) & (t->cap - 1);
+  }
+  return &t->slots[i];
+}
+
+static int table_init(Table *t)
+{
+  if (t->slots)
+    return 0;
+  t->cap = TABLE_INIT_CAP;
+  t->slots = calloc(t->cap, sizeof(*t->slots));
+  return t->slots ? 0 : ENOMEM;
+}
+
+static int table_set(Table *t, uint64_t key, uint64_t offset)
+{
+  Slot *slot = NULL;
+
+  if (2 * (t->used + 1) > t->cap)
+  {
+    Slot *old = t->slots;
+    size_t old_cap = t->cap;
+    t->cap = old_cap ? old_cap * 2 : TABLE_INIT_CAP;
+    t->slots = calloc(t->cap, sizeof(*t->slots));
+    if (!t->slots)
+    {
+      t->slots = old;
+      t->cap = old_cap;
+      return ENOMEM;
+    }
+    t->used = 0;
+    for (size_t i = 0; i < old_cap; i++)
+    {
+      if (old[i].offset != 0)
+      {
+        *table_find(t, old[i].key) = old[i];
+        t->used++;
+      }
+    }
+    free(old);
+  }
+
+  slot = table_find(t, key);
+  if (slot->offset == 0)
+    t->used++;
+  slot->key = key;
+  slot->offset = offset;
+  return 0;
+}
+
+static int read_full(int fd, void *buf, size_t len, uint64_t offset)
+{
+  uint8_t *p = (uint8_t *)buf;
+  ssize_t n = 0;
+
+  while (len > 0)
+  {
+    n = pread(fd, p, len, (off_t)offset);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return n < 0 ? errno : EIO;
+    p += n;
+    len -= (size_t)n;
+    offset += (uint64_t)n;
+  }
+  return 0;
+}
+
+static int write_full(int fd, const void *buf, size_t len, uint64_t offset)
+{
+  const uint8_t *p = (const uint8_t *)buf;
+  ssize_t n = 0;
+
+  while (len > 0)
+  {
+    n = pwrite(fd, p, len, (off_t)offset);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return n < 0 ? errno : EIO;
+    p += n;
+    len -= (size_t)n;
+    offset += (uint64_t)n;
+  }
+  return 0;
+}
+
+/* Whether the record at off, with header rh, is whole and well formed:
+ * a feature record's lengths agree with its payload_len, and so does a
+ * fingerprint record's cprint_len.  Random bytes (a zeroed gap, a torn
+ * write) practically never pass.
+ */
+static int record_valid(FPCache *c, const RecordHeader *rh, uint64_t off,
+                        uint64_t size)
+{
+  FeatureHeader fh;
+  uint32_t cprint_len = 0;
+  uint64_t expect = 0;
+
+  if (off + sizeof(*rh) + rh->payload_len > size)
+    return 0;
+  switch (rh->magic)
+  {
+  case RECORD_MAGIC:
+    if (rh->payload_len < sizeof(fh) ||
+        read_full(c->fd, &fh, sizeof(fh), off + sizeof(*rh)) != 0)
+      return 0;
+    expect = sizeof(fh) + (uint64_t)fh.fooid_n_samples * sizeof(int16_t) +
+             (uint64_t)fh.chroma_rows * CHROMA_IMAGE_COLUMNS * sizeof(uint16_t);
+    return expect == rh->payload_len;
+  case RECORD_MAGIC_FPRINT:
+    if (rh->payload_len < PACKED_FP_SIZE(0) ||
+        read_full(c->fd, &cprint_len, sizeof(cprint_len),
+                  off + sizeof(*rh) + offsetof(PackedFP, cprint_len)) != 0)
+      return 0;
+    return PACKED_FP_SIZE(cprint_len) == rh->payload_len;
+  case RECORD_MAGIC_SKIP:
+    return 1;
+  default:
+    return 0;
+  }
+}
+
+// offset of the first valid record past off, or size if there is none
+static uint64_t resync(FPCache *c, uint64_t off, uint64_t size)
+{
+  uint8_t *buf = malloc(RESYNC_CHUNK);
+  const uint32_t magics[3] = {RECORD_MAGIC, RECORD_MAGIC_FPRINT,
+                              RECORD_MAGIC_SKIP};
+  RecordHeader rh;
+  uint32_t m = 0;
+  size_t n = 0;
+
+  if (!buf)
+    return size;
+  for (off++; off + sizeof(rh) <= size; off += n - (sizeof(m) - 1))
+  {
+    n = size - off < RESYNC_CHUNK ? (size_t)(size - off) : RESYNC_CHUNK;
+    if (n < sizeof(m) || read_full(c->fd, buf, n, off) != 0)
+      break;
+    for (size_t i = 0; i + sizeof(m) <= n; i++)
+    {
+      memcpy(&m, &buf[i], sizeof(m));
+      if (m != magics[0] && m != magics[1] && m != magics[2])
+        continue;
+      if (off + i + sizeof(rh) <= size &&
+          read_full(c->fd, &rh, sizeof(rh), off + i) == 0 &&
+          record_valid(c, &rh, off + i, size))
+      {
+        free(buf);
+        return off + i;
+      }
+    }
+    if (n < RESYNC_CHUNK)
+      break;
+  }
+  free(buf);
+  return size;
+}
+
+/* index every valid record.  A write that failed or never landed (the
+ * process died after reserving the space) leaves a damaged span: skip to
+ * the next valid record rather than losing every record after it.  A torn
+ * record at the end is cut off so the next put starts cleanly.
+ */
+static int load_index(FPCache *c, uint64_t size)
+{
+  RecordHeader rh;
+  uint64_t off = sizeof(CacheHeader);
+  uint64_t end = off;
+  int errn = 0;
+
+  while (off + sizeof(rh) <= size)
+  {
+    if ((errn = read_full(c->fd, &rh, sizeof(rh), off)) != 0)
+      return errn;
+    if (!record_valid(c, &rh, off, size))
+    {
+      off = resync(c, off, size);
+      continue;
+    }
+    if (rh.magic != RECORD_MAGIC_SKIP)
+    {
+      errn = table_set(rh.magic == RECORD_MAGIC ? &c->features : &c->prints,
+                       rh.key, off);
+      if (errn != 0)
+        return errn;
+    }
+    off += sizeof(rh) + rh.payload_len;
+    end = off;
+  }
+
+  if (end < size && ftruncate(c->fd, (off_t)end) != 0)
+    return errno;
+  c->end = end;
+  return 0;
+}
+
+/* write a reserved record and publish it in t.  If the write fails, give
+ * the space back when no later record was reserved, or else cover it with
+ * a skip record so a partly written record is never loaded.
+ */
+static int write_record(FPCache *c, Table *t, uint64_t key,
+                        const uint8_t *buf, size_t total)
+{
+  RecordHeader skip;
+  uint64_t off = 0;
+  int errn = 0;
+
+  // reserve the space under the lock, write outside it, then publish
+  pthread_mutex_lock(&c->lock);
+  off = c->end;
+  c->end += total;
+  pthread_mutex_unlock(&c->lock);
+
+  errn = write_full(c->fd, buf, total, off);
+
+  pthread_mutex_lock(&c->lock);
+  if (errn == 0)
+    errn = table_set(t, key, off);
+  else if (c->end == off + total)
+  {
+    c->end = off;
+    if (ftruncate(c->fd, (off_t)off) != 0)
+      c->end = off + total;
+  }
+  else
+  {
+    skip.magic = RECORD_MAGIC_SKIP;
+    skip.payload_len = (uint32_t)(total - sizeof(skip));
+    skip.key = 0;
+    write_full(c->fd, &skip, sizeof(skip), off);
+  }
+  pthread_mutex_unlock(&c->lock);
+
+  return errn;
+}
+
+FPCache *fpcache_open(const char *path, int *error)
+{
+  FPCache *c = NULL;
+  CacheHeader h;
+  struct stat st;
+
+  *error = 0;
+  c = calloc(1, sizeof(*c));
+  if (!c)
+  {
+    *error = ENOMEM;
+    return NULL;
+  }
+  c->fd = open(path, O_RDWR | O_CREAT, 0644);
+  if (c->fd < 0 || fstat(c->fd, &st) != 0)
+  {
+    *error = errno;
+    goto error;
+  }
+
+  if (st.st_size == 0)
+  {
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, CACHE_MAGIC, sizeof(h.magic));
+    h.version = CACHE_VERSION;
+    if ((*error = write_full(c->fd, &h, sizeof(h), 0)) != 0)
+      goto error;
+    c->end = sizeof(h);
+  }
+  else
+  {
+    if ((size_t)st.st_size < sizeof(h) ||
+        read_full(c->fd, &h, sizeof(h), 0) != 0 ||
+        memcmp(h.magic, CACHE_MAGIC, sizeof(h.magic)) != 0 ||
+        h.version < 1 || h.version > CACHE_VERSION)
+    {
+      *error = EINVAL;
+      goto error;
+    }
+    if ((*error = load_index(c, (uint64_t)st.st_size)) != 0)
+      goto error;
+    if (h.version < CACHE_VERSION)
+    {
+      h.version = CACHE_VERSION;
+      if ((*error = write_full(c->fd, &h, sizeof(h), 0)) != 0)
+        goto error;
+    }
+  }
+
+  if ((*error = table_init(&c->features)) != 0 ||
+      (*error = table_init(&c->prints)) != 0)
+  {
+    goto error;
+  }
+  if ((*error = pthread_mutex_init(&c->lock, NULL)) != 0)
+    goto error;
+
+  return c;
+
+error:
+  fprintf(stderr, "ERROR: %d: unable to open feature cache %s\n",
+          *error, path);
+  if (c->fd >= 0)
+    close(c->fd);
+  free(c->features.slots);
+  free(c->prints.slots);
+  free(c);
+  return NULL;
+}
+
+void fpcache_close(FPCache *c)
+{
+  if (c)
+  {
+    close(c->fd);
+    pthread_mutex_destroy(&c->lock);
+    free(c->features.slots);
+    free(c->prints.slots);
+    free(c);
+  }
+}
+
+int fpcache_key(const char *filename, uint64_t *key)
+{
+  struct stat st;
+  uint64_t h = FNV64_OFFSET;
+  uint64_t fields[5];
+
+  if (stat(filename, &st) != 0)
+    return errno;
+
+  fields[0] = (uint64_t)st.st_dev;
+  fields[1] = (uint64_t)st.st_ino;
+  fields[2] = (uint64_t)st.st_size;
+  fields[3] = (uint64_t)st.st_mtime;
+  fields[4] = FPCACHE_FEATURES_VERSION;
+  h = fnv1a64(h, fields, sizeof(fields));
+  // 0 is never a valid key
+  *key = h ? h : 1;
+
+  return 0;
+}
+
+FPFeatures *fpcache_new_features(size_t fooid_n_samples, size_t chroma_rows)
+{
+  FPFeatures *f = calloc(1, sizeof(*f));
+
+  if (!f)
+    return NULL;
+  f->fooid_samples = malloc((fooid_n_samples ? fooid_n_samples : 1) *
+                            sizeof(*f->fooid_samples));
+  f->chroma = malloc((chroma_rows ? chroma_rows : 1) *
+                     CHROMA_IMAGE_COLUMNS * sizeof(*f->chroma));
+  if (!f->fooid_samples || !f->chroma)
+  {
+    fpcache_free_features(f);
+    return NULL;
+  }
+  f->fooid_n_samples = fooid_n_samples;
+  f->chroma_rows = chroma_rows;
+
+  return f;
+}
+
+void fpcache_free_features(FPFeatures *f)
+{
+  if (f)
+  {
+    free(f->fooid_samples);
+    free(f->chroma);
+    free(f);
+  }
+}
+
+FPFeatures *fpcache_get(FPCache *c, uint64_t key)
+{
+  Slot *slot = NULL;
+  uint64_t off = 0;
+  RecordHeader rh;
+  FeatureHeader fh;
+  FPFeatures *f = NULL;
+  size_t samples_sz, chroma_sz;
+
+  pthread_mutex_lock(&c->lock);
+  slot = table_find(&c->features, key);
+  off = slot->offset;
+  pthread_mutex_unlock(&c->lock);
+  if (off == 0)
+    return NULL;
+
+  // records are never rewritten, so they can be read without the lock
+  if (read_full(c->fd, &rh, sizeof(rh), off) != 0 || rh.key != key ||
+      rh.payload_len < sizeof(fh) ||
+      read_full(c->fd, &fh, sizeof(fh), off + sizeof(rh)) != 0 ||
+      fh.version != FPCACHE_FEATURES_VERSION)
+  {
+    return NULL;
+  }
+  samples_sz = (size_t)fh.fooid_n_samples * sizeof(int16_t);
+  chroma_sz = (size_t)fh.chroma_rows * CHROMA_IMAGE_COLUMNS * sizeof(uint16_t);
+  if (sizeof(fh) + samples_sz + chroma_sz != rh.payload_len)
+    return NULL;
+
+  f = fpcache_new_features(fh.fooid_n_samples, fh.chroma_rows);
+  if (!f)
+    return NULL;
+  off += sizeof(rh) + sizeof(fh);
+  if ((samples_sz && read_full(c->fd, f->fooid_samples, samples_sz, off) != 0) ||
+      (chroma_sz && read_full(c->fd, f->chroma, chroma_sz, off + samples_sz) != 0))
+  {
+    fpcache_free_features(f);
+    return NULL;
+  }
+  f->songlen = fh.songlen;
+  f->bit_rate = fh.bit_rate;
+  f->num_errors = fh.num_errors;
+  f->fooid_len = fh.fooid_len;
+  f->fooid_soundfound = fh.fooid_soundfound;
+
+  return f;
+}
+
+int fpcache_put(FPCache *c, uint64_t key, const FPFeatures *f)
+{
+  RecordHeader rh;
+  FeatureHeader fh;
+  size_t samples_sz = f->fooid_n_samples * sizeof(int16_t);
+  size_t chroma_sz = f->chroma_rows * CHROMA_IMAGE_COLUMNS * sizeof(uint16_t);
+  size_t total = sizeof(rh) + sizeof(fh) + samples_sz + chroma_sz;
+  uint8_t *buf = NULL;
+  int errn = 0;
+
+  if (sizeof(fh) + samples_sz + chroma_sz > UINT32_MAX)
+    return EFBIG;
+
+  buf = malloc(total);
+  if (!buf)
+    return ENOMEM;
+
+  rh.magic = RECORD_MAGIC;
+  rh.payload_len = (uint32_t)(total - sizeof(rh));
+  rh.key = key;
+  fh.version = FPCACHE_FEATURES_VERSION;
+  fh.songlen = f->songlen;
+  fh.bit_rate = f->bit_rate;
+  fh.num_errors = f->num_errors;
+  fh.fooid_len = f->fooid_len;
+  fh.fooid_soundfound = f->fooid_soundfound;
+  fh.fooid_n_samples = (uint32_t)f->fooid_n_samples;
+  fh.chroma_rows = (uint32_t)f->chroma_rows;
+  memcpy(buf, &rh, sizeof(rh));
+  memcpy(buf + sizeof(rh), &fh, sizeof(fh));
+  memcpy(buf + sizeof(rh) + sizeof(fh), f->fooid_samples, samples_sz);
+  memcpy(buf + sizeof(rh) + sizeof(fh) + samples_sz, f->chroma, chroma_sz);
+
+  errn = write_record(c, &c->features, key, buf, total);
+  free(buf);
+
+  return errn;
+}
+
+FPrint *fpcache_get_fprint(FPCache *c, uint64_t key)
+{
+  Slot *slot = NULL;
+  uint64_t off = 0;
+  RecordHeader rh;
+  uint8_t *buf = NULL;
+  FPrint *fp = NULL;
+
+  pthread_mutex_lock(&c->lock);
+  slot = table_find(&c->prints, key);
+  off = slot->offset;
+  pthread_mutex_unlock(&c->lock);
+  if (off == 0)
+    return NULL;
+
+  if (read_full(c->fd, &rh, sizeof(rh), off) != 0 || rh.key != key ||
+      rh.payload_len < PACKED_FP_SIZE(0))
+  {
+    return NULL;
+  }
+  buf = malloc(rh.payload_len);
+  if (!buf)
+    return NULL;
+  if (read_full(c->fd, buf, rh.payload_len, off + sizeof(rh)) == 0 &&
+      PACKED_FP_SIZE(((PackedFP *)buf)->cprint_len) == rh.payload_len)
+  {
+    fp = fprint_from_bytes(buf);
+  }
+  free(buf);
+
+  return fp;
+}
+
+int fpcache_put_fprint(FPCache *c, uint64_t key, const FPrint *fp)
+{
+  RecordHeader rh;
+  size_t packed_sz = PACKED_FP_SIZE(fp->cprint_len);
+  uint8_t *packed = NULL;
+  uint8_t *buf = NULL;
+  int errn = 0;
+
+  if (packed_sz > UINT32_MAX)
+    return EFBIG;
+  packed = fprint_to_bytes(fp);
+  buf = malloc(sizeof(rh) + packed_sz);
+  if (!packed || !buf)
+  {
+    free(packed);
+    free(buf);
+    return ENOMEM;
+  }
+  rh.magic = RECORD_MAGIC_FPRINT;
+  rh.payload_len = (uint32_t)packed_sz;
+  rh.key = key;
+  memcpy(buf, &rh, sizeof(rh));
+  memcpy(buf + sizeof(rh), packed, packed_sz);
+  free(packed);
+
+  errn = write_record(c, &c->prints, key, buf, sizeof(rh) + packed_sz);
+  free(buf);
+
+  return errn;
+}
@@ -0,0 +1,98 @@
+/*
+ *  fpcache.h
+ *
+ *  cache of the intermediate features get_fingerprint computes from the
+ *  decoded audio, so changes to the chromaprint classifiers or the fooid
+ *  quantizers can be re-run over a catalog without decoding, resampling or
+ *  running the chroma FFT again; and of finished fingerprints by audio
+ *  hash, so a retagged copy of a known file is not decoded at all
+ *
+ *  Copyright 2010 Zatisfi, LLC. MIT License, 2025
+ */
+
+#ifndef _FPCACHE_H
+#define _FPCACHE_H
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "fplib.h"
+
+// bump when the decode settings (sample rate, time limit, ...) or the
+// feature encoding change; old entries then stop matching
+#define FPCACHE_FEATURES_VERSION 1
+
+  typedef struct FPCache FPCache;
+
+  /* Features are quantized for storage:
+   *  - fooid input: the 8 kHz mono samples libfooid analyses, as int16
+   *  - chroma image: rows of CHROMA_IMAGE_COLUMNS values in [0, 1], as
+   *    uint16 scaled by 65535
+   * A 60 s song takes about 1 MB, almost all of it the fooid samples.
+   */
+  typedef struct FPFeatures
+  {
+    uint32_t songlen;
+    int32_t bit_rate;
+    int32_t num_errors;
+    // length argument get_fingerprint passed to fp_calculate
+    int32_t fooid_len;
+    int32_t fooid_soundfound;
+    size_t fooid_n_samples;
+    int16_t *fooid_samples;
+    size_t chroma_rows;
+    uint16_t *chroma;
+  } FPFeatures;
+
+  /*! fpcache_open
+   *  \brief open (creating if needed) a feature cache file.  The file is
+   *  append-only; an entry written again for the same key replaces the old
+   *  one.  Returns NULL and sets *error to an errno value on failure.
+   */
+  FPCache *fpcache_open(const char *path, int *error);
+
+  void fpcache_close(FPCache *cache);
+
+  /*! fpcache_key
+   *  \brief key identifying the current contents of an audio file (device,
+   *  inode, size, mtime and FPCACHE_FEATURES_VERSION); returns 0 or an
+   *  errno value
+   */
+  int fpcache_key(const char *filename, uint64_t *key);
+
+  /*! fpcache_get
+   *  \brief features stored under key, or NULL on a miss; free with
+   *  fpcache_free_features
+   */
+  FPFeatures *fpcache_get(FPCache *cache, uint64_t key);
+
+  /*! fpcache_put
+   *  \brief store features under key; returns 0 or an errno value
+   */
+  int fpcache_put(FPCache *cache, uint64_t key, const FPFeatures *f);
+
+  /*! fpcache_get_fprint
+   *  \brief fingerprint stored under key (get_fingerprint_opts derives it
+   *  from fp_audio_hash and the options), or NULL on a miss
+   */
+  FPrint *fpcache_get_fprint(FPCache *cache, uint64_t key);
+
+  /*! fpcache_put_fprint
+   *  \brief store a fingerprint under key; returns 0 or an errno value
+   */
+  int fpcache_put_fprint(FPCache *cache, uint64_t key, const FPrint *fp);
+
+  FPFeatures *fpcache_new_features(size_t fooid_n_samples, size_t chroma_rows);
+
+  void fpcache_free_features(FPFeatures *f);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _FPCACHE_H */
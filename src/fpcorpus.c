@@ -0,0 +1,724 @@
+/*
+ *  fpcorpus.c
+ *  column-wise, memory-mapped store for large sets of fingerprints
+ *
+ *  Copyright 2010 Zatisfi, LLC. MIT License, 2025
+ *
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "fplib.h"
+#include "fpcorpus.h"
+#include "fpnuma.h"
+
+#define ALIGN_UP(x, a) (((x) + ((a) - 1)) & ~((uint64_t)(a) - 1))
+
+// initial number of entries the writer buffers before growing
+#define WRITER_INIT_CAP 1024
+
+struct FPCorpusWriter
+{
+  FILE *out;
+  char *path;
+  char *tmp_path;
+  uint64_t count;
+  uint64_t cap;
+  uint64_t cprint_total;
+  uint64_t *ids;
+  uint32_t *songlen;
+  int32_t *bit_rate;
+  int32_t *num_errors;
+  uint64_t *cprint_off;
+  uint8_t *r;
+  uint8_t *dom;
+};
+
+////////////////////////////////////////////////////////////
+// Reading
+////////////////////////////////////////////////////////////
+
+// a column of n elements of elem_size bytes at off, aligned to align, in
+// the file; n is bounded first so n * elem_size cannot wrap
+static int section_ok(const FPCorpusHeader *h, uint64_t off, uint64_t n,
+                      uint64_t elem_size, uint64_t align)
+{
+  return n <= h->file_size / elem_size && off % align == 0 &&
+         off >= FPCORPUS_HEADER_SIZE && off <= h->file_size &&
+         n * elem_size <= h->file_size - off;
+}
+
+static int header_ok(const FPCorpusHeader *h, size_t map_size)
+{
+  uint64_t n = h->count;
+
+  if (memcmp(h->magic, FPCORPUS_MAGIC, sizeof(h->magic)) != 0 ||
+      h->version != FPCORPUS_VERSION ||
+      h->r_size != R_SIZE || h->dom_size != DOM_SIZE ||
+      h->file_size > map_size || n >= h->file_size)
+  {
+    return 0;
+  }
+
+  return section_ok(h, h->off_cprint, h->cprint_total, sizeof(int32_t),
+                    sizeof(int32_t)) &&
+         section_ok(h, h->off_ids, n, sizeof(uint64_t), sizeof(uint64_t)) &&
+         section_ok(h, h->off_songlen, n, sizeof(uint32_t), sizeof(uint32_t)) &&
+         section_ok(h, h->off_bit_rate, n, sizeof(int32_t), sizeof(int32_t)) &&
+         section_ok(h, h->off_num_errors, n, sizeof(int32_t), sizeof(int32_t)) &&
+         section_ok(h, h->off_cprint_off, n + 1, sizeof(uint64_t),
+                    sizeof(uint64_t)) &&
+         section_ok(h, h->off_r, n, R_SIZE, 1) &&
+         section_ok(h, h->off_dom, n, DOM_SIZE, 1);
+}
+
+/* Every scan indexes cprint by cprint_off, so a corrupt or half-written
+ * file must not get past open with offsets that go backwards or past the
+ * cprint column.
+ */
+static int cprint_off_ok(const uint64_t *cprint_off, uint64_t n,
+                         uint64_t cprint_total)
+{
+  if (cprint_off[0] != 0 || cprint_off[n] != cprint_total)
+    return 0;
+  for (uint64_t i = 0; i < n; i++)
+  {
+    if (cprint_off[i + 1] < cprint_off[i])
+      return 0;
+  }
+  return 1;
+}
+
+static void set_songlen_range(FPCorpus *c)
+{
+  c->songlen_min = UINT32_MAX;
+  c->songlen_max = 0;
+  for (uint64_t i = 0; i < c->count; i++)
+  {
+    if (c->songlen[i] < c->songlen_min)
+      c->songlen_min = c->songlen[i];
+    if (c->songlen[i] > c->songlen_max)
+      c->songlen_max = c->songlen[i];
+  }
+}
+
+FPCorpus *fpcorpus_open(const char *path, int *error)
+{
+  int fd = -1;
+  struct stat st;
+  void *base = MAP_FAILED;
+  const FPCorpusHeader *h = NULL;
+  const uint8_t *b = NULL;
+  FPCorpus *c = NULL;
+
+  *error = 0;
+
+  if ((fd = open(path, O_RDONLY)) < 0 || fstat(fd, &st) != 0)
+  {
+    *error = errno;
+    fprintf(stderr, "ERROR: %d: unable to open corpus %s\n", *error, path);
+    goto cleanup;
+  }
+  if ((size_t)st.st_size < FPCORPUS_HEADER_SIZE)
+  {
+    *error = EINVAL;
+    fprintf(stderr, "ERROR: %s is not a fingerprint corpus\n", path);
+    goto cleanup;
+  }
+
+  base = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  if (base == MAP_FAILED)
+  {
+    *error = errno;
+    fprintf(stderr, "ERROR: %d: unable to map corpus %s\n", *error, path);
+    goto cleanup;
+  }
+
+  h = (const FPCorpusHeader *)base;
+  if (!header_ok(h, (size_t)st.st_size))
+  {
+    *error = EINVAL;
+    fprintf(stderr, "ERROR: %s is not a valid fingerprint corpus\n", path);
+    goto cleanup;
+  }
+
+  c = calloc(1, sizeof(*c));
+  if (!c)
+  {
+    *error = ENOMEM;
+    goto cleanup;
+  }
+
+  b = (const uint8_t *)base;
+  c->base = base;
+  c->size = (size_t)st.st_size;
+  c->count = h->count;
+  c->cprint = (const int32_t *)(b + h->off_cprint);
+  c->ids = (const uint64_t *)(b + h->off_ids);
+  c->songlen = (const uint32_t *)(b + h->off_songlen);
+  c->bit_rate = (const int32_t *)(b + h->off_bit_rate);
+  c->num_errors = (const int32_t *)(b + h->off_num_errors);
+  c->cprint_off = (const uint64_t *)(b + h->off_cprint_off);
+  c->r = b + h->off_r;
+  c->dom = b + h->off_dom;
+
+  if (!cprint_off_ok(c->cprint_off, c->count, h->cprint_total))
+  {
+    *error = EINVAL;
+    fprintf(stderr, "ERROR: %s has inconsistent cprint offsets\n", path);
+    free(c);
+    c = NULL;
+    goto cleanup;
+  }
+  set_songlen_range(c);
+
+cleanup:
+  if (fd >= 0)
+    close(fd);
+  if (!c && base != MAP_FAILED)
+    munmap(base, (size_t)st.st_size);
+
+  return c;
+}
+
+FPCorpus *fpcorpus_load_shard(const char *path, uint64_t shard,
+                              uint64_t n_shards, int node, int flags,
+                              int *error)
+{
+  FPCorpus *file = NULL;
+  FPCorpus *c = NULL;
+  uint8_t *b = NULL;
+  uint64_t lo, hi, n, cp_lo, cp_n;
+  uint64_t off_ids, off_songlen, off_bit_rate, off_num_errors;
+  uint64_t off_cprint_off, off_r, off_dom, off_cprint, total;
+  uint64_t *cprint_off = NULL;
+
+  *error = 0;
+  if (n_shards == 0 || shard >= n_shards)
+  {
+    *error = EINVAL;
+    return NULL;
+  }
+  if (!(file = fpcorpus_open(path, error)))
+    return NULL;
+
+  lo = file->count * shard / n_shards;
+  hi = file->count * (shard + 1) / n_shards;
+  n = hi - lo;
+  cp_lo = file->cprint_off[lo];
+  cp_n = file->cprint_off[hi] - cp_lo;
+
+  // same column order as the file, cprint last so the rest stays together
+  off_ids = 0;
+  off_songlen = ALIGN_UP(off_ids + n * sizeof(uint64_t), FPCORPUS_ALIGN);
+  off_bit_rate = ALIGN_UP(off_songlen + n * sizeof(uint32_t), FPCORPUS_ALIGN);
+  off_num_errors = ALIGN_UP(off_bit_rate + n * sizeof(int32_t), FPCORPUS_ALIGN);
+  off_cprint_off = ALIGN_UP(off_num_errors + n * sizeof(int32_t), FPCORPUS_ALIGN);
+  off_r = ALIGN_UP(off_cprint_off + (n + 1) * sizeof(uint64_t), FPCORPUS_ALIGN);
+  off_dom = ALIGN_UP(off_r + n * R_SIZE, FPCORPUS_ALIGN);
+  off_cprint = ALIGN_UP(off_dom + n * DOM_SIZE, FPCORPUS_ALIGN);
+  total = off_cprint + cp_n * sizeof(int32_t);
+
+  c = calloc(1, sizeof(*c));
+  if (!c)
+  {
+    *error = ENOMEM;
+    goto cleanup;
+  }
+  b = fpnuma_alloc((size_t)total, node, flags, error);
+  if (!b)
+  {
+    fprintf(stderr, "ERROR: %d: unable to allocate shard %llu of %s\n",
+            *error, (unsigned long long)shard, path);
+    free(c);
+    c = NULL;
+    goto cleanup;
+  }
+
+  // fpnuma_alloc bound the mapping to node, so these first writes fault
+  // every page in there
+  memcpy(b + off_ids, &file->ids[lo], n * sizeof(uint64_t));
+  memcpy(b + off_songlen, &file->songlen[lo], n * sizeof(uint32_t));
+  memcpy(b + off_bit_rate, &file->bit_rate[lo], n * sizeof(int32_t));
+  memcpy(b + off_num_errors, &file->num_errors[lo], n * sizeof(int32_t));
+  cprint_off = (uint64_t *)(b + off_cprint_off);
+  for (uint64_t i = 0; i <= n; i++)
+    cprint_off[i] = file->cprint_off[lo + i] - cp_lo;
+  memcpy(b + off_r, &file->r[lo * R_SIZE], n * R_SIZE);
+  memcpy(b + off_dom, &file->dom[lo * DOM_SIZE], n * DOM_SIZE);
+  memcpy(b + off_cprint, &file->cprint[cp_lo], cp_n * sizeof(int32_t));
+
+  // fpcorpus_close unmaps base; fpnuma_alloc memory is a private mapping
+  c->base = b;
+  c->size = fpnuma_alloc_size((size_t)total);
+  c->count = n;
+  c->first = lo;
+  c->ids = (const uint64_t *)(b + off_ids);
+  c->songlen = (const uint32_t *)(b + off_songlen);
+  c->bit_rate = (const int32_t *)(b + off_bit_rate);
+  c->num_errors = (const int32_t *)(b + off_num_errors);
+  c->cprint_off = cprint_off;
+  c->r = b + off_r;
+  c->dom = b + off_dom;
+  c->cprint = (const int32_t *)(b + off_cprint);
+  set_songlen_range(c);
+
+cleanup:
+  fpcorpus_close(file);
+
+  return c;
+}
+
+void fpcorpus_close(FPCorpus *c)
+{
+  if (c)
+  {
+    munmap(c->base, c->size);
+    free(c);
+  }
+}
+
+FPrint *fpcorpus_get(const FPCorpus *c, uint64_t i)
+{
+  size_t cp_len = fpcorpus_cprint_len(c, i);
+  FPrint *fp = new_fprint((int)cp_len);
+
+  if (!fp)
+    return NULL;
+
+  fp->songlen = c->songlen[i];
+  fp->bit_rate = c->bit_rate[i];
+  fp->num_errors = c->num_errors[i];
+  memcpy(fp->r, &c->r[i * R_SIZE], R_SIZE);
+  memcpy(fp->dom, &c->dom[i * DOM_SIZE], DOM_SIZE);
+  memcpy(fp->cprint, fpcorpus_cprint(c, i), cp_len * sizeof(int32_t));
+
+  return fp;
+}
+
+////////////////////////////////////////////////////////////
+// Matching
+////////////////////////////////////////////////////////////
+
+static inline double match_entries(const FPCorpus *c, uint64_t a, uint64_t b)
+{
+  return match_cpfm_raw(c->songlen[a], &c->r[a * R_SIZE], &c->dom[a * DOM_SIZE],
+                        fpcorpus_cprint(c, a), fpcorpus_cprint_len(c, a),
+                        c->songlen[b], &c->r[b * R_SIZE], &c->dom[b * DOM_SIZE],
+                        fpcorpus_cprint(c, b), fpcorpus_cprint_len(c, b));
+}
+
+// entries are complete (fpcorpus_writer_add refuses partial prints), so
+// missing is fprint_missing(q) alone
+static inline double match_query(const FPCorpus *c, const FPrint *q,
+                                 uint16_t missing, uint64_t i)
+{
+  return match_cpfm_partial(missing, q->songlen, q->r, q->dom, q->cprint,
+                            q->cprint_len, c->songlen[i], &c->r[i * R_SIZE],
+                            &c->dom[i * DOM_SIZE], fpcorpus_cprint(c, i),
+                            fpcorpus_cprint_len(c, i));
+}
+
+double fpcorpus_match(const FPCorpus *c, const FPrint *q, uint64_t i)
+{
+  return match_query(c, q, fprint_missing(q), i);
+}
+
+void fpcorpus_match_range(const FPCorpus *c, const FPrint *q, uint64_t lo,
+                          uint64_t hi, double *scores)
+{
+  uint16_t missing = fprint_missing(q);
+
+  for (uint64_t i = lo; i < hi; i++)
+  {
+    // match_cpfm_partial checks this too; the songlen column is hot in cache
+    if (!FP_SONGLEN_MAY_MATCH(q->songlen, c->songlen[i]))
+      scores[i - lo] = 0.0;
+    else
+      scores[i - lo] = match_query(c, q, missing, i);
+  }
+}
+
+void fpcorpus_match_all(const FPCorpus *c, const FPrint *q, double *scores)
+{
+  fpcorpus_match_range(c, q, 0, c->count, scores);
+}
+
+// hits[0 .. n) is a min-heap on score
+static void heap_sift_down(FPCorpusHit *hits, size_t n, size_t i)
+{
+  FPCorpusHit tmp;
+  size_t child;
+
+  while ((child = 2 * i + 1) < n)
+  {
+    if (child + 1 < n && hits[child + 1].score < hits[child].score)
+      child++;
+    if (hits[i].score <= hits[child].score)
+      break;
+    tmp = hits[i];
+    hits[i] = hits[child];
+    hits[child] = tmp;
+    i = child;
+  }
+}
+
+static void heap_sift_up(FPCorpusHit *hits, size_t i)
+{
+  FPCorpusHit tmp;
+
+  while (i > 0 && hits[(i - 1) / 2].score > hits[i].score)
+  {
+    tmp = hits[i];
+    hits[i] = hits[(i - 1) / 2];
+    hits[(i - 1) / 2] = tmp;
+    i = (i - 1) / 2;
+  }
+}
+
+static int cmp_hit_desc(const void *a, const void *b)
+{
+  double sa = ((const FPCorpusHit *)a)->score;
+  double sb = ((const FPCorpusHit *)b)->score;
+  return (sa < sb) - (sa > sb);
+}
+
+size_t fpcorpus_topk(const FPCorpus *c, const FPrint *q, size_t k,
+                     double min_score, FPCorpusHit *hits)
+{
+  uint16_t missing = fprint_missing(q);
+  size_t n = 0;
+  double score = 0.0;
+
+  if (k == 0)
+    return 0;
+
+  for (uint64_t i = 0; i < c->count; i++)
+  {
+    if (!FP_SONGLEN_MAY_MATCH(q->songlen, c->songlen[i]))
+      continue;
+    score = match_query(c, q, missing, i);
+    if (score <= min_score)
+      continue;
+    if (n < k)
+    {
+      hits[n].ix = i;
+      hits[n].score = score;
+      heap_sift_up(hits, n++);
+    }
+    else if (score > hits[0].score)
+    {
+      hits[0].ix = i;
+      hits[0].score = score;
+      heap_sift_down(hits, n, 0);
+    }
+  }
+
+  qsort(hits, n, sizeof(*hits), cmp_hit_desc);
+
+  return n;
+}
+
+typedef struct
+{
+  uint32_t songlen;
+  uint64_t ix;
+} SonglenIx;
+
+static int cmp_songlen_ix(const void *a, const void *b)
+{
+  const SonglenIx *x = (const SonglenIx *)a;
+  const SonglenIx *y = (const SonglenIx *)b;
+  if (x->songlen != y->songlen)
+    return (x->songlen > y->songlen) - (x->songlen < y->songlen);
+  return (x->ix > y->ix) - (x->ix < y->ix);
+}
+
+FPCorpusPair *fpcorpus_self_join(const FPCorpus *c, double min_score,
+                                 size_t *n_pairs, int *error)
+{
+  SonglenIx *order = NULL;
+  FPCorpusPair *pairs = NULL;
+  FPCorpusPair *tmp = NULL;
+  size_t n = 0;
+  size_t cap = 0;
+  double score = 0.0;
+  uint64_t a, b;
+
+  *n_pairs = 0;
+  *error = 0;
+  if (c->count < 2)
+    return NULL;
+
+  order = malloc(c->count * sizeof(*order));
+  if (!order)
+  {
+    *error = ENOMEM;
+    return NULL;
+  }
+  for (uint64_t i = 0; i < c->count; i++)
+  {
+    order[i].songlen = c->songlen[i];
+    order[i].ix = i;
+  }
+  qsort(order, c->count, sizeof(*order), cmp_songlen_ix);
+
+  for (uint64_t i = 0; i < c->count; i++)
+  {
+    // songlen only grows from here; stop once the gate can no longer pass
+    for (uint64_t j = i + 1; j < c->count &&
+                             FP_SONGLEN_MAY_MATCH(order[i].songlen, order[j].songlen);
+         j++)
+    {
+      a = order[i].ix < order[j].ix ? order[i].ix : order[j].ix;
+      b = order[i].ix < order[j].ix ? order[j].ix : order[i].ix;
+      score = match_entries(c, a, b);
+      if (score <= min_score)
+        continue;
+      if (n == cap)
+      {
+        cap = cap ? cap * 2 : WRITER_INIT_CAP;
+        tmp = realloc(pairs, cap * sizeof(*pairs));
+        if (!tmp)
+        {
+          *error = ENOMEM;
+          free(pairs);
+          pairs = NULL;
+          n = 0;
+          goto cleanup;
+        }
+        pairs = tmp;
+      }
+      pairs[n].a = a;
+      pairs[n].b = b;
+      pairs[n].score = score;
+      n++;
+    }
+  }
+
+cleanup:
+  free(order);
+  *n_pairs = n;
+
+  return pairs;
+}
+
+////////////////////////////////////////////////////////////
+// Writing
+////////////////////////////////////////////////////////////
+
+static int writer_grow(FPCorpusWriter *w)
+{
+  uint64_t cap = w->cap ? w->cap * 2 : WRITER_INIT_CAP;
+  void *p = NULL;
+
+#define GROW(field, n)                                 \
+  do                                                   \
+  {                                                    \
+    p = realloc(w->field, (n) * sizeof(*w->field));    \
+    if (!p)                                            \
+      return ENOMEM;                                   \
+    w->field = p;                                      \
+  } while (0)
+
+  GROW(ids, cap);
+  GROW(songlen, cap);
+  GROW(bit_rate, cap);
+  GROW(num_errors, cap);
+  GROW(cprint_off, cap + 1);
+  GROW(r, cap * R_SIZE);
+  GROW(dom, cap * DOM_SIZE);
+#undef GROW
+
+  w->cap = cap;
+  return 0;
+}
+
+static void writer_free(FPCorpusWriter *w)
+{
+  free(w->ids);
+  free(w->songlen);
+  free(w->bit_rate);
+  free(w->num_errors);
+  free(w->cprint_off);
+  free(w->r);
+  free(w->dom);
+  free(w->path);
+  free(w->tmp_path);
+  free(w);
+}
+
+FPCorpusWriter *fpcorpus_writer_new(const char *path, int *error)
+{
+  FPCorpusWriter *w = NULL;
+  static const char zeros[FPCORPUS_HEADER_SIZE];
+  size_t path_len = strlen(path);
+
+  *error = 0;
+  w = calloc(1, sizeof(*w));
+  if (!w)
+  {
+    *error = ENOMEM;
+    return NULL;
+  }
+  w->path = strdup(path);
+  w->tmp_path = malloc(path_len + sizeof(".tmp"));
+  if (!w->path || !w->tmp_path || (*error = writer_grow(w)) != 0)
+  {
+    *error = ENOMEM;
+    writer_free(w);
+    return NULL;
+  }
+  memcpy(w->tmp_path, path, path_len);
+  memcpy(&w->tmp_path[path_len], ".tmp", sizeof(".tmp"));
+  w->cprint_off[0] = 0;
+
+  w->out = fopen(w->tmp_path, "wb");
+  if (!w->out || fwrite(zeros, 1, sizeof(zeros), w->out) != sizeof(zeros))
+  {
+    *error = errno;
+    fprintf(stderr, "ERROR: %d: unable to create corpus %s\n",
+            *error, w->tmp_path);
+    fpcorpus_writer_abort(w);
+    return NULL;
+  }
+
+  return w;
+}
+
+int fpcorpus_writer_add(FPCorpusWriter *w, uint64_t id, const FPrint *fp)
+{
+  uint64_t i = w->count;
+  int errn = 0;
+
+  // the corpus has no missing column; matches assume complete prints
+  if (fp->missing)
+    return EINVAL;
+
+  if (i == w->cap && (errn = writer_grow(w)) != 0)
+    return errn;
+
+  if (fp->cprint_len &&
+      fwrite(fp->cprint, sizeof(int32_t), fp->cprint_len, w->out) != fp->cprint_len)
+  {
+    return errno ? errno : EIO;
+  }
+
+  w->ids[i] = id;
+  w->songlen[i] = fp->songlen;
+  w->bit_rate[i] = fp->bit_rate;
+  w->num_errors[i] = fp->num_errors;
+  memcpy(&w->r[i * R_SIZE], fp->r, R_SIZE);
+  memcpy(&w->dom[i * DOM_SIZE], fp->dom, DOM_SIZE);
+  w->cprint_total += fp->cprint_len;
+  w->cprint_off[i + 1] = w->cprint_total;
+  w->count++;
+
+  return 0;
+}
+
+// pad the file to FPCORPUS_ALIGN, write a column and return its offset
+static int write_column(FILE *out, const void *data, size_t size,
+                        uint64_t *offset)
+{
+  static const char zeros[FPCORPUS_ALIGN];
+  long pos = ftell(out);
+  uint64_t start = 0;
+
+  if (pos < 0)
+    return errno;
+  start = ALIGN_UP((uint64_t)pos, FPCORPUS_ALIGN);
+  if (start > (uint64_t)pos &&
+      fwrite(zeros, 1, (size_t)(start - (uint64_t)pos), out) != (size_t)(start - (uint64_t)pos))
+  {
+    return EIO;
+  }
+  if (size && fwrite(data, 1, size, out) != size)
+    return EIO;
+
+  *offset = start;
+  return 0;
+}
+
+int fpcorpus_writer_close(FPCorpusWriter *w)
+{
+  FPCorpusHeader h;
+  uint64_t n = w->count;
+  long end = 0;
+  int errn = 0;
+
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, FPCORPUS_MAGIC, sizeof(h.magic));
+  h.version = FPCORPUS_VERSION;
+  h.r_size = R_SIZE;
+  h.dom_size = DOM_SIZE;
+  h.count = n;
+  h.cprint_total = w->cprint_total;
+  h.off_cprint = FPCORPUS_HEADER_SIZE;
+
+  if ((errn = write_column(w->out, w->ids, n * sizeof(uint64_t), &h.off_ids)) ||
+      (errn = write_column(w->out, w->songlen, n * sizeof(uint32_t), &h.off_songlen)) ||
+      (errn = write_column(w->out, w->bit_rate, n * sizeof(int32_t), &h.off_bit_rate)) ||
+      (errn = write_column(w->out, w->num_errors, n * sizeof(int32_t), &h.off_num_errors)) ||
+      (errn = write_column(w->out, w->cprint_off, (n + 1) * sizeof(uint64_t), &h.off_cprint_off)) ||
+      (errn = write_column(w->out, w->r, n * R_SIZE, &h.off_r)) ||
+      (errn = write_column(w->out, w->dom, n * DOM_SIZE, &h.off_dom)))
+  {
+    goto error;
+  }
+
+  if ((end = ftell(w->out)) < 0)
+  {
+    errn = errno;
+    goto error;
+  }
+  h.file_size = (uint64_t)end;
+
+  if (fseek(w->out, 0, SEEK_SET) != 0 ||
+      fwrite(&h, sizeof(h), 1, w->out) != 1 ||
+      fflush(w->out) != 0 || fsync(fileno(w->out)) != 0)
+  {
+    errn = errno ? errno : EIO;
+    goto error;
+  }
+  if (fclose(w->out) != 0)
+  {
+    w->out = NULL;
+    errn = errno;
+    goto error;
+  }
+  w->out = NULL;
+
+  if (rename(w->tmp_path, w->path) != 0)
+  {
+    errn = errno;
+    goto error;
+  }
+
+  writer_free(w);
+  return 0;
+
+error:
+  fprintf(stderr, "ERROR: %d: unable to write corpus %s\n", errn, w->path);
+  fpcorpus_writer_abort(w);
+  return errn;
+}
+
+void fpcorpus_writer_abort(FPCorpusWriter *w)
+{
+  if (!w)
+    return;
+  if (w->out)
+    fclose(w->out);
+  if (w->tmp_path)
+    unlink(w->tmp_path);
+  writer_free(w);
+}
@@ -0,0 +1,204 @@
+/*
+ *  fpcorpus.h
+ *
+ *  column-wise, memory-mapped store for large sets of fingerprints
+ *
+ *  A corpus file is written once (FPCorpusWriter) and then mapped read-only
+ *  by any number of processes, which share the pages through the page cache.
+ *  Opening a corpus does no per-fingerprint work, so a million fingerprints
+ *  are available as soon as the mmap returns.
+ *
+ *  Copyright 2010 Zatisfi, LLC. MIT License, 2025
+ */
+
+#ifndef _FPCORPUS_H
+#define _FPCORPUS_H
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "fplib.h"
+
+#define FPCORPUS_MAGIC "FPCORP01"
+#define FPCORPUS_VERSION 1
+// the header is padded to a page so the cprint column is page aligned
+#define FPCORPUS_HEADER_SIZE 4096
+// every other column starts on a cache line
+#define FPCORPUS_ALIGN 64
+
+  /* On-disk layout, native byte order:
+   *
+   *   FPCorpusHeader                 padded to FPCORPUS_HEADER_SIZE
+   *   int32_t  cprint[cprint_total]  every chromaprint, back to back
+   *   uint64_t ids[count]            caller-assigned ids
+   *   uint32_t songlen[count]
+   *   int32_t  bit_rate[count]
+   *   int32_t  num_errors[count]
+   *   uint64_t cprint_off[count + 1] cprint of entry i is
+   *                                  cprint[cprint_off[i] .. cprint_off[i+1])
+   *   uint8_t  r[count][R_SIZE]
+   *   uint8_t  dom[count][DOM_SIZE]
+   *
+   * cprint comes first so the writer can stream it to disk; the fixed-size
+   * columns are small enough to buffer and are written on close.
+   * dom records are 66 bytes apart, so most are not 4-byte aligned; the
+   * matching kernels load r and dom with memcpy and accept any alignment.
+   */
+  typedef struct FPCorpusHeader
+  {
+    char magic[8];
+    uint32_t version;
+    uint32_t r_size;
+    uint32_t dom_size;
+    uint32_t reserved;
+    uint64_t count;
+    uint64_t cprint_total;
+    uint64_t off_cprint;
+    uint64_t off_ids;
+    uint64_t off_songlen;
+    uint64_t off_bit_rate;
+    uint64_t off_num_errors;
+    uint64_t off_cprint_off;
+    uint64_t off_r;
+    uint64_t off_dom;
+    uint64_t file_size;
+  } FPCorpusHeader;
+
+  typedef struct FPCorpus
+  {
+    void *base;
+    size_t size;
+    uint64_t count;
+    const uint64_t *ids;
+    const uint32_t *songlen;
+    const int32_t *bit_rate;
+    const int32_t *num_errors;
+    const uint64_t *cprint_off;
+    const uint8_t *r;
+    const uint8_t *dom;
+    const int32_t *cprint;
+    // index of entry 0 in the corpus file (non-zero for a shard)
+    uint64_t first;
+    // range of songlen, found when the corpus is opened (UINT32_MAX and 0
+    // if it is empty)
+    uint32_t songlen_min;
+    uint32_t songlen_max;
+  } FPCorpus;
+
+  typedef struct FPCorpusHit
+  {
+    uint64_t ix;
+    double score;
+  } FPCorpusHit;
+
+  typedef struct FPCorpusPair
+  {
+    uint64_t a;
+    uint64_t b;
+    double score;
+  } FPCorpusPair;
+
+  typedef struct FPCorpusWriter FPCorpusWriter;
+
+  static inline size_t fpcorpus_cprint_len(const FPCorpus *c, uint64_t i)
+  {
+    return (size_t)(c->cprint_off[i + 1] - c->cprint_off[i]);
+  }
+
+  static inline const int32_t *fpcorpus_cprint(const FPCorpus *c, uint64_t i)
+  {
+    return &c->cprint[c->cprint_off[i]];
+  }
+
+  /*! fpcorpus_open
+   *  \brief map a corpus file read-only; returns NULL and sets *error to an
+   *  errno value on failure (EINVAL for a file that is not a valid corpus)
+   */
+  FPCorpus *fpcorpus_open(const char *path, int *error);
+
+  /*! fpcorpus_load_shard
+   *  \brief copy entries [count * shard / n_shards, count * (shard + 1) /
+   *  n_shards) of a corpus file into private memory on a NUMA node (see
+   *  fpnuma_alloc for node and flags).  Entry i of the shard is entry
+   *  first + i of the file.  Free with fpcorpus_close.
+   */
+  FPCorpus *fpcorpus_load_shard(const char *path, uint64_t shard,
+                                uint64_t n_shards, int node, int flags,
+                                int *error);
+
+  void fpcorpus_close(FPCorpus *c);
+
+  /*! fpcorpus_get
+   *  \brief copy entry i into a new FPrint (free with free_fprint)
+   */
+  FPrint *fpcorpus_get(const FPCorpus *c, uint64_t i);
+
+  /*! fpcorpus_match
+   *  \brief match_cpfm of q against entry i; a partial q (FPrint.missing)
+   *  is scored on the parts it has
+   */
+  double fpcorpus_match(const FPCorpus *c, const FPrint *q, uint64_t i);
+
+  /*! fpcorpus_match_all
+   *  \brief scores[i] = fpcorpus_match(c, q, i) for every entry
+   */
+  void fpcorpus_match_all(const FPCorpus *c, const FPrint *q, double *scores);
+
+  /*! fpcorpus_match_range
+   *  \brief scores[i - lo] = fpcorpus_match(c, q, i) for lo <= i < hi, so
+   *  threads can split one scan
+   */
+  void fpcorpus_match_range(const FPCorpus *c, const FPrint *q, uint64_t lo,
+                            uint64_t hi, double *scores);
+
+  /*! fpcorpus_topk
+   *  \brief fill hits (room for k) with the best entries scoring above
+   *  min_score, best first; returns the number of hits
+   */
+  size_t fpcorpus_topk(const FPCorpus *c, const FPrint *q, size_t k,
+                       double min_score, FPCorpusHit *hits);
+
+  /*! fpcorpus_self_join
+   *  \brief every pair a < b of entries scoring above min_score.
+   *  Entries are visited in songlen order so only pairs that can pass the
+   *  match_cpfm songlen gate are scored.  Returns a malloc'd array of
+   *  *n_pairs pairs (NULL with *n_pairs == 0 if there are none); on error
+   *  returns NULL and sets *error to an errno value.
+   */
+  FPCorpusPair *fpcorpus_self_join(const FPCorpus *c, double min_score,
+                                   size_t *n_pairs, int *error);
+
+  /*! fpcorpus_writer_new
+   *  \brief start writing a corpus to path.  The file is built under a
+   *  temporary name and renamed into place by fpcorpus_writer_close, so
+   *  processes that have the old corpus mapped are unaffected.
+   */
+  FPCorpusWriter *fpcorpus_writer_new(const char *path, int *error);
+
+  /*! fpcorpus_writer_add
+   *  \brief append a fingerprint; returns 0 or an errno value (EINVAL for
+   *  a partial fingerprint, see FPrint.missing)
+   */
+  int fpcorpus_writer_add(FPCorpusWriter *w, uint64_t id, const FPrint *fp);
+
+  /*! fpcorpus_writer_close
+   *  \brief write the columns and header, rename the file into place and
+   *  free the writer; returns 0 or an errno value
+   */
+  int fpcorpus_writer_close(FPCorpusWriter *w);
+
+  /*! fpcorpus_writer_abort
+   *  \brief discard a partially written corpus and free the writer
+   */
+  void fpcorpus_writer_abort(FPCorpusWriter *w);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _FPCORPUS_H */
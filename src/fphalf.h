@@ -0,0 +1,114 @@
+/*
+ *  fphalf.h
+ *
+ *  16-bit "half-prints" of a corpus' chromaprints, for a first pass that
+ *  reads half the cprint bytes
+ *
+ *  A cprint value holds 16 Gray-coded 2-bit classifier outputs, classifier
+ *  j in bits 2j and 2j + 1.  match_chromab only compares the lowest set
+ *  bit of two values, so classifier j counts only where classifiers
+ *  0 .. j-1 are all zero: the low classifiers decide nearly every
+ *  position.  A half-print keeps classifiers 0 .. 7, the low 16 bits.
+ *
+ *  Two half values compare as the full values do unless both are zero;
+ *  there the full values may still differ, so a half-print
+ *  gives a range for match_chromab instead of its value; for most pairs
+ *  the range is a single point.  fphalf_topk bounds match_cpfm over that
+ *  range, first with match_fooid_fp at its maximum and then with its
+ *  value.  It reads an entry's r and dom, and then its full cprint, only
+ *  while the bound can still put the entry in the top k, so its results
+ *  are exactly those of fpcorpus_topk.
+ *
+ *  A half-print set is built in memory from an open corpus, or written
+ *  next to the corpus file and mapped from there.
+ *
+ *  Copyright 2010 Zatisfi, LLC. MIT License, 2025
+ */
+
+#ifndef _FPHALF_H
+#define _FPHALF_H
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "fplib.h"
+#include "fpcorpus.h"
+
+#define FPHALF_MAGIC "FPHALF01"
+#define FPHALF_VERSION 1
+#define FPHALF_HEADER_SIZE 64
+
+  /* On-disk layout, native byte order: an FPHalfHeader padded to
+   * FPHALF_HEADER_SIZE, then uint16_t half[cprint_total], the half-print
+   * of the corpus' cprint column (indexed by its cprint_off).
+   */
+  typedef struct FPHalfHeader
+  {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    // of the corpus the file was written from
+    uint64_t count;
+    uint64_t cprint_total;
+  } FPHalfHeader;
+
+  typedef struct FPHalf FPHalf;
+
+  // what one fphalf_topk call did
+  typedef struct FPHalfStats
+  {
+    // entries scored from the half-prints
+    uint64_t scanned;
+    // entries whose full cprint was read
+    uint64_t rescored;
+  } FPHalfStats;
+
+  /*! fphalf_build
+   *  \brief half-prints of every cprint of c, in memory; returns NULL and
+   *  sets *error to an errno value on failure
+   */
+  FPHalf *fphalf_build(const FPCorpus *c, int *error);
+
+  /*! fphalf_write
+   *  \brief write the half-prints of c to path (by convention the corpus
+   *  path with ".fph" appended), under a temporary name renamed into
+   *  place; returns 0 or an errno value
+   */
+  int fphalf_write(const FPCorpus *c, const char *path);
+
+  /*! fphalf_open
+   *  \brief map the half-prints at path; returns NULL and sets *error to
+   *  an errno value on failure (EINVAL if the file was not written from a
+   *  corpus shaped like c)
+   */
+  FPHalf *fphalf_open(const char *path, const FPCorpus *c, int *error);
+
+  void fphalf_close(FPHalf *h);
+
+  /*! fphalf_match_all
+   *  \brief scores[i] = fpcorpus_match(c, q, i) estimated from the
+   *  half-prints alone (the top of the match_chromab range), for every
+   *  entry; h must be of c
+   */
+  void fphalf_match_all(const FPHalf *h, const FPCorpus *c, const FPrint *q,
+                        double *scores);
+
+  /*! fphalf_topk
+   *  \brief fpcorpus_topk, scanning the half-prints and reading the full
+   *  cprint only of entries that may place; stats (or NULL) gets what
+   *  was read
+   */
+  size_t fphalf_topk(const FPHalf *h, const FPCorpus *c, const FPrint *q,
+                     size_t k, double min_score, FPCorpusHit *hits,
+                     FPHalfStats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _FPHALF_H */
@@ -0,0 +1,2138 @@
+/*
+ *  fpindex.c
+ *  persistent inverted index from chromaprint terms to fingerprints
+ *
+ *  Copyright 2010 Zatisfi, LLC. MIT License, 2025
+ *
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "fplib.h"
+#include "fpindex.h"
+#include "fpqcache.h"
+
+#define SEGMENT_MAGIC "FPIXSEG1"
+#define SEGMENT_VERSION 1
+// the header is padded to a page so the prints start page aligned
+#define SEGMENT_HEADER_SIZE 4096
+#define SEGMENT_FMT "seg-%016llx.fps"
+#define LOG_FMT "wal-%016llx.log"
+#define MANIFEST_NAME "MANIFEST"
+#define MANIFEST_HEADER "FPINDEX 1"
+#define LOG_MAGIC 0x4c575046 /* "FPWL" */
+
+// postings are bit-packed in blocks of this many doc numbers ...
+#define BLOCK_SIZE 128
+// ... unless the list is this short, when they are stored as is
+#define SHORT_LIST 16
+// queries skip terms in more than 1/STOP_TERM_DIVISOR of a segment's
+// fingerprints (and more than STOP_TERM_MIN): they select nothing
+#define STOP_TERM_DIVISOR 20
+#define STOP_TERM_MIN 1024
+
+#define INIT_CAP 64
+
+#define ALIGN4(x) (((x) + 3) & ~(uint64_t)3)
+
+/* Segment file layout, native byte order:
+ *
+ *   SegmentHeader                 padded to SEGMENT_HEADER_SIZE
+ *   PackedFP prints               back to back, in doc order
+ *   uint32_t postings[]           per term, see encode_postings
+ *   uint64_t ids[n_docs]
+ *   uint64_t print_off[n_docs + 1] byte offsets into prints
+ *   uint32_t terms[n_terms]       sorted
+ *   uint32_t counts[n_terms]      postings per term
+ *   uint64_t post_off[n_terms + 1] byte offsets into postings
+ *
+ * prints and postings are streamed; the rest is buffered and written last.
+ */
+typedef struct
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t term_shift;
+  uint64_t n_docs;
+  uint64_t n_terms;
+  uint64_t off_prints;
+  uint64_t off_postings;
+  uint64_t off_ids;
+  uint64_t off_print_off;
+  uint64_t off_terms;
+  uint64_t off_counts;
+  uint64_t off_post_off;
+  uint64_t file_size;
+} SegmentHeader;
+
+typedef struct
+{
+  uint32_t magic;
+  uint32_t len;
+  uint64_t id;
+} LogRecord;
+
+typedef struct Segment
+{
+  int refs;
+  uint64_t seq;
+  void *base;
+  size_t size;
+  uint64_t n_docs;
+  uint64_t n_terms;
+  const uint8_t *prints;
+  const uint8_t *postings;
+  const uint64_t *ids;
+  const uint64_t *print_off;
+  const uint32_t *terms;
+  const uint32_t *counts;
+  const uint64_t *post_off;
+} Segment;
+
+typedef struct
+{
+  uint32_t term;
+  uint32_t n;
+  uint32_t cap;
+  uint32_t *docs;
+} MemPosting;
+
+typedef struct MemTable
+{
+  int refs;
+  uint64_t seq;
+  int log_fd;
+  // bytes of whole records in the log; log_torn is set while a failed
+  // add's partial record could not be cut off past it
+  size_t log_size;
+  int log_torn;
+  // adds take it for writing; queries for reading
+  pthread_rwlock_t lock;
+  size_t n_docs;
+  size_t cap_docs;
+  uint64_t *ids;
+  uint8_t **prints;
+  // open addressing on term; docs == NULL marks an empty slot
+  MemPosting *map;
+  size_t map_cap;
+  size_t map_used;
+} MemTable;
+
+// what a query sees: immutable once published, freed with its last ref
+typedef struct
+{
+  int refs;
+  size_t n_segs;
+  Segment **segs;
+  size_t n_frozen;
+  MemTable **frozen;
+} View;
+
+struct FPIndex
+{
+  char *path;
+  // view, active, next_seq, the refs of everything and the flags below
+  pthread_mutex_t lock;
+  pthread_cond_t work;
+  pthread_cond_t flushed;
+  // serializes fpindex_add (and freezing the active memtable)
+  pthread_mutex_t add_lock;
+  View *view;
+  MemTable *active;
+  uint64_t next_seq;
+  int stop;
+  int bg_error;
+  pthread_t thread;
+  // results of recent queries, or NULL
+  FPQCache *qcache;
+};
+
+typedef struct
+{
+  uint32_t doc;
+  uint32_t hits;
+} Candidate;
+
+////////////////////////////////////////////////////////////
+// Postings
+////////////////////////////////////////////////////////////
+
+static inline uint32_t bits_needed(uint32_t x)
+{
+  return x ? 32 - (uint32_t)__builtin_clz(x) : 0;
+}
+
+// words the encoding of a list of count doc numbers may take
+static size_t postings_max_words(uint32_t count)
+{
+  if (count <= SHORT_LIST)
+    return count;
+  return (size_t)count + 2 * ((count + BLOCK_SIZE - 1) / BLOCK_SIZE);
+}
+
+/* Lists of up to SHORT_LIST doc numbers are stored as is.  Longer ones are
+ * cut into blocks of BLOCK_SIZE, each
+ *
+ *   uint32_t first   doc number
+ *   uint32_t bits    width of the gaps
+ *   uint32_t packed[((n - 1) * bits + 31) / 32]
+ *
+ * where the n - 1 gaps docs[i] - docs[i - 1] - 1 are packed low bits first.
+ * Every block decodes on its own, and at 128 values to a fixed width the
+ * unpacking loop is branch-free.
+ */
+static size_t encode_postings(const uint32_t *docs, uint32_t count,
+                              uint32_t *out)
+{
+  size_t w = 0;
+  uint32_t n, bits, gap;
+  uint64_t acc;
+  uint32_t acc_bits;
+
+  if (count <= SHORT_LIST)
+  {
+    memcpy(out, docs, count * sizeof(*docs));
+    return count;
+  }
+
+  for (uint32_t done = 0; done < count; done += n)
+  {
+    n = count - done < BLOCK_SIZE ? count - done : BLOCK_SIZE;
+    bits = 0;
+    for (uint32_t i = 1; i < n; i++)
+    {
+      gap = docs[done + i] - docs[done + i - 1] - 1;
+      bits |= gap;
+    }
+    bits = bits_needed(bits);
+    out[w++] = docs[done];
+    out[w++] = bits;
+
+    acc = 0;
+    acc_bits = 0;
+    for (uint32_t i = 1; i < n && bits; i++)
+    {
+      gap = docs[done + i] - docs[done + i - 1] - 1;
+      acc |= (uint64_t)gap << acc_bits;
+      acc_bits += bits;
+      if (acc_bits >= 32)
+      {
+        out[w++] = (uint32_t)acc;
+        acc >>= 32;
+        acc_bits -= 32;
+      }
+    }
+    if (acc_bits > 0)
+      out[w++] = (uint32_t)acc;
+  }
+
+  return w;
+}
+
+static void unpack_gaps(const uint32_t *in, uint32_t bits, uint32_t n,
+                        uint32_t *out)
+{
+  uint64_t acc = 0;
+  uint32_t acc_bits = 0;
+  uint32_t mask = bits == 32 ? UINT32_MAX : ((uint32_t)1 << bits) - 1;
+
+  for (uint32_t i = 0; i < n; i++)
+  {
+    if (acc_bits < bits)
+    {
+      acc |= (uint64_t)*in++ << acc_bits;
+      acc_bits += 32;
+    }
+    out[i] = (uint32_t)acc & mask;
+    acc >>= bits;
+    acc_bits -= bits;
+  }
+}
+
+// decode a list of count doc numbers from words (n_words of them); returns
+// 0, or -1 if the encoding runs past the end
+static int decode_postings(const uint32_t *in, size_t n_words, uint32_t count,
+                           uint32_t *out)
+{
+  const uint32_t *end = in + n_words;
+  uint32_t n, bits;
+  size_t words;
+
+  if (count <= SHORT_LIST)
+  {
+    if (count > n_words)
+      return -1;
+    memcpy(out, in, count * sizeof(*in));
+    return 0;
+  }
+
+  for (uint32_t done = 0; done < count; done += n)
+  {
+    n = count - done < BLOCK_SIZE ? count - done : BLOCK_SIZE;
+    if (end - in < 2)
+      return -1;
+    out[done] = in[0];
+    bits = in[1];
+    in += 2;
+    words = ((size_t)(n - 1) * bits + 31) / 32;
+    if (bits > 32 || (size_t)(end - in) < words)
+      return -1;
+    if (bits)
+      unpack_gaps(in, bits, n - 1, &out[done + 1]);
+    else
+      memset(&out[done + 1], 0, (n - 1) * sizeof(*out));
+    in += words;
+    for (uint32_t i = 1; i < n; i++)
+      out[done + i] += out[done + i - 1] + 1;
+  }
+
+  return 0;
+}
+
+// distinct terms of a cprint, sorted; returns the number, or -1
+static int cmp_u32(const void *a, const void *b)
+{
+  uint32_t x = *(const uint32_t *)a;
+  uint32_t y = *(const uint32_t *)b;
+  return (x > y) - (x < y);
+}
+
+static size_t cprint_terms(const int32_t *cprint, size_t len, uint32_t *terms)
+{
+  size_t n = 0;
+
+  for (size_t i = 0; i < len; i++)
+    terms[i] = FPINDEX_TERM(cprint[i]);
+  qsort(terms, len, sizeof(*terms), cmp_u32);
+  for (size_t i = 0; i < len; i++)
+  {
+    if (n == 0 || terms[n - 1] != terms[i])
+      terms[n++] = terms[i];
+  }
+  return n;
+}
+
+////////////////////////////////////////////////////////////
+// Files
+////////////////////////////////////////////////////////////
+
+static char *join_path(const char *dir, const char *name)
+{
+  size_t dir_len = strlen(dir);
+  size_t name_len = strlen(name);
+  char *p = malloc(dir_len + name_len + 2);
+
+  if (!p)
+    return NULL;
+  memcpy(p, dir, dir_len);
+  p[dir_len] = '/';
+  memcpy(&p[dir_len + 1], name, name_len + 1);
+  return p;
+}
+
+static char *seq_path(const char *dir, const char *fmt, uint64_t seq)
+{
+  char name[64];
+  snprintf(name, sizeof(name), fmt, (unsigned long long)seq);
+  return join_path(dir, name);
+}
+
+static int write_full(int fd, const void *buf, size_t len)
+{
+  const uint8_t *p = (const uint8_t *)buf;
+  ssize_t n = 0;
+
+  while (len > 0)
+  {
+    n = write(fd, p, len);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return n < 0 ? errno : EIO;
+    p += n;
+    len -= (size_t)n;
+  }
+  return 0;
+}
+
+static int sync_dir(const char *dir)
+{
+  int fd = open(dir, O_RDONLY);
+  int errn = 0;
+
+  if (fd < 0)
+    return errno;
+  if (fsync(fd) != 0)
+    errn = errno;
+  close(fd);
+  return errn;
+}
+
+////////////////////////////////////////////////////////////
+// Segments
+////////////////////////////////////////////////////////////
+
+typedef struct
+{
+  FILE *out;
+  char *path;
+  char *tmp_path;
+  uint64_t pos;
+  uint64_t n_docs;
+  uint64_t cap_docs;
+  uint64_t *ids;
+  uint64_t *print_off;
+  size_t n_terms;
+  size_t cap_terms;
+  uint32_t *terms;
+  uint32_t *counts;
+  uint64_t *post_off;
+  uint32_t *scratch;
+  size_t scratch_cap;
+  uint64_t off_postings;
+} SegWriter;
+
+static void seg_writer_free(SegWriter *w)
+{
+  if (w->out)
+    fclose(w->out);
+  if (w->tmp_path)
+    unlink(w->tmp_path);
+  free(w->path);
+  free(w->tmp_path);
+  free(w->ids);
+  free(w->print_off);
+  free(w->terms);
+  free(w->counts);
+  free(w->post_off);
+  free(w->scratch);
+  free(w);
+}
+
+static SegWriter *seg_writer_new(const char *dir, uint64_t seq, uint64_t n_docs,
+                                 int *error)
+{
+  static const char zeros[SEGMENT_HEADER_SIZE];
+  SegWriter *w = calloc(1, sizeof(*w));
+  size_t path_len = 0;
+
+  *error = ENOMEM;
+  if (!w)
+    return NULL;
+  w->path = seq_path(dir, SEGMENT_FMT, seq);
+  w->cap_docs = n_docs;
+  w->ids = malloc((n_docs ? n_docs : 1) * sizeof(*w->ids));
+  w->print_off = malloc((n_docs + 1) * sizeof(*w->print_off));
+  if (!w->path || !w->ids || !w->print_off)
+    goto error;
+  path_len = strlen(w->path);
+  if (!(w->tmp_path = malloc(path_len + sizeof(".tmp"))))
+    goto error;
+  memcpy(w->tmp_path, w->path, path_len);
+  memcpy(&w->tmp_path[path_len], ".tmp", sizeof(".tmp"));
+
+  w->out = fopen(w->tmp_path, "wb");
+  if (!w->out || fwrite(zeros, 1, sizeof(zeros), w->out) != sizeof(zeros))
+  {
+    *error = errno ? errno : EIO;
+    goto error;
+  }
+  w->pos = SEGMENT_HEADER_SIZE;
+  w->print_off[0] = 0;
+  *error = 0;
+  return w;
+
+error:
+  seg_writer_free(w);
+  return NULL;
+}
+
+// docs first, in order; every PackedFP is a multiple of 4 bytes
+static int seg_writer_add_doc(SegWriter *w, uint64_t id, const uint8_t *packed)
+{
+  size_t len = PACKED_FP_SIZE(((const PackedFP *)packed)->cprint_len);
+
+  if (w->n_docs == w->cap_docs)
+    return EINVAL;
+  if (fwrite(packed, 1, len, w->out) != len)
+    return errno ? errno : EIO;
+  w->ids[w->n_docs] = id;
+  w->print_off[w->n_docs + 1] = w->print_off[w->n_docs] + len;
+  w->n_docs++;
+  w->pos += len;
+  return 0;
+}
+
+// then the terms, in increasing order, each with its sorted doc numbers
+static int seg_writer_add_term(SegWriter *w, uint32_t term,
+                               const uint32_t *docs, uint32_t count)
+{
+  size_t words = postings_max_words(count);
+  void *p = NULL;
+
+  if (w->n_terms == 0)
+    w->off_postings = w->pos;
+  if (w->n_terms == w->cap_terms)
+  {
+    w->cap_terms = w->cap_terms ? 2 * w->cap_terms : 4 * INIT_CAP;
+    if (!(p = realloc(w->terms, w->cap_terms * sizeof(*w->terms))))
+      return ENOMEM;
+    w->terms = p;
+    if (!(p = realloc(w->counts, w->cap_terms * sizeof(*w->counts))))
+      return ENOMEM;
+    w->counts = p;
+    if (!(p = realloc(w->post_off, (w->cap_terms + 1) * sizeof(*w->post_off))))
+      return ENOMEM;
+    w->post_off = p;
+    w->post_off[0] = 0;
+  }
+  if (words > w->scratch_cap)
+  {
+    if (!(p = realloc(w->scratch, words * sizeof(*w->scratch))))
+      return ENOMEM;
+    w->scratch = p;
+    w->scratch_cap = words;
+  }
+
+  words = encode_postings(docs, count, w->scratch);
+  if (fwrite(w->scratch, sizeof(*w->scratch), words, w->out) != words)
+    return errno ? errno : EIO;
+  w->terms[w->n_terms] = term;
+  w->counts[w->n_terms] = count;
+  w->post_off[w->n_terms + 1] = w->post_off[w->n_terms] + words * sizeof(uint32_t);
+  w->n_terms++;
+  w->pos += words * sizeof(uint32_t);
+  return 0;
+}
+
+static int seg_write_column(SegWriter *w, const void *data, size_t size,
+                            uint64_t *offset)
+{
+  *offset = w->pos;
+  if (size && fwrite(data, 1, size, w->out) != size)
+    return errno ? errno : EIO;
+  w->pos += size;
+  return 0;
+}
+
+// write the buffered columns and the header and rename the file into place;
+// frees the writer either way
+static int seg_writer_close(SegWriter *w)
+{
+  SegmentHeader h;
+  uint64_t zero = 0;
+  int errn = 0;
+
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, SEGMENT_MAGIC, sizeof(h.magic));
+  h.version = SEGMENT_VERSION;
+  h.term_shift = FPINDEX_TERM_SHIFT;
+  h.n_docs = w->n_docs;
+  h.n_terms = w->n_terms;
+  h.off_prints = SEGMENT_HEADER_SIZE;
+  h.off_postings = w->n_terms ? w->off_postings : w->pos;
+
+  // 8-byte columns follow 4-byte ones
+  if (w->pos % 8 && (errn = seg_write_column(w, &zero, 4, &h.off_ids)) != 0)
+    goto done;
+  if ((errn = seg_write_column(w, w->ids, w->n_docs * sizeof(uint64_t), &h.off_ids)) ||
+      (errn = seg_write_column(w, w->print_off, (w->n_docs + 1) * sizeof(uint64_t), &h.off_print_off)) ||
+      (errn = seg_write_column(w, w->post_off ? w->post_off : &zero, (w->n_terms + 1) * sizeof(uint64_t), &h.off_post_off)) ||
+      (errn = seg_write_column(w, w->terms, w->n_terms * sizeof(uint32_t), &h.off_terms)) ||
+      (errn = seg_write_column(w, w->counts, w->n_terms * sizeof(uint32_t), &h.off_counts)))
+  {
+    goto done;
+  }
+  h.file_size = w->pos;
+
+  if (fseek(w->out, 0, SEEK_SET) != 0 || fwrite(&h, sizeof(h), 1, w->out) != 1 ||
+      fflush(w->out) != 0 || fsync(fileno(w->out)) != 0)
+  {
+    errn = errno ? errno : EIO;
+    goto done;
+  }
+  if (fclose(w->out) != 0)
+  {
+    w->out = NULL;
+    errn = errno;
+    goto done;
+  }
+  w->out = NULL;
+  if (rename(w->tmp_path, w->path) != 0)
+  {
+    errn = errno;
+    goto done;
+  }
+  free(w->tmp_path);
+  w->tmp_path = NULL;
+
+done:
+  if (errn)
+    fprintf(stderr, "ERROR: %d: unable to write index segment %s\n",
+            errn, w->path);
+  seg_writer_free(w);
+  return errn;
+}
+
+static int seg_section_ok(const SegmentHeader *h, uint64_t off, uint64_t len,
+                          uint64_t align)
+{
+  return off >= SEGMENT_HEADER_SIZE && off % align == 0 &&
+         off <= h->file_size && len <= h->file_size - off;
+}
+
+static Segment *segment_open(const char *dir, uint64_t seq, int *error)
+{
+  char *path = seq_path(dir, SEGMENT_FMT, seq);
+  int fd = -1;
+  struct stat st;
+  void *base = MAP_FAILED;
+  const SegmentHeader *h = NULL;
+  const uint8_t *b = NULL;
+  Segment *s = NULL;
+
+  *error = 0;
+  if (!path)
+  {
+    *error = ENOMEM;
+    return NULL;
+  }
+  if ((fd = open(path, O_RDONLY)) < 0 || fstat(fd, &st) != 0)
+  {
+    *error = errno;
+    goto cleanup;
+  }
+  if ((size_t)st.st_size < SEGMENT_HEADER_SIZE)
+  {
+    *error = EINVAL;
+    goto cleanup;
+  }
+  base = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  if (base == MAP_FAILED)
+  {
+    *error = errno;
+    goto cleanup;
+  }
+
+  h = (const SegmentHeader *)base;
+  if (memcmp(h->magic, SEGMENT_MAGIC, sizeof(h->magic)) != 0 ||
+      h->version != SEGMENT_VERSION || h->term_shift != FPINDEX_TERM_SHIFT ||
+      h->file_size > (uint64_t)st.st_size ||
+      h->n_docs > h->file_size / PACKED_FP_SIZE(0) ||
+      h->n_terms > h->file_size / sizeof(uint32_t) ||
+      !seg_section_ok(h, h->off_ids, h->n_docs * sizeof(uint64_t), 8) ||
+      !seg_section_ok(h, h->off_print_off, (h->n_docs + 1) * sizeof(uint64_t), 8) ||
+      !seg_section_ok(h, h->off_post_off, (h->n_terms + 1) * sizeof(uint64_t), 8) ||
+      !seg_section_ok(h, h->off_terms, h->n_terms * sizeof(uint32_t), 4) ||
+      !seg_section_ok(h, h->off_counts, h->n_terms * sizeof(uint32_t), 4))
+  {
+    *error = EINVAL;
+    goto cleanup;
+  }
+  b = (const uint8_t *)base;
+  if (((const uint64_t *)(b + h->off_print_off))[h->n_docs] >
+          h->off_postings - h->off_prints ||
+      ((const uint64_t *)(b + h->off_post_off))[h->n_terms] >
+          h->off_ids - h->off_postings)
+  {
+    *error = EINVAL;
+    goto cleanup;
+  }
+
+  if (!(s = calloc(1, sizeof(*s))))
+  {
+    *error = ENOMEM;
+    goto cleanup;
+  }
+  s->refs = 1;
+  s->seq = seq;
+  s->base = base;
+  s->size = (size_t)st.st_size;
+  s->n_docs = h->n_docs;
+  s->n_terms = h->n_terms;
+  s->prints = b + h->off_prints;
+  s->postings = b + h->off_postings;
+  s->ids = (const uint64_t *)(b + h->off_ids);
+  s->print_off = (const uint64_t *)(b + h->off_print_off);
+  s->terms = (const uint32_t *)(b + h->off_terms);
+  s->counts = (const uint32_t *)(b + h->off_counts);
+  s->post_off = (const uint64_t *)(b + h->off_post_off);
+
+cleanup:
+  if (*error)
+    fprintf(stderr, "ERROR: %d: unable to open index segment %s\n",
+            *error, path);
+  if (fd >= 0)
+    close(fd);
+  if (!s && base != MAP_FAILED)
+    munmap(base, (size_t)st.st_size);
+  free(path);
+  return s;
+}
+
+static void segment_free(Segment *s)
+{
+  munmap(s->base, s->size);
+  free(s);
+}
+
+static inline const uint8_t *segment_print(const Segment *s, uint64_t doc)
+{
+  return s->prints + s->print_off[doc];
+}
+
+////////////////////////////////////////////////////////////
+// Memtables
+////////////////////////////////////////////////////////////
+
+static void memtable_free(MemTable *mt)
+{
+  if (mt->log_fd >= 0)
+    close(mt->log_fd);
+  for (size_t i = 0; i < mt->n_docs; i++)
+    free(mt->prints[i]);
+  for (size_t i = 0; i < mt->map_cap; i++)
+    free(mt->map[i].docs);
+  free(mt->ids);
+  free(mt->prints);
+  free(mt->map);
+  pthread_rwlock_destroy(&mt->lock);
+  free(mt);
+}
+
+static MemTable *memtable_new(uint64_t seq)
+{
+  MemTable *mt = calloc(1, sizeof(*mt));
+
+  if (!mt)
+    return NULL;
+  mt->refs = 1;
+  mt->seq = seq;
+  mt->log_fd = -1;
+  mt->map_cap = 16 * INIT_CAP;
+  mt->map = calloc(mt->map_cap, sizeof(*mt->map));
+  if (!mt->map || pthread_rwlock_init(&mt->lock, NULL) != 0)
+  {
+    free(mt->map);
+    free(mt);
+    return NULL;
+  }
+  return mt;
+}
+
+static MemPosting *memtable_find(MemPosting *map, size_t cap, uint32_t term)
+{
+  // terms are spread well enough by a multiplicative hash
+  size_t i = (size_t)((term * 2654435761U) & (cap - 1));
+
+  while (map[i].docs && map[i].term != term)
+    i = (i + 1) & (cap - 1);
+  return &map[i];
+}
+
+static int memtable_grow_map(MemTable *mt)
+{
+  size_t cap = 2 * mt->map_cap;
+  MemPosting *map = calloc(cap, sizeof(*map));
+
+  if (!map)
+    return ENOMEM;
+  for (size_t i = 0; i < mt->map_cap; i++)
+  {
+    if (mt->map[i].docs)
+      *memtable_find(map, cap, mt->map[i].term) = mt->map[i];
+  }
+  free(mt->map);
+  mt->map = map;
+  mt->map_cap = cap;
+  return 0;
+}
+
+// takes ownership of packed; caller holds the write lock
+static int memtable_insert(MemTable *mt, uint64_t id, uint8_t *packed)
+{
+  const PackedFP *p = (const PackedFP *)packed;
+  uint32_t doc = (uint32_t)mt->n_docs;
+  MemPosting *mp = NULL;
+  void *tmp = NULL;
+  uint32_t term;
+  int errn = 0;
+
+  if (mt->n_docs == mt->cap_docs)
+  {
+    size_t cap = mt->cap_docs ? 2 * mt->cap_docs : INIT_CAP;
+    if (!(tmp = realloc(mt->ids, cap * sizeof(*mt->ids))))
+      return ENOMEM;
+    mt->ids = tmp;
+    if (!(tmp = realloc(mt->prints, cap * sizeof(*mt->prints))))
+      return ENOMEM;
+    mt->prints = tmp;
+    mt->cap_docs = cap;
+  }
+
+  for (uint32_t i = 0; i < p->cprint_len; i++)
+  {
+    if (2 * (mt->map_used + 1) > mt->map_cap && (errn = memtable_grow_map(mt)) != 0)
+      return errn;
+    term = FPINDEX_TERM(p->cprint[i]);
+    mp = memtable_find(mt->map, mt->map_cap, term);
+    if (!mp->docs)
+    {
+      if (!(mp->docs = malloc(4 * sizeof(*mp->docs))))
+        return ENOMEM;
+      mp->term = term;
+      mp->cap = 4;
+      mp->n = 0;
+      mt->map_used++;
+    }
+    // one posting per doc however often the term occurs
+    if (mp->n && mp->docs[mp->n - 1] == doc)
+      continue;
+    if (mp->n == mp->cap)
+    {
+      if (!(tmp = realloc(mp->docs, 2 * mp->cap * sizeof(*mp->docs))))
+        return ENOMEM;
+      mp->docs = tmp;
+      mp->cap *= 2;
+    }
+    mp->docs[mp->n++] = doc;
+  }
+
+  mt->ids[doc] = id;
+  mt->prints[doc] = packed;
+  mt->n_docs++;
+  return 0;
+}
+
+static int log_open(FPIndex *ix, MemTable *mt)
+{
+  char *path = seq_path(ix->path, LOG_FMT, mt->seq);
+
+  if (!path)
+    return ENOMEM;
+  mt->log_fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+  free(path);
+  return mt->log_fd < 0 ? errno : 0;
+}
+
+/* Append one record to the log of mt.  log_replay stops at the first
+ * torn record and cuts everything after it, so a failed write is cut back
+ * to the last whole record before another record may follow it.
+ */
+static int log_append(MemTable *mt, const LogRecord *rec,
+                      const uint8_t *packed, size_t len)
+{
+  int errn = 0;
+
+  if (mt->log_torn)
+  {
+    if (ftruncate(mt->log_fd, (off_t)mt->log_size) != 0)
+      return errno;
+    mt->log_torn = 0;
+  }
+  if ((errn = write_full(mt->log_fd, rec, sizeof(*rec))) != 0 ||
+      (errn = write_full(mt->log_fd, packed, len)) != 0)
+  {
+    if (ftruncate(mt->log_fd, (off_t)mt->log_size) != 0)
+      mt->log_torn = 1;
+    return errn;
+  }
+  mt->log_size += sizeof(*rec) + len;
+  return 0;
+}
+
+// read a log back into a new memtable, cutting off a torn last record
+static MemTable *log_replay(FPIndex *ix, uint64_t seq, int *error)
+{
+  char *path = seq_path(ix->path, LOG_FMT, seq);
+  MemTable *mt = memtable_new(seq);
+  uint8_t *buf = NULL;
+  uint8_t *packed = NULL;
+  struct stat st;
+  LogRecord rec;
+  size_t off = 0;
+  ssize_t n = 0;
+  int fd = -1;
+
+  *error = 0;
+  if (!path || !mt)
+  {
+    *error = ENOMEM;
+    goto error;
+  }
+  if ((fd = open(path, O_RDWR)) < 0 || fstat(fd, &st) != 0)
+  {
+    *error = errno;
+    goto error;
+  }
+  if (!(buf = malloc((size_t)st.st_size + 1)))
+  {
+    *error = ENOMEM;
+    goto error;
+  }
+  for (off = 0; off < (size_t)st.st_size; off += (size_t)n)
+  {
+    n = pread(fd, buf + off, (size_t)st.st_size - off, (off_t)off);
+    if (n < 0 && errno == EINTR)
+    {
+      n = 0;
+      continue;
+    }
+    if (n <= 0)
+    {
+      *error = n < 0 ? errno : EIO;
+      goto error;
+    }
+  }
+
+  off = 0;
+  while (off + sizeof(rec) <= (size_t)st.st_size)
+  {
+    memcpy(&rec, buf + off, sizeof(rec));
+    if (rec.magic != LOG_MAGIC || rec.len < PACKED_FP_SIZE(0) ||
+        rec.len > (size_t)st.st_size - off - sizeof(rec) ||
+        PACKED_FP_SIZE(((const PackedFP *)(buf + off + sizeof(rec)))->cprint_len) != rec.len)
+    {
+      break;
+    }
+    if (!(packed = malloc(rec.len)))
+    {
+      *error = ENOMEM;
+      goto error;
+    }
+    memcpy(packed, buf + off + sizeof(rec), rec.len);
+    if ((*error = memtable_insert(mt, rec.id, packed)) != 0)
+    {
+      free(packed);
+      goto error;
+    }
+    off += sizeof(rec) + rec.len;
+  }
+  if (off < (size_t)st.st_size && ftruncate(fd, (off_t)off) != 0)
+  {
+    *error = errno;
+    goto error;
+  }
+
+  close(fd);
+  free(buf);
+  free(path);
+  return mt;
+
+error:
+  fprintf(stderr, "ERROR: %d: unable to replay index log %s\n",
+          *error, path ? path : "");
+  if (fd >= 0)
+    close(fd);
+  free(buf);
+  free(path);
+  if (mt)
+    memtable_free(mt);
+  return NULL;
+}
+
+////////////////////////////////////////////////////////////
+// Views and refs (all under FPIndex.lock)
+////////////////////////////////////////////////////////////
+
+static void segment_unref(Segment *s)
+{
+  if (--s->refs == 0)
+    segment_free(s);
+}
+
+static void memtable_unref(MemTable *mt)
+{
+  if (--mt->refs == 0)
+    memtable_free(mt);
+}
+
+static void view_unref(View *v)
+{
+  if (--v->refs > 0)
+    return;
+  for (size_t i = 0; i < v->n_segs; i++)
+    segment_unref(v->segs[i]);
+  for (size_t i = 0; i < v->n_frozen; i++)
+    memtable_unref(v->frozen[i]);
+  free(v->segs);
+  free(v->frozen);
+  free(v);
+}
+
+// a view of segs and frozen, taking a ref to each
+static View *view_new(Segment **segs, size_t n_segs, MemTable **frozen,
+                      size_t n_frozen)
+{
+  View *v = calloc(1, sizeof(*v));
+
+  if (!v)
+    return NULL;
+  v->segs = malloc((n_segs ? n_segs : 1) * sizeof(*v->segs));
+  v->frozen = malloc((n_frozen ? n_frozen : 1) * sizeof(*v->frozen));
+  if (!v->segs || !v->frozen)
+  {
+    free(v->segs);
+    free(v->frozen);
+    free(v);
+    return NULL;
+  }
+  v->refs = 1;
+  v->n_segs = n_segs;
+  v->n_frozen = n_frozen;
+  for (size_t i = 0; i < n_segs; i++)
+  {
+    v->segs[i] = segs[i];
+    segs[i]->refs++;
+  }
+  for (size_t i = 0; i < n_frozen; i++)
+  {
+    v->frozen[i] = frozen[i];
+    frozen[i]->refs++;
+  }
+  return v;
+}
+
+static View *view_acquire(FPIndex *ix)
+{
+  View *v = NULL;
+
+  pthread_mutex_lock(&ix->lock);
+  v = ix->view;
+  v->refs++;
+  pthread_mutex_unlock(&ix->lock);
+  return v;
+}
+
+static void view_publish(FPIndex *ix, View *v)
+{
+  View *old = ix->view;
+  ix->view = v;
+  if (old)
+    view_unref(old);
+}
+
+////////////////////////////////////////////////////////////
+// Background flushes and merges
+////////////////////////////////////////////////////////////
+
+static int write_manifest(FPIndex *ix, Segment **segs, size_t n_segs)
+{
+  char *path = join_path(ix->path, MANIFEST_NAME);
+  char *tmp_path = join_path(ix->path, MANIFEST_NAME ".tmp");
+  FILE *out = NULL;
+  int errn = 0;
+
+  if (!path || !tmp_path)
+  {
+    errn = ENOMEM;
+    goto done;
+  }
+  if (!(out = fopen(tmp_path, "w")))
+  {
+    errn = errno;
+    goto done;
+  }
+  fprintf(out, MANIFEST_HEADER "\n");
+  for (size_t i = 0; i < n_segs; i++)
+    fprintf(out, SEGMENT_FMT "\n", (unsigned long long)segs[i]->seq);
+  if (fflush(out) != 0 || fsync(fileno(out)) != 0)
+    errn = errno ? errno : EIO;
+  if (fclose(out) != 0 && !errn)
+    errn = errno;
+  if (!errn && rename(tmp_path, path) != 0)
+    errn = errno;
+  if (!errn)
+    errn = sync_dir(ix->path);
+
+done:
+  if (errn)
+    fprintf(stderr, "ERROR: %d: unable to write index manifest\n", errn);
+  free(path);
+  free(tmp_path);
+  return errn;
+}
+
+static int cmp_term_ix(const void *a, const void *b)
+{
+  uint32_t x = (*(MemPosting *const *)a)->term;
+  uint32_t y = (*(MemPosting *const *)b)->term;
+  return (x > y) - (x < y);
+}
+
+static Segment *flush_memtable(FPIndex *ix, MemTable *mt, int *error)
+{
+  SegWriter *w = NULL;
+  MemPosting **order = NULL;
+  size_t n = 0;
+
+  if (!(w = seg_writer_new(ix->path, mt->seq, mt->n_docs, error)))
+    return NULL;
+  for (size_t i = 0; i < mt->n_docs && !*error; i++)
+    *error = seg_writer_add_doc(w, mt->ids[i], mt->prints[i]);
+
+  if (!*error && !(order = malloc((mt->map_used + 1) * sizeof(*order))))
+    *error = ENOMEM;
+  if (!*error)
+  {
+    for (size_t i = 0; i < mt->map_cap; i++)
+    {
+      if (mt->map[i].docs)
+        order[n++] = &mt->map[i];
+    }
+    qsort(order, n, sizeof(*order), cmp_term_ix);
+    for (size_t i = 0; i < n && !*error; i++)
+      *error = seg_writer_add_term(w, order[i]->term, order[i]->docs,
+                                   order[i]->n);
+  }
+  free(order);
+
+  if (*error)
+  {
+    seg_writer_free(w);
+    return NULL;
+  }
+  if ((*error = seg_writer_close(w)) != 0)
+    return NULL;
+  return segment_open(ix->path, mt->seq, error);
+}
+
+static Segment *merge_segments(FPIndex *ix, Segment **src, size_t n_src,
+                               uint64_t seq, int *error)
+{
+  SegWriter *w = NULL;
+  uint64_t n_docs = 0;
+  uint64_t *cursor = NULL;
+  uint32_t *base = NULL;
+  uint32_t *docs = NULL;
+  size_t docs_cap = 0;
+  uint32_t term, count;
+  void *tmp = NULL;
+
+  *error = 0;
+  for (size_t s = 0; s < n_src; s++)
+    n_docs += src[s]->n_docs;
+  if (n_docs > UINT32_MAX)
+  {
+    *error = EFBIG;
+    return NULL;
+  }
+  cursor = calloc(n_src, sizeof(*cursor));
+  base = calloc(n_src, sizeof(*base));
+  if (!cursor || !base || !(w = seg_writer_new(ix->path, seq, n_docs, error)))
+  {
+    *error = *error ? *error : ENOMEM;
+    goto done;
+  }
+
+  // docs of src[0], then src[1], ...: doc numbers shift by base
+  for (size_t s = 0; s < n_src && !*error; s++)
+  {
+    base[s] = s ? base[s - 1] + (uint32_t)src[s - 1]->n_docs : 0;
+    for (uint64_t d = 0; d < src[s]->n_docs && !*error; d++)
+      *error = seg_writer_add_doc(w, src[s]->ids[d], segment_print(src[s], d));
+  }
+
+  // merge the sorted term lists
+  while (!*error)
+  {
+    int any = 0;
+    term = 0;
+    for (size_t s = 0; s < n_src; s++)
+    {
+      if (cursor[s] < src[s]->n_terms &&
+          (!any || src[s]->terms[cursor[s]] < term))
+      {
+        term = src[s]->terms[cursor[s]];
+        any = 1;
+      }
+    }
+    if (!any)
+      break;
+
+    count = 0;
+    for (size_t s = 0; s < n_src; s++)
+    {
+      if (cursor[s] < src[s]->n_terms && src[s]->terms[cursor[s]] == term)
+        count += src[s]->counts[cursor[s]];
+    }
+    if (count > docs_cap)
+    {
+      if (!(tmp = realloc(docs, count * sizeof(*docs))))
+      {
+        *error = ENOMEM;
+        break;
+      }
+      docs = tmp;
+      docs_cap = count;
+    }
+
+    count = 0;
+    for (size_t s = 0; s < n_src && !*error; s++)
+    {
+      uint64_t t = cursor[s];
+      if (t >= src[s]->n_terms || src[s]->terms[t] != term)
+        continue;
+      if (decode_postings((const uint32_t *)(src[s]->postings + src[s]->post_off[t]),
+                          (src[s]->post_off[t + 1] - src[s]->post_off[t]) / sizeof(uint32_t),
+                          src[s]->counts[t], &docs[count]) != 0)
+      {
+        *error = EINVAL;
+        break;
+      }
+      for (uint32_t i = 0; i < src[s]->counts[t]; i++)
+        docs[count + i] += base[s];
+      count += src[s]->counts[t];
+      cursor[s]++;
+    }
+    if (!*error)
+      *error = seg_writer_add_term(w, term, docs, count);
+  }
+
+  if (*error)
+  {
+    seg_writer_free(w);
+    w = NULL;
+  }
+
+done:
+  free(cursor);
+  free(base);
+  free(docs);
+  if (!w)
+    return NULL;
+  if ((*error = seg_writer_close(w)) != 0)
+    return NULL;
+  return segment_open(ix->path, seq, error);
+}
+
+// size class of a segment: merges combine segments of the same one
+static int segment_tier(const Segment *s)
+{
+  uint64_t n = s->n_docs / FPINDEX_MEMTABLE_DOCS;
+  int tier = 0;
+
+  while (n >= FPINDEX_MERGE_FACTOR)
+  {
+    n /= FPINDEX_MERGE_FACTOR;
+    tier++;
+  }
+  return tier;
+}
+
+// replace the published segment list with segs (owned by the caller) and
+// drop the first n_flushed frozen memtables
+static int publish_segments(FPIndex *ix, Segment **segs, size_t n_segs,
+                            size_t n_flushed)
+{
+  View *v = NULL;
+  int errn = 0;
+
+  if ((errn = write_manifest(ix, segs, n_segs)) != 0)
+    return errn;
+
+  pthread_mutex_lock(&ix->lock);
+  v = view_new(segs, n_segs, ix->view->frozen + n_flushed,
+               ix->view->n_frozen - n_flushed);
+  if (v)
+    view_publish(ix, v);
+  else
+    errn = ENOMEM;
+  pthread_mutex_unlock(&ix->lock);
+
+  return errn;
+}
+
+static int background_flush(FPIndex *ix, MemTable *mt)
+{
+  View *v = NULL;
+  Segment *s = NULL;
+  Segment **segs = NULL;
+  char *log_path = NULL;
+  int errn = 0;
+
+  if (!(s = flush_memtable(ix, mt, &errn)))
+    return errn;
+  // only this thread changes the segment list, so v->segs is current
+  v = view_acquire(ix);
+  if ((segs = malloc((v->n_segs + 1) * sizeof(*segs))))
+  {
+    memcpy(segs, v->segs, v->n_segs * sizeof(*segs));
+    segs[v->n_segs] = s;
+    errn = publish_segments(ix, segs, v->n_segs + 1, 1);
+  }
+  else
+  {
+    errn = ENOMEM;
+  }
+
+  pthread_mutex_lock(&ix->lock);
+  segment_unref(s);
+  view_unref(v);
+  pthread_mutex_unlock(&ix->lock);
+  free(segs);
+  if (errn)
+    return errn;
+
+  // the segment is in the manifest: its log is no longer needed
+  if ((log_path = seq_path(ix->path, LOG_FMT, mt->seq)))
+    unlink(log_path);
+  free(log_path);
+  return 0;
+}
+
+// merge one run of FPINDEX_MERGE_FACTOR segments of a tier; returns 0 with
+// *merged = 0 if there is none
+static int background_merge(FPIndex *ix, int *merged)
+{
+  View *v = view_acquire(ix);
+  Segment *run[FPINDEX_MERGE_FACTOR];
+  Segment **segs = NULL;
+  Segment *s = NULL;
+  size_t n_run = 0;
+  size_t n = 0;
+  size_t r = 0;
+  uint64_t seq = 0;
+  char *path = NULL;
+  int errn = 0;
+
+  *merged = 0;
+  for (size_t i = 0; i < v->n_segs && n_run < FPINDEX_MERGE_FACTOR; i++)
+  {
+    n_run = 0;
+    for (size_t j = i; j < v->n_segs && n_run < FPINDEX_MERGE_FACTOR; j++)
+    {
+      if (segment_tier(v->segs[j]) == segment_tier(v->segs[i]))
+        run[n_run++] = v->segs[j];
+    }
+  }
+  if (n_run < FPINDEX_MERGE_FACTOR)
+    goto done;
+
+  pthread_mutex_lock(&ix->lock);
+  seq = ix->next_seq++;
+  pthread_mutex_unlock(&ix->lock);
+
+  if (!(s = merge_segments(ix, run, n_run, seq, &errn)))
+    goto done;
+  if (!(segs = malloc(v->n_segs * sizeof(*segs))))
+  {
+    errn = ENOMEM;
+    goto done;
+  }
+  // the merged segment takes the place of the first of its run; run is in
+  // list order
+  for (size_t i = 0; i < v->n_segs; i++)
+  {
+    if (r < n_run && v->segs[i] == run[r])
+    {
+      if (r++ == 0)
+        segs[n++] = s;
+    }
+    else
+    {
+      segs[n++] = v->segs[i];
+    }
+  }
+  if ((errn = publish_segments(ix, segs, n, 0)) != 0)
+    goto done;
+
+  // queries still reading the old segments keep their mappings
+  for (size_t i = 0; i < n_run; i++)
+  {
+    if ((path = seq_path(ix->path, SEGMENT_FMT, run[i]->seq)))
+      unlink(path);
+    free(path);
+  }
+  *merged = 1;
+
+done:
+  if (errn && s && (path = seq_path(ix->path, SEGMENT_FMT, seq)))
+  {
+    unlink(path);
+    free(path);
+  }
+  pthread_mutex_lock(&ix->lock);
+  if (s)
+    segment_unref(s);
+  view_unref(v);
+  pthread_mutex_unlock(&ix->lock);
+  free(segs);
+  return errn;
+}
+
+static void *background_run(void *arg)
+{
+  FPIndex *ix = (FPIndex *)arg;
+  MemTable *mt = NULL;
+  int merged = 0;
+  int errn = 0;
+
+  pthread_mutex_lock(&ix->lock);
+  for (;;)
+  {
+    while (!ix->stop && ix->view->n_frozen == 0)
+      pthread_cond_wait(&ix->work, &ix->lock);
+    if (ix->stop)
+      break;
+
+    mt = ix->view->frozen[0];
+    mt->refs++;
+    pthread_mutex_unlock(&ix->lock);
+
+    errn = background_flush(ix, mt);
+    merged = 1;
+    while (!errn && merged && !ix->stop)
+      errn = background_merge(ix, &merged);
+
+    pthread_mutex_lock(&ix->lock);
+    memtable_unref(mt);
+    if (errn)
+    {
+      // keep the logs; the next open retries
+      fprintf(stderr, "ERROR: %d: index background thread stopped\n", errn);
+      ix->bg_error = errn;
+      pthread_cond_broadcast(&ix->flushed);
+      break;
+    }
+    pthread_cond_broadcast(&ix->flushed);
+  }
+  pthread_mutex_unlock(&ix->lock);
+
+  return NULL;
+}
+
+////////////////////////////////////////////////////////////
+// Opening and adding
+////////////////////////////////////////////////////////////
+
+static int cmp_u64(const void *a, const void *b)
+{
+  uint64_t x = *(const uint64_t *)a;
+  uint64_t y = *(const uint64_t *)b;
+  return (x > y) - (x < y);
+}
+
+// seqs of the segments in the manifest (none if there is no manifest yet)
+static int read_manifest(const char *dir, uint64_t **seqs, size_t *n)
+{
+  char *path = join_path(dir, MANIFEST_NAME);
+  FILE *in = NULL;
+  char line[128];
+  unsigned long long seq;
+  size_t cap = 0;
+  void *tmp = NULL;
+  int errn = 0;
+
+  *seqs = NULL;
+  *n = 0;
+  if (!path)
+    return ENOMEM;
+  if (!(in = fopen(path, "r")))
+  {
+    errn = errno == ENOENT ? 0 : errno;
+    free(path);
+    return errn;
+  }
+  if (!fgets(line, sizeof(line), in) ||
+      strncmp(line, MANIFEST_HEADER "\n", sizeof(MANIFEST_HEADER)) != 0)
+  {
+    errn = EINVAL;
+  }
+  while (!errn && fgets(line, sizeof(line), in))
+  {
+    if (sscanf(line, SEGMENT_FMT, &seq) != 1)
+    {
+      errn = EINVAL;
+      break;
+    }
+    if (*n == cap)
+    {
+      cap = cap ? 2 * cap : INIT_CAP;
+      if (!(tmp = realloc(*seqs, cap * sizeof(**seqs))))
+      {
+        errn = ENOMEM;
+        break;
+      }
+      *seqs = tmp;
+    }
+    (*seqs)[(*n)++] = seq;
+  }
+  fclose(in);
+  free(path);
+  if (errn)
+  {
+    free(*seqs);
+    *seqs = NULL;
+    *n = 0;
+  }
+  return errn;
+}
+
+// seqs of the logs in dir, sorted; removes stray temporary files and
+// segments that are not in the manifest
+static int scan_dir(const char *dir, const uint64_t *segs, size_t n_segs,
+                    uint64_t **logs, size_t *n_logs, uint64_t *max_seq)
+{
+  DIR *d = opendir(dir);
+  struct dirent *e = NULL;
+  unsigned long long seq;
+  size_t cap = 0;
+  size_t len = 0;
+  char *path = NULL;
+  void *tmp = NULL;
+  int listed = 0;
+  int errn = 0;
+
+  *logs = NULL;
+  *n_logs = 0;
+  if (!d)
+    return errno;
+  while ((e = readdir(d)) != NULL)
+  {
+    len = strlen(e->d_name);
+    if (len > 4 && strcmp(&e->d_name[len - 4], ".tmp") == 0)
+    {
+      if ((path = join_path(dir, e->d_name)))
+        unlink(path);
+      free(path);
+      path = NULL;
+    }
+    else if (sscanf(e->d_name, SEGMENT_FMT, &seq) == 1 && len == 24)
+    {
+      listed = 0;
+      for (size_t i = 0; i < n_segs; i++)
+        listed |= segs[i] == seq;
+      // written but never published (or merged away): unreferenced
+      if (!listed && (path = join_path(dir, e->d_name)))
+        unlink(path);
+      free(path);
+      path = NULL;
+      if (seq > *max_seq)
+        *max_seq = seq;
+    }
+    else if (sscanf(e->d_name, LOG_FMT, &seq) == 1 && len == 24)
+    {
+      if (seq > *max_seq)
+        *max_seq = seq;
+      listed = 0;
+      for (size_t i = 0; i < n_segs; i++)
+        listed |= segs[i] == seq;
+      // flushed, then interrupted before the log was removed
+      if (listed)
+      {
+        if ((path = join_path(dir, e->d_name)))
+          unlink(path);
+        free(path);
+        path = NULL;
+        continue;
+      }
+      if (*n_logs == cap)
+      {
+        cap = cap ? 2 * cap : INIT_CAP;
+        if (!(tmp = realloc(*logs, cap * sizeof(**logs))))
+        {
+          errn = ENOMEM;
+          break;
+        }
+        *logs = tmp;
+      }
+      (*logs)[(*n_logs)++] = seq;
+    }
+  }
+  closedir(d);
+  if (errn)
+  {
+    free(*logs);
+    *logs = NULL;
+    *n_logs = 0;
+    return errn;
+  }
+  if (*n_logs > 1)
+    qsort(*logs, *n_logs, sizeof(**logs), cmp_u64);
+  return 0;
+}
+
+FPIndex *fpindex_open(const char *path, int *error)
+{
+  FPIndex *ix = NULL;
+  uint64_t *seg_seqs = NULL;
+  uint64_t *log_seqs = NULL;
+  size_t n_segs = 0;
+  size_t n_logs = 0;
+  uint64_t max_seq = 0;
+  Segment **segs = NULL;
+  MemTable **frozen = NULL;
+  size_t n_open = 0;
+  size_t n_frozen = 0;
+  char *log_path = NULL;
+  int locks = 0;
+
+  *error = 0;
+  if (mkdir(path, 0755) != 0 && errno != EEXIST)
+  {
+    *error = errno;
+    fprintf(stderr, "ERROR: %d: unable to create index %s\n", *error, path);
+    return NULL;
+  }
+  if (!(ix = calloc(1, sizeof(*ix))) || !(ix->path = strdup(path)))
+  {
+    *error = ENOMEM;
+    goto error;
+  }
+  if ((*error = read_manifest(path, &seg_seqs, &n_segs)) != 0 ||
+      (*error = scan_dir(path, seg_seqs, n_segs, &log_seqs, &n_logs, &max_seq)) != 0)
+  {
+    goto error;
+  }
+
+  segs = calloc(n_segs + 1, sizeof(*segs));
+  frozen = calloc(n_logs + 1, sizeof(*frozen));
+  if (!segs || !frozen)
+  {
+    *error = ENOMEM;
+    goto error;
+  }
+  for (; n_open < n_segs; n_open++)
+  {
+    if (!(segs[n_open] = segment_open(path, seg_seqs[n_open], error)))
+      goto error;
+  }
+  for (size_t i = 0; i < n_logs; i++)
+  {
+    if (!(frozen[n_frozen] = log_replay(ix, log_seqs[i], error)))
+      goto error;
+    if (frozen[n_frozen]->n_docs > 0)
+    {
+      n_frozen++;
+      continue;
+    }
+    // the log of an active memtable nothing was added to
+    memtable_free(frozen[n_frozen]);
+    if ((log_path = seq_path(path, LOG_FMT, log_seqs[i])))
+      unlink(log_path);
+    free(log_path);
+  }
+
+  if (pthread_mutex_init(&ix->lock, NULL) != 0 ||
+      pthread_mutex_init(&ix->add_lock, NULL) != 0 ||
+      pthread_cond_init(&ix->work, NULL) != 0 ||
+      pthread_cond_init(&ix->flushed, NULL) != 0)
+  {
+    *error = ENOMEM;
+    goto error;
+  }
+  locks = 1;
+  ix->next_seq = max_seq + 1;
+
+  // the view takes its own refs
+  if (!(ix->view = view_new(segs, n_open, frozen, n_frozen)))
+  {
+    *error = ENOMEM;
+    goto error;
+  }
+  for (size_t i = 0; i < n_open; i++)
+    segs[i]->refs--;
+  for (size_t i = 0; i < n_frozen; i++)
+    frozen[i]->refs--;
+  n_open = n_frozen = 0;
+
+  if (!(ix->active = memtable_new(ix->next_seq++)))
+  {
+    *error = ENOMEM;
+    goto error;
+  }
+  if ((*error = log_open(ix, ix->active)) != 0 ||
+      (*error = pthread_create(&ix->thread, NULL, background_run, ix)) != 0)
+  {
+    goto error;
+  }
+
+  free(seg_seqs);
+  free(log_seqs);
+  free(segs);
+  free(frozen);
+  return ix;
+
+error:
+  fprintf(stderr, "ERROR: %d: unable to open index %s\n", *error, path);
+  for (size_t i = 0; i < n_open; i++)
+    segment_free(segs[i]);
+  for (size_t i = 0; i < n_frozen; i++)
+    memtable_free(frozen[i]);
+  if (ix)
+  {
+    if (ix->view)
+      view_unref(ix->view);
+    if (ix->active)
+      memtable_free(ix->active);
+    if (locks)
+    {
+      pthread_mutex_destroy(&ix->lock);
+      pthread_mutex_destroy(&ix->add_lock);
+      pthread_cond_destroy(&ix->work);
+      pthread_cond_destroy(&ix->flushed);
+    }
+    free(ix->path);
+    free(ix);
+  }
+  free(seg_seqs);
+  free(log_seqs);
+  free(segs);
+  free(frozen);
+  return NULL;
+}
+
+void fpindex_close(FPIndex *ix)
+{
+  if (!ix)
+    return;
+
+  pthread_mutex_lock(&ix->lock);
+  ix->stop = 1;
+  pthread_cond_broadcast(&ix->work);
+  pthread_mutex_unlock(&ix->lock);
+  pthread_join(ix->thread, NULL);
+
+  view_unref(ix->view);
+  memtable_unref(ix->active);
+  fpqcache_free(ix->qcache);
+  pthread_mutex_destroy(&ix->lock);
+  pthread_mutex_destroy(&ix->add_lock);
+  pthread_cond_destroy(&ix->work);
+  pthread_cond_destroy(&ix->flushed);
+  free(ix->path);
+  free(ix);
+}
+
+// hand the active memtable to the background thread; add_lock held
+static int freeze_active(FPIndex *ix)
+{
+  MemTable *mt = NULL;
+  View *v = NULL;
+  View *old = NULL;
+  int errn = 0;
+
+  pthread_mutex_lock(&ix->lock);
+  mt = memtable_new(ix->next_seq++);
+  pthread_mutex_unlock(&ix->lock);
+  if (!mt)
+    return ENOMEM;
+  if ((errn = log_open(ix, mt)) != 0)
+  {
+    memtable_free(mt);
+    return errn;
+  }
+
+  pthread_mutex_lock(&ix->lock);
+  old = ix->view;
+  v = view_new(old->segs, old->n_segs, old->frozen, old->n_frozen);
+  if (v)
+  {
+    // append the active memtable, moving its ref from ix->active
+    void *tmp = realloc(v->frozen, (v->n_frozen + 1) * sizeof(*v->frozen));
+    if (tmp)
+    {
+      v->frozen = tmp;
+      v->frozen[v->n_frozen++] = ix->active;
+      ix->active = mt;
+      view_publish(ix, v);
+      pthread_cond_signal(&ix->work);
+      mt = NULL;
+    }
+    else
+    {
+      view_unref(v);
+    }
+  }
+  pthread_mutex_unlock(&ix->lock);
+
+  if (mt)
+  {
+    memtable_free(mt);
+    return ENOMEM;
+  }
+  return 0;
+}
+
+int fpindex_add(FPIndex *ix, uint64_t id, const FPrint *fp)
+{
+  uint8_t *packed = NULL;
+  LogRecord rec;
+  size_t len = 0;
+  int errn = 0;
+
+  if (fp->cprint_len == 0 || (fprint_missing(fp) & FP_MISSING_CHROMA))
+    return EINVAL;
+  if (!(packed = fprint_to_bytes(fp)))
+    return ENOMEM;
+  len = PACKED_FP_SIZE(fp->cprint_len);
+
+  pthread_mutex_lock(&ix->add_lock);
+
+  rec.magic = LOG_MAGIC;
+  rec.len = (uint32_t)len;
+  rec.id = id;
+  if ((errn = log_append(ix->active, &rec, packed, len)) != 0)
+  {
+    free(packed);
+    goto done;
+  }
+
+  pthread_rwlock_wrlock(&ix->active->lock);
+  errn = memtable_insert(ix->active, id, packed);
+  pthread_rwlock_unlock(&ix->active->lock);
+  if (errn)
+  {
+    free(packed);
+    goto done;
+  }
+  if (ix->qcache)
+    fpqcache_invalidate(ix->qcache);
+
+  if (ix->active->n_docs >= FPINDEX_MEMTABLE_DOCS)
+    errn = freeze_active(ix);
+
+done:
+  pthread_mutex_unlock(&ix->add_lock);
+  return errn;
+}
+
+int fpindex_flush(FPIndex *ix)
+{
+  int errn = 0;
+
+  pthread_mutex_lock(&ix->add_lock);
+  if (ix->active->n_docs > 0)
+    errn = freeze_active(ix);
+  pthread_mutex_unlock(&ix->add_lock);
+  if (errn)
+    return errn;
+
+  pthread_mutex_lock(&ix->lock);
+  while (ix->view->n_frozen > 0 && !ix->bg_error)
+    pthread_cond_wait(&ix->flushed, &ix->lock);
+  errn = ix->bg_error;
+  pthread_mutex_unlock(&ix->lock);
+
+  return errn;
+}
+
+////////////////////////////////////////////////////////////
+// Queries
+////////////////////////////////////////////////////////////
+
+typedef struct
+{
+  const FPrint *q;
+  const uint32_t *terms;
+  size_t n_terms;
+  double min_score;
+  // doc numbers of every posting of the query terms
+  uint32_t *docs;
+  size_t n_docs;
+  size_t cap_docs;
+  Candidate *cands;
+  size_t cap_cands;
+  FPIndexHit *hits;
+  size_t n_hits;
+  size_t cap_hits;
+} Query;
+
+static int query_reserve(Query *qs, size_t more)
+{
+  size_t cap = qs->cap_docs ? qs->cap_docs : 1024;
+  void *tmp = NULL;
+
+  if (qs->n_docs + more <= qs->cap_docs)
+    return 0;
+  while (cap < qs->n_docs + more)
+    cap *= 2;
+  if (!(tmp = realloc(qs->docs, cap * sizeof(*qs->docs))))
+    return ENOMEM;
+  qs->docs = tmp;
+  qs->cap_docs = cap;
+  return 0;
+}
+
+static int cmp_cand_desc(const void *a, const void *b)
+{
+  const Candidate *x = (const Candidate *)a;
+  const Candidate *y = (const Candidate *)b;
+  if (x->hits != y->hits)
+    return (x->hits < y->hits) - (x->hits > y->hits);
+  return (x->doc > y->doc) - (x->doc < y->doc);
+}
+
+// the docs sharing the most terms with the query; returns their number
+static size_t query_candidates(Query *qs)
+{
+  size_t n = 0;
+  void *tmp = NULL;
+
+  if (qs->n_docs == 0)
+    return 0;
+  qsort(qs->docs, qs->n_docs, sizeof(*qs->docs), cmp_u32);
+  for (size_t i = 0, j = 0; i < qs->n_docs; i = j)
+  {
+    while (j < qs->n_docs && qs->docs[j] == qs->docs[i])
+      j++;
+    if (j - i < FPINDEX_MIN_TERM_HITS)
+      continue;
+    if (n == qs->cap_cands)
+    {
+      size_t cap = qs->cap_cands ? 2 * qs->cap_cands : INIT_CAP;
+      if (!(tmp = realloc(qs->cands, cap * sizeof(*qs->cands))))
+        break;
+      qs->cands = tmp;
+      qs->cap_cands = cap;
+    }
+    qs->cands[n].doc = qs->docs[i];
+    qs->cands[n].hits = (uint32_t)(j - i);
+    n++;
+  }
+  if (n > 1)
+    qsort(qs->cands, n, sizeof(*qs->cands), cmp_cand_desc);
+  qs->n_docs = 0;
+
+  return n < FPINDEX_MAX_CANDIDATES ? n : FPINDEX_MAX_CANDIDATES;
+}
+
+static void query_score(Query *qs, uint64_t id, const uint8_t *packed)
+{
+  const PackedFP *p = (const PackedFP *)packed;
+  FPrint *fp = NULL;
+  double score = 0.0;
+  void *tmp = NULL;
+
+  if (!FP_SONGLEN_MAY_MATCH(qs->q->songlen, p->songlen) ||
+      !(fp = fprint_from_bytes(packed)))
+  {
+    return;
+  }
+  score = match_cpfm((FPrint *)qs->q, fp);
+  free_fprint(fp);
+  if (score <= qs->min_score)
+    return;
+
+  if (qs->n_hits == qs->cap_hits)
+  {
+    size_t cap = qs->cap_hits ? 2 * qs->cap_hits : INIT_CAP;
+    if (!(tmp = realloc(qs->hits, cap * sizeof(*qs->hits))))
+      return;
+    qs->hits = tmp;
+    qs->cap_hits = cap;
+  }
+  qs->hits[qs->n_hits].id = id;
+  qs->hits[qs->n_hits].score = score;
+  qs->n_hits++;
+}
+
+static void query_segment(Query *qs, const Segment *s)
+{
+  uint64_t stop = s->n_docs / STOP_TERM_DIVISOR;
+  size_t lo, hi, mid, n;
+
+  if (stop < STOP_TERM_MIN)
+    stop = STOP_TERM_MIN;
+
+  for (size_t t = 0; t < qs->n_terms; t++)
+  {
+    lo = 0;
+    hi = s->n_terms;
+    while (lo < hi)
+    {
+      mid = lo + (hi - lo) / 2;
+      if (s->terms[mid] < qs->terms[t])
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+    if (lo == s->n_terms || s->terms[lo] != qs->terms[t] || s->counts[lo] > stop)
+      continue;
+    if (query_reserve(qs, s->counts[lo]) != 0)
+      break;
+    if (decode_postings((const uint32_t *)(s->postings + s->post_off[lo]),
+                        (s->post_off[lo + 1] - s->post_off[lo]) / sizeof(uint32_t),
+                        s->counts[lo], &qs->docs[qs->n_docs]) == 0)
+    {
+      qs->n_docs += s->counts[lo];
+    }
+  }
+
+  n = query_candidates(qs);
+  for (size_t i = 0; i < n; i++)
+  {
+    if (qs->cands[i].doc < s->n_docs)
+      query_score(qs, s->ids[qs->cands[i].doc], segment_print(s, qs->cands[i].doc));
+  }
+}
+
+static void query_memtable(Query *qs, MemTable *mt)
+{
+  MemPosting *mp = NULL;
+  size_t n;
+
+  pthread_rwlock_rdlock(&mt->lock);
+  for (size_t t = 0; t < qs->n_terms; t++)
+  {
+    mp = memtable_find(mt->map, mt->map_cap, qs->terms[t]);
+    if (!mp->docs || query_reserve(qs, mp->n) != 0)
+      continue;
+    memcpy(&qs->docs[qs->n_docs], mp->docs, mp->n * sizeof(*mp->docs));
+    qs->n_docs += mp->n;
+  }
+  n = query_candidates(qs);
+  for (size_t i = 0; i < n; i++)
+    query_score(qs, mt->ids[qs->cands[i].doc], mt->prints[qs->cands[i].doc]);
+  pthread_rwlock_unlock(&mt->lock);
+}
+
+static int cmp_hit_desc(const void *a, const void *b)
+{
+  double sa = ((const FPIndexHit *)a)->score;
+  double sb = ((const FPIndexHit *)b)->score;
+  return (sa < sb) - (sa > sb);
+}
+
+static double now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// the search itself: fill hits (room for k) and return their number
+static size_t query_search(FPIndex *ix, const FPrint *q, size_t k,
+                           double min_score, FPIndexHit *hits)
+{
+  Query qs;
+  uint32_t *terms = NULL;
+  View *v = NULL;
+  MemTable *active = NULL;
+  size_t n = 0;
+
+  if (!(terms = malloc(q->cprint_len * sizeof(*terms))))
+    return 0;
+
+  memset(&qs, 0, sizeof(qs));
+  qs.q = q;
+  qs.terms = terms;
+  qs.n_terms = cprint_terms(q->cprint, q->cprint_len, terms);
+  qs.min_score = min_score;
+
+  pthread_mutex_lock(&ix->lock);
+  v = ix->view;
+  v->refs++;
+  active = ix->active;
+  active->refs++;
+  pthread_mutex_unlock(&ix->lock);
+
+  for (size_t i = 0; i < v->n_segs; i++)
+    query_segment(&qs, v->segs[i]);
+  for (size_t i = 0; i < v->n_frozen; i++)
+    query_memtable(&qs, v->frozen[i]);
+  query_memtable(&qs, active);
+
+  pthread_mutex_lock(&ix->lock);
+  view_unref(v);
+  memtable_unref(active);
+  pthread_mutex_unlock(&ix->lock);
+
+  if (qs.n_hits > 1)
+    qsort(qs.hits, qs.n_hits, sizeof(*qs.hits), cmp_hit_desc);
+  n = qs.n_hits < k ? qs.n_hits : k;
+  if (n)
+    memcpy(hits, qs.hits, n * sizeof(*hits));
+
+  free(terms);
+  free(qs.docs);
+  free(qs.cands);
+  free(qs.hits);
+  return n;
+}
+
+size_t fpindex_query(FPIndex *ix, const FPrint *q, size_t k,
+                     double min_score, FPIndexHit *hits)
+{
+  FPQCacheHit *cached = NULL;
+  uint64_t generation = 0;
+  double t0 = 0.0;
+  size_t n = 0;
+
+  if (k == 0 || q->cprint_len == 0)
+    return 0;
+  if (!ix->qcache || !(cached = malloc(k * sizeof(*cached))))
+    return query_search(ix, q, k, min_score, hits);
+
+  if (fpqcache_get(ix->qcache, q, k, min_score, cached, &n))
+  {
+    for (size_t i = 0; i < n; i++)
+    {
+      hits[i].id = cached[i].id;
+      hits[i].score = cached[i].score;
+    }
+    free(cached);
+    return n;
+  }
+
+  // before the search, so an add during it keeps the result out
+  generation = fpqcache_generation(ix->qcache);
+  t0 = now();
+  n = query_search(ix, q, k, min_score, hits);
+  for (size_t i = 0; i < n; i++)
+  {
+    cached[i].id = hits[i].id;
+    cached[i].score = hits[i].score;
+  }
+  fpqcache_put(ix->qcache, generation, q, k, min_score, cached, n, now() - t0);
+  free(cached);
+
+  return n;
+}
+
+int fpindex_enable_cache(FPIndex *ix, size_t entries)
+{
+  if (ix->qcache)
+    return EBUSY;
+  if (!(ix->qcache = fpqcache_new(entries)))
+    return ENOMEM;
+  return 0;
+}
+
+void fpindex_cache_stats(FPIndex *ix, FPQCacheStats *st)
+{
+  if (ix->qcache)
+    fpqcache_stats(ix->qcache, st);
+  else
+    memset(st, 0, sizeof(*st));
+}
+
+uint64_t fpindex_count(FPIndex *ix)
+{
+  uint64_t n = 0;
+
+  pthread_mutex_lock(&ix->lock);
+  for (size_t i = 0; i < ix->view->n_segs; i++)
+    n += ix->view->segs[i]->n_docs;
+  for (size_t i = 0; i < ix->view->n_frozen; i++)
+    n += ix->view->frozen[i]->n_docs;
+  // n_docs of the active memtable only grows; a stale read is harmless
+  pthread_rwlock_rdlock(&ix->active->lock);
+  n += ix->active->n_docs;
+  pthread_rwlock_unlock(&ix->active->lock);
+  pthread_mutex_unlock(&ix->lock);
+
+  return n;
+}
@@ -0,0 +1,121 @@
+/*
+ *  fpindex.h
+ *
+ *  persistent inverted index from chromaprint terms to fingerprints
+ *
+ *  An index is a directory of immutable segment files plus a small
+ *  in-memory segment for recent additions, LSM-style:
+ *
+ *   - fpindex_add appends to a log and to the in-memory segment; when that
+ *     holds FPINDEX_MEMTABLE_DOCS fingerprints it is frozen and a new one
+ *     started, so adding never waits on disk
+ *   - a background thread writes frozen segments to disk and merges runs of
+ *     FPINDEX_MERGE_FACTOR similar-sized segments into one
+ *   - queries work on a snapshot of the segment list and never wait for a
+ *     flush or a merge
+ *
+ *  Opening an index maps its segments and replays the logs of segments that
+ *  were never flushed, so it takes milliseconds however large the index, and
+ *  the index may be larger than memory.
+ *
+ *  A query collects the fingerprints sharing the most cprint terms with it
+ *  and scores those candidates with match_cpfm.
+ *
+ *  Copyright 2010 Zatisfi, LLC. MIT License, 2025
+ */
+
+#ifndef _FPINDEX_H
+#define _FPINDEX_H
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "fplib.h"
+#include "fpqcache.h"
+
+// a term is a cprint value without its low bits, which flip most often
+// between encodings of the same song
+#define FPINDEX_TERM_SHIFT 4
+#define FPINDEX_TERM(cp) ((uint32_t)(cp) >> FPINDEX_TERM_SHIFT)
+
+// fingerprints in the in-memory segment before it is frozen
+#define FPINDEX_MEMTABLE_DOCS 4096
+// segments of about the same size that are merged together
+#define FPINDEX_MERGE_FACTOR 4
+// candidates per segment scored with match_cpfm
+#define FPINDEX_MAX_CANDIDATES 64
+// a candidate must share at least this many terms with the query
+#define FPINDEX_MIN_TERM_HITS 2
+
+  typedef struct FPIndex FPIndex;
+
+  typedef struct FPIndexHit
+  {
+    uint64_t id;
+    double score;
+  } FPIndexHit;
+
+  /*! fpindex_open
+   *  \brief open the index in directory path, creating it if needed, and
+   *  start its background thread.  Returns NULL and sets *error to an errno
+   *  value on failure.
+   */
+  FPIndex *fpindex_open(const char *path, int *error);
+
+  /*! fpindex_close
+   *  \brief stop the background thread and free the index.  Fingerprints
+   *  not yet in a segment file are kept in the logs and come back on the
+   *  next open.
+   */
+  void fpindex_close(FPIndex *ix);
+
+  /*! fpindex_add
+   *  \brief add a fingerprint under id; returns 0 or an errno value
+   *  (EINVAL for a fingerprint without a chromaprint).  Adding an id again
+   *  adds a second entry.  The log is written but not synced: an entry
+   *  survives the process crashing, not the machine.
+   */
+  int fpindex_add(FPIndex *ix, uint64_t id, const FPrint *fp);
+
+  /*! fpindex_query
+   *  \brief fill hits (room for k) with the best entries scoring above
+   *  min_score, best first; returns the number of hits
+   */
+  size_t fpindex_query(FPIndex *ix, const FPrint *q, size_t k,
+                       double min_score, FPIndexHit *hits);
+
+  /*! fpindex_flush
+   *  \brief freeze the in-memory segment and wait until every frozen
+   *  segment is on disk; returns 0 or an errno value
+   */
+  int fpindex_flush(FPIndex *ix);
+
+  /*! fpindex_enable_cache
+   *  \brief keep the results of about entries recent queries (see
+   *  fpqcache.h); every fpindex_add invalidates them.  Call before querying
+   *  from other threads.  Returns 0, EBUSY if there already is a cache, or
+   *  ENOMEM.
+   */
+  int fpindex_enable_cache(FPIndex *ix, size_t entries);
+
+  /*! fpindex_cache_stats
+   *  \brief hits, misses and time saved by the query cache; all zero
+   *  without one
+   */
+  void fpindex_cache_stats(FPIndex *ix, FPQCacheStats *st);
+
+  /*! fpindex_count
+   *  \brief number of entries, on disk and in memory
+   */
+  uint64_t fpindex_count(FPIndex *ix);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _FPINDEX_H */
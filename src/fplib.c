@@ -24,7 +24,10 @@
 #include <libfooid/fooid.h>
 
 #include "chromaw.h"
+#include "fpcache.h"
 #include "fplib.h"
+#include "fpmatch.h"
+#include "fpstage.h"
 
 #if LIBAVCODEC_VERSION_MAJOR < 52
 #error "This library requires ffmpeg version >= 53"
@@ -35,14 +38,10 @@
 #define STD_CHANNELS 1
 #define STD_SAMPLE_RATE 44100
 
-// record at most a minute of audio
-#define SAMPLE_TIME_LIMIT 60
+// size of the libfooid sample buffer (SSIZE in libfooid/common.h)
+#define FOOID_MAX_SAMPLES (8000 * 100)
 
-// R is scaled (max 25,056: 2x what reference (java) lib has)
-#define MAX_RDIFF (9 * R_SIZE * CHAR_BIT)
-// reference calculated max diff arithmetically
-#define MAX_DOMDIFF (DOM_SIZE * CHAR_BIT)
-#define MAX_TOTDIFF (MAX_RDIFF + MAX_DOMDIFF)
+#define MAX_TOTDIFF FPMATCH_MAX_TOTDIFF
 #define U32_BITS 32
 
 #if defined(_64_BIT) || defined(__APPLE__)
@@ -91,376 +90,1091 @@ void ffmpeg_init(void)
   av_register_all();
 }
 
-FPrint *get_fingerprint(const char *filename, int *error, int verbose)
+void fp_options_init(FPOptions *opts)
+{
+  memset(opts, 0, sizeof(*opts));
+  opts->extractors = FP_EXTRACT_ALL;
+  opts->duration = FP_DEFAULT_DURATION;
+}
+
+void fp_options_preview(FPOptions *opts)
+{
+  fp_options_init(opts);
+  opts->extractors = FP_EXTRACT_CHROMA;
+  opts->duration = FP_PREVIEW_DURATION;
+}
+
+// copy the extracted parts into p_fprint; fid or cprint is NULL for an
+// extractor that did not run
+static void fill_fprint_parts(FPrint *p_fprint, const t_fooid *fid,
+                              const int32_t *cprint, size_t cprint_len)
+{
+  p_fprint->missing = 0;
+  if (fid)
+  {
+    memcpy(p_fprint->r, fid->fp.r, R_SIZE * sizeof(uint8_t));
+    memcpy(p_fprint->dom, fid->fp.dom, DOM_SIZE * sizeof(uint8_t));
+  }
+  else
+  {
+    p_fprint->missing |= FP_MISSING_FOOID;
+  }
+  if (cprint)
+  {
+    memcpy(p_fprint->cprint, cprint, cprint_len * sizeof(*cprint));
+  }
+  else
+  {
+    p_fprint->cprint_len = 0;
+    p_fprint->missing |= FP_MISSING_CHROMA;
+  }
+}
+
+// copy what fp_calculate and chroma_calculate consume; must run before
+// fp_calculate, which windows fid->samples in place
+static FPFeatures *capture_features(const t_fooid *fid,
+                                    ChromaFingerprinter cpr,
+                                    int32_t fooid_len)
+{
+  FPFeatures *f = NULL;
+  double *image = NULL;
+  size_t n_rows = 0;
+  int errn = 0;
+
+  image = chroma_get_image(cpr, &errn, &n_rows);
+  if (!image)
+    return NULL;
+
+  f = fpcache_new_features((size_t)fid->outpos, n_rows);
+  if (!f)
+  {
+    free(image);
+    return NULL;
+  }
+  f->fooid_len = fooid_len;
+  f->fooid_soundfound = fid->soundfound;
+  for (size_t i = 0; i < f->fooid_n_samples; i++)
+  {
+    float v = fmaxf(fminf(fid->samples[i], 1.0f), -1.0f);
+    f->fooid_samples[i] = (int16_t)lrintf(v * 32767.0f);
+  }
+  for (size_t i = 0; i < n_rows * CHROMA_IMAGE_COLUMNS; i++)
+  {
+    double v = fmax(fmin(image[i], 1.0), 0.0);
+    f->chroma[i] = (uint16_t)lrint(v * 65535.0);
+  }
+
+  free(image);
+  return f;
+}
+
+// rebuild a fingerprint from cached features without touching the audio
+static FPrint *fprint_from_features(const FPFeatures *f, int extractors,
+                                    int *error)
 {
-  int errn;
-  AVFormatContext *ic = NULL;
-  AVStream *st = NULL;
-  int n_streams;
-  AVCodecContext *cxt = NULL;
-  AVCodec *dec_codec = NULL;
-  ReSampleContext *resample = NULL;
-  int n_samples = 0;
-  int dec_sample_limit = 0;
-  AVPacket pkt;
-  int32_t len, dec_size, out_size;
-  uint32_t last_size, min_size;
-  int16_t *raw_buf = NULL;
-  int16_t *audio_buf = NULL;
-  int samplerate, channels;
   t_fooid *fid = NULL;
   uint8_t *fp_buf = NULL;
-  float *fp_dbl_buf = NULL;
-  int fp_size = 0;
-  int ibps_sz = 0;
-  int obps_sz = 0;
-  FPrint *p_fprint = NULL;
-  int32_t music_errors = 0;
-  int fooid_stopped = 0;
-  ChromaFingerprinter cpr = NULL;
-  size_t cprint_len = 0;
+  double *image = NULL;
   int32_t *cprint = NULL;
+  size_t cprint_len = 0;
+  FPrint *p_fprint = NULL;
+  int errn = 0;
 
-  // final NULL uses default parameters
+  *error = 1;
+
+  if (extractors & FP_EXTRACT_FOOID)
+  {
+    fid = fp_init(STD_SAMPLE_RATE, STD_CHANNELS);
+    if (!fid)
+    {
+      fprintf(stderr, "ERROR: initializing fooid\n");
+      fflush(stderr);
+      goto cleanup;
+    }
+    fp_buf = (uint8_t *)malloc(fp_getsize(fid));
+    if (!fp_buf)
+    {
+      *error = ENOMEM;
+      goto cleanup;
+    }
+    // fid->samples holds FOOID_MAX_SAMPLES
+    if (f->fooid_n_samples > FOOID_MAX_SAMPLES)
+    {
+      fprintf(stderr, "ERROR: %lu cached fooid samples\n",
+              (unsigned long)f->fooid_n_samples);
+      goto cleanup;
+    }
+
+    for (size_t i = 0; i < f->fooid_n_samples; i++)
+    {
+      fid->samples[i] = (float)f->fooid_samples[i] / 32767.0f;
+    }
+    fid->outpos = (int)f->fooid_n_samples;
+    fid->soundfound = f->fooid_soundfound;
+    if ((errn = fp_calculate(fid, f->fooid_len, fp_buf)) < 0)
+    {
+      fprintf(stderr, "ERROR: %d calculating fingerprint\n", errn);
+      fflush(stderr);
+      goto cleanup;
+    }
+  }
+
+  if (extractors & FP_EXTRACT_CHROMA)
+  {
+    image = (double *)malloc((f->chroma_rows ? f->chroma_rows : 1) *
+                             CHROMA_IMAGE_COLUMNS * sizeof(*image));
+    if (!image)
+    {
+      *error = ENOMEM;
+      goto cleanup;
+    }
+    for (size_t i = 0; i < f->chroma_rows * CHROMA_IMAGE_COLUMNS; i++)
+    {
+      image[i] = (double)f->chroma[i] / 65535.0;
+    }
+    cprint = chroma_calculate_image(image, f->chroma_rows, &errn,
+                                    &cprint_len);
+    if (errn != 0)
+    {
+      fprintf(stderr, "ERROR: %d calculating chromaprint\n", errn);
+      if (errn == ENOMEM)
+        *error = ENOMEM;
+      goto cleanup;
+    }
+  }
+
+  p_fprint = new_fprint((int)cprint_len);
+  if (!p_fprint)
+  {
+    *error = ENOMEM;
+    goto cleanup;
+  }
+  p_fprint->songlen = f->songlen;
+  p_fprint->cprint_len = cprint_len;
+  p_fprint->bit_rate = f->bit_rate;
+  p_fprint->num_errors = f->num_errors;
+  fill_fprint_parts(p_fprint, fid, cprint, cprint_len);
+
+  *error = 0;
+
+cleanup:
+  if (cprint)
+    free(cprint);
+  if (image)
+    free(image);
+  if (fp_buf)
+    free(fp_buf);
+  if (fid)
+    fp_free(fid);
+
+  return p_fprint;
+}
+
+// XXH64's round and avalanche constants; one lane is plenty, since reading
+// the packets costs more than hashing them
+#define HASH_P1 11400714785074694791ULL
+#define HASH_P2 14029467366897019727ULL
+#define HASH_P3 1609587929392839161ULL
+#define HASH_P4 9650029242287828579ULL
+#define HASH_P5 2870177450012600261ULL
+
+// bytes held back from the hash until the end of the stream, where
+// trailing tags are looked for
+#define HASH_TAIL_SIZE (256 * 1024)
+#define ID3V1_SIZE 128
+#define APE_FOOTER_SIZE 32
+#define APE_HAS_HEADER 0x80000000U
+
+static inline uint64_t rotl64(uint64_t x, int r)
+{
+  return (x << r) | (x >> (64 - r));
+}
+
+// hash the whole 8-byte words of p; returns the number of bytes consumed
+static size_t hash_words(uint64_t *h, const uint8_t *p, size_t len)
+{
+  uint64_t k;
+  size_t n = len & ~(size_t)7;
+
+  for (size_t i = 0; i < n; i += 8)
+  {
+    memcpy(&k, p + i, sizeof(k));
+    k *= HASH_P2;
+    k = rotl64(k, 31) * HASH_P1;
+    *h ^= k;
+    *h = rotl64(*h, 27) * HASH_P1 + HASH_P4;
+  }
+  return n;
+}
+
+static uint64_t hash_final(uint64_t h, const uint8_t *p, size_t len,
+                           uint64_t total)
+{
+  size_t n = hash_words(&h, p, len);
+
+  for (; n < len; n++)
+  {
+    h ^= p[n] * HASH_P5;
+    h = rotl64(h, 11) * HASH_P1;
+  }
+  h += total;
+  h ^= h >> 33;
+  h *= HASH_P2;
+  h ^= h >> 29;
+  h *= HASH_P3;
+  h ^= h >> 32;
+  return h;
+}
+
+static inline uint32_t read_le32(const uint8_t *p)
+{
+  return (uint32_t)p[0] | ((uint32_t)p[1] << 8) |
+         ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+// length of p without the ID3v1 and APEv2 tags at its end
+static size_t strip_trailing_tags(const uint8_t *p, size_t len)
+{
+  uint32_t tag_size;
+
+  for (;;)
+  {
+    if (len >= ID3V1_SIZE && memcmp(&p[len - ID3V1_SIZE], "TAG", 3) == 0)
+    {
+      len -= ID3V1_SIZE;
+      continue;
+    }
+    if (len >= APE_FOOTER_SIZE &&
+        memcmp(&p[len - APE_FOOTER_SIZE], "APETAGEX", 8) == 0)
+    {
+      // the size in the footer counts the items and the footer
+      tag_size = read_le32(&p[len - APE_FOOTER_SIZE + 12]);
+      if (read_le32(&p[len - APE_FOOTER_SIZE + 20]) & APE_HAS_HEADER)
+        tag_size += APE_FOOTER_SIZE;
+      if (tag_size >= APE_FOOTER_SIZE && tag_size <= len)
+      {
+        len -= tag_size;
+        continue;
+      }
+    }
+    return len;
+  }
+}
+
+int fp_audio_hash(const char *filename, uint64_t *hash)
+{
+  AVFormatContext *ic = NULL;
+  AVPacket pkt;
+  int st_ix = -1;
+  int errn = 0;
+  uint64_t h = HASH_P5;
+  uint64_t total = 0;
+  uint64_t codec_id = 0;
+  uint8_t *tail = NULL;
+  uint8_t *tmp = NULL;
+  size_t tail_len = 0;
+  size_t tail_cap = 2 * HASH_TAIL_SIZE;
+  size_t n = 0;
+
+  *hash = 0;
   if ((errn = avformat_open_input(&ic, filename, NULL, NULL)) != 0 || !ic)
+    return errn ? errn : ENOMEM;
+
+  // the headers name the streams of most music containers; only probe
+  // packets when they do not
+  st_ix = av_find_best_stream(ic, AVMEDIA_TYPE_AUDIO, -1, -1, NULL, 0);
+  if (st_ix < 0 && avformat_find_stream_info(ic, NULL) >= 0)
+    st_ix = av_find_best_stream(ic, AVMEDIA_TYPE_AUDIO, -1, -1, NULL, 0);
+  if (st_ix < 0)
+  {
+    errn = st_ix;
+    goto cleanup;
+  }
+  for (unsigned int i = 0; i < ic->nb_streams; i++)
+  {
+    if ((int)i != st_ix)
+      ic->streams[i]->discard = AVDISCARD_ALL;
+  }
+
+  if (!(tail = malloc(tail_cap)))
+  {
+    errn = ENOMEM;
+    goto cleanup;
+  }
+  codec_id = (uint64_t)ic->streams[st_ix]->codec->codec_id;
+  hash_words(&h, (const uint8_t *)&codec_id, sizeof(codec_id));
+
+  // hash the payloads as one stream, so demuxers that cut it into
+  // arbitrary packets (raw MP3) still agree
+  for (;;)
+  {
+    av_init_packet(&pkt);
+    errn = av_read_frame(ic, &pkt);
+    if (errn == AVERROR(EAGAIN))
+    {
+      av_free_packet(&pkt);
+      continue;
+    }
+    else if (errn < 0)
+    {
+      av_free_packet(&pkt);
+      errn = 0;
+      break;
+    }
+    if (pkt.stream_index != st_ix || pkt.size <= 0)
+    {
+      av_free_packet(&pkt);
+      continue;
+    }
+
+    if (tail_len + pkt.size > tail_cap)
+    {
+      // keep the last HASH_TAIL_SIZE bytes (or more, to a whole word)
+      if (tail_len > HASH_TAIL_SIZE)
+      {
+        n = hash_words(&h, tail, tail_len - HASH_TAIL_SIZE);
+        memmove(tail, tail + n, tail_len - n);
+        tail_len -= n;
+        total += n;
+      }
+      if (tail_len + pkt.size > tail_cap)
+      {
+        tail_cap = tail_len + pkt.size;
+        if (!(tmp = realloc(tail, tail_cap)))
+        {
+          av_free_packet(&pkt);
+          errn = ENOMEM;
+          goto cleanup;
+        }
+        tail = tmp;
+      }
+    }
+    memcpy(tail + tail_len, pkt.data, pkt.size);
+    tail_len += pkt.size;
+    av_free_packet(&pkt);
+  }
+
+  tail_len = strip_trailing_tags(tail, tail_len);
+  *hash = hash_final(h, tail, tail_len, total + tail_len);
+
+cleanup:
+  free(tail);
+  avformat_close_input(&ic);
+
+  return errn;
+}
+
+// key of the fingerprint of some audio under the given options
+static uint64_t fprint_cache_key(uint64_t audio_hash, int extractors,
+                                 int duration)
+{
+  uint64_t words[3];
+  uint64_t h = HASH_P5;
+
+  words[0] = audio_hash;
+  words[1] = (uint64_t)extractors;
+  words[2] = (uint64_t)duration;
+  h = hash_final(h, (const uint8_t *)words, sizeof(words), sizeof(words));
+  // 0 is never a valid key
+  return h ? h : 1;
+}
+
+struct FPDecoder
+{
+  AVFormatContext *ic;
+  AVStream *st;
+  AVCodecContext *cxt;
+  AVPacket pkt;
+  // pkt has been read and not freed; advance bytes of it were decoded
+  // into the last frame returned
+  int pkt_live;
+  int32_t advance;
+  int16_t *raw_buf;
+  uint32_t last_size;
+  uint32_t min_size;
+  int32_t music_errors;
+};
+
+struct FPDsp
+{
+  int extractors;
+  int duration;
+  int sample_rate;
+  int sample_fmt;
+  int channels;
+  int ibps_sz;
+  int obps_sz;
+  int dec_sample_limit;
+  int n_samples;
+  int truncated;
+  ReSampleContext *resample;
+  int16_t *audio_buf;
+  float *fp_dbl_buf;
+  uint32_t last_size;
+  t_fooid *fid;
+  int fooid_stopped;
+  ChromaFingerprinter cpr;
+  // of the last frame fed
+  int32_t bit_rate;
+  int32_t num_errors;
+};
+
+FPrint *get_fingerprint(const char *filename, int *error, int verbose)
+{
+  return get_fingerprint_opts(filename, NULL, error, verbose);
+}
+
+static FPrint *decode_fingerprint(const char *filename,
+                                  const FPStagePlan *plan, int *error,
+                                  int verbose);
+
+FPrint *get_fingerprint_opts(const char *filename, const FPOptions *opts,
+                             int *error, int verbose)
+{
+  FPStagePlan plan;
+  FPrint *p_fprint = fpstage_plan(filename, opts, &plan, error);
+
+  if (p_fprint || *error != 0)
+    return p_fprint;
+
+  return decode_fingerprint(filename, &plan, error, verbose);
+}
+
+FPrint *fpstage_plan(const char *filename, const FPOptions *opts,
+                     FPStagePlan *plan, int *error)
+{
+  int extractors = opts ? opts->extractors : FP_EXTRACT_ALL;
+  int duration = opts && opts->duration ? opts->duration : FP_DEFAULT_DURATION;
+  FPCache *cache = opts ? opts->cache : NULL;
+  FPCache *prints = cache;
+  uint64_t key = 0;
+  uint64_t audio_hash = 0;
+  uint64_t print_key = 0;
+  FPFeatures *f = NULL;
+  FPrint *p_fprint = NULL;
+
+  memset(plan, 0, sizeof(*plan));
+  if (extractors == 0 || (extractors & ~FP_EXTRACT_ALL) != 0)
+  {
+    fprintf(stderr, "ERROR: invalid extractors 0x%x\n", extractors);
+    *error = EINVAL;
+    return NULL;
+  }
+  if (duration < 1 ||
+      ((extractors & FP_EXTRACT_FOOID) && duration < FP_MIN_DURATION))
+  {
+    fprintf(stderr, "ERROR: invalid duration %d for extractors 0x%x\n",
+            duration, extractors);
+    *error = EINVAL;
+    return NULL;
+  }
+  // a longer capture has a longer cprint, which a default-length print
+  // would only match over its own length
+  if (duration > FP_DEFAULT_DURATION)
+    duration = FP_DEFAULT_DURATION;
+
+  // cached features are those of a default-length capture
+  if (duration != FP_DEFAULT_DURATION)
+    cache = NULL;
+
+  if (cache && fpcache_key(filename, &key) != 0)
+    cache = NULL;
+
+  if (cache && (f = fpcache_get(cache, key)) != NULL)
+  {
+    p_fprint = fprint_from_features(f, extractors, error);
+    fpcache_free_features(f);
+    if (p_fprint)
+      return p_fprint;
+    // fall back to decoding: the entry is rewritten below
+  }
+
+  // a new file, or a retag of audio we have seen: the payload hash only
+  // reads the packets, which is far cheaper than decoding them
+  if (prints && fp_audio_hash(filename, &audio_hash) == 0)
+  {
+    print_key = fprint_cache_key(audio_hash, extractors, duration);
+    if ((p_fprint = fpcache_get_fprint(prints, print_key)) != NULL)
+    {
+      *error = 0;
+      return p_fprint;
+    }
+  }
+
+  // features are only cached from a full extraction, but serve any
+  if (extractors != FP_EXTRACT_ALL)
+    cache = NULL;
+
+  plan->extractors = extractors;
+  plan->duration = duration;
+  plan->features = cache;
+  plan->feature_key = key;
+  plan->prints = print_key != 0 ? prints : NULL;
+  plan->print_key = print_key;
+  *error = 0;
+
+  return NULL;
+}
+
+static FPrint *decode_fingerprint(const char *filename,
+                                  const FPStagePlan *plan, int *error,
+                                  int verbose)
+{
+  FPStreamInfo info;
+  FPDecoder *d = NULL;
+  FPDsp *p = NULL;
+  FPFrame frame;
+  FPrint *p_fprint = NULL;
+  int eof = 0;
+  int full = 0;
+
+  if (!(d = fpstage_decoder_open(filename, verbose, &info, error)))
+    goto cleanup;
+  if (!(p = fpstage_dsp_new(plan, &info, error)))
+    goto cleanup;
+
+  while (!eof && !full)
+  {
+    if ((*error = fpstage_decode(d, &frame, &eof)) != 0 ||
+        (*error = fpstage_dsp_feed(p, &frame, &full)) != 0)
+      goto cleanup;
+  }
+  // no need to flush stream at end since we are working from file not FIFO
+
+  p_fprint = fpstage_dsp_finish(p, plan, &info, filename, error);
+
+cleanup:
+  if (p)
+    fpstage_dsp_free(p);
+  if (d)
+    fpstage_decoder_close(d);
+
+  return p_fprint;
+}
+
+FPDecoder *fpstage_decoder_open(const char *filename, int verbose,
+                                FPStreamInfo *info, int *error)
+{
+  int errn;
+  FPDecoder *d = NULL;
+  AVCodec *dec_codec = NULL;
+  AVCodecContext *cxt = NULL;
+  int n_streams;
+  int st_ix;
+  double seconds;
+
+  d = (FPDecoder *)calloc(1, sizeof(*d));
+  if (!d)
+  {
+    *error = ENOMEM;
+    return NULL;
+  }
+
+  // final NULL uses default parameters
+  if ((errn = avformat_open_input(&d->ic, filename, NULL, NULL)) != 0 ||
+      !d->ic)
   {
     fprintf(stderr, "ERROR: %d: unable to open input file %s\n",
             errn, filename);
     fflush(stdout);
     *error = 1;
-    goto cleanup;
+    goto error;
   }
 
-  if ((errn = avformat_find_stream_info(ic, NULL)) < 0)
+  if ((errn = avformat_find_stream_info(d->ic, NULL)) < 0)
   {
     fprintf(stderr, "ERROR: %d: unable to find format parameters\n", errn);
     fflush(stdout);
     *error = 1;
-    goto cleanup;
+    goto error;
   }
 
-  // find audio stream (should be first and only one for music files)
+  // find the audio stream (usually the only one for music files, but
+  // music videos and M4As often carry video or cover art as well)
   // AVCodecContext already initialized here
-  n_streams = ic->nb_streams;
-  for (int ads_ix = 0; ads_ix < n_streams; ads_ix++)
-  {
-    if (ic->streams[ads_ix]->codec->codec_type == AVMEDIA_TYPE_AUDIO)
-    {
-      st = ic->streams[ads_ix];
-      cxt = st->codec;
-      break;
-    }
-  }
-  if (!cxt)
+  st_ix = av_find_best_stream(d->ic, AVMEDIA_TYPE_AUDIO, -1, -1, &dec_codec,
+                              0);
+  if (st_ix == AVERROR_STREAM_NOT_FOUND)
   {
     fprintf(stderr, "ERROR: no audio stream found in file %s\n", filename);
     fflush(stdout);
     *error = 1;
-    goto cleanup;
+    goto error;
   }
-
-  dec_codec = avcodec_find_decoder(cxt->codec_id);
-  if (!dec_codec)
+  else if (st_ix < 0 || !dec_codec)
   {
-    fprintf(stderr, "ERROR: no codec found for stream %s\n",
-            cxt->codec_name);
+    fprintf(stderr, "ERROR: %d: no codec found for audio stream in %s\n",
+            st_ix, filename);
     fflush(stdout);
     *error = 1;
-    goto cleanup;
+    goto error;
   }
+  d->st = d->ic->streams[st_ix];
+  cxt = d->st->codec;
+
+  // have the demuxer skip every other stream: their packets are never
+  // read into memory (or, for most containers, off the disk)
+  n_streams = d->ic->nb_streams;
+  for (int ads_ix = 0; ads_ix < n_streams; ads_ix++)
+  {
+    if (ads_ix != st_ix)
+      d->ic->streams[ads_ix]->discard = AVDISCARD_ALL;
+  }
+
+  // we only use mono; decoders that can downmix internally (AC-3, DTS,
+  // TrueHD, ...) then skip decoding the channels we would throw away.
+  // Others ignore this and the resampler downmixes as before.
+  cxt->request_channels = STD_CHANNELS;
+  cxt->request_channel_layout = AV_CH_LAYOUT_MONO;
 
   if ((errn = avcodec_open2(cxt, dec_codec, NULL)) < 0)
   {
     fprintf(stderr, "ERROR: unable to open dec_codec %s\n",
             cxt->codec_name);
     *error = errn;
-    goto cleanup;
+    goto error;
   }
+  d->cxt = cxt;
 
+  // through av_log, to stderr: stdout is left to the caller's results
   if (verbose)
-    av_dump_format(ic, 0, filename, 0);
+    av_dump_format(d->ic, 0, filename, 0);
 
   // length (for VBR)
   // samples_per_frame / sample_rate * total_frames
 
   // already in Hz (samples / 1s)
-  samplerate = cxt->sample_rate;
-  channels = cxt->channels;
-  dec_sample_limit = SAMPLE_TIME_LIMIT * samplerate * channels;
-
-  // convert bps to sample size (uint8_t): >> 3 == / 8
-  ibps_sz = av_get_bytes_per_sample(cxt->sample_fmt) >> 3;
-  obps_sz = av_get_bytes_per_sample(AV_SAMPLE_FMT_S16) >> 3;
-
-  // clamp samples to 1 channel
-  // this eliminates most sampling errors for chromaprint over bitrate
-  // libfooid resamples to mono 64k but that is too reductive
-  resample = av_audio_resample_init(STD_CHANNELS, channels,
-                                    STD_SAMPLE_RATE, samplerate,
-                                    AV_SAMPLE_FMT_S16, cxt->sample_fmt,
-                                    16, 10, 0, 0.8);
-  if (!resample)
-  {
-    fprintf(stderr,
-            "ERROR: resample %d channels @ %d Hz to %d channels %d Hz\n",
-            channels, samplerate, STD_CHANNELS, STD_SAMPLE_RATE);
-    fflush(stderr);
-    *error = errno == ENOMEM ? ENOMEM : 1;
-    goto cleanup;
-  }
+  info->sample_rate = cxt->sample_rate;
+  info->channels = cxt->channels;
+  info->sample_fmt = (int)cxt->sample_fmt;
+  // convert duration to seconds, truncated: fractions inconsequential
+  // WARNING: due to an ffmpeg bug (skips VBR header in favor of VBRI),
+  // this duration may be incorrect: double by number of channels, so
+  // a 23-second song registers as 46 seconds with 2 channels.
+  seconds = (double)d->st->duration * av_q2d(d->st->time_base);
+  info->songlen = (uint32_t)seconds;
+  // for flac files, we have to estimate based on filesize and
+  // (float) duration -- perhaps duration should always be a float?
+  info->est_bit_rate =
+      seconds > 0.0
+          ? (uint32_t)ceil(((double)avio_size(d->ic->pb) * 8) / seconds /
+                           1000.0)
+          : 0;
 
   // libavcodec/avcodec.h
   // in uint8_t; audio frame size ~= 1s 48Khz 32bit audio
   // AVCODEC_MAX_AUDIO_FRAME_SIZE: 192,000
   // FF_INPUT_BUFFER_PADDING_SIZE: 8
   // FF_MIN_BUFFER_SIZE:           16,384
-  last_size = 0;
-  min_size = (AVCODEC_MAX_AUDIO_FRAME_SIZE * 3) / 2;
+  d->min_size = (AVCODEC_MAX_AUDIO_FRAME_SIZE * 3) / 2;
   // good alignment but unnecessary as malloc, calloc align 16:
   // min_size = FFMAX(17*min_size/16 + 32, min_size);
-  raw_buf = (int16_t *)calloc(min_size, sizeof(*raw_buf));
-  if (!raw_buf)
+  d->raw_buf = (int16_t *)calloc(d->min_size, sizeof(*d->raw_buf));
+  if (!d->raw_buf)
   {
     fprintf(stderr, "ERROR: unable to allocate raw_buf\n");
     fflush(stderr);
     *error = ENOMEM;
-    goto cleanup;
+    goto error;
   }
-  last_size = min_size;
-  audio_buf = (int16_t *)calloc(min_size, sizeof(*audio_buf));
-  if (!audio_buf)
+  d->last_size = d->min_size;
+
+  return d;
+
+error:
+  fpstage_decoder_close(d);
+  return NULL;
+}
+
+int fpstage_decode(FPDecoder *d, FPFrame *frame, int *eof)
+{
+  int errn;
+  int32_t len, dec_size;
+  int16_t *tmp = NULL;
+
+  *eof = 0;
+  for (;;)
   {
-    fprintf(stderr, "ERROR: unable to allocate audio_buf\n");
-    fflush(stderr);
-    *error = ENOMEM;
-    goto cleanup;
+    if (d->pkt_live)
+    {
+      d->pkt.data += d->advance;
+      d->pkt.size -= d->advance;
+      d->advance = 0;
+      if (d->pkt.size <= 0)
+        d->pkt_live = 0;
+    }
+
+    if (!d->pkt_live)
+    {
+      av_init_packet(&d->pkt);
+
+      errn = av_read_frame(d->ic, &d->pkt);
+      if (errn == AVERROR(EAGAIN))
+      {
+        av_free_packet(&d->pkt);
+        d->music_errors += 1;
+        continue;
+      }
+      else if (errn < 0)
+      {
+        // EOF: no more packets
+        av_free_packet(&d->pkt);
+        *eof = 1;
+        frame->pcm = NULL;
+        frame->size = 0;
+        frame->channels = d->cxt->channels;
+        frame->bit_rate = d->cxt->bit_rate;
+        frame->num_errors = d->music_errors;
+        return 0;
+      }
+
+      // discarded streams should not get here, but some demuxers
+      // (e.g. raw formats) ignore AVStream.discard
+      if (d->pkt.stream_index != d->st->index)
+      {
+        av_free_packet(&d->pkt);
+        continue;
+      }
+      d->pkt_live = d->pkt.size > 0;
+      continue;
+    }
+
+    dec_size = FFMAX(d->pkt.size + FF_INPUT_BUFFER_PADDING_SIZE, d->min_size);
+    // rarely ever need this except in cases of bad files...
+    if (d->last_size < dec_size)
+    {
+      // avcodec_decode_audio3 decodes into this flat int16_t buffer
+      tmp = (int16_t *)realloc((void *)d->raw_buf,
+                               dec_size * sizeof(*d->raw_buf));
+      if (!tmp)
+      {
+        fprintf(stderr, ERROR_REALLOC_BUF, "raw_buf",
+                dec_size * sizeof(*d->raw_buf));
+        fflush(stderr);
+        av_free_packet(&d->pkt);
+        d->pkt_live = 0;
+        return ENOMEM;
+      }
+      d->raw_buf = tmp;
+      d->last_size = dec_size;
+    }
+    memset((void *)d->raw_buf, 0, d->last_size * sizeof(*d->raw_buf));
+
+    len = avcodec_decode_audio3(d->cxt, d->raw_buf, &dec_size, &d->pkt);
+
+    if (len < 0)
+    {
+      // len == -1 corresponds to a missing header
+      if (len != -1)
+      {
+        fprintf(stderr, "ERROR: %d while decoding\n", len);
+        fflush(stderr);
+      }
+      d->music_errors += 1;
+      av_free_packet(&d->pkt);
+      d->pkt_live = 0;
+      continue;
+    }
+
+    // the rest of the packet is decoded on the next call
+    d->advance = len;
+    if (dec_size > 0)
+    {
+      frame->pcm = d->raw_buf;
+      frame->size = dec_size;
+      // decoders honouring request_channels only switch to mono once
+      // they have parsed the first frame
+      frame->channels = d->cxt->channels;
+      frame->bit_rate = d->cxt->bit_rate;
+      frame->num_errors = d->music_errors;
+      return 0;
+    }
   }
-  fp_dbl_buf = (float *)calloc(min_size, sizeof(*fp_dbl_buf));
-  if (!fp_dbl_buf)
+}
+
+void fpstage_decoder_close(FPDecoder *d)
+{
+  if (!d)
+    return;
+  // a capture cut short leaves the packet it stopped in
+  if (d->pkt_live)
+    av_free_packet(&d->pkt);
+  if (d->raw_buf)
+    free(d->raw_buf);
+  if (d->cxt)
+    avcodec_close(d->cxt);
+  if (d->ic)
+    avformat_close_input(&d->ic);
+  free(d);
+}
+
+FPDsp *fpstage_dsp_new(const FPStagePlan *plan, const FPStreamInfo *info,
+                       int *error)
+{
+  FPDsp *p = (FPDsp *)calloc(1, sizeof(*p));
+
+  if (!p)
   {
-    fprintf(stderr, "ERROR: unable to allocate fp_dbl_buf\n");
-    fflush(stderr);
     *error = ENOMEM;
-    goto cleanup;
+    return NULL;
   }
+  p->extractors = plan->extractors;
+  p->duration = plan->duration;
+  p->sample_rate = info->sample_rate;
+  p->sample_fmt = info->sample_fmt;
+  p->channels = info->channels;
+  p->fooid_stopped = !(plan->extractors & FP_EXTRACT_FOOID);
+  p->dec_sample_limit = plan->duration * p->sample_rate * p->channels;
 
-  fid = fp_init(STD_SAMPLE_RATE, STD_CHANNELS);
-  if (!fid)
+  // convert bps to sample size (uint8_t): >> 3 == / 8
+  p->ibps_sz = av_get_bytes_per_sample(p->sample_fmt) >> 3;
+  p->obps_sz = av_get_bytes_per_sample(AV_SAMPLE_FMT_S16) >> 3;
+
+  // clamp samples to 1 channel
+  // this eliminates most sampling errors for chromaprint over bitrate
+  // libfooid resamples to mono 64k but that is too reductive
+  p->resample = av_audio_resample_init(STD_CHANNELS, p->channels,
+                                       STD_SAMPLE_RATE, p->sample_rate,
+                                       AV_SAMPLE_FMT_S16, p->sample_fmt,
+                                       16, 10, 0, 0.8);
+  if (!p->resample)
   {
-    fprintf(stderr, "ERROR: initializing fooid\n");
+    fprintf(stderr,
+            "ERROR: resample %d channels @ %d Hz to %d channels %d Hz\n",
+            p->channels, p->sample_rate, STD_CHANNELS, STD_SAMPLE_RATE);
     fflush(stderr);
-    *error = 1;
-    goto cleanup;
+    *error = errno == ENOMEM ? ENOMEM : 1;
+    goto error;
   }
 
-  cpr = chroma_init(STD_SAMPLE_RATE, STD_CHANNELS);
-  if (!cpr)
+  p->last_size = (AVCODEC_MAX_AUDIO_FRAME_SIZE * 3) / 2;
+  p->audio_buf = (int16_t *)calloc(p->last_size, sizeof(*p->audio_buf));
+  if (!p->audio_buf)
   {
-    fprintf(stderr, "ERROR: initializing chromaprint\n");
+    fprintf(stderr, "ERROR: unable to allocate audio_buf\n");
     fflush(stderr);
-    *error = 1;
-    goto cleanup;
+    *error = ENOMEM;
+    goto error;
   }
-
-  n_samples = 0;
-  for (;;)
+  p->fp_dbl_buf = (float *)calloc(p->last_size, sizeof(*p->fp_dbl_buf));
+  if (!p->fp_dbl_buf)
   {
-    av_init_packet(&pkt);
+    fprintf(stderr, "ERROR: unable to allocate fp_dbl_buf\n");
+    fflush(stderr);
+    *error = ENOMEM;
+    goto error;
+  }
 
-    errn = av_read_frame(ic, &pkt);
-    if (errn == AVERROR(EAGAIN))
-    {
-      av_free_packet(&pkt);
-      music_errors += 1;
-      continue;
-    }
-    else if (errn < 0)
+  if (plan->extractors & FP_EXTRACT_FOOID)
+  {
+    p->fid = fp_init(STD_SAMPLE_RATE, STD_CHANNELS);
+    if (!p->fid)
     {
-      // EOF: no more packets
-      av_free_packet(&pkt);
-      break;
+      fprintf(stderr, "ERROR: initializing fooid\n");
+      fflush(stderr);
+      *error = 1;
+      goto error;
     }
+  }
 
-    if (pkt.stream_index >= ic->nb_streams)
+  if (plan->extractors & FP_EXTRACT_CHROMA)
+  {
+    p->cpr = chroma_init(STD_SAMPLE_RATE, STD_CHANNELS);
+    if (!p->cpr)
     {
-      av_free_packet(&pkt);
-      continue;
+      fprintf(stderr, "ERROR: initializing chromaprint\n");
+      fflush(stderr);
+      *error = 1;
+      goto error;
     }
+  }
 
-    while (pkt.size > 0)
-    {
-      dec_size = FFMAX(pkt.size + FF_INPUT_BUFFER_PADDING_SIZE, min_size);
-      // rarely ever need this except in cases of bad files...
-      if (last_size < dec_size)
-      {
-        printf("reallocating...\n");
-        // TODO: current FFMPEG raw_buf is an AVFrame*
-        raw_buf = (int16_t *)realloc((void *)raw_buf,
-                                     dec_size * sizeof(*raw_buf));
-        if (!raw_buf)
-        {
-          fprintf(stderr, ERROR_REALLOC_BUF, "raw_buf",
-                  dec_size * sizeof(*raw_buf));
-          fflush(stderr);
-          if (pkt.size > 0)
-            av_free_packet(&pkt);
-          *error = ENOMEM;
-          goto cleanup;
-        }
-        audio_buf = (int16_t *)realloc((void *)audio_buf,
-                                       dec_size * sizeof(*audio_buf));
-        if (!audio_buf)
-        {
-          fprintf(stderr, ERROR_REALLOC_BUF, "audio_buf",
-                  dec_size * sizeof(*audio_buf));
-          fflush(stderr);
-          if (pkt.size > 0)
-            av_free_packet(&pkt);
-          *error = ENOMEM;
-          goto cleanup;
-        }
-        fp_dbl_buf = (float *)realloc((void *)fp_dbl_buf,
-                                      dec_size * sizeof(*fp_dbl_buf));
-        if (!fp_dbl_buf)
-        {
-          fprintf(stderr, ERROR_REALLOC_BUF, "fp_dbl_buf",
-                  dec_size * sizeof(*fp_dbl_buf));
-          fflush(stderr);
-          if (pkt.size > 0)
-            av_free_packet(&pkt);
-          *error = ENOMEM;
-          goto cleanup;
-        }
-        last_size = dec_size;
-      }
-      memset((void *)raw_buf, 0, last_size * sizeof(*raw_buf));
-      memset((void *)audio_buf, 0, last_size * sizeof(*audio_buf));
-      memset((void *)fp_dbl_buf, 0, last_size * sizeof(*fp_dbl_buf));
+  return p;
 
-      len = avcodec_decode_audio3(cxt, raw_buf, &dec_size, &pkt);
+error:
+  fpstage_dsp_free(p);
+  return NULL;
+}
 
-      if (len < 0)
-      {
-        // len == -1 corresponds to a missing header
-        if (len != -1)
-        {
-          fprintf(stderr, "ERROR: %d while decoding\n", len);
-          fflush(stderr);
-        }
-        music_errors += 1;
-        if (pkt.size > 0)
-          av_free_packet(&pkt);
-        continue;
-      }
+int fpstage_dsp_feed(FPDsp *p, const FPFrame *frame, int *full)
+{
+  int errn;
+  int32_t out_size;
+  int16_t *audio_buf = NULL;
+  float *fp_dbl_buf = NULL;
 
-      // TODO: still getting floating point exception here
-      if (dec_size > 0)
-      {
-        out_size = audio_resample(resample, audio_buf, raw_buf,
-                                  dec_size / (channels * ibps_sz));
-        // out_size only == STD_CHANNELS if the input data is already
-        // int32_t PCM (single frame per packet)
-        out_size *= STD_CHANNELS * obps_sz;
-        errn = chroma_feed(cpr, audio_buf, out_size);
-        if (errn != 0)
-        {
-          fprintf(stderr, "ERROR: feeding data to chromaprint\n");
-          fflush(stderr);
-          *error = 1;
-          goto cleanup;
-        }
-        if (!fooid_stopped)
-        {
-          // pulled from fp_feed_short so we do not need to allocate
-          // a new buffer each run through the loop
-          for (int32_t i = 0; i < out_size; i++)
-          {
-            fp_dbl_buf[i] = (float)audio_buf[i] / 32767.0f;
-          }
-          errn = fp_feed_float(fid, fp_dbl_buf, out_size);
-          if (errn == 0)
-          {
-            fooid_stopped = 1;
-          }
-          else if (errn < 0)
-          {
-            fprintf(stderr, "ERROR: feeding data to fooid\n");
-            fflush(stderr);
-            if (pkt.size > 0)
-              av_free_packet(&pkt);
-            *error = 1;
-            goto cleanup;
-          }
-        }
-        n_samples += out_size;
-        if (n_samples >= dec_sample_limit)
-        {
-          // cut out based on the number of samples
-          if (pkt.size > 0)
-            av_free_packet(&pkt);
-          goto fgprint;
-        }
-      }
+  *full = p->truncated;
+  if (p->truncated)
+    return 0;
+  p->bit_rate = frame->bit_rate;
+  p->num_errors = frame->num_errors;
+  if (frame->size <= 0)
+    return 0;
 
-      pkt.data += len;
-      pkt.size -= len;
+  // rarely ever need this except in cases of bad files...
+  if (p->last_size < (uint32_t)frame->size)
+  {
+    audio_buf = (int16_t *)realloc((void *)p->audio_buf,
+                                   frame->size * sizeof(*audio_buf));
+    if (!audio_buf)
+    {
+      fprintf(stderr, ERROR_REALLOC_BUF, "audio_buf",
+              frame->size * sizeof(*audio_buf));
+      fflush(stderr);
+      return ENOMEM;
+    }
+    p->audio_buf = audio_buf;
+    fp_dbl_buf = (float *)realloc((void *)p->fp_dbl_buf,
+                                  frame->size * sizeof(*fp_dbl_buf));
+    if (!fp_dbl_buf)
+    {
+      fprintf(stderr, ERROR_REALLOC_BUF, "fp_dbl_buf",
+              frame->size * sizeof(*fp_dbl_buf));
+      fflush(stderr);
+      return ENOMEM;
+    }
+    p->fp_dbl_buf = fp_dbl_buf;
+    p->last_size = frame->size;
+  }
+  memset((void *)p->audio_buf, 0, p->last_size * sizeof(*p->audio_buf));
+  memset((void *)p->fp_dbl_buf, 0, p->last_size * sizeof(*p->fp_dbl_buf));
+
+  // decoders honouring request_channels only switch to mono once they
+  // have parsed the first frame
+  if (frame->channels != p->channels)
+  {
+    audio_resample_close(p->resample);
+    p->resample = NULL;
+    if (p->n_samples == 0)
+      p->dec_sample_limit = p->duration * p->sample_rate * frame->channels;
+    p->channels = frame->channels;
+    p->resample = av_audio_resample_init(STD_CHANNELS, p->channels,
+                                         STD_SAMPLE_RATE, p->sample_rate,
+                                         AV_SAMPLE_FMT_S16, p->sample_fmt,
+                                         16, 10, 0, 0.8);
+    if (!p->resample)
+    {
+      fprintf(stderr,
+              "ERROR: resample %d channels @ %d Hz to %d channels %d Hz\n",
+              p->channels, p->sample_rate, STD_CHANNELS, STD_SAMPLE_RATE);
+      fflush(stderr);
+      return errno == ENOMEM ? ENOMEM : 1;
     }
-
-    if (pkt.size > 0)
-      av_free_packet(&pkt);
   }
 
-  // no need to flush stream at end since we are working from file not FIFO
-
-fgprint:
-  if (n_samples <= 0)
+  // TODO: still getting floating point exception here
+  out_size = audio_resample(p->resample, p->audio_buf, (short *)frame->pcm,
+                            frame->size / (p->channels * p->ibps_sz));
+  // out_size only == STD_CHANNELS if the input data is already
+  // int32_t PCM (single frame per packet)
+  out_size *= STD_CHANNELS * p->obps_sz;
+  if (p->cpr && (errn = chroma_feed(p->cpr, p->audio_buf, out_size)) != 0)
   {
-    fprintf(stderr, "ERROR: no samples for fingerprint\n");
+    fprintf(stderr, "ERROR: feeding data to chromaprint\n");
     fflush(stderr);
-    *error = 1;
-    goto cleanup;
+    return 1;
   }
-
-  fp_size = fp_getsize(fid);
-  if (fp_size <= 0)
+  if (!p->fooid_stopped)
   {
-    fprintf(stderr, "ERROR: %d getting size for fingerprint\n", fp_size);
-    fflush(stderr);
-    *error = 1;
-    goto cleanup;
+    // pulled from fp_feed_short so we do not need to allocate
+    // a new buffer each run through the loop
+    for (int32_t i = 0; i < out_size; i++)
+    {
+      p->fp_dbl_buf[i] = (float)p->audio_buf[i] / 32767.0f;
+    }
+    errn = fp_feed_float(p->fid, p->fp_dbl_buf, out_size);
+    if (errn == 0)
+    {
+      p->fooid_stopped = 1;
+    }
+    else if (errn < 0)
+    {
+      fprintf(stderr, "ERROR: feeding data to fooid\n");
+      fflush(stderr);
+      return 1;
+    }
   }
-
-  fp_buf = (uint8_t *)malloc(fp_size);
-  if (!fp_buf)
+  p->n_samples += out_size;
+  if (p->n_samples >= p->dec_sample_limit)
   {
-    fprintf(stderr, "ERROR: allocating %d bytes for fp_buf\n", fp_size);
-    fflush(stderr);
-    *error = 1;
-    goto cleanup;
+    // cut out based on the number of samples
+    p->truncated = 1;
+    *full = 1;
   }
 
-  if ((errn = fp_calculate(fid, n_samples, fp_buf)) < 0)
+  return 0;
+}
+
+FPrint *fpstage_dsp_finish(FPDsp *p, const FPStagePlan *plan,
+                           const FPStreamInfo *info, const char *filename,
+                           int *error)
+{
+  int errn;
+  uint8_t *fp_buf = NULL;
+  int fp_size = 0;
+  size_t cprint_len = 0;
+  int32_t *cprint = NULL;
+  FPFeatures *features = NULL;
+  FPrint *p_fprint = NULL;
+
+  if (p->n_samples <= 0)
   {
-    fprintf(stderr, "ERROR: %d calculating fingerprint\n", errn);
+    fprintf(stderr, "ERROR: no samples for fingerprint\n");
     fflush(stderr);
     *error = 1;
     goto cleanup;
   }
 
-  cprint_len = 0;
-  cprint = chroma_calculate(cpr, &errn, &cprint_len);
-  if (errn != 0)
+  // a failed capture only costs the cache entry
+  if (plan->features)
+    features = capture_features(p->fid, p->cpr, p->n_samples);
+
+  if (p->fid)
   {
-    fprintf(stderr, "ERROR: %d calculating chromaprint\n", errn);
-    if (errn == ENOMEM)
+    fp_size = fp_getsize(p->fid);
+    if (fp_size <= 0)
     {
-      *error = ENOMEM;
+      fprintf(stderr, "ERROR: %d getting size for fingerprint\n", fp_size);
+      fflush(stderr);
+      *error = 1;
+      goto cleanup;
     }
-    else
+
+    fp_buf = (uint8_t *)malloc(fp_size);
+    if (!fp_buf)
     {
+      fprintf(stderr, "ERROR: allocating %d bytes for fp_buf\n", fp_size);
+      fflush(stderr);
       *error = 1;
+      goto cleanup;
+    }
+
+    if ((errn = fp_calculate(p->fid, p->n_samples, fp_buf)) < 0)
+    {
+      fprintf(stderr, "ERROR: %d calculating fingerprint\n", errn);
+      fflush(stderr);
+      *error = 1;
+      goto cleanup;
+    }
+  }
+
+  cprint_len = 0;
+  if (p->cpr)
+  {
+    cprint = chroma_calculate(p->cpr, &errn, &cprint_len);
+    if (errn != 0)
+    {
+      fprintf(stderr, "ERROR: %d calculating chromaprint\n", errn);
+      if (errn == ENOMEM)
+      {
+        *error = ENOMEM;
+      }
+      else
+      {
+        *error = 1;
+      }
+      goto cleanup;
     }
-    goto cleanup;
   }
   p_fprint = new_fprint((int)cprint_len);
   if (!p_fprint)
@@ -468,84 +1182,76 @@ fgprint:
     *error = ENOMEM;
     goto cleanup;
   }
-  // convert duration to seconds, truncated: fractions inconsequential
-  // WARNING: due to an ffmpeg bug (skips VBR header in favor of VBRI),
-  // this duration may be incorrect: double by number of channels, so
-  // a 23-second song registers as 46 seconds with 2 channels.
-  p_fprint->songlen = (uint32_t)((double)st->duration * av_q2d(st->time_base));
+  p_fprint->songlen = info->songlen;
   p_fprint->cprint_len = cprint_len;
-  if (cxt->bit_rate > 0)
-  {
-    // if bit_rate encoded, it is in kbps
-    p_fprint->bit_rate = cxt->bit_rate / 1000;
+  // if bit_rate encoded, it is in kbps
+  p_fprint->bit_rate = p->bit_rate > 0 ? p->bit_rate / 1000
+                                       : info->est_bit_rate;
+  p_fprint->num_errors = p->num_errors;
+  fill_fprint_parts(p_fprint, p->fid, cprint, cprint_len);
+  if (p->truncated && p->duration < FP_DEFAULT_DURATION)
+    p_fprint->missing |= FP_MISSING_TAIL;
+
+  if (features)
+  {
+    features->songlen = p_fprint->songlen;
+    features->bit_rate = p_fprint->bit_rate;
+    features->num_errors = p_fprint->num_errors;
+    if ((errn = fpcache_put(plan->features, plan->feature_key,
+                            features)) != 0)
+    {
+      fprintf(stderr, "WARNING: %d: unable to cache features for %s\n",
+              errn, filename);
+      fflush(stderr);
+    }
   }
-  else
+
+  if (plan->prints &&
+      (errn = fpcache_put_fprint(plan->prints, plan->print_key,
+                                 p_fprint)) != 0)
   {
-    // for flac files, we have to estimate based on filesize and
-    // (float) duration -- perhaps duration should always be a float?
-    p_fprint->bit_rate = (uint32_t)ceil(((double)avio_size(ic->pb) * 8) / ((double)st->duration * av_q2d(st->time_base)) / 1000.0);
+    fprintf(stderr, "WARNING: %d: unable to cache fingerprint for %s\n",
+            errn, filename);
+    fflush(stderr);
   }
-  p_fprint->num_errors = music_errors;
-  memcpy(p_fprint->r, fid->fp.r, R_SIZE * sizeof(uint8_t));
-  memcpy(p_fprint->dom, fid->fp.dom, DOM_SIZE * sizeof(uint8_t));
-  memcpy(p_fprint->cprint, cprint, cprint_len * sizeof(*cprint));
 
   *error = 0;
 
 cleanup:
+  if (features)
+    fpcache_free_features(features);
   if (cprint)
     free(cprint);
-  if (cpr)
-    chroma_destroy(cpr);
-  if (raw_buf)
-    free(raw_buf);
-  if (audio_buf)
-    free(audio_buf);
-  if (fp_dbl_buf)
-    free(fp_dbl_buf);
-  if (fid)
-    fp_free(fid);
-  if (resample)
-    audio_resample_close(resample);
-  if (cxt)
-    avcodec_close(cxt);
-  if (ic)
-    avformat_close_input(&ic);
+  if (fp_buf)
+    free(fp_buf);
 
   return p_fprint;
 }
 
-static inline uint32_t pop32(uint32_t x)
-{
-  x = x - ((x >> 1) & 0x55555555);
-  x = (x & 0x33333333) + ((x >> 2) & 0x33333333);
-  return (((x + (x >> 4)) & 0x0F0F0F0F) * 0x01010101) >> 24;
-}
-
-static inline uint32_t pop16(uint16_t x)
-{
-  x = x - ((x >> 1) & 0x5555);
-  x = (x & 0x3333) + ((x >> 2) & 0x3333);
-  return (((x + (x >> 4)) & 0x0F0F) * 0x0101) >> 8;
-}
-
-static inline void rdiff_fooid32(uint32_t x, uint32_t *restrict rdiff)
+void fpstage_dsp_free(FPDsp *p)
 {
-  rdiff[(x & 0x3)]++;
-  for (uint32_t i = 1; i < 16; i++)
-  {
-    rdiff[((x >> (i << 1)) & 0x3)]++;
-  }
+  if (!p)
+    return;
+  if (p->cpr)
+    chroma_destroy(p->cpr);
+  if (p->audio_buf)
+    free(p->audio_buf);
+  if (p->fp_dbl_buf)
+    free(p->fp_dbl_buf);
+  if (p->fid)
+    fp_free(p->fid);
+  if (p->resample)
+    audio_resample_close(p->resample);
+  free(p);
 }
 
 uint32_t hdist_r(const uint8_t *restrict r_a, const uint8_t *restrict r_b)
 {
   uint32_t rdiff[4] = {0, 0, 0, 0};
-  const uint32_t *r_a32 = (const uint32_t *)r_a;
-  const uint32_t *r_b32 = (const uint32_t *)r_b;
   for (size_t i = 0; i < R_SIZE32; i++)
   {
-    rdiff_fooid32(r_a32[i] ^ r_b32[i], rdiff);
+    fpmatch_rdiff32(fpmatch_load32(&r_a[4 * i]) ^ fpmatch_load32(&r_b[4 * i]),
+                    rdiff);
   }
   return rdiff[1] + rdiff[2] * 4 + rdiff[3] * 9;
 }
@@ -554,14 +1260,14 @@ uint32_t hdist_dom(const uint8_t *restrict dom_a,
                    const uint8_t *restrict dom_b)
 {
   unsigned int dist = 0;
-  const uint32_t *dom32_a = (const uint32_t *)dom_a;
-  const uint32_t *dom32_b = (const uint32_t *)dom_b;
 
   for (size_t i = 0; i < DOM_LEN32; i++)
   {
-    dist += pop32(dom32_a[i] ^ dom32_b[i]);
+    dist += fpmatch_pop32(fpmatch_load32(&dom_a[4 * i]) ^
+                          fpmatch_load32(&dom_b[4 * i]));
   }
-  dist += pop16(((uint16_t *)dom_a)[DOM_END16] ^ ((uint16_t *)dom_b)[DOM_END16]);
+  dist += fpmatch_pop16(fpmatch_load16(&dom_a[2 * (DOM_END16)]) ^
+                        fpmatch_load16(&dom_b[2 * (DOM_END16)]));
 
   return dist;
 }
@@ -571,37 +1277,7 @@ double match_fooid_fp(const uint8_t *restrict r_a,
                       const uint8_t *restrict r_b,
                       const uint8_t *restrict dom_b)
 {
-  const double maxdiff = (double)MAX_TOTDIFF;
-  uint32_t diff_r = 0;
-  uint32_t diff_dom = 0;
-  double perc = 0.0;
-  double conf = 0.0;
-  uint32_t rdiff[4] = {0, 0, 0, 0};
-
-  // scaled popcount for r (slow!)
-  const uint32_t *r_a32 = (uint32_t *)r_a;
-  const uint32_t *r_b32 = (uint32_t *)r_b;
-  for (size_t i = 0; i < R_SIZE32; i++)
-  {
-    rdiff_fooid32(r_a32[i] ^ r_b32[i], rdiff);
-  }
-  diff_r = rdiff[1] + rdiff[2] * 4 + rdiff[3] * 9;
-
-  // popcount for dom
-  const uint32_t *dom32_a = (const uint32_t *)dom_a;
-  const uint32_t *dom32_b = (const uint32_t *)dom_b;
-  for (size_t i = 0; i < DOM_LEN32; i += 2)
-  {
-    diff_dom += pop32(dom32_a[i] ^ dom32_b[i]);
-    diff_dom += pop32(dom32_a[i + 1] ^ dom32_b[i + 1]);
-  }
-  diff_dom += pop16(((uint16_t *)dom_a)[DOM_END16] ^ ((uint16_t *)dom_b)[DOM_END16]);
-
-  // below is pretty much verbatim from the reference
-  perc = (double)(diff_r + diff_dom) / maxdiff;
-  conf = ((1.0 - perc) - 0.5) * 2.0;
-
-  return fmax(fmin(conf, 1.0), 0.0);
+  return fpmatch_fooid_fp(r_a, dom_a, r_b, dom_b);
 }
 
 #define POPCOUNT(x) __builtin_popcount((x))
@@ -699,45 +1375,13 @@ double match_chroma(const int32_t *restrict cp1, size_t cp1_len,
  *  r |= (r >> 16);
  *  return popcount(r >> 1);
  *
- * where a faster implementation than __builtin_popcount() is above.
+ * where fpmatch_pop32 (fpmatch.h) is a faster implementation than
+ * __builtin_popcount().
  */
-static inline uint32_t cmp_low_bit(uint32_t x, uint32_t y)
-{
-  return (x & (-x)) == (y & (-y));
-}
-
 double match_chromab(const int32_t *restrict cp1, size_t cp1_len,
                      const int32_t *restrict cp2, size_t cp2_len)
 {
-  size_t maxsize = min_st(cp1_len, cp2_len);
-  // better than sample correlation but seems to be 40%;
-  // slower than hamming!!  Damn comparisons.
-  size_t end = maxsize;
-  size_t rem = end % 4;
-  end >>= 2;
-  register uint32_t sm = 0;
-  uint32_t *cp1_32 = (uint32_t *)cp1;
-  uint32_t *cp2_32 = (uint32_t *)cp2;
-
-  if (maxsize == 0)
-    return 0.0;
-
-  for (size_t i = 0; i < end; i++)
-  {
-    sm += cmp_low_bit(*cp1_32++, *cp2_32++);
-    sm += cmp_low_bit(*cp1_32++, *cp2_32++);
-    sm += cmp_low_bit(*cp1_32++, *cp2_32++);
-    sm += cmp_low_bit(*cp1_32++, *cp2_32++);
-  }
-  while (rem-- > 0)
-  {
-    sm += cmp_low_bit(*cp1_32++, *cp2_32++);
-  }
-
-  if (sm == 0)
-    return 0.0;
-
-  return (double)sm / (double)max_st(cp1_len, cp2_len);
+  return fpmatch_chromab(cp1, cp1_len, cp2, cp2_len);
 }
 
 /* // old popcount method (fast but in range .86 - 1.0; not very accurate)
@@ -796,21 +1440,21 @@ double match_chromat(const int32_t *restrict cp1, size_t cp1_len,
 
   for (size_t i = 0; i < end; i += 4)
   {
-    a = pop32(cp1_32[i] & cp2_32[i]);
-    b = pop32(cp1_32[i + 1] & cp2_32[i + 1]);
-    c = pop32(cp1_32[i + 2] & cp2_32[i + 2]);
-    d = pop32(cp1_32[i + 3] & cp2_32[i + 3]);
+    a = fpmatch_pop32(cp1_32[i] & cp2_32[i]);
+    b = fpmatch_pop32(cp1_32[i + 1] & cp2_32[i + 1]);
+    c = fpmatch_pop32(cp1_32[i + 2] & cp2_32[i + 2]);
+    d = fpmatch_pop32(cp1_32[i + 3] & cp2_32[i + 3]);
     tdiff += a + b + c + d;
-    a = pop32(*cp1_32++ | *cp2_32++);
-    b = pop32(*cp1_32++ | *cp2_32++);
-    c = pop32(*cp1_32++ | *cp2_32++);
-    d = pop32(*cp1_32++ | *cp2_32++);
+    a = fpmatch_pop32(*cp1_32++ | *cp2_32++);
+    b = fpmatch_pop32(*cp1_32++ | *cp2_32++);
+    c = fpmatch_pop32(*cp1_32++ | *cp2_32++);
+    d = fpmatch_pop32(*cp1_32++ | *cp2_32++);
     tcomm += a + b + c + d;
   }
   while (rem-- > 0)
   {
-    tdiff = pop32(*cp1_32 & *cp2_32);
-    tcomm += pop32(*cp1_32++ | *cp2_32++);
+    tdiff = fpmatch_pop32(*cp1_32 & *cp2_32);
+    tcomm += fpmatch_pop32(*cp1_32++ | *cp2_32++);
   }
 
   if (tdiff == 0)
@@ -850,23 +1494,86 @@ double match_chromac(const int32_t *restrict cp1, size_t cp1_len,
   return fabs(r);
 }
 
-double match_cpfm(FPrint *restrict a, FPrint *restrict b)
+double match_cpfm_combine(double fm, double cp)
 {
-  if (!(a && b))
-    return 0.0;
+  return fpmatch_cpfm_combine(fm, cp);
+}
+
+double match_cpfm_raw(uint32_t songlen_a, const uint8_t *restrict r_a,
+                      const uint8_t *restrict dom_a,
+                      const int32_t *restrict cp_a, size_t cp_a_len,
+                      uint32_t songlen_b, const uint8_t *restrict r_b,
+                      const uint8_t *restrict dom_b,
+                      const int32_t *restrict cp_b, size_t cp_b_len)
+{
+  return fpmatch_cpfm_partial(0, songlen_a, r_a, dom_a, cp_a, cp_a_len,
+                              songlen_b, r_b, dom_b, cp_b, cp_b_len);
+}
 
-  float sl_a = (float)a->songlen;
-  float sl_b = (float)b->songlen;
-  float songlen_diff = fabsf(sl_a - sl_b);
-  if (songlen_diff > (0.1f * fmin(sl_a, sl_b)))
+// r and dom are never all zero for audio fooid accepted (fp_calculate
+// rejects silence), so that is how a missing fooid part shows
+static int fprint_fooid_empty(const FPrint *fp)
+{
+  for (size_t i = 0; i < R_SIZE; i++)
   {
-    return 0.0;
+    if (fp->r[i])
+      return 0;
+  }
+  for (size_t i = 0; i < DOM_SIZE; i++)
+  {
+    if (fp->dom[i])
+      return 0;
+  }
+  return 1;
+}
+
+// seconds a full capture of a song `songlen` seconds long analyzes: the
+// song up to FP_DEFAULT_DURATION; an unknown (0) songlen may be any length
+static uint32_t analyzed_duration(uint32_t songlen)
+{
+  if (songlen == 0 || songlen > FP_DEFAULT_DURATION)
+    return FP_DEFAULT_DURATION;
+  return songlen;
+}
+
+uint16_t fprint_missing(const FPrint *fp)
+{
+  uint16_t missing = fp->missing;
+
+  if (missing == 0)
+    return 0;
+
+  missing &= FP_MISSING_ALL;
+  if ((missing & FP_MISSING_CHROMA) && fp->cprint_len > 0)
+    missing &= ~FP_MISSING_CHROMA;
+  if ((missing & FP_MISSING_FOOID) && !fprint_fooid_empty(fp))
+    missing &= ~FP_MISSING_FOOID;
+  // a full capture has (nearly) FP_CPRINT_LEN of the analyzed duration in
+  // cprint entries, however long the song runs past it
+  if ((missing & FP_MISSING_TAIL) && fp->cprint_len > 0 &&
+      fp->cprint_len >= FP_CPRINT_LEN(analyzed_duration(fp->songlen)) * 9 / 10)
+  {
+    missing &= ~FP_MISSING_TAIL;
   }
 
-  double fm = match_fooid_fp(a->r, a->dom, b->r, b->dom);
-  double cp = match_chromab(a->cprint, a->cprint_len, b->cprint, b->cprint_len);
+  return missing;
+}
+
+double match_cpfm_partial(uint16_t missing,
+                          uint32_t songlen_a, const uint8_t *restrict r_a,
+                          const uint8_t *restrict dom_a,
+                          const int32_t *restrict cp_a, size_t cp_a_len,
+                          uint32_t songlen_b, const uint8_t *restrict r_b,
+                          const uint8_t *restrict dom_b,
+                          const int32_t *restrict cp_b, size_t cp_b_len)
+{
+  return fpmatch_cpfm_partial(missing, songlen_a, r_a, dom_a, cp_a, cp_a_len,
+                              songlen_b, r_b, dom_b, cp_b, cp_b_len);
+}
 
-  return ((0.012985 + .263439 * fm + -.683234 * cp + 1.592623 * pow(cp, 3)) + 0.06348) / 1.2489;
+double match_cpfm(FPrint *restrict a, FPrint *restrict b)
+{
+  return fpmatch_cpfm(a, b);
 }
 
 void fprint_merge(FPrintUnion *restrict u,
@@ -920,140 +1627,22 @@ void fprint_merge(FPrintUnion *restrict u,
 
   u->min_songlen = min_u32(a->songlen, b->songlen);
   u->max_songlen = max_u32(a->songlen, b->songlen);
+  u->missing = fprint_missing(a) | fprint_missing(b);
 }
 
 void fprint_merge_one(FPrintUnion *restrict u, const FPrint *restrict a)
 {
-  size_t cp_len = a->cprint_len;
-
-  uint32_t *restrict r_u = (uint32_t *)u->r;
-  const uint32_t *restrict r_a = (uint32_t *)a->r;
-  for (size_t i = 0; i < R_SIZE32; i++)
-  {
-    r_u[i] |= r_a[i];
-  }
-
-  uint8_t *restrict dom_u = u->dom;
-  const uint8_t *restrict dom_a = a->dom;
-  uint32_t *restrict dom32_u = (uint32_t *)dom_u;
-  const uint32_t *restrict dom32_a = (uint32_t *)dom_a;
-  for (size_t j = 0; j < DOM_LEN32; j++)
-  {
-    dom32_u[j] |= dom32_a[j];
-  }
-  ((uint16_t *restrict)dom_u)[DOM_END16] |= ((const uint16_t *)dom_a)[DOM_END16];
-
-  uint32_t *restrict cp_u = (uint32_t *)u->cprint;
-  const uint32_t *restrict cp_a = (uint32_t *)a->cprint;
-  for (size_t l = 0; l < cp_len; l++)
-  {
-    cp_u[l] |= cp_a[l];
-  }
-
-  if (u->min_songlen > 0)
-  {
-    u->min_songlen = min_u32(u->min_songlen, a->songlen);
-  }
-  else
-  {
-    u->min_songlen = a->songlen;
-  }
-  u->max_songlen = max_u32(u->max_songlen, a->songlen);
+  fpmatch_merge_one(u, a);
 }
 
 void fprint_merge_one_union(FPrintUnion *restrict u, const FPrintUnion *restrict a)
 {
-  size_t cp_len = a->cprint_len;
-
-  uint32_t *restrict r_u = (uint32_t *)u->r;
-  const uint32_t *restrict r_a = (uint32_t *)a->r;
-  for (size_t i = 0; i < R_SIZE32; i++)
-  {
-    r_u[i] |= r_a[i];
-  }
-
-  uint8_t *restrict dom_u = u->dom;
-  const uint8_t *restrict dom_a = a->dom;
-  uint32_t *restrict dom32_u = (uint32_t *)dom_u;
-  const uint32_t *restrict dom32_a = (uint32_t *)dom_a;
-  for (size_t j = 0; j < DOM_LEN32; j++)
-  {
-    dom32_u[j] |= dom32_a[j];
-  }
-  ((uint16_t *restrict)dom_u)[DOM_END16] |= ((const uint16_t *)dom_a)[DOM_END16];
-
-  uint32_t *restrict cp_u = (uint32_t *)u->cprint;
-  const uint32_t *restrict cp_a = (uint32_t *)a->cprint;
-  for (size_t l = 0; l < cp_len; l++)
-  {
-    cp_u[l] |= cp_a[l];
-  }
-
-  if (u->min_songlen > 0)
-  {
-    u->min_songlen = min_u32(u->min_songlen, a->min_songlen);
-  }
-  else
-  {
-    u->min_songlen = a->min_songlen;
-  }
-  u->max_songlen = max_u32(u->max_songlen, a->max_songlen);
+  fpmatch_merge_one_union(u, a);
 }
 
 float match_fprint_merge(const FPrint *restrict a, const FPrintUnion *restrict u)
 {
-  const double maxdiff = (double)MAX_TOTDIFF;
-  uint32_t diff_r = 0;
-  uint32_t diff_dom = 0;
-  float perc = 0.0f;
-  float conf = 0.0f;
-  float fooid = 0.0f;
-  size_t cp_len = min_st(u->cprint_len, a->cprint_len);
-  uint32_t diff_cp = 0;
-  float chroma = 0.0f;
-
-  uint32_t rdiff[4] = {0, 0, 0, 0};
-  const uint32_t *restrict r_a = (const uint32_t *)a->r;
-  const uint32_t *restrict r_u = (const uint32_t *)u->r;
-  for (size_t i = 0; i < R_SIZE32; i++)
-  {
-    rdiff_fooid32(r_a[i] ^ (r_a[i] & r_u[i]), rdiff);
-  }
-  diff_r = rdiff[1] + rdiff[2] * 4 + rdiff[3] * 9;
-
-  const uint8_t *restrict dom_a = a->dom;
-  const uint8_t *restrict dom_u = u->dom;
-  const uint32_t *restrict dom32_a = (const uint32_t *)dom_a;
-  const uint32_t *restrict dom32_u = (const uint32_t *)dom_u;
-  for (size_t j = 0; j < DOM_LEN32; j++)
-  {
-    diff_dom += pop32(dom32_a[j] ^ (dom32_a[j] & dom32_u[j]));
-  }
-  uint16_t a_d16 = ((uint16_t *)dom_a)[DOM_END16];
-  diff_dom += pop16(a_d16 ^ (a_d16 & ((uint16_t *)dom_u)[DOM_END16]));
-
-  perc = (float)(diff_r + diff_dom) / maxdiff;
-  conf = ((1.0 - perc) - 0.5) * 2.0;
-  fooid = fmaxf(fminf(conf, 1.0), 0.0);
-
-  const uint32_t *restrict cp_a = (const uint32_t *)a->cprint;
-  const uint32_t *restrict cp_u = (const uint32_t *)u->cprint;
-  uint32_t x, y;
-  for (size_t k = 0; k < cp_len; k++)
-  {
-    x = cp_a[k];
-    y = cp_u[k];
-    diff_cp += ((x == (x & y)) || cmp_low_bit(x, y));
-  }
-
-  if (cp_len > 0)
-  {
-    chroma = (float)diff_cp / (float)a->cprint_len;
-  }
-
-  float comb = ((0.012985 + .263439 * fooid + -.683234 * chroma + 1.592623 * (chroma * chroma * chroma)) + 0.06348) / 1.2489;
-
-  return fmaxf(fminf(comb, 1.0), 0.0);
+  return fpmatch_fprint_merge(a, u);
 }
 
 float match_merges(const FPrintUnion *restrict u1, const FPrintUnion *restrict u2)
@@ -1076,7 +1665,7 @@ float match_merges(const FPrintUnion *restrict u1, const FPrintUnion *restrict u
   const uint32_t *restrict r_u2 = (const uint32_t *)u2->r;
   for (size_t i = 0; i < R_SIZE32; i++)
   {
-    rdiff_fooid32(r_u1[i] ^ (r_u1[i] & r_u2[i]), rdiff);
+    fpmatch_rdiff32(r_u1[i] ^ (r_u1[i] & r_u2[i]), rdiff);
   }
   diff_r = rdiff[1] + rdiff[2] * 4 + rdiff[3] * 9;
 
@@ -1086,10 +1675,10 @@ float match_merges(const FPrintUnion *restrict u1, const FPrintUnion *restrict u
   const uint32_t *restrict dom32_u2 = (const uint32_t *)dom_u2;
   for (size_t j = 0; j < DOM_LEN32; j++)
   {
-    diff_dom += pop32(dom32_u1[j] ^ (dom32_u1[j] & dom32_u2[j]));
+    diff_dom += fpmatch_pop32(dom32_u1[j] ^ (dom32_u1[j] & dom32_u2[j]));
   }
   uint16_t u1_d16 = ((uint16_t *)dom_u1)[DOM_END16];
-  diff_dom += pop16(u1_d16 ^ (u1_d16 & ((uint16_t *)dom_u2)[DOM_END16]));
+  diff_dom += fpmatch_pop16(u1_d16 ^ (u1_d16 & ((uint16_t *)dom_u2)[DOM_END16]));
 
   perc = (float)(diff_r + diff_dom) / maxdiff;
   conf = ((1.0 - perc) - 0.5) * 2.0;
@@ -1102,7 +1691,7 @@ float match_merges(const FPrintUnion *restrict u1, const FPrintUnion *restrict u
   {
     x = cp_u1[k];
     y = cp_u2[k];
-    diff_cp += ((x == (x & y)) || cmp_low_bit(x, y));
+    diff_cp += ((x == (x & y)) || fpmatch_low_bit_eq(x, y));
   }
 
   if (cp_len > 0)
@@ -1137,7 +1726,7 @@ float try_match_merges(const FPrintUnion *restrict u1,
   {
     x = r_u1[i];
     y = (r_u2[i] | r_a[i]);
-    rdiff_fooid32(x ^ (x & y), rdiff);
+    fpmatch_rdiff32(x ^ (x & y), rdiff);
   }
   diff_r = rdiff[1] + rdiff[2] * 4 + rdiff[3] * 9;
 
@@ -1151,11 +1740,11 @@ float try_match_merges(const FPrintUnion *restrict u1,
   {
     x = dom32_u1[j];
     y = (dom32_u2[j] | dom32_a[j]);
-    diff_dom += pop32(x ^ (x & y));
+    diff_dom += fpmatch_pop32(x ^ (x & y));
   }
   uint16_t z1 = ((const uint16_t *)dom_u1)[DOM_END16];
   uint16_t z2 = ((const uint16_t *)dom_u2)[DOM_END16] | ((const uint16_t *)dom_a)[DOM_END16];
-  diff_dom += pop16(z1 ^ (z1 & z2));
+  diff_dom += fpmatch_pop16(z1 ^ (z1 & z2));
 
   perc = (double)(diff_r + diff_dom) / maxdiff;
   conf = ((1.0 - perc) - 0.5) * 2.0;
@@ -1170,7 +1759,7 @@ float try_match_merges(const FPrintUnion *restrict u1,
   {
     x = cp_u1[k];
     y = (cp_u2[k] | cp_a[k]);
-    diff_cp += ((x == (x & y)) || cmp_low_bit(x, y));
+    diff_cp += ((x == (x & y)) || fpmatch_low_bit_eq(x, y));
   }
   if (u1->cprint_len > cp_len)
   {
@@ -1181,7 +1770,7 @@ float try_match_merges(const FPrintUnion *restrict u1,
       {
         x = cp_u1[l];
         y = cp_a[l];
-        diff_cp += ((x == (x & y)) || cmp_low_bit(x, y));
+        diff_cp += ((x == (x & y)) || fpmatch_low_bit_eq(x, y));
       }
     }
     else if (u2->cprint_len > cp_len)
@@ -1191,7 +1780,7 @@ float try_match_merges(const FPrintUnion *restrict u1,
       {
         x = cp_u1[l];
         y = cp_u2[l];
-        diff_cp += ((x == (x & y)) || cmp_low_bit(x, y));
+        diff_cp += ((x == (x & y)) || fpmatch_low_bit_eq(x, y));
       }
     }
   }
@@ -1209,6 +1798,9 @@ float try_match_merges(const FPrintUnion *restrict u1,
 // max 24 (10 each for songlen, bit_rate, num_errors) + 3 for "(,," + 1 '\0'
 #define BASE_SIZE 24
 #define BASEFMT "(%u,%u,%u,"
+// FPrint.missing, when nonzero, follows the closing ')': ":65535\0"
+#define MISSING_SIZE 7
+#define MISSINGFMT ":%u"
 
 char *fprint_to_string(const FPrint *fp)
 {
@@ -1238,7 +1830,7 @@ char *fprint_to_string(const FPrint *fp)
   base_sz = snprintf(base, BASE_SIZE, BASEFMT,
                      fp->songlen, fp->bit_rate, fp->num_errors);
   // + 2 for following ")\0"; 9 to allow for '-'
-  str_sz = base_sz + (2 * R_SIZE + 1) + (2 * DOM_SIZE + 1) + (12 * cprint_len) + 2;
+  str_sz = base_sz + (2 * R_SIZE + 1) + (2 * DOM_SIZE + 1) + (12 * cprint_len) + 2 + MISSING_SIZE;
 
   tmpstr = calloc(str_sz, sizeof(char));
   if (!tmpstr)
@@ -1267,9 +1859,15 @@ char *fprint_to_string(const FPrint *fp)
     // 32-bit int max size is 10 chars + 2 ("-"? and " \0")
     out_len += snprintf(&tmpstr[out_len], 13, "%d ", cprint[j]);
   }
-  // cheat: pull back from final " "
-  out_len -= 1;
+  // cheat: pull back from final " " (there is none for an empty cprint)
+  if (cprint_len > 0)
+    out_len -= 1;
   strncpy(&tmpstr[out_len++], ")", 2);
+  if (fprint_missing(fp))
+  {
+    out_len += snprintf(&tmpstr[out_len], MISSING_SIZE, MISSINGFMT,
+                        fprint_missing(fp));
+  }
 
   outstr = realloc(tmpstr, ((size_t)out_len + 1) * sizeof(*tmpstr));
 
@@ -1307,8 +1905,8 @@ FPrint *fprint_from_string(const char *fp_str)
 
   //   7 for minimum: "(0,0,0,"
   // + 2 ",," after R and DOM
-  // + 2 "0)" for minimum cprint and finishing ')'
-  if ((fp_str_len = strlen(fp_str)) < (11 + 2 * R_SIZE + 2 * DOM_SIZE))
+  // + 1 ")" for an empty cprint and finishing ')'
+  if ((fp_str_len = strlen(fp_str)) < (10 + 2 * R_SIZE + 2 * DOM_SIZE))
   {
     fprintf(stderr, "invalid string length: %d\n", fp_str_len);
     return NULL;
@@ -1379,6 +1977,11 @@ FPrint *fprint_from_string(const char *fp_str)
               fp_str_ix - 1);
       goto error;
     }
+    else if (c == ')' && cp_char_ix == 0 && cprint_ix == 0)
+    {
+      // empty cprint: no chromaprint was extracted
+      break;
+    }
     else if (c == ' ' || c == ')')
     {
       cpn_str[cp_char_ix] = '\0';
@@ -1412,6 +2015,12 @@ FPrint *fprint_from_string(const char *fp_str)
       goto error;
     }
   }
+  // the loop also ends at the terminating NUL, past which nothing is read
+  if (c != ')')
+  {
+    fprintf(stderr, "missing ')' at the end of the cprint\n");
+    goto error;
+  }
 
   // based on cprint[cprint_ix++], cprint_ix == n items
   cprint_len = cprint_ix;
@@ -1427,6 +2036,17 @@ FPrint *fprint_from_string(const char *fp_str)
   memcpy(fp->r, r, sizeof(r));
   memcpy(fp->dom, dom, sizeof(dom));
   memcpy(fp->cprint, cprint, cprint_len * sizeof(*cprint));
+  if (fp_str[fp_str_ix] == ':')
+  {
+    fp->missing = (uint16_t)(strtoul(&fp_str[fp_str_ix + 1], NULL, 10) &
+                             FP_MISSING_ALL);
+  }
+  else
+  {
+    // no suffix: the parts that are empty are missing
+    fp->missing = FP_MISSING_FOOID | FP_MISSING_CHROMA;
+    fp->missing = fprint_missing(fp);
+  }
 
   if (cprint)
   {
@@ -1446,3 +2066,46 @@ error:
     free_fprint(fp);
   return NULL;
 }
+
+uint8_t *fprint_to_bytes(const FPrint *fp)
+{
+  PackedFP *p = NULL;
+
+  if (fp->cprint_len > UINT32_MAX)
+    return NULL;
+  p = (PackedFP *)calloc(1, PACKED_FP_SIZE(max_st(fp->cprint_len, 1)));
+  if (!p)
+    return NULL;
+
+  p->cprint_len = (uint32_t)fp->cprint_len;
+  p->songlen = fp->songlen;
+  p->bit_rate = fp->bit_rate;
+  p->num_errors = fp->num_errors;
+  p->missing = fprint_missing(fp);
+  memcpy(p->r, fp->r, R_SIZE);
+  memcpy(p->dom, fp->dom, DOM_SIZE);
+  memcpy(p->cprint, fp->cprint, fp->cprint_len * sizeof(int32_t));
+
+  return (uint8_t *)p;
+}
+
+FPrint *fprint_from_bytes(const uint8_t *bytes)
+{
+  const PackedFP *p = (const PackedFP *)bytes;
+  FPrint *fp = NULL;
+
+  if (p->cprint_len > INT_MAX || !(fp = new_fprint((int)p->cprint_len)))
+    return NULL;
+
+  fp->cprint_len = p->cprint_len;
+  fp->songlen = p->songlen;
+  fp->bit_rate = p->bit_rate;
+  fp->num_errors = p->num_errors;
+  memcpy(fp->r, p->r, R_SIZE);
+  memcpy(fp->dom, p->dom, DOM_SIZE);
+  memcpy(fp->cprint, p->cprint, p->cprint_len * sizeof(int32_t));
+  fp->missing = p->missing;
+  fp->missing = fprint_missing(fp);
+
+  return fp;
+}
@@ -15,6 +15,8 @@ extern "C"
 {
 #endif
 
+#include <math.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <libfooid/fooid.h>
 
@@ -27,8 +29,31 @@ extern "C"
 #define DOM_LEN32 DOM_SIZE8 / sizeof(uint32_t)
 #define DOM_END16 DOM_SIZE8 / sizeof(uint16_t) - 1
 
+// capture lengths in seconds (FPOptions.duration).  libfooid needs about
+// 10 s of sound; the preview tier is a cheap chromaprint-only first stage.
+#define FP_DEFAULT_DURATION 60
+#define FP_MIN_DURATION 10
+#define FP_PREVIEW_DURATION 15
+
 // based on 60-second samples
 #define KNOWN_CPRINT_LEN 948
+// cprint length of a capture of `secs` seconds (~15.8 per second)
+#define FP_CPRINT_LEN(secs) \
+  ((size_t)ceil((double)(secs) * KNOWN_CPRINT_LEN / FP_DEFAULT_DURATION))
+
+// extractors get_fingerprint can run (FPOptions.extractors)
+#define FP_EXTRACT_FOOID 0x1
+#define FP_EXTRACT_CHROMA 0x2
+#define FP_EXTRACT_ALL (FP_EXTRACT_FOOID | FP_EXTRACT_CHROMA)
+
+// FPrint.missing: parts of a fingerprint that were not extracted.
+// Without fooid r and dom are zero; without chroma cprint_len is 0.
+// FP_MISSING_TAIL: the capture stopped short of FP_DEFAULT_DURATION, so
+// the parts describe only the start of the song.
+#define FP_MISSING_FOOID 0x1
+#define FP_MISSING_CHROMA 0x2
+#define FP_MISSING_TAIL 0x4
+#define FP_MISSING_ALL (FP_MISSING_FOOID | FP_MISSING_CHROMA | FP_MISSING_TAIL)
 
 #if defined(__x86_64__) || defined(__ppc64__)
 #define _64_BIT
@@ -42,6 +67,10 @@ extern "C"
     int32_t num_errors;
     uint8_t r[R_SIZE];
     uint8_t dom[DOM_SIZE];
+    // FP_MISSING_* bits; sits in what was padding before cprint, so
+    // fingerprints stored before it existed may hold anything here: read
+    // it through fprint_missing
+    uint16_t missing;
     int32_t cprint[1];
   } FPrint;
 
@@ -53,39 +82,35 @@ extern "C"
     uint32_t max_songlen;
     uint8_t r[R_SIZE];
     uint8_t dom[DOM_SIZE];
+    // FP_MISSING_* bits of any fingerprint merged into the union
+    uint16_t missing;
     int32_t cprint[1];
   } FPrintUnion;
 
 #ifdef _64_BIT
-  extern inline size_t max_st(size_t x, size_t y);
-  extern inline size_t max_st(size_t x, size_t y)
+  static inline size_t max_st(size_t x, size_t y)
   {
     return ((((size_t)(-((int64_t)(y < x)))) & (x ^ y)) ^ y);
   }
-  extern inline size_t min_st(size_t x, size_t y);
-  extern inline size_t min_st(size_t x, size_t y)
+  static inline size_t min_st(size_t x, size_t y)
   {
     return ((((size_t)(-((int64_t)(y > x)))) & (x ^ y)) ^ y);
   }
 #else
-extern inline size_t max_st(size_t x, size_t y);
-extern inline size_t max_st(size_t x, size_t y)
+static inline size_t max_st(size_t x, size_t y)
 {
   return ((((size_t)(-((int32_t)(y < x)))) & (x ^ y)) ^ y);
 }
-extern inline size_t min_st(size_t x, size_t y);
-extern inline size_t min_st(size_t x, size_t y)
+static inline size_t min_st(size_t x, size_t y)
 {
   return ((((size_t)(-((int32_t)(y > x)))) & (x ^ y)) ^ y);
 }
 #endif
-  extern inline uint32_t max_u32(uint32_t x, uint32_t y);
-  extern inline uint32_t max_u32(uint32_t x, uint32_t y)
+  static inline uint32_t max_u32(uint32_t x, uint32_t y)
   {
     return ((((uint32_t)(-((int32_t)(y < x)))) & (x ^ y)) ^ y);
   }
-  extern inline uint32_t min_u32(uint32_t x, uint32_t y);
-  extern inline uint32_t min_u32(uint32_t x, uint32_t y)
+  static inline uint32_t min_u32(uint32_t x, uint32_t y)
   {
     return ((((uint32_t)(-((int32_t)(y > x)))) & (x ^ y)) ^ y);
   }
@@ -95,6 +120,27 @@ extern inline size_t min_st(size_t x, size_t y)
 #define CALC_FP_SIZE(cprint_len) \
   sizeof(FPrint) + (max_st((cprint_len), 1) - 1) * sizeof(int32_t)
 
+  /* FPrint as a flat run of bytes (native byte order) for files and
+   * caches: fixed-width fields only, and exactly PACKED_FP_SIZE(cprint_len)
+   * long, with no trailing padding.
+   */
+  typedef struct PackedFP
+  {
+    uint32_t cprint_len;
+    uint32_t songlen;
+    int32_t bit_rate;
+    int32_t num_errors;
+    uint16_t missing;
+    uint16_t reserved;
+    uint8_t r[R_SIZE];
+    uint8_t dom[DOM_SIZE];
+    uint8_t pad[2];
+    int32_t cprint[1];
+  } PackedFP;
+
+#define PACKED_FP_SIZE(cprint_len) \
+  (offsetof(PackedFP, cprint) + (size_t)(cprint_len) * sizeof(int32_t))
+
 #define FP_EXACT_CUTOFF 0.98
 #define FP_ISNEQ(val) ((val) <= FP_EXACT_CUTOFF)
 #define FP_ISEQ(val) ((val) > FP_EXACT_CUTOFF)
@@ -102,6 +148,20 @@ extern inline size_t min_st(size_t x, size_t y)
 #define FP_NOMATCH(val) ((val) <= FP_MATCH_CUTOFF)
 #define FP_ISMATCH(val) ((val) > FP_MATCH_CUTOFF)
 
+// match_cpfm never matches songs whose lengths differ by more than this
+// fraction of the shorter song.  FP_SONGLEN_LO/HI give the (slightly
+// generous) range of songlen that may match a song of length `s`; used by
+// the postgres extension to prune partitions and index ranges.
+#define FP_SONGLEN_TOLERANCE 0.1
+#define FP_SONGLEN_LO(s) \
+  ((uint32_t)floor((double)(s) / (1.0 + FP_SONGLEN_TOLERANCE)))
+#define FP_SONGLEN_HI(s) \
+  ((uint32_t)ceil((double)(s) * (1.0 + FP_SONGLEN_TOLERANCE)))
+// the exact gate applied by match_cpfm; false means the score is 0.0
+#define FP_SONGLEN_MAY_MATCH(sl_a, sl_b)                 \
+  (fabsf((float)(sl_a) - (float)(sl_b)) <=               \
+   ((float)FP_SONGLEN_TOLERANCE * fmin((float)(sl_a), (float)(sl_b))))
+
   FPrint *new_fprint(int cprint_len);
 
   void free_fprint(FPrint *fp);
@@ -110,11 +170,55 @@ extern inline size_t min_st(size_t x, size_t y)
    *  \brief return a t_fooid* FooID structure containing the fingerprint, or NULL
    *    \param   filename    const char* to an existing audio music file
    *    \param   error       int* will be set with error code on error
-   *    \param   verbose     int, if nonzero print metadata to stdout
+   *    \param   verbose     int, if nonzero print metadata to stderr
    *                         (temporary; may remove in future versions)
    */
   FPrint *get_fingerprint(const char *filename, int *error, int verbose);
 
+  struct FPCache;
+
+  typedef struct FPOptions
+  {
+    // FP_EXTRACT_* bits; an extractor left out is never initialized or
+    // fed, and the result has the matching FP_MISSING_* bit set
+    int extractors;
+    // seconds of audio to decode, at least FP_MIN_DURATION if fooid is
+    // extracted and at most FP_DEFAULT_DURATION (longer is cut to it); 0
+    // means FP_DEFAULT_DURATION
+    int duration;
+    // feature cache (fpcache.h): on a hit the fingerprint is rebuilt from
+    // the cached features without decoding.  Otherwise the file's audio
+    // is hashed (fp_audio_hash) and a fingerprint already computed for the
+    // same audio, e.g. before the file was retagged, is returned as is.
+    // NULL disables caching.
+    struct FPCache *cache;
+  } FPOptions;
+
+  /*! fp_options_init
+   *  \brief set opts to the defaults get_fingerprint uses
+   */
+  void fp_options_init(FPOptions *opts);
+
+  /*! fp_options_preview
+   *  \brief set opts to the preview tier: FP_PREVIEW_DURATION seconds,
+   *  chromaprint only.  Previews match full fingerprints on the start of
+   *  the song (see match_cpfm).
+   */
+  void fp_options_preview(FPOptions *opts);
+
+  /*! fprint_missing
+   *  \brief FPrint.missing, keeping only bits the fingerprint bears out
+   *  (e.g. FP_MISSING_CHROMA only with an empty cprint), so stray bytes
+   *  in fingerprints stored before the field existed read as complete
+   */
+  uint16_t fprint_missing(const FPrint *fp);
+
+  /*! get_fingerprint_opts
+   *  \brief get_fingerprint with options; opts may be NULL
+   */
+  FPrint *get_fingerprint_opts(const char *filename, const FPOptions *opts,
+                               int *error, int verbose);
+
   /*! ffmpeg_init
    *
    *  \brief Initialize ffmpeg structures; must be called once before
@@ -168,8 +272,46 @@ extern inline size_t min_st(size_t x, size_t y)
   double match_chromat(const int32_t *restrict cp1, size_t cp1_len,
                        const int32_t *restrict cp2, size_t cp2_len);
 
+  /*! match_cpfm
+   *  \brief combined fooid/chromaprint score of a and b.  If either lacks
+   *  one part (FPrint.missing) the score comes from the other part alone,
+   *  match_chromab or match_fooid_fp, put through match_cpfm_combine as
+   *  if the missing part had scored the same, so the FP_*_CUTOFF values
+   *  hold for partial pairs too.  If either is a short capture
+   *  (FP_MISSING_TAIL) the part is match_chromab over the cprint both
+   *  captures cover, since fooid summarizes the whole capture.
+   */
   double match_cpfm(FPrint *restrict a, FPrint *restrict b);
 
+  /*! match_cpfm_combine
+   *  \brief the score match_cpfm_raw gives a match_fooid_fp score fm and a
+   *  match_chromab score cp, for matchers that compute the two apart
+   */
+  double match_cpfm_combine(double fm, double cp);
+
+  /*! match_cpfm_raw
+   *  \brief match_cpfm over separately stored fields, for complete
+   *  fingerprints that do not live in an FPrint (e.g. a column-wise FPCorpus)
+   */
+  double match_cpfm_raw(uint32_t songlen_a, const uint8_t *restrict r_a,
+                        const uint8_t *restrict dom_a,
+                        const int32_t *restrict cp_a, size_t cp_a_len,
+                        uint32_t songlen_b, const uint8_t *restrict r_b,
+                        const uint8_t *restrict dom_b,
+                        const int32_t *restrict cp_b, size_t cp_b_len);
+
+  /*! match_cpfm_partial
+   *  \brief match_cpfm over separately stored fields, where missing is
+   *  fprint_missing of one fingerprint or'ed with that of the other
+   */
+  double match_cpfm_partial(uint16_t missing,
+                            uint32_t songlen_a, const uint8_t *restrict r_a,
+                            const uint8_t *restrict dom_a,
+                            const int32_t *restrict cp_a, size_t cp_a_len,
+                            uint32_t songlen_b, const uint8_t *restrict r_b,
+                            const uint8_t *restrict dom_b,
+                            const int32_t *restrict cp_b, size_t cp_b_len);
+
   void fprint_merge(FPrintUnion *restrict u,
                     const FPrint *restrict a,
                     const FPrint *restrict b);
@@ -186,10 +328,37 @@ extern inline size_t min_st(size_t x, size_t y)
                          const FPrintUnion *restrict u2,
                          const FPrint *restrict a);
 
+  /*! fprint_to_string
+   *  \brief "(songlen,bit_rate,num_errors,R,DOM,CPRINT)", followed by
+   *  ":<missing>" for a partial fingerprint
+   */
   char *fprint_to_string(const FPrint *fp);
 
+  /*! fprint_from_string
+   *  \brief parse fprint_to_string output.  Without a ":<missing>" suffix
+   *  an empty cprint or all-zero r and dom mark the part as missing.
+   */
   FPrint *fprint_from_string(const char *fp_str);
 
+  /*! fprint_to_bytes
+   *  \brief malloc'd PackedFP of PACKED_FP_SIZE(fp->cprint_len) bytes
+   */
+  uint8_t *fprint_to_bytes(const FPrint *fp);
+
+  /*! fprint_from_bytes
+   *  \brief new FPrint from fprint_to_bytes output (free with free_fprint)
+   */
+  FPrint *fprint_from_bytes(const uint8_t *bytes);
+
+  /*! fp_audio_hash
+   *  \brief 64-bit hash of the compressed audio in filename: the payload of
+   *  every packet of the audio stream, read without decoding.  Tags the
+   *  demuxer does not strip (trailing ID3v1 and APEv2) are left out, so
+   *  copies of a file that differ only in their tags hash alike.  Returns
+   *  0, or an FFmpeg (negative) or errno value.
+   */
+  int fp_audio_hash(const char *filename, uint64_t *hash);
+
 #ifdef __cplusplus
 }
 #endif
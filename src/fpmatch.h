@@ -0,0 +1,425 @@
+/*
+ *  fpmatch.h
+ *
+ *  inline matching kernels shared by libfingerprint and pgfprint
+ *
+ *  match_cpfm and the union matchers are called once per index tuple by
+ *  the GiST support functions.  Called through the shared library they are
+ *  opaque to the compiler: a PLT call each, and loops over a run-time
+ *  length.  The kernels here are static inline, so code that includes this
+ *  header gets them inlined, and every loop over cprint checks for the
+ *  FPMATCH_KEY_CP_LEN window the index keys hold and runs a copy of itself
+ *  with that length as a constant, which the compiler unrolls and
+ *  vectorizes.
+ *
+ *  libfingerprint's match_* functions are these kernels; the results are
+ *  the same whichever is called.
+ *
+ *  Copyright 2010 Zatisfi, LLC. MIT License, 2025
+ */
+
+#ifndef _FPMATCH_H
+#define _FPMATCH_H
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#include <limits.h>
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "fplib.h"
+
+// cprint values an index key keeps (MAX_KEY_CP_LEN in pgfprint)
+#define FPMATCH_KEY_CP_LEN 240
+
+// R is scaled (max 25,056: 2x what reference (java) lib has)
+#define FPMATCH_MAX_RDIFF (9 * R_SIZE * CHAR_BIT)
+// reference calculated max diff arithmetically
+#define FPMATCH_MAX_DOMDIFF (DOM_SIZE * CHAR_BIT)
+#define FPMATCH_MAX_TOTDIFF (FPMATCH_MAX_RDIFF + FPMATCH_MAX_DOMDIFF)
+
+#define FPMATCH_INLINE static inline __attribute__((always_inline))
+
+  FPMATCH_INLINE uint32_t fpmatch_pop32(uint32_t x)
+  {
+    x = x - ((x >> 1) & 0x55555555);
+    x = (x & 0x33333333) + ((x >> 2) & 0x33333333);
+    return (((x + (x >> 4)) & 0x0F0F0F0F) * 0x01010101) >> 24;
+  }
+
+  FPMATCH_INLINE uint32_t fpmatch_pop16(uint16_t x)
+  {
+    x = x - ((x >> 1) & 0x5555);
+    x = (x & 0x3333) + ((x >> 2) & 0x3333);
+    return (((x + (x >> 4)) & 0x0F0F) * 0x0101) >> 8;
+  }
+
+  /* r and dom need not be aligned: a corpus' dom column has a 66-byte
+   * stride.  memcpy loads are a plain load where unaligned access is
+   * allowed and safe where it is not.
+   */
+  FPMATCH_INLINE uint32_t fpmatch_load32(const uint8_t *p)
+  {
+    uint32_t x;
+    memcpy(&x, p, sizeof(x));
+    return x;
+  }
+
+  FPMATCH_INLINE uint16_t fpmatch_load16(const uint8_t *p)
+  {
+    uint16_t x;
+    memcpy(&x, p, sizeof(x));
+    return x;
+  }
+
+  // histogram of the 2-bit differences in x
+  FPMATCH_INLINE void fpmatch_rdiff32(uint32_t x, uint32_t *restrict rdiff)
+  {
+    rdiff[(x & 0x3)]++;
+    for (uint32_t i = 1; i < 16; i++)
+    {
+      rdiff[((x >> (i << 1)) & 0x3)]++;
+    }
+  }
+
+  // match_chromab's test: same lowest set bit
+  FPMATCH_INLINE uint32_t fpmatch_low_bit_eq(uint32_t x, uint32_t y)
+  {
+    return (x & (-x)) == (y & (-y));
+  }
+
+  /*! fpmatch_fooid_fp
+   *  \brief match_fooid_fp
+   */
+  FPMATCH_INLINE double fpmatch_fooid_fp(const uint8_t *restrict r_a,
+                                         const uint8_t *restrict dom_a,
+                                         const uint8_t *restrict r_b,
+                                         const uint8_t *restrict dom_b)
+  {
+    const double maxdiff = (double)FPMATCH_MAX_TOTDIFF;
+    uint32_t diff_r = 0;
+    uint32_t diff_dom = 0;
+    double perc = 0.0;
+    double conf = 0.0;
+    uint32_t rdiff[4] = {0, 0, 0, 0};
+
+    // scaled popcount for r (slow!)
+    for (size_t i = 0; i < R_SIZE32; i++)
+    {
+      fpmatch_rdiff32(fpmatch_load32(&r_a[4 * i]) ^ fpmatch_load32(&r_b[4 * i]),
+                      rdiff);
+    }
+    diff_r = rdiff[1] + rdiff[2] * 4 + rdiff[3] * 9;
+
+    // popcount for dom
+    for (size_t i = 0; i < DOM_LEN32; i += 2)
+    {
+      diff_dom += fpmatch_pop32(fpmatch_load32(&dom_a[4 * i]) ^
+                                fpmatch_load32(&dom_b[4 * i]));
+      diff_dom += fpmatch_pop32(fpmatch_load32(&dom_a[4 * i + 4]) ^
+                                fpmatch_load32(&dom_b[4 * i + 4]));
+    }
+    diff_dom += fpmatch_pop16(fpmatch_load16(&dom_a[2 * (DOM_END16)]) ^
+                              fpmatch_load16(&dom_b[2 * (DOM_END16)]));
+
+    // below is pretty much verbatim from the reference
+    perc = (double)(diff_r + diff_dom) / maxdiff;
+    conf = ((1.0 - perc) - 0.5) * 2.0;
+
+    return fmax(fmin(conf, 1.0), 0.0);
+  }
+
+  FPMATCH_INLINE uint32_t fpmatch_chromab_count(const int32_t *restrict cp1,
+                                                const int32_t *restrict cp2,
+                                                size_t n)
+  {
+    const uint32_t *cp1_32 = (const uint32_t *)cp1;
+    const uint32_t *cp2_32 = (const uint32_t *)cp2;
+    uint32_t sm = 0;
+
+    for (size_t i = 0; i < n; i++)
+      sm += fpmatch_low_bit_eq(cp1_32[i], cp2_32[i]);
+    return sm;
+  }
+
+  /*! fpmatch_chromab
+   *  \brief match_chromab
+   */
+  FPMATCH_INLINE double fpmatch_chromab(const int32_t *restrict cp1,
+                                        size_t cp1_len,
+                                        const int32_t *restrict cp2,
+                                        size_t cp2_len)
+  {
+    size_t n = min_st(cp1_len, cp2_len);
+    uint32_t sm = 0;
+
+    if (n == 0)
+      return 0.0;
+    if (n == FPMATCH_KEY_CP_LEN)
+      sm = fpmatch_chromab_count(cp1, cp2, FPMATCH_KEY_CP_LEN);
+    else
+      sm = fpmatch_chromab_count(cp1, cp2, n);
+    if (sm == 0)
+      return 0.0;
+
+    return (double)sm / (double)max_st(cp1_len, cp2_len);
+  }
+
+  /*! fpmatch_cpfm_combine
+   *  \brief match_cpfm_combine
+   */
+  FPMATCH_INLINE double fpmatch_cpfm_combine(double fm, double cp)
+  {
+    return ((0.012985 + .263439 * fm + -.683234 * cp + 1.592623 * pow(cp, 3)) + 0.06348) / 1.2489;
+  }
+
+  /*! fpmatch_cpfm_one_part
+   *  \brief the combined score of a pair compared on one part only, whose
+   *  score is s: the missing part is taken to agree as well as the other,
+   *  so FP_MATCH_CUTOFF and FP_EXACT_CUTOFF ask as much of it as of a
+   *  complete pair scoring s on both parts
+   */
+  FPMATCH_INLINE double fpmatch_cpfm_one_part(double s)
+  {
+    return fpmatch_cpfm_combine(s, s);
+  }
+
+  /*! fpmatch_cpfm_partial
+   *  \brief match_cpfm_partial (match_cpfm_raw if missing is 0)
+   */
+  FPMATCH_INLINE double fpmatch_cpfm_partial(uint16_t missing,
+                                             uint32_t songlen_a,
+                                             const uint8_t *restrict r_a,
+                                             const uint8_t *restrict dom_a,
+                                             const int32_t *restrict cp_a,
+                                             size_t cp_a_len,
+                                             uint32_t songlen_b,
+                                             const uint8_t *restrict r_b,
+                                             const uint8_t *restrict dom_b,
+                                             const int32_t *restrict cp_b,
+                                             size_t cp_b_len)
+  {
+    size_t cp_len;
+
+    if (!FP_SONGLEN_MAY_MATCH(songlen_a, songlen_b))
+      return 0.0;
+    if (missing == 0)
+      return fpmatch_cpfm_combine(fpmatch_fooid_fp(r_a, dom_a, r_b, dom_b),
+                                  fpmatch_chromab(cp_a, cp_a_len, cp_b, cp_b_len));
+
+    // partial fingerprints: score on the part both have
+    if ((missing & FP_MISSING_FOOID) && (missing & FP_MISSING_CHROMA))
+      return 0.0;
+    if ((missing & FP_MISSING_TAIL) && !(missing & FP_MISSING_CHROMA))
+    {
+      // captures of different lengths: compare the start both cover
+      cp_len = min_st(cp_a_len, cp_b_len);
+      return fpmatch_cpfm_one_part(fpmatch_chromab(cp_a, cp_len, cp_b, cp_len));
+    }
+    if (missing & FP_MISSING_FOOID)
+      return fpmatch_cpfm_one_part(fpmatch_chromab(cp_a, cp_a_len, cp_b, cp_b_len));
+
+    return fpmatch_cpfm_one_part(fpmatch_fooid_fp(r_a, dom_a, r_b, dom_b));
+  }
+
+  // fprint_missing, without the call for the usual complete fingerprint
+  FPMATCH_INLINE uint16_t fpmatch_missing(const FPrint *fp)
+  {
+    return fp->missing ? fprint_missing(fp) : 0;
+  }
+
+  /*! fpmatch_cpfm
+   *  \brief match_cpfm
+   */
+  FPMATCH_INLINE double fpmatch_cpfm(const FPrint *restrict a,
+                                     const FPrint *restrict b)
+  {
+    if (!(a && b))
+      return 0.0;
+
+    return fpmatch_cpfm_partial(fpmatch_missing(a) | fpmatch_missing(b),
+                                a->songlen, a->r, a->dom, a->cprint, a->cprint_len,
+                                b->songlen, b->r, b->dom, b->cprint, b->cprint_len);
+  }
+
+  FPMATCH_INLINE void fpmatch_or_cprint_n(int32_t *restrict cp_u,
+                                          const int32_t *restrict cp_a,
+                                          size_t n)
+  {
+    uint32_t *restrict u32 = (uint32_t *)cp_u;
+    const uint32_t *restrict a32 = (const uint32_t *)cp_a;
+
+    for (size_t l = 0; l < n; l++)
+      u32[l] |= a32[l];
+  }
+
+  // cp_u[i] |= cp_a[i] for i < n
+  FPMATCH_INLINE void fpmatch_or_cprint(int32_t *restrict cp_u,
+                                        const int32_t *restrict cp_a, size_t n)
+  {
+    if (n == FPMATCH_KEY_CP_LEN)
+      fpmatch_or_cprint_n(cp_u, cp_a, FPMATCH_KEY_CP_LEN);
+    else
+      fpmatch_or_cprint_n(cp_u, cp_a, n);
+  }
+
+  // r and dom of a or'ed into those of u
+  FPMATCH_INLINE void fpmatch_or_fooid(uint8_t *restrict r_u,
+                                       uint8_t *restrict dom_u,
+                                       const uint8_t *restrict r_a,
+                                       const uint8_t *restrict dom_a)
+  {
+    uint32_t *restrict r_u32 = (uint32_t *)r_u;
+    const uint32_t *restrict r_a32 = (const uint32_t *)r_a;
+    for (size_t i = 0; i < R_SIZE32; i++)
+    {
+      r_u32[i] |= r_a32[i];
+    }
+
+    uint32_t *restrict dom32_u = (uint32_t *)dom_u;
+    const uint32_t *restrict dom32_a = (const uint32_t *)dom_a;
+    for (size_t j = 0; j < DOM_LEN32; j++)
+    {
+      dom32_u[j] |= dom32_a[j];
+    }
+    ((uint16_t *restrict)dom_u)[DOM_END16] |= ((const uint16_t *)dom_a)[DOM_END16];
+  }
+
+  /*! fpmatch_merge_one
+   *  \brief fprint_merge_one
+   */
+  FPMATCH_INLINE void fpmatch_merge_one(FPrintUnion *restrict u,
+                                        const FPrint *restrict a)
+  {
+    fpmatch_or_fooid(u->r, u->dom, a->r, a->dom);
+    fpmatch_or_cprint(u->cprint, a->cprint, a->cprint_len);
+
+    if (u->min_songlen > 0)
+    {
+      u->min_songlen = min_u32(u->min_songlen, a->songlen);
+    }
+    else
+    {
+      u->min_songlen = a->songlen;
+    }
+    u->max_songlen = max_u32(u->max_songlen, a->songlen);
+    u->missing |= fpmatch_missing(a);
+  }
+
+  /*! fpmatch_merge_one_union
+   *  \brief fprint_merge_one_union
+   */
+  FPMATCH_INLINE void fpmatch_merge_one_union(FPrintUnion *restrict u,
+                                              const FPrintUnion *restrict a)
+  {
+    fpmatch_or_fooid(u->r, u->dom, a->r, a->dom);
+    fpmatch_or_cprint(u->cprint, a->cprint, a->cprint_len);
+
+    if (u->min_songlen > 0)
+    {
+      u->min_songlen = min_u32(u->min_songlen, a->min_songlen);
+    }
+    else
+    {
+      u->min_songlen = a->min_songlen;
+    }
+    u->max_songlen = max_u32(u->max_songlen, a->max_songlen);
+    u->missing |= a->missing;
+  }
+
+  // positions where x is covered by the union value y, or where they have
+  // the same lowest set bit
+  FPMATCH_INLINE uint32_t fpmatch_covered_count(const int32_t *restrict cp_a,
+                                                const int32_t *restrict cp_u,
+                                                size_t n)
+  {
+    const uint32_t *restrict a32 = (const uint32_t *)cp_a;
+    const uint32_t *restrict u32 = (const uint32_t *)cp_u;
+    uint32_t diff_cp = 0;
+    uint32_t x, y;
+
+    for (size_t k = 0; k < n; k++)
+    {
+      x = a32[k];
+      y = u32[k];
+      diff_cp += ((x == (x & y)) | fpmatch_low_bit_eq(x, y));
+    }
+    return diff_cp;
+  }
+
+  /*! fpmatch_fprint_merge
+   *  \brief match_fprint_merge
+   */
+  FPMATCH_INLINE float fpmatch_fprint_merge(const FPrint *restrict a,
+                                            const FPrintUnion *restrict u)
+  {
+    const double maxdiff = (double)FPMATCH_MAX_TOTDIFF;
+    uint32_t diff_r = 0;
+    uint32_t diff_dom = 0;
+    float perc = 0.0f;
+    float conf = 0.0f;
+    float fooid = 0.0f;
+    size_t cp_len = min_st(u->cprint_len, a->cprint_len);
+    uint32_t diff_cp = 0;
+    float chroma = 0.0f;
+    uint16_t missing = 0;
+
+    uint32_t rdiff[4] = {0, 0, 0, 0};
+    const uint32_t *restrict r_a = (const uint32_t *)a->r;
+    const uint32_t *restrict r_u = (const uint32_t *)u->r;
+    for (size_t i = 0; i < R_SIZE32; i++)
+    {
+      fpmatch_rdiff32(r_a[i] ^ (r_a[i] & r_u[i]), rdiff);
+    }
+    diff_r = rdiff[1] + rdiff[2] * 4 + rdiff[3] * 9;
+
+    const uint8_t *restrict dom_a = a->dom;
+    const uint8_t *restrict dom_u = u->dom;
+    const uint32_t *restrict dom32_a = (const uint32_t *)dom_a;
+    const uint32_t *restrict dom32_u = (const uint32_t *)dom_u;
+    for (size_t j = 0; j < DOM_LEN32; j++)
+    {
+      diff_dom += fpmatch_pop32(dom32_a[j] ^ (dom32_a[j] & dom32_u[j]));
+    }
+    uint16_t a_d16 = ((const uint16_t *)dom_a)[DOM_END16];
+    diff_dom += fpmatch_pop16(a_d16 ^ (a_d16 & ((const uint16_t *)dom_u)[DOM_END16]));
+
+    perc = (float)(diff_r + diff_dom) / maxdiff;
+    conf = ((1.0 - perc) - 0.5) * 2.0;
+    fooid = fmaxf(fminf(conf, 1.0), 0.0);
+
+    if (cp_len == FPMATCH_KEY_CP_LEN)
+      diff_cp = fpmatch_covered_count(a->cprint, u->cprint, FPMATCH_KEY_CP_LEN);
+    else
+      diff_cp = fpmatch_covered_count(a->cprint, u->cprint, cp_len);
+
+    if (cp_len > 0)
+    {
+      chroma = (float)diff_cp / (float)a->cprint_len;
+    }
+
+    // as match_cpfm: if a or some member of u lacks a part, only the
+    // other part bounds the score
+    missing = fpmatch_missing(a) | u->missing;
+    if ((missing & FP_MISSING_FOOID) && (missing & FP_MISSING_CHROMA))
+      return 0.0f;
+    if (missing & FP_MISSING_CHROMA)
+      return fmaxf(fminf(fpmatch_cpfm_one_part(fooid), 1.0), 0.0);
+    if (missing & (FP_MISSING_FOOID | FP_MISSING_TAIL))
+      return fmaxf(fminf(fpmatch_cpfm_one_part(chroma), 1.0), 0.0);
+
+    float comb = ((0.012985 + .263439 * fooid + -.683234 * chroma + 1.592623 * (chroma * chroma * chroma)) + 0.06348) / 1.2489;
+
+    return fmaxf(fminf(comb, 1.0), 0.0);
+  }
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _FPMATCH_H */
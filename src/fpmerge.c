@@ -0,0 +1,309 @@
+/*
+ *  fpmerge.c
+ *  merge corpus files into one, with similar fingerprints stored together
+ *
+ *  Copyright 2010 Zatisfi, LLC. MIT License, 2025
+ *
+ */
+
+#include <errno.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fplib.h"
+#include "fpcorpus.h"
+#include "fpmerge.h"
+
+#define KEY_SIDE (1u << FPMERGE_KEY_BITS)
+// dom bits behind each bit of the sketch
+#define SLICE_BITS (DOM_SIZE * 8 / FPMERGE_SKETCH_BITS)
+
+typedef struct
+{
+  uint32_t key;
+  uint32_t input;
+  uint64_t ix;
+  // of songlen, r, dom and cprint: equal entries sort next to each other
+  uint64_t hash;
+} MergeEntry;
+
+////////////////////////////////////////////////////////////
+// Keys
+////////////////////////////////////////////////////////////
+
+static uint32_t songlen_coord(uint32_t songlen)
+{
+  double x = 0.0;
+
+  if (songlen == 0)
+    return 0;
+  x = 1.0 + round(log((double)songlen) / log1p(FPMERGE_SONGLEN_STEP));
+  return x < KEY_SIDE - 1 ? (uint32_t)x : KEY_SIDE - 1;
+}
+
+// each bit of the sketch set if most of its slice of dom is, Gray-decoded
+// so that neighbouring coordinates differ in one bit of the sketch
+static uint32_t dom_coord(const uint8_t *dom)
+{
+  uint32_t sketch = 0;
+  uint32_t ones = 0;
+  uint32_t b = 0;
+
+  for (uint32_t s = 0; s < FPMERGE_SKETCH_BITS; s++)
+  {
+    ones = 0;
+    for (uint32_t i = 0; i < SLICE_BITS; i++, b++)
+      ones += (dom[b >> 3] >> (b & 7)) & 1;
+    if (2 * ones > SLICE_BITS)
+      sketch |= 1u << s;
+  }
+  for (uint32_t shift = 1; shift < FPMERGE_SKETCH_BITS; shift <<= 1)
+    sketch ^= sketch >> shift;
+  return sketch << (FPMERGE_KEY_BITS - FPMERGE_SKETCH_BITS);
+}
+
+// distance of (x, y) along the Hilbert curve filling the KEY_SIDE square
+static uint32_t hilbert_index(uint32_t x, uint32_t y)
+{
+  uint32_t d = 0;
+  uint32_t rx = 0;
+  uint32_t ry = 0;
+  uint32_t t = 0;
+
+  for (uint32_t s = KEY_SIDE / 2; s > 0; s >>= 1)
+  {
+    rx = (x & s) != 0;
+    ry = (y & s) != 0;
+    d += s * s * ((3 * rx) ^ ry);
+    // rotate the quadrant so the curve inside it starts where it enters
+    if (ry == 0)
+    {
+      if (rx == 1)
+      {
+        x = KEY_SIDE - 1 - x;
+        y = KEY_SIDE - 1 - y;
+      }
+      t = x;
+      x = y;
+      y = t;
+    }
+  }
+  return d;
+}
+
+uint32_t fpmerge_key(uint32_t songlen, const uint8_t *dom)
+{
+  return hilbert_index(songlen_coord(songlen), dom_coord(dom));
+}
+
+////////////////////////////////////////////////////////////
+// Merging
+////////////////////////////////////////////////////////////
+
+// FNV-1a over 8 bytes at a time
+static uint64_t hash_bytes(uint64_t h, const void *data, size_t len)
+{
+  const uint8_t *p = (const uint8_t *)data;
+  uint64_t w = 0;
+
+  for (; len >= 8; p += 8, len -= 8)
+  {
+    memcpy(&w, p, 8);
+    h = (h ^ w) * 0x100000001b3ULL;
+  }
+  for (; len > 0; p++, len--)
+    h = (h ^ *p) * 0x100000001b3ULL;
+  return h;
+}
+
+static uint64_t hash_entry(const FPCorpus *c, uint64_t i)
+{
+  uint64_t h = 0xcbf29ce484222325ULL;
+
+  h = hash_bytes(h, &c->songlen[i], sizeof(c->songlen[i]));
+  h = hash_bytes(h, &c->r[i * R_SIZE], R_SIZE);
+  h = hash_bytes(h, &c->dom[i * DOM_SIZE], DOM_SIZE);
+  return hash_bytes(h, fpcorpus_cprint(c, i),
+                    fpcorpus_cprint_len(c, i) * sizeof(int32_t));
+}
+
+static int same_entry(const FPCorpus *a, uint64_t i, const FPCorpus *b,
+                      uint64_t j)
+{
+  size_t len = fpcorpus_cprint_len(a, i);
+
+  return a->songlen[i] == b->songlen[j] &&
+         len == fpcorpus_cprint_len(b, j) &&
+         memcmp(&a->r[i * R_SIZE], &b->r[j * R_SIZE], R_SIZE) == 0 &&
+         memcmp(&a->dom[i * DOM_SIZE], &b->dom[j * DOM_SIZE], DOM_SIZE) == 0 &&
+         memcmp(fpcorpus_cprint(a, i), fpcorpus_cprint(b, j),
+                len * sizeof(int32_t)) == 0;
+}
+
+static int cmp_merge_entry(const void *a, const void *b)
+{
+  const MergeEntry *x = (const MergeEntry *)a;
+  const MergeEntry *y = (const MergeEntry *)b;
+  if (x->key != y->key)
+    return (x->key > y->key) - (x->key < y->key);
+  if (x->hash != y->hash)
+    return (x->hash > y->hash) - (x->hash < y->hash);
+  // the first input wins among duplicates
+  if (x->input != y->input)
+    return (x->input > y->input) - (x->input < y->input);
+  return (x->ix > y->ix) - (x->ix < y->ix);
+}
+
+static int write_map(const char *map_path, FPCorpus **corpora, int n_inputs,
+                     const uint64_t *first, const uint64_t *new_id)
+{
+  FILE *out = fopen(map_path, "w");
+  int errn = 0;
+
+  if (!out)
+    return errno;
+  for (int f = 0; f < n_inputs && !errn; f++)
+  {
+    for (uint64_t i = 0; i < corpora[f]->count; i++)
+    {
+      if (fprintf(out, "%d\t%llu\t%llu\n", f,
+                  (unsigned long long)corpora[f]->ids[i],
+                  (unsigned long long)new_id[first[f] + i]) < 0)
+      {
+        errn = EIO;
+        break;
+      }
+    }
+  }
+  if (fclose(out) != 0 && !errn)
+    errn = errno;
+  return errn;
+}
+
+int fpmerge_corpora(const char *const *inputs, int n_inputs,
+                    const char *path, const char *map_path,
+                    FPMergeStats *stats)
+{
+  FPCorpus **corpora = NULL;
+  FPCorpusWriter *w = NULL;
+  MergeEntry *order = NULL;
+  uint64_t *first = NULL;
+  uint64_t *new_id = NULL;
+  FPMergeStats st;
+  FPrint *fp = NULL;
+  uint64_t total = 0;
+  uint64_t run = 0;
+  uint64_t n = 0;
+  int errn = 0;
+
+  memset(&st, 0, sizeof(st));
+  if (n_inputs <= 0)
+    return EINVAL;
+  corpora = calloc(n_inputs, sizeof(*corpora));
+  first = malloc(n_inputs * sizeof(*first));
+  if (!corpora || !first)
+  {
+    errn = ENOMEM;
+    goto cleanup;
+  }
+  for (int f = 0; f < n_inputs; f++)
+  {
+    if (!(corpora[f] = fpcorpus_open(inputs[f], &errn)))
+      goto cleanup;
+    first[f] = total;
+    total += corpora[f]->count;
+  }
+
+  order = malloc((total ? total : 1) * sizeof(*order));
+  new_id = malloc((total ? total : 1) * sizeof(*new_id));
+  if (!order || !new_id)
+  {
+    errn = ENOMEM;
+    goto cleanup;
+  }
+  for (int f = 0; f < n_inputs; f++)
+  {
+    const FPCorpus *c = corpora[f];
+    for (uint64_t i = 0; i < c->count; i++)
+    {
+      order[n].key = fpmerge_key(c->songlen[i], &c->dom[i * DOM_SIZE]);
+      order[n].input = (uint32_t)f;
+      order[n].ix = i;
+      order[n].hash = hash_entry(c, i);
+      n++;
+    }
+  }
+  qsort(order, total, sizeof(*order), cmp_merge_entry);
+
+  if (!(w = fpcorpus_writer_new(path, &errn)))
+    goto cleanup;
+  for (uint64_t i = 0; i < total; i++)
+  {
+    const MergeEntry *e = &order[i];
+    const FPCorpus *c = corpora[e->input];
+    int dup = 0;
+
+    if (i == 0 || e->key != order[i - 1].key || e->hash != order[i - 1].hash)
+      run = i;
+    // a run of equal keys and hashes is almost always one entry and its
+    // duplicates, but hashes can collide: compare in full.  The first entry
+    // of the run is kept, so a duplicate usually stops at j == run.
+    for (uint64_t j = run; j < i && !dup; j++)
+    {
+      const MergeEntry *k = &order[j];
+      if (same_entry(corpora[k->input], k->ix, c, e->ix))
+      {
+        new_id[first[e->input] + e->ix] = new_id[first[k->input] + k->ix];
+        dup = 1;
+      }
+    }
+    if (dup)
+    {
+      st.n_dups++;
+      continue;
+    }
+
+    if (!(fp = fpcorpus_get(c, e->ix)))
+    {
+      errn = ENOMEM;
+      goto cleanup;
+    }
+    errn = fpcorpus_writer_add(w, st.n_out, fp);
+    free_fprint(fp);
+    if (errn)
+      goto cleanup;
+    new_id[first[e->input] + e->ix] = st.n_out++;
+  }
+  st.n_in = total;
+
+  if (map_path &&
+      (errn = write_map(map_path, corpora, n_inputs, first, new_id)) != 0)
+  {
+    fprintf(stderr, "ERROR: %d: unable to write %s\n", errn, map_path);
+    goto cleanup;
+  }
+  errn = fpcorpus_writer_close(w);
+  w = NULL;
+
+cleanup:
+  if (errn)
+    fprintf(stderr, "ERROR: %d: unable to merge into %s\n", errn, path);
+  else if (stats)
+    *stats = st;
+  if (w)
+    fpcorpus_writer_abort(w);
+  if (corpora)
+  {
+    for (int f = 0; f < n_inputs; f++)
+      fpcorpus_close(corpora[f]);
+  }
+  free(corpora);
+  free(first);
+  free(order);
+  free(new_id);
+
+  return errn;
+}
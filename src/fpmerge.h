@@ -0,0 +1,72 @@
+/*
+ *  fpmerge.h
+ *
+ *  merge corpus files into one, with similar fingerprints stored together
+ *
+ *  A corpus keeps its entries in the order they were added, so the
+ *  candidates a query or a verification pass touches are scattered over
+ *  the whole file.  fpmerge_corpora writes the entries of one or more
+ *  corpora to a new corpus sorted by fpmerge_key, which places entries of
+ *  close songlen and similar dom next to each other, and drops exact
+ *  duplicates.  Entries get new ids, their index in the merged corpus, and
+ *  a map file records the new id of every input entry.
+ *
+ *  Copyright 2010 Zatisfi, LLC. MIT License, 2025
+ */
+
+#ifndef _FPMERGE_H
+#define _FPMERGE_H
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "fplib.h"
+
+// bits of each coordinate of fpmerge_key
+#define FPMERGE_KEY_BITS 12
+// bits of the dom sketch.  More bits split the entries of one songlen
+// finer, but near-identical doms then differ in the sketch more often.
+#define FPMERGE_SKETCH_BITS 6
+// songlen steps of 1% along the songlen coordinate, so the match_cpfm
+// songlen gate is the same width everywhere
+#define FPMERGE_SONGLEN_STEP 0.01
+
+  typedef struct FPMergeStats
+  {
+    // entries read, written, and dropped as duplicates of a written entry
+    uint64_t n_in;
+    uint64_t n_out;
+    uint64_t n_dups;
+  } FPMergeStats;
+
+  /*! fpmerge_key
+   *  \brief position of a fingerprint along a Hilbert curve over log
+   *  songlen and a FPMERGE_SKETCH_BITS-bit sketch of dom (each bit the
+   *  majority of a slice of dom).  Fingerprints that can match have close
+   *  songlens and doms, so mostly close keys.
+   */
+  uint32_t fpmerge_key(uint32_t songlen, const uint8_t *dom);
+
+  /*! fpmerge_corpora
+   *  \brief write the entries of the n_inputs corpora at inputs to a new
+   *  corpus at path in fpmerge_key order, keeping the first of entries
+   *  with equal songlen, r, dom and cprint.  Entry i of the merged corpus
+   *  gets id i.  If map_path is not NULL, writes "input<TAB>old_id<TAB>
+   *  new_id" to it for every input entry, in input order; a duplicate maps
+   *  to the id of the entry kept.  Fills in stats if not NULL; returns 0 or
+   *  an errno value.
+   */
+  int fpmerge_corpora(const char *const *inputs, int n_inputs,
+                      const char *path, const char *map_path,
+                      FPMergeStats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _FPMERGE_H */
@@ -0,0 +1,328 @@
+/*
+ *  fpminhash.c
+ *  MinHash signatures of chromaprints, and a banded LSH table over them
+ *
+ *  Copyright 2010 Zatisfi, LLC. MIT License, 2025
+ *
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fplib.h"
+#include "fpcorpus.h"
+#include "fpminhash.h"
+
+#define PRIME64_1 0x9e3779b185ebca87ULL
+#define PRIME64_2 0xc2b2ae3d27d4eb4fULL
+
+// band entries are chained from heads[key & (n_heads - 1)]; 0 is the end
+typedef struct
+{
+  uint64_t key;
+  uint32_t entry;
+  uint32_t next;
+} Node;
+
+struct FPMinHashIndex
+{
+  size_t count;
+  size_t capacity;
+  uint64_t *ids;
+  uint32_t *sigs;
+  size_t n_heads;
+  uint32_t *heads;
+  // nodes[0] is unused, so 0 can end a chain
+  size_t n_nodes;
+  Node *nodes;
+};
+
+static inline uint64_t mix64(uint64_t h, uint64_t v)
+{
+  h ^= v * PRIME64_2;
+  h = (h << 31) | (h >> 33);
+  return h * PRIME64_1;
+}
+
+static inline uint64_t avalanche(uint64_t h)
+{
+  h ^= h >> 33;
+  h *= PRIME64_2;
+  h ^= h >> 29;
+  h *= PRIME64_1;
+  return h ^ (h >> 32);
+}
+
+void fpminhash_sign(const int32_t *cprint, size_t cprint_len, uint32_t mask,
+                    uint32_t *sig)
+{
+  uint32_t a[FPMINHASH_K], b[FPMINHASH_K], mins[FPMINHASH_K];
+  uint32_t x, h;
+
+  // one multiply-xorshift hash per component, each with its own odd
+  // multiplier and offset
+  for (uint32_t j = 0; j < FPMINHASH_K; j++)
+  {
+    a[j] = (uint32_t)avalanche(PRIME64_1 * (j + 1)) | 1;
+    b[j] = (uint32_t)avalanche(PRIME64_2 * (j + 1));
+    mins[j] = FPMINHASH_EMPTY;
+  }
+  // the inner loop is over independent lanes with no branches, so it is
+  // compiled to SIMD multiplies and mins, FPMINHASH_K hashes a value
+  for (size_t i = 0; i < cprint_len; i++)
+  {
+    x = (uint32_t)cprint[i] & mask;
+    for (int j = 0; j < FPMINHASH_K; j++)
+    {
+      h = x * a[j] + b[j];
+      h ^= h >> 16;
+      h *= 0x85ebca6bu;
+      h ^= h >> 13;
+      mins[j] = h < mins[j] ? h : mins[j];
+    }
+  }
+  memcpy(sig, mins, sizeof(mins));
+}
+
+double fpminhash_jaccard(const uint32_t *a, const uint32_t *b)
+{
+  int same = 0;
+
+  if (a[0] == FPMINHASH_EMPTY || b[0] == FPMINHASH_EMPTY)
+    return 0.0;
+  for (int j = 0; j < FPMINHASH_K; j++)
+    same += a[j] == b[j];
+  return (double)same / FPMINHASH_K;
+}
+
+static inline uint64_t band_key(const uint32_t *sig, int band)
+{
+  uint64_t h = mix64(PRIME64_1, (uint64_t)band);
+
+  for (int r = 0; r < FPMINHASH_ROWS; r++)
+    h = mix64(h, sig[band * FPMINHASH_ROWS + r]);
+  return avalanche(h);
+}
+
+FPMinHashIndex *fpminhash_index_new(int *error)
+{
+  FPMinHashIndex *ix = calloc(1, sizeof(*ix));
+
+  *error = 0;
+  if (!ix)
+    goto error;
+  ix->n_heads = 1024;
+  ix->n_nodes = 1;
+  ix->heads = calloc(ix->n_heads, sizeof(*ix->heads));
+  ix->nodes = malloc(sizeof(*ix->nodes));
+  if (!ix->heads || !ix->nodes)
+    goto error;
+
+  return ix;
+
+error:
+  *error = ENOMEM;
+  fpminhash_index_free(ix);
+  return NULL;
+}
+
+void fpminhash_index_free(FPMinHashIndex *ix)
+{
+  if (!ix)
+    return;
+  free(ix->ids);
+  free(ix->sigs);
+  free(ix->heads);
+  free(ix->nodes);
+  free(ix);
+}
+
+size_t fpminhash_index_count(const FPMinHashIndex *ix)
+{
+  return ix->count;
+}
+
+// double the chain heads, keeping about one node a head
+static int rehash(FPMinHashIndex *ix)
+{
+  size_t n_heads = ix->n_heads * 2;
+  uint32_t *heads = calloc(n_heads, sizeof(*heads));
+  Node *node = NULL;
+
+  if (!heads)
+    return ENOMEM;
+  for (uint32_t i = 1; i < ix->n_nodes; i++)
+  {
+    node = &ix->nodes[i];
+    node->next = heads[node->key & (n_heads - 1)];
+    heads[node->key & (n_heads - 1)] = i;
+  }
+  free(ix->heads);
+  ix->heads = heads;
+  ix->n_heads = n_heads;
+
+  return 0;
+}
+
+int fpminhash_index_add(FPMinHashIndex *ix, uint64_t id, const uint32_t *sig)
+{
+  size_t capacity = 0;
+  uint64_t *ids = NULL;
+  uint32_t *sigs = NULL;
+  Node *nodes = NULL;
+  Node *node = NULL;
+  uint32_t entry = 0;
+
+  // an empty set would share every band with every other empty one
+  if (sig[0] == FPMINHASH_EMPTY)
+    return EINVAL;
+  if (ix->n_nodes + FPMINHASH_BANDS > UINT32_MAX)
+    return EOVERFLOW;
+
+  if (ix->count == ix->capacity)
+  {
+    capacity = ix->capacity ? ix->capacity * 2 : 256;
+    if (!(ids = realloc(ix->ids, capacity * sizeof(*ids))))
+      return ENOMEM;
+    ix->ids = ids;
+    if (!(sigs = realloc(ix->sigs, capacity * FPMINHASH_K * sizeof(*sigs))))
+      return ENOMEM;
+    ix->sigs = sigs;
+    if (!(nodes = realloc(ix->nodes, (capacity * FPMINHASH_BANDS + 1) *
+                                         sizeof(*nodes))))
+      return ENOMEM;
+    ix->nodes = nodes;
+    ix->capacity = capacity;
+  }
+  if (ix->n_nodes + FPMINHASH_BANDS > ix->n_heads && rehash(ix) != 0)
+    return ENOMEM;
+
+  entry = (uint32_t)ix->count++;
+  ix->ids[entry] = id;
+  memcpy(&ix->sigs[(size_t)entry * FPMINHASH_K], sig,
+         FPMINHASH_K * sizeof(*sig));
+  for (int band = 0; band < FPMINHASH_BANDS; band++)
+  {
+    node = &ix->nodes[ix->n_nodes];
+    node->key = band_key(sig, band);
+    node->entry = entry;
+    node->next = ix->heads[node->key & (ix->n_heads - 1)];
+    ix->heads[node->key & (ix->n_heads - 1)] = (uint32_t)ix->n_nodes++;
+  }
+
+  return 0;
+}
+
+FPMinHashIndex *fpminhash_index_from_corpus(const FPCorpus *c, int *error)
+{
+  FPMinHashIndex *ix = fpminhash_index_new(error);
+  uint32_t sig[FPMINHASH_K];
+
+  if (!ix)
+    return NULL;
+  for (uint64_t i = 0; i < c->count; i++)
+  {
+    fpminhash_sign(fpcorpus_cprint(c, i), fpcorpus_cprint_len(c, i),
+                   FPMINHASH_MASK, sig);
+    // empty cprints cannot be found by set similarity; leave them out
+    if (sig[0] == FPMINHASH_EMPTY)
+      continue;
+    if ((*error = fpminhash_index_add(ix, i, sig)) != 0)
+    {
+      fprintf(stderr, "ERROR: %d: unable to index corpus entry %llu\n",
+              *error, (unsigned long long)i);
+      fpminhash_index_free(ix);
+      return NULL;
+    }
+  }
+
+  return ix;
+}
+
+static int cmp_u32(const void *a, const void *b)
+{
+  uint32_t x = *(const uint32_t *)a;
+  uint32_t y = *(const uint32_t *)b;
+  return (x > y) - (x < y);
+}
+
+static int cmp_hit_desc(const void *a, const void *b)
+{
+  double sa = ((const FPMinHashHit *)a)->jaccard;
+  double sb = ((const FPMinHashHit *)b)->jaccard;
+  return (sa < sb) - (sa > sb);
+}
+
+size_t fpminhash_index_query(const FPMinHashIndex *ix, const uint32_t *sig,
+                             size_t k, double min_jaccard,
+                             FPMinHashHit *hits, size_t *n_candidates)
+{
+  uint32_t *cand = NULL;
+  uint32_t *grown = NULL;
+  FPMinHashHit *scored = NULL;
+  size_t n_cand = 0, cap = 64, n_unique = 0, n = 0;
+  uint64_t key = 0;
+  uint32_t i = 0;
+  double jaccard = 0.0;
+
+  if (n_candidates)
+    *n_candidates = 0;
+  if (k == 0 || sig[0] == FPMINHASH_EMPTY || !(cand = malloc(cap * sizeof(*cand))))
+    return 0;
+
+  for (int band = 0; band < FPMINHASH_BANDS; band++)
+  {
+    key = band_key(sig, band);
+    for (i = ix->heads[key & (ix->n_heads - 1)]; i; i = ix->nodes[i].next)
+    {
+      if (ix->nodes[i].key != key)
+        continue;
+      if (n_cand == cap)
+      {
+        if (!(grown = realloc(cand, cap * 2 * sizeof(*cand))))
+          goto cleanup;
+        cand = grown;
+        cap *= 2;
+      }
+      cand[n_cand++] = ix->nodes[i].entry;
+    }
+  }
+  if (n_cand == 0)
+    goto cleanup;
+
+  // an entry sharing several bands is listed once for each
+  qsort(cand, n_cand, sizeof(*cand), cmp_u32);
+  for (size_t c = 0; c < n_cand; c++)
+  {
+    if (c == 0 || cand[c] != cand[c - 1])
+      cand[n_unique++] = cand[c];
+  }
+  if (n_candidates)
+    *n_candidates = n_unique;
+
+  if (!(scored = malloc(n_unique * sizeof(*scored))))
+    goto cleanup;
+  for (size_t c = 0; c < n_unique; c++)
+  {
+    jaccard = fpminhash_jaccard(sig, &ix->sigs[(size_t)cand[c] * FPMINHASH_K]);
+    if (jaccard < min_jaccard)
+      continue;
+    scored[n].id = ix->ids[cand[c]];
+    scored[n].jaccard = jaccard;
+    n++;
+  }
+  if (n > 1)
+    qsort(scored, n, sizeof(*scored), cmp_hit_desc);
+  if (n > k)
+    n = k;
+  memcpy(hits, scored, n * sizeof(*hits));
+
+cleanup:
+  free(scored);
+  free(cand);
+
+  return n;
+}
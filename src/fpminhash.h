@@ -0,0 +1,109 @@
+/*
+ *  fpminhash.h
+ *
+ *  MinHash signatures of chromaprints, and a banded LSH table over them
+ *
+ *  match_chromab compares two cprints position by position, so a copy that
+ *  is trimmed or starts a few seconds late scores far below the original.
+ *  Taken as a set of (masked) values instead, a cprint is the same however
+ *  it is shifted, and the Jaccard similarity of two such sets is estimated
+ *  by the fraction of equal components of their MinHash signatures.
+ *
+ *  FPMinHashIndex cuts each signature into FPMINHASH_BANDS bands of
+ *  FPMINHASH_ROWS values and files the entry under each band; a query only
+ *  looks at the entries sharing at least one band with it, so the cost of a
+ *  lookup depends on the number of near matches, not on the corpus size.
+ *  Two sets of Jaccard similarity j share a band with probability
+ *  1 - (1 - j^ROWS)^BANDS: about 0.025 at j = 0.2, 0.34 at j = 0.4 and
+ *  0.89 at j = 0.6, so the index reliably finds pairs above j = 0.6 and
+ *  few below 0.3.
+ *
+ *  Candidates are ranked by estimated Jaccard similarity only; verify them
+ *  with match_cpfm (or fpcorpus_match) before reporting a match.
+ *
+ *  Copyright 2010 Zatisfi, LLC. MIT License, 2025
+ */
+
+#ifndef _FPMINHASH_H
+#define _FPMINHASH_H
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "fplib.h"
+#include "fpcorpus.h"
+
+// hash functions a signature, and how they are banded
+#define FPMINHASH_K 64
+#define FPMINHASH_BANDS 16
+#define FPMINHASH_ROWS (FPMINHASH_K / FPMINHASH_BANDS)
+// bits of each cprint value kept in the set: the low bits are the least
+// stable across encodings
+#define FPMINHASH_MASK 0xfffff000u
+// signature component of an empty set
+#define FPMINHASH_EMPTY UINT32_MAX
+
+  typedef struct FPMinHashIndex FPMinHashIndex;
+
+  typedef struct FPMinHashHit
+  {
+    uint64_t id;
+    // estimated Jaccard similarity of the cprint sets
+    double jaccard;
+  } FPMinHashHit;
+
+  /*! fpminhash_sign
+   *  \brief sig[0 .. FPMINHASH_K) = MinHash signature of the set of
+   *  cprint[i] & mask; every component is FPMINHASH_EMPTY if cprint_len is 0
+   */
+  void fpminhash_sign(const int32_t *cprint, size_t cprint_len, uint32_t mask,
+                      uint32_t *sig);
+
+  /*! fpminhash_jaccard
+   *  \brief estimated Jaccard similarity of the sets signed a and b; 0.0 if
+   *  either is empty
+   */
+  double fpminhash_jaccard(const uint32_t *a, const uint32_t *b);
+
+  /*! fpminhash_index_new
+   *  \brief empty table; returns NULL and sets *error to an errno value on
+   *  failure
+   */
+  FPMinHashIndex *fpminhash_index_new(int *error);
+
+  /*! fpminhash_index_from_corpus
+   *  \brief table of every entry of c, signed with FPMINHASH_MASK; the id of
+   *  entry i is i, so hits index c directly
+   */
+  FPMinHashIndex *fpminhash_index_from_corpus(const FPCorpus *c, int *error);
+
+  void fpminhash_index_free(FPMinHashIndex *ix);
+
+  /*! fpminhash_index_add
+   *  \brief file id under each band of sig; returns 0 or an errno value.
+   *  Not safe to call concurrently with anything else on ix.
+   */
+  int fpminhash_index_add(FPMinHashIndex *ix, uint64_t id, const uint32_t *sig);
+
+  size_t fpminhash_index_count(const FPMinHashIndex *ix);
+
+  /*! fpminhash_index_query
+   *  \brief the (up to) k entries sharing a band with sig whose estimated
+   *  Jaccard similarity is at least min_jaccard, best first; returns the
+   *  number of hits.  If n_candidates is not NULL it is set to the number of
+   *  distinct entries examined.
+   */
+  size_t fpminhash_index_query(const FPMinHashIndex *ix, const uint32_t *sig,
+                               size_t k, double min_jaccard,
+                               FPMinHashHit *hits, size_t *n_candidates);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _FPMINHASH_H */
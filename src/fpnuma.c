@@ -0,0 +1,258 @@
+/*
+ *  fpnuma.c
+ *  NUMA placement and huge pages for worker threads and large arrays
+ *
+ *  Copyright 2010 Zatisfi, LLC. MIT License, 2025
+ *
+ */
+
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#endif
+
+#include "fpnuma.h"
+
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+#ifdef __linux__
+
+// from <numaif.h>, which comes with libnuma rather than the libc
+#define FP_MPOL_PREFERRED 1
+#define FP_MPOL_BIND 2
+
+#define SYSFS_NODE "/sys/devices/system/node"
+#define MAX_NODES 1024
+#define LONG_BITS (CHAR_BIT * sizeof(unsigned long))
+
+typedef struct
+{
+  unsigned long bits[MAX_NODES / LONG_BITS];
+} NodeMask;
+
+// parse a sysfs list such as "0-7,16-23" and call add(i, arg) for each i;
+// returns the number of entries, or -1 if the file cannot be read
+static int read_list(const char *path, void (*add)(int, void *), void *arg)
+{
+  FILE *f = NULL;
+  char buf[4096];
+  char *p = NULL;
+  char *end = NULL;
+  long lo, hi;
+  int n = 0;
+
+  if (!(f = fopen(path, "r")))
+    return -1;
+  if (!fgets(buf, sizeof(buf), f))
+  {
+    fclose(f);
+    return -1;
+  }
+  fclose(f);
+
+  p = buf;
+  while (*p && *p != '\n')
+  {
+    lo = strtol(p, &end, 10);
+    if (end == p || lo < 0)
+      break;
+    hi = lo;
+    p = end;
+    if (*p == '-')
+    {
+      hi = strtol(p + 1, &end, 10);
+      if (end == p + 1 || hi < lo)
+        break;
+      p = end;
+    }
+    for (long i = lo; i <= hi; i++, n++)
+    {
+      if (add)
+        add((int)i, arg);
+    }
+    if (*p == ',')
+      p++;
+  }
+
+  return n;
+}
+
+static void add_max(int i, void *arg)
+{
+  int *max = (int *)arg;
+  if (i > *max)
+    *max = i;
+}
+
+static void add_cpu(int i, void *arg)
+{
+  if (i < CPU_SETSIZE)
+    CPU_SET(i, (cpu_set_t *)arg);
+}
+
+static int node_cpuset(int node, cpu_set_t *set)
+{
+  char path[64];
+
+  CPU_ZERO(set);
+  snprintf(path, sizeof(path), SYSFS_NODE "/node%d/cpulist", node);
+  return read_list(path, add_cpu, set);
+}
+
+static void node_mask(int node, NodeMask *mask)
+{
+  memset(mask, 0, sizeof(*mask));
+  mask->bits[node / LONG_BITS] |= 1UL << (node % LONG_BITS);
+}
+
+int fpnuma_num_nodes(void)
+{
+  int max = -1;
+
+  if (read_list(SYSFS_NODE "/online", add_max, &max) <= 0 || max < 0)
+    return 1;
+  return max + 1;
+}
+
+int fpnuma_node_cpus(int node)
+{
+  cpu_set_t set;
+
+  if (node < 0 || node >= MAX_NODES || node_cpuset(node, &set) < 0)
+    return 0;
+  return CPU_COUNT(&set);
+}
+
+int fpnuma_bind_thread(int node)
+{
+  cpu_set_t set;
+  NodeMask mask;
+  int errn = 0;
+
+  if (node < 0 || node >= MAX_NODES)
+    return EINVAL;
+  if (node_cpuset(node, &set) <= 0)
+    return fpnuma_num_nodes() == 1 && node == 0 ? 0 : EINVAL;
+
+  if ((errn = pthread_setaffinity_np(pthread_self(), sizeof(set), &set)) != 0)
+    return errn;
+
+  // preferred, not bound: the thread may still allocate when its node is
+  // full
+  node_mask(node, &mask);
+  if (syscall(SYS_set_mempolicy, FP_MPOL_PREFERRED, mask.bits,
+              (unsigned long)MAX_NODES + 1) != 0 &&
+      errno != ENOSYS)
+  {
+    return errno;
+  }
+
+  return 0;
+}
+
+#else /* !__linux__ */
+
+int fpnuma_num_nodes(void)
+{
+  return 1;
+}
+
+int fpnuma_node_cpus(int node)
+{
+  long n = sysconf(_SC_NPROCESSORS_ONLN);
+  return node == 0 && n > 0 ? (int)n : 0;
+}
+
+int fpnuma_bind_thread(int node)
+{
+  return node == 0 ? 0 : EINVAL;
+}
+
+#endif /* __linux__ */
+
+size_t fpnuma_alloc_size(size_t size)
+{
+  if (size >= FPNUMA_HUGE_PAGE_SIZE)
+    return (size + FPNUMA_HUGE_PAGE_SIZE - 1) & ~(FPNUMA_HUGE_PAGE_SIZE - 1);
+  return size ? size : 1;
+}
+
+void *fpnuma_alloc(size_t size, int node, int flags, int *error)
+{
+  size_t map_size = fpnuma_alloc_size(size);
+  void *p = MAP_FAILED;
+
+  *error = 0;
+
+#if defined(__linux__) && defined(MAP_HUGETLB)
+  if ((flags & FPNUMA_HUGETLB) && map_size >= FPNUMA_HUGE_PAGE_SIZE)
+  {
+    p = mmap(NULL, map_size, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    // no reserved huge pages: fall back to transparent ones
+    if (p == MAP_FAILED)
+      flags |= FPNUMA_HUGE;
+  }
+#else
+  if (flags & FPNUMA_HUGETLB)
+    flags |= FPNUMA_HUGE;
+#endif
+
+  if (p == MAP_FAILED)
+  {
+    p = mmap(NULL, map_size, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+    {
+      *error = errno;
+      return NULL;
+    }
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+    if ((flags & FPNUMA_HUGE) && map_size >= FPNUMA_HUGE_PAGE_SIZE)
+      (void)madvise(p, map_size, MADV_HUGEPAGE);
+#endif
+  }
+
+#ifdef __linux__
+  // before the first touch, so every page is allocated on node
+  if (node >= 0 && node < MAX_NODES && fpnuma_num_nodes() > 1)
+  {
+    NodeMask mask;
+    node_mask(node, &mask);
+    if (syscall(SYS_mbind, p, map_size, FP_MPOL_BIND, mask.bits,
+                (unsigned long)MAX_NODES + 1, 0) != 0 &&
+        errno != ENOSYS)
+    {
+      *error = errno;
+      munmap(p, map_size);
+      return NULL;
+    }
+  }
+#else
+  (void)node;
+#endif
+
+  return p;
+}
+
+void fpnuma_free(void *p, size_t size)
+{
+  if (p)
+    munmap(p, fpnuma_alloc_size(size));
+}
@@ -0,0 +1,72 @@
+/*
+ *  fpnuma.h
+ *
+ *  NUMA placement and huge pages for worker threads and large arrays
+ *
+ *  On a multi-socket machine a corpus scan runs at the bandwidth of the
+ *  memory it reads: threads should read memory on their own node, and the
+ *  big column arrays should sit on huge pages so the scan does not miss the
+ *  TLB every 4 KB.  These calls use the kernel interfaces directly (no
+ *  libnuma); where they are not available everything is one node and the
+ *  hints are ignored.
+ *
+ *  Copyright 2010 Zatisfi, LLC. MIT License, 2025
+ */
+
+#ifndef _FPNUMA_H
+#define _FPNUMA_H
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#include <stddef.h>
+
+// fpnuma_alloc flags
+// transparent huge pages (madvise); silently 4 KB pages if THP is off
+#define FPNUMA_HUGE 0x1
+// reserved hugetlbfs pages (vm.nr_hugepages); falls back to FPNUMA_HUGE
+#define FPNUMA_HUGETLB 0x2
+
+// no placement: the kernel's default (first touch)
+#define FPNUMA_ANY_NODE -1
+
+#define FPNUMA_HUGE_PAGE_SIZE (2UL * 1024 * 1024)
+
+  /*! fpnuma_num_nodes
+   *  \brief number of NUMA nodes (1 without NUMA support)
+   */
+  int fpnuma_num_nodes(void);
+
+  /*! fpnuma_node_cpus
+   *  \brief number of CPUs on node, or 0 if it has none (or does not exist)
+   */
+  int fpnuma_node_cpus(int node);
+
+  /*! fpnuma_bind_thread
+   *  \brief run the calling thread only on node's CPUs and allocate its
+   *  memory from node; returns 0 or an errno value
+   */
+  int fpnuma_bind_thread(int node);
+
+  /*! fpnuma_alloc
+   *  \brief zeroed, page-aligned memory on node (FPNUMA_ANY_NODE for no
+   *  placement).  Sizes of at least FPNUMA_HUGE_PAGE_SIZE are rounded up to
+   *  a multiple of it; see fpnuma_alloc_size.  Returns NULL and sets *error
+   *  to an errno value on failure.  Free with fpnuma_free.
+   */
+  void *fpnuma_alloc(size_t size, int node, int flags, int *error);
+
+  /*! fpnuma_alloc_size
+   *  \brief bytes actually mapped by fpnuma_alloc(size, ...)
+   */
+  size_t fpnuma_alloc_size(size_t size);
+
+  void fpnuma_free(void *p, size_t size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _FPNUMA_H */
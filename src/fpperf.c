@@ -0,0 +1,229 @@
+/*
+ *  fpperf.c
+ *  hardware performance counters for benchmarks
+ *
+ *  Copyright 2010 Zatisfi, LLC. MIT License, 2025
+ *
+ */
+
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+#include "fpperf.h"
+
+static const char *event_names[FPPERF_N_EVENTS] = {
+    "cycles", "instructions", "l1d_misses", "llc_misses", "branch_misses"};
+
+static double now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+const char *fpperf_event_name(int e)
+{
+  return e >= 0 && e < FPPERF_N_EVENTS ? event_names[e] : "unknown";
+}
+
+#ifdef __linux__
+
+// value, then the times needed to scale it if the counter was multiplexed
+typedef struct
+{
+  uint64_t value;
+  uint64_t time_enabled;
+  uint64_t time_running;
+} Reading;
+
+static void event_attr(int e, struct perf_event_attr *attr)
+{
+  memset(attr, 0, sizeof(*attr));
+  attr->size = sizeof(*attr);
+  attr->disabled = 1;
+  // user space only: what the benchmarked code does, and what
+  // perf_event_paranoid 2 still allows
+  attr->exclude_kernel = 1;
+  attr->exclude_hv = 1;
+  attr->read_format = PERF_FORMAT_TOTAL_TIME_ENABLED |
+                      PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+  switch (e)
+  {
+  case FPPERF_CYCLES:
+    attr->type = PERF_TYPE_HARDWARE;
+    attr->config = PERF_COUNT_HW_CPU_CYCLES;
+    break;
+  case FPPERF_INSTRUCTIONS:
+    attr->type = PERF_TYPE_HARDWARE;
+    attr->config = PERF_COUNT_HW_INSTRUCTIONS;
+    break;
+  case FPPERF_L1D_MISSES:
+    attr->type = PERF_TYPE_HW_CACHE;
+    attr->config = PERF_COUNT_HW_CACHE_L1D |
+                   (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                   (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    break;
+  case FPPERF_LLC_MISSES:
+    attr->type = PERF_TYPE_HARDWARE;
+    attr->config = PERF_COUNT_HW_CACHE_MISSES;
+    break;
+  case FPPERF_BRANCH_MISSES:
+    attr->type = PERF_TYPE_HARDWARE;
+    attr->config = PERF_COUNT_HW_BRANCH_MISSES;
+    break;
+  }
+}
+
+int fpperf_open(FPPerf *p)
+{
+  struct perf_event_attr attr;
+  int errn = 0;
+  int n_open = 0;
+
+  for (int e = 0; e < FPPERF_N_EVENTS; e++)
+  {
+    event_attr(e, &attr);
+    // this thread (pid 0), on whichever CPU it runs (-1)
+    p->fd[e] = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    if (p->fd[e] < 0)
+    {
+      p->fd[e] = -1;
+      errn = errno;
+    }
+    else
+      n_open++;
+  }
+  p->t0 = 0.0;
+
+  return n_open ? 0 : errn;
+}
+
+void fpperf_close(FPPerf *p)
+{
+  for (int e = 0; e < FPPERF_N_EVENTS; e++)
+  {
+    if (p->fd[e] >= 0)
+      close(p->fd[e]);
+    p->fd[e] = -1;
+  }
+}
+
+void fpperf_start(FPPerf *p)
+{
+  for (int e = 0; e < FPPERF_N_EVENTS; e++)
+  {
+    if (p->fd[e] >= 0)
+      ioctl(p->fd[e], PERF_EVENT_IOC_RESET, 0);
+  }
+  p->t0 = now();
+  for (int e = 0; e < FPPERF_N_EVENTS; e++)
+  {
+    if (p->fd[e] >= 0)
+      ioctl(p->fd[e], PERF_EVENT_IOC_ENABLE, 0);
+  }
+}
+
+void fpperf_stop(FPPerf *p, FPPerfCounts *counts)
+{
+  Reading r;
+
+  for (int e = 0; e < FPPERF_N_EVENTS; e++)
+  {
+    if (p->fd[e] >= 0)
+      ioctl(p->fd[e], PERF_EVENT_IOC_DISABLE, 0);
+  }
+  counts->seconds = now() - p->t0;
+
+  for (int e = 0; e < FPPERF_N_EVENTS; e++)
+  {
+    counts->value[e] = 0;
+    counts->valid[e] = 0;
+    if (p->fd[e] < 0 || read(p->fd[e], &r, sizeof(r)) != sizeof(r) ||
+        r.time_running == 0)
+    {
+      continue;
+    }
+    counts->value[e] = r.time_running < r.time_enabled
+                           ? (uint64_t)((double)r.value * r.time_enabled /
+                                        r.time_running)
+                           : r.value;
+    counts->valid[e] = 1;
+  }
+}
+
+#else /* !__linux__ */
+
+int fpperf_open(FPPerf *p)
+{
+  for (int e = 0; e < FPPERF_N_EVENTS; e++)
+    p->fd[e] = -1;
+  p->t0 = 0.0;
+  return ENOSYS;
+}
+
+void fpperf_close(FPPerf *p)
+{
+}
+
+void fpperf_start(FPPerf *p)
+{
+  p->t0 = now();
+}
+
+void fpperf_stop(FPPerf *p, FPPerfCounts *counts)
+{
+  memset(counts, 0, sizeof(*counts));
+  counts->seconds = now() - p->t0;
+}
+
+#endif /* __linux__ */
+
+void fpperf_json(FILE *out, const char *name, const FPPerfCounts *counts,
+                 uint64_t items, const char *item_name)
+{
+  const uint64_t *v = counts->value;
+  const int *valid = counts->valid;
+
+  fprintf(out, "{\"name\": \"%s\", \"seconds\": %.6f, \"items\": %llu, "
+               "\"per\": \"%s\"",
+          name, counts->seconds, (unsigned long long)items, item_name);
+  for (int e = 0; e < FPPERF_N_EVENTS; e++)
+  {
+    if (valid[e])
+      fprintf(out, ", \"%s\": %llu", event_names[e], (unsigned long long)v[e]);
+    else
+      fprintf(out, ", \"%s\": null", event_names[e]);
+  }
+  if (valid[FPPERF_CYCLES] && valid[FPPERF_INSTRUCTIONS] && v[FPPERF_CYCLES])
+    fprintf(out, ", \"ipc\": %.3f",
+            (double)v[FPPERF_INSTRUCTIONS] / v[FPPERF_CYCLES]);
+  else
+    fprintf(out, ", \"ipc\": null");
+
+  // every counter divided by the number of items
+  fprintf(out, ", \"per_%s\": {\"seconds\": %.9g", item_name,
+          items ? counts->seconds / items : 0.0);
+  for (int e = 0; e < FPPERF_N_EVENTS; e++)
+  {
+    if (valid[e] && items)
+      fprintf(out, ", \"%s\": %.4f", event_names[e], (double)v[e] / items);
+    else
+      fprintf(out, ", \"%s\": null", event_names[e]);
+  }
+  fprintf(out, "}}");
+}
@@ -0,0 +1,92 @@
+/*
+ *  fpperf.h
+ *
+ *  hardware performance counters for benchmarks
+ *
+ *  Wall-clock time does not say whether a loop waits on arithmetic, on
+ *  memory or on mispredicted branches.  An FPPerf counts cycles,
+ *  instructions, L1 data cache misses, last-level cache misses and branch
+ *  misses of the calling thread between fpperf_start and fpperf_stop,
+ *  through perf_event_open, and fpperf_json reports them with the IPC and
+ *  the misses per item (fingerprint or pair) as one JSON object.
+ *
+ *  Counters the kernel or the CPU does not provide (perf_event_paranoid,
+ *  virtual machines, other systems than Linux) are reported as null; the
+ *  benchmark itself runs either way.
+ *
+ *  Copyright 2010 Zatisfi, LLC. MIT License, 2025
+ */
+
+#ifndef _FPPERF_H
+#define _FPPERF_H
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#include <stdint.h>
+#include <stdio.h>
+
+  enum
+  {
+    FPPERF_CYCLES,
+    FPPERF_INSTRUCTIONS,
+    FPPERF_L1D_MISSES,
+    FPPERF_LLC_MISSES,
+    FPPERF_BRANCH_MISSES,
+    FPPERF_N_EVENTS
+  };
+
+  typedef struct FPPerf
+  {
+    // -1 for an event that could not be opened
+    int fd[FPPERF_N_EVENTS];
+    double t0;
+  } FPPerf;
+
+  typedef struct FPPerfCounts
+  {
+    // value[e] is meaningful if valid[e]; scaled up if the kernel had to
+    // multiplex the counters
+    uint64_t value[FPPERF_N_EVENTS];
+    int valid[FPPERF_N_EVENTS];
+    double seconds;
+  } FPPerfCounts;
+
+  /*! fpperf_open
+   *  \brief open the counters for the calling thread; returns 0 if at least
+   *  one could be opened, else an errno value (p is usable either way)
+   */
+  int fpperf_open(FPPerf *p);
+
+  void fpperf_close(FPPerf *p);
+
+  /*! fpperf_start
+   *  \brief reset and start the counters and the clock
+   */
+  void fpperf_start(FPPerf *p);
+
+  /*! fpperf_stop
+   *  \brief stop the counters and read them, and the seconds since start,
+   *  into counts
+   */
+  void fpperf_stop(FPPerf *p, FPPerfCounts *counts);
+
+  /*! fpperf_event_name
+   *  \brief JSON key of event e
+   */
+  const char *fpperf_event_name(int e);
+
+  /*! fpperf_json
+   *  \brief write counts of benchmark name over items (each an item_name,
+   *  e.g. "pair") to out as a JSON object, without a trailing newline
+   */
+  void fpperf_json(FILE *out, const char *name, const FPPerfCounts *counts,
+                   uint64_t items, const char *item_name);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _FPPERF_H */
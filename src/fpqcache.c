@@ -0,0 +1,282 @@
+/*
+ *  fpqcache.c
+ *  bounded cache of query results
+ *
+ *  Copyright 2010 Zatisfi, LLC. MIT License, 2025
+ *
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fplib.h"
+#include "fpqcache.h"
+
+// entries per set; a set is scanned whole on every lookup
+#define WAYS 8
+// sets share this many locks
+#define N_LOCKS 64
+
+#define PRIME64_1 0x9e3779b185ebca87ULL
+#define PRIME64_2 0xc2b2ae3d27d4eb4fULL
+
+typedef struct
+{
+  uint64_t sketch;
+  uint64_t digest;
+  uint64_t generation;
+  double min_score;
+  double seconds;
+  uint32_t k;
+  uint32_t n;
+  // CLOCK reference bit; used marks a live entry
+  uint8_t ref;
+  uint8_t used;
+  FPQCacheHit *hits;
+} Entry;
+
+typedef struct
+{
+  pthread_mutex_t lock;
+  FPQCacheStats stats;
+} Stripe;
+
+struct FPQCache
+{
+  size_t n_sets;
+  Entry *entries;
+  uint8_t *hands;
+  uint64_t generation;
+  Stripe stripes[N_LOCKS];
+};
+
+static inline uint64_t mix64(uint64_t h, uint64_t v)
+{
+  h ^= v * PRIME64_2;
+  h = (h << 31) | (h >> 33);
+  return h * PRIME64_1;
+}
+
+static inline uint64_t avalanche(uint64_t h)
+{
+  h ^= h >> 33;
+  h *= PRIME64_2;
+  h ^= h >> 29;
+  h *= PRIME64_1;
+  return h ^ (h >> 32);
+}
+
+// songlen and the high bits of the first cprint values: what places q
+static uint64_t query_sketch(const FPrint *q)
+{
+  uint64_t h = mix64(PRIME64_1, q->songlen);
+  size_t n = q->cprint_len < FPQCACHE_SKETCH_LEN ? q->cprint_len : FPQCACHE_SKETCH_LEN;
+
+  for (size_t i = 0; i < n; i++)
+    h = mix64(h, (uint32_t)q->cprint[i] >> FPQCACHE_SKETCH_SHIFT);
+  return avalanche(h ^ n);
+}
+
+static uint64_t hash_bytes(uint64_t h, const uint8_t *p, size_t len)
+{
+  uint64_t v;
+
+  for (; len >= 8; p += 8, len -= 8)
+  {
+    memcpy(&v, p, 8);
+    h = mix64(h, v);
+  }
+  v = 0;
+  memcpy(&v, p, len);
+  return mix64(h, v ^ ((uint64_t)len << 56));
+}
+
+// every field match_cpfm reads: the exact check on a cached result
+static uint64_t query_digest(const FPrint *q)
+{
+  uint64_t h = mix64(PRIME64_2, q->songlen);
+
+  h = mix64(h, ((uint64_t)fprint_missing(q) << 32) | q->cprint_len);
+  h = hash_bytes(h, q->r, R_SIZE);
+  h = hash_bytes(h, q->dom, DOM_SIZE);
+  h = hash_bytes(h, (const uint8_t *)q->cprint, q->cprint_len * sizeof(int32_t));
+  return avalanche(h);
+}
+
+FPQCache *fpqcache_new(size_t capacity)
+{
+  FPQCache *qc = calloc(1, sizeof(*qc));
+
+  if (!qc)
+    return NULL;
+  qc->n_sets = (capacity + WAYS - 1) / WAYS;
+  if (qc->n_sets == 0)
+    qc->n_sets = 1;
+  qc->entries = calloc(qc->n_sets * WAYS, sizeof(*qc->entries));
+  qc->hands = calloc(qc->n_sets, sizeof(*qc->hands));
+  if (!qc->entries || !qc->hands)
+  {
+    free(qc->entries);
+    free(qc->hands);
+    free(qc);
+    return NULL;
+  }
+  for (int i = 0; i < N_LOCKS; i++)
+    pthread_mutex_init(&qc->stripes[i].lock, NULL);
+
+  return qc;
+}
+
+void fpqcache_free(FPQCache *qc)
+{
+  if (!qc)
+    return;
+  for (size_t i = 0; i < qc->n_sets * WAYS; i++)
+    free(qc->entries[i].hits);
+  for (int i = 0; i < N_LOCKS; i++)
+    pthread_mutex_destroy(&qc->stripes[i].lock);
+  free(qc->entries);
+  free(qc->hands);
+  free(qc);
+}
+
+uint64_t fpqcache_generation(FPQCache *qc)
+{
+  return __atomic_load_n(&qc->generation, __ATOMIC_ACQUIRE);
+}
+
+void fpqcache_invalidate(FPQCache *qc)
+{
+  __atomic_add_fetch(&qc->generation, 1, __ATOMIC_RELEASE);
+}
+
+static inline void entry_clear(Entry *e)
+{
+  free(e->hits);
+  e->hits = NULL;
+  e->used = 0;
+  e->ref = 0;
+}
+
+int fpqcache_get(FPQCache *qc, const FPrint *q, size_t k, double min_score,
+                 FPQCacheHit *hits, size_t *n_hits)
+{
+  uint64_t sketch = query_sketch(q);
+  uint64_t digest = query_digest(q);
+  uint64_t generation = fpqcache_generation(qc);
+  size_t set = (size_t)(sketch % qc->n_sets);
+  Stripe *stripe = &qc->stripes[set % N_LOCKS];
+  Entry *e = &qc->entries[set * WAYS];
+  int found = 0;
+
+  pthread_mutex_lock(&stripe->lock);
+  for (int w = 0; w < WAYS; w++, e++)
+  {
+    if (!e->used || e->sketch != sketch || e->digest != digest)
+      continue;
+    if (e->generation != generation)
+    {
+      stripe->stats.stale++;
+      entry_clear(e);
+      continue;
+    }
+    // the best e->k include the best k; fewer than e->k means all there are
+    if (e->min_score != min_score || e->k < k)
+      continue;
+    *n_hits = e->n < k ? e->n : k;
+    memcpy(hits, e->hits, *n_hits * sizeof(*hits));
+    e->ref = 1;
+    stripe->stats.saved_seconds += e->seconds;
+    found = 1;
+    break;
+  }
+  if (found)
+    stripe->stats.hits++;
+  else
+    stripe->stats.misses++;
+  pthread_mutex_unlock(&stripe->lock);
+
+  return found;
+}
+
+void fpqcache_put(FPQCache *qc, uint64_t generation, const FPrint *q,
+                  size_t k, double min_score, const FPQCacheHit *hits,
+                  size_t n_hits, double seconds)
+{
+  uint64_t sketch = query_sketch(q);
+  uint64_t digest = query_digest(q);
+  size_t set = (size_t)(sketch % qc->n_sets);
+  Stripe *stripe = &qc->stripes[set % N_LOCKS];
+  Entry *ways = &qc->entries[set * WAYS];
+  Entry *e = NULL;
+  FPQCacheHit *copy = NULL;
+  int w = 0;
+
+  if (k > UINT32_MAX || (n_hits && !(copy = malloc(n_hits * sizeof(*copy)))))
+    return;
+  if (n_hits)
+    memcpy(copy, hits, n_hits * sizeof(*copy));
+
+  pthread_mutex_lock(&stripe->lock);
+  // searched before an invalidation: the result may already be wrong
+  if (generation != fpqcache_generation(qc))
+  {
+    pthread_mutex_unlock(&stripe->lock);
+    free(copy);
+    return;
+  }
+  for (w = 0; w < WAYS && !e; w++)
+  {
+    if (ways[w].used && ways[w].sketch == sketch && ways[w].digest == digest)
+      e = &ways[w];
+  }
+  for (w = 0; w < WAYS && !e; w++)
+  {
+    if (!ways[w].used)
+      e = &ways[w];
+  }
+  // CLOCK: pass over recently used entries, clearing their bit
+  while (!e)
+  {
+    w = qc->hands[set];
+    qc->hands[set] = (uint8_t)((w + 1) % WAYS);
+    if (ways[w].ref)
+    {
+      ways[w].ref = 0;
+      continue;
+    }
+    e = &ways[w];
+    stripe->stats.evictions++;
+  }
+
+  free(e->hits);
+  e->sketch = sketch;
+  e->digest = digest;
+  e->generation = generation;
+  e->min_score = min_score;
+  e->seconds = seconds;
+  e->k = (uint32_t)k;
+  e->n = (uint32_t)n_hits;
+  e->hits = copy;
+  e->used = 1;
+  e->ref = 1;
+  pthread_mutex_unlock(&stripe->lock);
+}
+
+void fpqcache_stats(FPQCache *qc, FPQCacheStats *st)
+{
+  memset(st, 0, sizeof(*st));
+  for (int i = 0; i < N_LOCKS; i++)
+  {
+    Stripe *stripe = &qc->stripes[i];
+    pthread_mutex_lock(&stripe->lock);
+    st->hits += stripe->stats.hits;
+    st->misses += stripe->stats.misses;
+    st->stale += stripe->stats.stale;
+    st->evictions += stripe->stats.evictions;
+    st->saved_seconds += stripe->stats.saved_seconds;
+    pthread_mutex_unlock(&stripe->lock);
+  }
+}
@@ -0,0 +1,98 @@
+/*
+ *  fpqcache.h
+ *
+ *  bounded cache of query results
+ *
+ *  Lookup traffic is skewed: the same popular songs are identified over and
+ *  over.  An FPQCache keeps the top-k results of recent queries so a repeat
+ *  skips the search and the match_cpfm verification.
+ *
+ *  A query is placed by a sketch of it (its songlen and the high bits of
+ *  its first cprint values) and a cached result is only returned for a
+ *  query with the same digest of every field, so a near-duplicate query
+ *  never gets another's results.  The cache is set-associative with CLOCK
+ *  replacement inside each set and a lock per group of sets, so concurrent
+ *  lookups rarely contend.
+ *
+ *  fpqcache_invalidate drops every result at once; call it whenever the
+ *  searched collection changes.
+ *
+ *  Copyright 2010 Zatisfi, LLC. MIT License, 2025
+ */
+
+#ifndef _FPQCACHE_H
+#define _FPQCACHE_H
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "fplib.h"
+
+// cprint values in the sketch, and the low bits dropped from each
+#define FPQCACHE_SKETCH_LEN 32
+#define FPQCACHE_SKETCH_SHIFT 4
+
+  typedef struct FPQCache FPQCache;
+
+  typedef struct FPQCacheHit
+  {
+    uint64_t id;
+    double score;
+  } FPQCacheHit;
+
+  typedef struct FPQCacheStats
+  {
+    uint64_t hits;
+    uint64_t misses;
+    // found, but cached before the last fpqcache_invalidate
+    uint64_t stale;
+    uint64_t evictions;
+    // search time of the results served from the cache
+    double saved_seconds;
+  } FPQCacheStats;
+
+  /*! fpqcache_new
+   *  \brief cache of about capacity query results; NULL if out of memory
+   */
+  FPQCache *fpqcache_new(size_t capacity);
+
+  void fpqcache_free(FPQCache *qc);
+
+  /*! fpqcache_generation
+   *  \brief current generation; read it before searching and pass it to
+   *  fpqcache_put, so a result computed across an invalidation is dropped
+   */
+  uint64_t fpqcache_generation(FPQCache *qc);
+
+  /*! fpqcache_get
+   *  \brief if the results of q for k and min_score are cached, copy them
+   *  to hits (room for k), set *n_hits and return 1; else return 0
+   */
+  int fpqcache_get(FPQCache *qc, const FPrint *q, size_t k, double min_score,
+                   FPQCacheHit *hits, size_t *n_hits);
+
+  /*! fpqcache_put
+   *  \brief cache the n_hits results of q for k and min_score, which took
+   *  seconds to compute in generation
+   */
+  void fpqcache_put(FPQCache *qc, uint64_t generation, const FPrint *q,
+                    size_t k, double min_score, const FPQCacheHit *hits,
+                    size_t n_hits, double seconds);
+
+  /*! fpqcache_invalidate
+   *  \brief forget every cached result (lazily, as they are looked up)
+   */
+  void fpqcache_invalidate(FPQCache *qc);
+
+  void fpqcache_stats(FPQCache *qc, FPQCacheStats *st);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _FPQCACHE_H */
@@ -0,0 +1,965 @@
+/*
+ *  fpshard.c
+ *  query a corpus split across worker processes
+ *
+ *  Copyright 2010 Zatisfi, LLC. MIT License, 2025
+ *
+ */
+
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "fplib.h"
+#include "fpcorpus.h"
+#include "fpshard.h"
+#include "fpsnap.h"
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+#define MSG_MAGIC 0x48535046 /* "FPSH" */
+#define MSG_INFO 1
+#define MSG_QUERY 2
+#define MSG_ERROR 3
+// a query carries one PackedFP; anything longer is not one
+#define MSG_MAX_LEN (64 << 20)
+
+#define LISTEN_BACKLOG 64
+// a shard that takes longer than this to answer is dropped
+#define QUERY_TIMEOUT_MS 30000
+// a shard skipped by the songlen gate is queried anyway once its info is
+// this old, so the gate catches up with a reloaded corpus
+#define INFO_MAX_AGE_MS 10000
+
+/* Every message is a MsgHeader and len bytes of payload:
+ *
+ *   MSG_INFO   request: empty         reply: InfoReply
+ *   MSG_QUERY  request: QueryRequest  reply: QueryReply
+ *              and a PackedFP         and n ReplyHits, best first
+ *   MSG_ERROR                         reply: int32_t errno value
+ *
+ * A QueryReply carries the InfoReply of the corpus the query ran against,
+ * so the coordinator's copy follows reloads.
+ */
+typedef struct
+{
+  uint32_t magic;
+  uint32_t type;
+  uint32_t len;
+  uint32_t reserved;
+} MsgHeader;
+
+typedef struct
+{
+  uint64_t count;
+  uint32_t songlen_min;
+  uint32_t songlen_max;
+} InfoReply;
+
+typedef struct
+{
+  uint32_t k;
+  uint32_t reserved;
+  double min_score;
+} QueryRequest;
+
+typedef struct
+{
+  uint32_t n;
+  uint32_t reserved;
+  double seconds;
+  InfoReply info;
+} QueryReply;
+
+typedef struct
+{
+  uint64_t id;
+  double score;
+} ReplyHit;
+
+typedef struct
+{
+  int fd;
+  InfoReply info;
+  // when info was received
+  double info_at;
+  // set while a query waits on this shard
+  double sent;
+} Shard;
+
+struct FPShardClient
+{
+  int n_shards;
+  Shard *shards;
+};
+
+// shared by the connection threads of fpshard_serve, freed by the last
+typedef struct
+{
+  // snapshots are FPCorpus
+  FPSnap *snap;
+  // snap was made by fpshard_serve and goes with the Server
+  int own_snap;
+  pthread_mutex_t lock;
+  int refs;
+} Server;
+
+typedef struct
+{
+  Server *srv;
+  int fd;
+} Conn;
+
+static double now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+////////////////////////////////////////////////////////////
+// Splitting
+////////////////////////////////////////////////////////////
+
+typedef struct
+{
+  uint32_t songlen;
+  uint64_t ix;
+} SonglenIx;
+
+static int cmp_songlen_ix(const void *a, const void *b)
+{
+  const SonglenIx *x = (const SonglenIx *)a;
+  const SonglenIx *y = (const SonglenIx *)b;
+  if (x->songlen != y->songlen)
+    return (x->songlen > y->songlen) - (x->songlen < y->songlen);
+  return (x->ix > y->ix) - (x->ix < y->ix);
+}
+
+// splitmix64 finalizer: ids are often sequential
+static inline uint64_t mix_id(uint64_t x)
+{
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+  return x ^ (x >> 31);
+}
+
+int fpshard_split(const char *path, int n_shards, int mode, const char *prefix)
+{
+  FPCorpus *c = NULL;
+  FPCorpusWriter **writers = NULL;
+  uint32_t *shard_of = NULL;
+  SonglenIx *order = NULL;
+  FPrint *fp = NULL;
+  char *shard_path = NULL;
+  size_t path_len = strlen(prefix) + 32;
+  int errn = 0;
+
+  if (n_shards <= 0 || (mode != FPSHARD_BY_SONGLEN && mode != FPSHARD_BY_HASH))
+    return EINVAL;
+  if (!(c = fpcorpus_open(path, &errn)))
+    return errn;
+
+  writers = calloc(n_shards, sizeof(*writers));
+  shard_of = malloc((c->count ? c->count : 1) * sizeof(*shard_of));
+  shard_path = malloc(path_len);
+  if (!writers || !shard_of || !shard_path)
+  {
+    errn = ENOMEM;
+    goto cleanup;
+  }
+
+  if (mode == FPSHARD_BY_SONGLEN)
+  {
+    if (!(order = malloc((c->count ? c->count : 1) * sizeof(*order))))
+    {
+      errn = ENOMEM;
+      goto cleanup;
+    }
+    for (uint64_t i = 0; i < c->count; i++)
+    {
+      order[i].songlen = c->songlen[i];
+      order[i].ix = i;
+    }
+    qsort(order, c->count, sizeof(*order), cmp_songlen_ix);
+    for (uint64_t r = 0; r < c->count; r++)
+      shard_of[order[r].ix] = (uint32_t)(r * n_shards / c->count);
+  }
+  else
+  {
+    for (uint64_t i = 0; i < c->count; i++)
+      shard_of[i] = (uint32_t)(mix_id(c->ids[i]) % (uint64_t)n_shards);
+  }
+
+  for (int s = 0; s < n_shards; s++)
+  {
+    snprintf(shard_path, path_len, "%s.%d.fpc", prefix, s);
+    if (!(writers[s] = fpcorpus_writer_new(shard_path, &errn)))
+      goto cleanup;
+  }
+  // in file order, so each shard keeps the order of the corpus
+  for (uint64_t i = 0; i < c->count; i++)
+  {
+    if (!(fp = fpcorpus_get(c, i)))
+    {
+      errn = ENOMEM;
+      goto cleanup;
+    }
+    errn = fpcorpus_writer_add(writers[shard_of[i]], c->ids[i], fp);
+    free_fprint(fp);
+    if (errn)
+      goto cleanup;
+  }
+  for (int s = 0; s < n_shards; s++)
+  {
+    errn = fpcorpus_writer_close(writers[s]);
+    writers[s] = NULL;
+    if (errn)
+      goto cleanup;
+  }
+
+cleanup:
+  if (errn)
+    fprintf(stderr, "ERROR: %d: unable to split %s\n", errn, path);
+  if (writers)
+  {
+    for (int s = 0; s < n_shards; s++)
+    {
+      if (writers[s])
+        fpcorpus_writer_abort(writers[s]);
+    }
+  }
+  free(writers);
+  free(shard_of);
+  free(order);
+  free(shard_path);
+  fpcorpus_close(c);
+
+  return errn;
+}
+
+////////////////////////////////////////////////////////////
+// Sockets
+////////////////////////////////////////////////////////////
+
+static int read_full(int fd, void *buf, size_t len)
+{
+  uint8_t *p = (uint8_t *)buf;
+  ssize_t n = 0;
+
+  while (len > 0)
+  {
+    n = recv(fd, p, len, 0);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return n < 0 ? errno : ECONNRESET;
+    p += n;
+    len -= (size_t)n;
+  }
+  return 0;
+}
+
+static int write_full(int fd, const void *buf, size_t len)
+{
+  const uint8_t *p = (const uint8_t *)buf;
+  ssize_t n = 0;
+
+  while (len > 0)
+  {
+    n = send(fd, p, len, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return n < 0 ? errno : EIO;
+    p += n;
+    len -= (size_t)n;
+  }
+  return 0;
+}
+
+static int send_msg(int fd, uint32_t type, const void *payload, size_t len)
+{
+  MsgHeader h;
+  int errn = 0;
+
+  h.magic = MSG_MAGIC;
+  h.type = type;
+  h.len = (uint32_t)len;
+  h.reserved = 0;
+  if ((errn = write_full(fd, &h, sizeof(h))) != 0)
+    return errn;
+  return len ? write_full(fd, payload, len) : 0;
+}
+
+// read a message header; EPROTO for anything that is not one
+static int recv_header(int fd, MsgHeader *h)
+{
+  int errn = read_full(fd, h, sizeof(*h));
+
+  if (errn)
+    return errn;
+  if (h->magic != MSG_MAGIC || h->len > MSG_MAX_LEN)
+    return EPROTO;
+  return 0;
+}
+
+static void socket_options(int fd, int family)
+{
+  int one = 1;
+
+  // queries and replies are single small messages: send them at once
+  if (family != AF_UNIX)
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+#ifdef SO_NOSIGPIPE
+  setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &one, sizeof(one));
+#endif
+}
+
+// socket bound (listening) or connected to addr; -1 with *error set
+static int open_socket(const char *addr, int listening, int *error)
+{
+  struct sockaddr_un sun;
+  struct addrinfo hints;
+  struct addrinfo *res = NULL;
+  struct addrinfo *ai = NULL;
+  const char *colon = NULL;
+  char *host = NULL;
+  int one = 1;
+  int fd = -1;
+  int rc = 0;
+
+  *error = 0;
+  if (strchr(addr, '/'))
+  {
+    memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    if (strlen(addr) >= sizeof(sun.sun_path))
+    {
+      *error = ENAMETOOLONG;
+      return -1;
+    }
+    strcpy(sun.sun_path, addr);
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+    {
+      *error = errno;
+      return -1;
+    }
+    if (listening)
+    {
+      // a socket left behind by a worker that did not exit cleanly
+      unlink(addr);
+      rc = bind(fd, (struct sockaddr *)&sun, sizeof(sun));
+      if (rc == 0)
+        rc = listen(fd, LISTEN_BACKLOG);
+    }
+    else
+    {
+      rc = connect(fd, (struct sockaddr *)&sun, sizeof(sun));
+    }
+    if (rc != 0)
+    {
+      *error = errno;
+      close(fd);
+      return -1;
+    }
+    socket_options(fd, AF_UNIX);
+    return fd;
+  }
+
+  if (!(colon = strrchr(addr, ':')))
+  {
+    *error = EINVAL;
+    return -1;
+  }
+  if (!(host = strndup(addr, colon - addr)))
+  {
+    *error = ENOMEM;
+    return -1;
+  }
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = listening ? AI_PASSIVE : 0;
+  if ((rc = getaddrinfo(host[0] ? host : NULL, colon + 1, &hints, &res)) != 0)
+  {
+    fprintf(stderr, "ERROR: %s: %s\n", addr, gai_strerror(rc));
+    free(host);
+    *error = EINVAL;
+    return -1;
+  }
+  free(host);
+
+  for (ai = res; ai; ai = ai->ai_next)
+  {
+    if ((fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) < 0)
+    {
+      *error = errno;
+      continue;
+    }
+    if (listening)
+    {
+      setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+      rc = bind(fd, ai->ai_addr, ai->ai_addrlen);
+      if (rc == 0)
+        rc = listen(fd, LISTEN_BACKLOG);
+    }
+    else
+    {
+      rc = connect(fd, ai->ai_addr, ai->ai_addrlen);
+    }
+    if (rc == 0)
+    {
+      socket_options(fd, ai->ai_family);
+      *error = 0;
+      break;
+    }
+    *error = errno;
+    close(fd);
+    fd = -1;
+  }
+  freeaddrinfo(res);
+
+  return fd;
+}
+
+int fpshard_listen(const char *addr, int *error)
+{
+  int fd = open_socket(addr, 1, error);
+
+  if (fd < 0)
+    fprintf(stderr, "ERROR: %d: unable to listen on %s\n", *error, addr);
+  return fd;
+}
+
+////////////////////////////////////////////////////////////
+// Worker
+////////////////////////////////////////////////////////////
+
+static void server_unref(Server *srv)
+{
+  int refs;
+
+  pthread_mutex_lock(&srv->lock);
+  refs = --srv->refs;
+  pthread_mutex_unlock(&srv->lock);
+  if (refs == 0)
+  {
+    if (srv->own_snap)
+      fpsnap_free(srv->snap);
+    pthread_mutex_destroy(&srv->lock);
+    free(srv);
+  }
+}
+
+// songlen range of c, for the coordinator's songlen gate; found once when
+// the corpus was opened, so every reply can carry it
+static void corpus_info(const FPCorpus *c, InfoReply *info)
+{
+  info->count = c->count;
+  info->songlen_min = c->songlen_min;
+  info->songlen_max = c->songlen_max;
+}
+
+static void serve_info(const Server *srv, InfoReply *info)
+{
+  FPSnapRead rd;
+
+  corpus_info(fpsnap_enter(srv->snap, &rd), info);
+  fpsnap_leave(srv->snap, &rd);
+}
+
+// answer one query; returns 0, or an errno value to close the connection
+static int serve_query(const Server *srv, int fd, const uint8_t *payload,
+                       size_t len)
+{
+  QueryRequest req;
+  QueryReply rep;
+  FPSnapRead rd;
+  const FPCorpus *c = NULL;
+  FPCorpusHit *hits = NULL;
+  ReplyHit *out = NULL;
+  FPrint *q = NULL;
+  int32_t errn = 0;
+  double t0 = 0.0;
+  size_t k = 0;
+  size_t n = 0;
+
+  if (len < sizeof(req) + PACKED_FP_SIZE(0))
+    return EPROTO;
+  memcpy(&req, payload, sizeof(req));
+  if (PACKED_FP_SIZE(((const PackedFP *)(payload + sizeof(req)))->cprint_len) !=
+      len - sizeof(req))
+  {
+    return EPROTO;
+  }
+  k = req.k < FPSHARD_MAX_K ? req.k : FPSHARD_MAX_K;
+
+  q = fprint_from_bytes(payload + sizeof(req));
+  hits = malloc((k ? k : 1) * sizeof(*hits));
+  out = malloc(sizeof(rep) + (k ? k : 1) * sizeof(*out));
+  if (!q || !hits || !out)
+  {
+    errn = ENOMEM;
+    free_fprint(q);
+    free(hits);
+    free(out);
+    return send_msg(fd, MSG_ERROR, &errn, sizeof(errn));
+  }
+
+  // the ids are read before leaving: a reload may unmap c right after
+  t0 = now();
+  c = fpsnap_enter(srv->snap, &rd);
+  n = fpcorpus_topk(c, q, k, req.min_score, hits);
+  for (size_t i = 0; i < n; i++)
+  {
+    ReplyHit h;
+    h.id = c->ids[hits[i].ix];
+    h.score = hits[i].score;
+    memcpy((uint8_t *)out + sizeof(rep) + i * sizeof(h), &h, sizeof(h));
+  }
+  corpus_info(c, &rep.info);
+  fpsnap_leave(srv->snap, &rd);
+  rep.n = (uint32_t)n;
+  rep.reserved = 0;
+  rep.seconds = now() - t0;
+  memcpy(out, &rep, sizeof(rep));
+
+  errn = send_msg(fd, MSG_QUERY, out, sizeof(rep) + n * sizeof(ReplyHit));
+
+  free_fprint(q);
+  free(hits);
+  free(out);
+  return errn;
+}
+
+static void *serve_conn(void *arg)
+{
+  Conn *conn = (Conn *)arg;
+  MsgHeader h;
+  InfoReply info;
+  uint8_t *payload = NULL;
+  size_t cap = 0;
+  void *tmp = NULL;
+  int errn = 0;
+
+  while ((errn = recv_header(conn->fd, &h)) == 0)
+  {
+    if (h.len > cap)
+    {
+      if (!(tmp = realloc(payload, h.len)))
+      {
+        errn = ENOMEM;
+        break;
+      }
+      payload = tmp;
+      cap = h.len;
+    }
+    if (h.len && (errn = read_full(conn->fd, payload, h.len)) != 0)
+      break;
+
+    if (h.type == MSG_INFO)
+    {
+      serve_info(conn->srv, &info);
+      errn = send_msg(conn->fd, MSG_INFO, &info, sizeof(info));
+    }
+    else if (h.type == MSG_QUERY)
+      errn = serve_query(conn->srv, conn->fd, payload, h.len);
+    else
+      errn = EPROTO;
+    if (errn)
+      break;
+  }
+  // a coordinator hanging up is the normal end of a connection
+  if (errn && errn != ECONNRESET)
+    fprintf(stderr, "ERROR: %d: shard connection failed\n", errn);
+
+  close(conn->fd);
+  free(payload);
+  server_unref(conn->srv);
+  free(conn);
+  return NULL;
+}
+
+static int serve(FPSnap *snap, int own_snap, int listen_fd)
+{
+  Server *srv = calloc(1, sizeof(*srv));
+  Conn *conn = NULL;
+  pthread_attr_t attr;
+  pthread_t thread;
+  struct sockaddr_storage local;
+  socklen_t local_len = sizeof(local);
+  int family = AF_UNSPEC;
+  int fd = -1;
+  int errn = 0;
+
+  if (!srv)
+  {
+    if (own_snap)
+      fpsnap_free(snap);
+    return ENOMEM;
+  }
+  srv->snap = snap;
+  srv->own_snap = own_snap;
+  srv->refs = 1;
+  pthread_mutex_init(&srv->lock, NULL);
+  // accepted sockets are of the listener's family
+  if (getsockname(listen_fd, (struct sockaddr *)&local, &local_len) == 0)
+    family = local.ss_family;
+
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  for (;;)
+  {
+    if ((fd = accept(listen_fd, NULL, NULL)) < 0)
+    {
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+      errn = errno;
+      fprintf(stderr, "ERROR: %d: unable to accept connections\n", errn);
+      break;
+    }
+    if (!(conn = malloc(sizeof(*conn))))
+    {
+      close(fd);
+      continue;
+    }
+    socket_options(fd, family);
+    conn->srv = srv;
+    conn->fd = fd;
+    pthread_mutex_lock(&srv->lock);
+    srv->refs++;
+    pthread_mutex_unlock(&srv->lock);
+    if (pthread_create(&thread, &attr, serve_conn, conn) != 0)
+    {
+      fprintf(stderr, "ERROR: unable to start a connection thread\n");
+      close(fd);
+      free(conn);
+      server_unref(srv);
+    }
+  }
+  pthread_attr_destroy(&attr);
+  server_unref(srv);
+
+  return errn;
+}
+
+int fpshard_serve(const FPCorpus *c, int listen_fd)
+{
+  // c stays the caller's
+  FPSnap *snap = fpsnap_new((void *)c, NULL);
+
+  if (!snap)
+    return ENOMEM;
+  return serve(snap, 1, listen_fd);
+}
+
+int fpshard_serve_snap(FPSnap *snap, int listen_fd)
+{
+  return serve(snap, 0, listen_fd);
+}
+
+////////////////////////////////////////////////////////////
+// Coordinator
+////////////////////////////////////////////////////////////
+
+static void shard_drop(Shard *s)
+{
+  if (s->fd >= 0)
+    close(s->fd);
+  s->fd = -1;
+}
+
+FPShardClient *fpshard_connect(const char *const *addrs, int n_shards,
+                               int *error)
+{
+  FPShardClient *cl = NULL;
+  MsgHeader h;
+  int s = 0;
+
+  *error = 0;
+  if (n_shards <= 0)
+  {
+    *error = EINVAL;
+    return NULL;
+  }
+  if (!(cl = calloc(1, sizeof(*cl))) ||
+      !(cl->shards = calloc(n_shards, sizeof(*cl->shards))))
+  {
+    free(cl);
+    *error = ENOMEM;
+    return NULL;
+  }
+  cl->n_shards = n_shards;
+  for (s = 0; s < n_shards; s++)
+    cl->shards[s].fd = -1;
+
+  for (s = 0; s < n_shards; s++)
+  {
+    if ((cl->shards[s].fd = open_socket(addrs[s], 0, error)) < 0)
+      break;
+    if ((*error = send_msg(cl->shards[s].fd, MSG_INFO, NULL, 0)) != 0 ||
+        (*error = recv_header(cl->shards[s].fd, &h)) != 0)
+    {
+      break;
+    }
+    if (h.type != MSG_INFO || h.len != sizeof(InfoReply))
+    {
+      *error = EPROTO;
+      break;
+    }
+    if ((*error = read_full(cl->shards[s].fd, &cl->shards[s].info,
+                            sizeof(InfoReply))) != 0)
+    {
+      break;
+    }
+    cl->shards[s].info_at = now();
+  }
+  if (*error)
+  {
+    fprintf(stderr, "ERROR: %d: unable to connect to shard %s\n",
+            *error, addrs[s]);
+    fpshard_disconnect(cl);
+    return NULL;
+  }
+
+  return cl;
+}
+
+void fpshard_disconnect(FPShardClient *cl)
+{
+  if (!cl)
+    return;
+  for (int s = 0; s < cl->n_shards; s++)
+    shard_drop(&cl->shards[s]);
+  free(cl->shards);
+  free(cl);
+}
+
+uint64_t fpshard_count(const FPShardClient *cl)
+{
+  uint64_t n = 0;
+
+  for (int s = 0; s < cl->n_shards; s++)
+    n += cl->shards[s].info.count;
+  return n;
+}
+
+// read the reply of shard s, appending its hits; returns 0 or an errno value
+static int recv_reply(FPShardClient *cl, int s, FPShardHit **hits,
+                      size_t *n_hits, size_t *cap, FPShardStats *st)
+{
+  MsgHeader h;
+  QueryReply rep;
+  ReplyHit hit;
+  int32_t remote = 0;
+  void *tmp = NULL;
+  int fd = cl->shards[s].fd;
+  int errn = 0;
+
+  if ((errn = recv_header(fd, &h)) != 0)
+    return errn;
+  if (h.type == MSG_ERROR && h.len == sizeof(remote))
+  {
+    if ((errn = read_full(fd, &remote, sizeof(remote))) != 0)
+      return errn;
+    // the connection is still in step: only this query failed
+    st->error = remote;
+    return 0;
+  }
+  if (h.type != MSG_QUERY || h.len < sizeof(rep))
+    return EPROTO;
+  if ((errn = read_full(fd, &rep, sizeof(rep))) != 0)
+    return errn;
+  if (h.len != sizeof(rep) + rep.n * sizeof(ReplyHit) || rep.n > FPSHARD_MAX_K)
+    return EPROTO;
+
+  if (*n_hits + rep.n > *cap)
+  {
+    *cap = 2 * (*n_hits + rep.n);
+    if (!(tmp = realloc(*hits, *cap * sizeof(**hits))))
+      return ENOMEM;
+    *hits = tmp;
+  }
+  for (uint32_t i = 0; i < rep.n; i++)
+  {
+    if ((errn = read_full(fd, &hit, sizeof(hit))) != 0)
+      return errn;
+    (*hits)[*n_hits].id = hit.id;
+    (*hits)[*n_hits].score = hit.score;
+    (*hits)[*n_hits].shard = s;
+    (*n_hits)++;
+  }
+  cl->shards[s].info = rep.info;
+  cl->shards[s].info_at = now();
+  st->seconds = now() - cl->shards[s].sent;
+  st->match_seconds = rep.seconds;
+  st->n_hits = rep.n;
+  return 0;
+}
+
+static int cmp_shard_hit_desc(const void *a, const void *b)
+{
+  double sa = ((const FPShardHit *)a)->score;
+  double sb = ((const FPShardHit *)b)->score;
+  return (sa < sb) - (sa > sb);
+}
+
+size_t fpshard_query(FPShardClient *cl, const FPrint *q, size_t k,
+                     double min_score, FPShardHit *hits, FPShardStats *stats)
+{
+  FPShardStats *st = stats;
+  struct pollfd *pfds = NULL;
+  int *pending = NULL;
+  int n_pending = 0;
+  uint8_t *msg = NULL;
+  size_t packed_len = PACKED_FP_SIZE(q->cprint_len);
+  size_t msg_len = sizeof(MsgHeader) + sizeof(QueryRequest) + packed_len;
+  uint8_t *packed = NULL;
+  FPShardHit *all = NULL;
+  size_t n_all = 0;
+  size_t cap = 0;
+  MsgHeader h;
+  QueryRequest req;
+  uint32_t lo = FP_SONGLEN_LO(q->songlen);
+  uint32_t hi = FP_SONGLEN_HI(q->songlen);
+  double deadline = 0.0;
+  int timeout = 0;
+  int errn = 0;
+  size_t n = 0;
+
+  if (k > FPSHARD_MAX_K)
+    k = FPSHARD_MAX_K;
+  if (!st && !(st = malloc(cl->n_shards * sizeof(*st))))
+    return 0;
+  memset(st, 0, cl->n_shards * sizeof(*st));
+
+  pfds = malloc(cl->n_shards * sizeof(*pfds));
+  pending = malloc(cl->n_shards * sizeof(*pending));
+  msg = malloc(msg_len);
+  packed = fprint_to_bytes(q);
+  if (!pfds || !pending || !msg || !packed)
+  {
+    for (int s = 0; s < cl->n_shards; s++)
+      st[s].error = ENOMEM;
+    goto cleanup;
+  }
+
+  // one message for every shard
+  h.magic = MSG_MAGIC;
+  h.type = MSG_QUERY;
+  h.len = (uint32_t)(msg_len - sizeof(h));
+  h.reserved = 0;
+  req.k = (uint32_t)k;
+  req.reserved = 0;
+  req.min_score = min_score;
+  memcpy(msg, &h, sizeof(h));
+  memcpy(msg + sizeof(h), &req, sizeof(req));
+  memcpy(msg + sizeof(h) + sizeof(req), packed, packed_len);
+
+  // fan out: every shard works on the query at once
+  for (int s = 0; s < cl->n_shards; s++)
+  {
+    Shard *sh = &cl->shards[s];
+    if (sh->fd < 0)
+    {
+      st[s].error = ENOTCONN;
+      continue;
+    }
+    if (k == 0 || (now() - sh->info_at < INFO_MAX_AGE_MS / 1000.0 &&
+                   (sh->info.count == 0 || sh->info.songlen_max < lo ||
+                    sh->info.songlen_min > hi)))
+    {
+      st[s].skipped = 1;
+      continue;
+    }
+    sh->sent = now();
+    if ((errn = write_full(sh->fd, msg, msg_len)) != 0)
+    {
+      st[s].error = errn;
+      shard_drop(sh);
+      continue;
+    }
+    pending[n_pending++] = s;
+  }
+
+  // gather the replies as they come
+  deadline = now() + QUERY_TIMEOUT_MS / 1000.0;
+  while (n_pending > 0)
+  {
+    for (int i = 0; i < n_pending; i++)
+    {
+      pfds[i].fd = cl->shards[pending[i]].fd;
+      pfds[i].events = POLLIN;
+      pfds[i].revents = 0;
+    }
+    timeout = (int)((deadline - now()) * 1000.0);
+    if (timeout < 0 || (errn = poll(pfds, n_pending, timeout)) == 0)
+    {
+      // a late reply would be taken for the next query's: drop the shard
+      for (int i = 0; i < n_pending; i++)
+      {
+        st[pending[i]].error = ETIMEDOUT;
+        shard_drop(&cl->shards[pending[i]]);
+      }
+      break;
+    }
+    if (errn < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      errn = errno;
+      for (int i = 0; i < n_pending; i++)
+      {
+        st[pending[i]].error = errn;
+        shard_drop(&cl->shards[pending[i]]);
+      }
+      break;
+    }
+
+    for (int i = n_pending - 1; i >= 0; i--)
+    {
+      int s = pending[i];
+      if (!pfds[i].revents)
+        continue;
+      if ((errn = recv_reply(cl, s, &all, &n_all, &cap, &st[s])) != 0)
+      {
+        fprintf(stderr, "ERROR: %d: shard %d failed\n", errn, s);
+        st[s].error = errn;
+        shard_drop(&cl->shards[s]);
+      }
+      pending[i] = pending[--n_pending];
+    }
+  }
+
+  // merge: each list is one shard's best, so the best k overall are among
+  // them
+  if (n_all > 1)
+    qsort(all, n_all, sizeof(*all), cmp_shard_hit_desc);
+  n = n_all < k ? n_all : k;
+  if (n)
+    memcpy(hits, all, n * sizeof(*hits));
+
+cleanup:
+  if (st != stats)
+    free(st);
+  free(pfds);
+  free(pending);
+  free(msg);
+  free(packed);
+  free(all);
+  return n;
+}
@@ -0,0 +1,129 @@
+/*
+ *  fpshard.h
+ *
+ *  query a corpus split across worker processes
+ *
+ *  A corpus too large for one process is split into shard corpora
+ *  (fpshard_split), each served by its own worker process
+ *  (fpshard_listen, fpshard_serve) on a Unix socket or a TCP port, on one
+ *  machine or several.  A coordinator connects to every worker
+ *  (fpshard_connect), sends each query to all the shards that can hold a
+ *  match and merges their top-k lists (fpshard_query).  Workers score with
+ *  fpcorpus_topk, so the results are those of one process over the whole
+ *  corpus.
+ *
+ *  Shards split by songlen hold disjoint songlen ranges, and a query only
+ *  goes to the shards whose range passes the match_cpfm songlen gate.
+ *
+ *  Messages are in native byte order: every machine in a cluster must
+ *  share one architecture.
+ *
+ *  Copyright 2010 Zatisfi, LLC. MIT License, 2025
+ */
+
+#ifndef _FPSHARD_H
+#define _FPSHARD_H
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "fplib.h"
+#include "fpcorpus.h"
+#include "fpsnap.h"
+
+// fpshard_split modes
+// contiguous songlen ranges of equal size, so queries skip most shards
+#define FPSHARD_BY_SONGLEN 0
+// by a hash of the id, so every shard sees the same mix of queries
+#define FPSHARD_BY_HASH 1
+
+// most hits a worker returns for one query
+#define FPSHARD_MAX_K 1024
+
+  typedef struct FPShardClient FPShardClient;
+
+  typedef struct FPShardHit
+  {
+    uint64_t id;
+    double score;
+    // the shard it came from
+    int shard;
+  } FPShardHit;
+
+  // per shard, for one query
+  typedef struct FPShardStats
+  {
+    // round trip as seen by the coordinator, and time in fpcorpus_topk
+    double seconds;
+    double match_seconds;
+    size_t n_hits;
+    // the query was not sent: no entry of the shard can match it
+    int skipped;
+    // 0, or an errno value if the shard failed (its hits are missing)
+    int error;
+  } FPShardStats;
+
+  /*! fpshard_split
+   *  \brief write the entries of corpus path into n_shards corpora named
+   *  "<prefix>.<shard>.fpc", by FPSHARD_BY_SONGLEN or FPSHARD_BY_HASH;
+   *  returns 0 or an errno value
+   */
+  int fpshard_split(const char *path, int n_shards, int mode,
+                    const char *prefix);
+
+  /*! fpshard_listen
+   *  \brief listening socket for addr: a Unix socket path (containing a
+   *  '/'), or "host:port" / ":port" for TCP.  Returns the descriptor, or -1
+   *  and sets *error to an errno value.
+   */
+  int fpshard_listen(const char *addr, int *error);
+
+  /*! fpshard_serve
+   *  \brief answer coordinators connecting to listen_fd from corpus c, one
+   *  thread per connection.  Only returns if accept fails, with its errno.
+   */
+  int fpshard_serve(const FPCorpus *c, int listen_fd);
+
+  /*! fpshard_serve_snap
+   *  \brief fpshard_serve from the corpus snapshots of snap (see fpsnap.h):
+   *  each query runs against the corpus current when it arrives, so the
+   *  corpus can be reloaded with fpsnap_reload_corpus while serving.  snap
+   *  must outlive every connection.
+   */
+  int fpshard_serve_snap(FPSnap *snap, int listen_fd);
+
+  /*! fpshard_connect
+   *  \brief connect to the workers at addrs (see fpshard_listen); shard i is
+   *  addrs[i].  Returns NULL and sets *error to an errno value on failure.
+   */
+  FPShardClient *fpshard_connect(const char *const *addrs, int n_shards,
+                                 int *error);
+
+  void fpshard_disconnect(FPShardClient *cl);
+
+  /*! fpshard_count
+   *  \brief entries over all shards
+   */
+  uint64_t fpshard_count(const FPShardClient *cl);
+
+  /*! fpshard_query
+   *  \brief fill hits (room for k, at most FPSHARD_MAX_K) with the best
+   *  entries of every shard scoring above min_score, best first, and
+   *  stats (room for one per shard, or NULL) with what each shard did;
+   *  returns the number of hits.  A shard that fails is dropped from the
+   *  client and reported in its stats.
+   */
+  size_t fpshard_query(FPShardClient *cl, const FPrint *q, size_t k,
+                       double min_score, FPShardHit *hits,
+                       FPShardStats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _FPSHARD_H */
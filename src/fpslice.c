@@ -0,0 +1,345 @@
+/*
+ *  fpslice.c
+ *  bit-sliced copy of a corpus' chromaprints, to scan 64 entries at a time
+ *
+ *  Copyright 2010 Zatisfi, LLC. MIT License, 2025
+ *
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fplib.h"
+#include "fpcorpus.h"
+#include "fpslice.h"
+
+// the code of a position past the end of a cprint: no value has it
+#define CODE_NONE 63
+// enough counter planes for any cprint length
+#define MAX_PLANES 33
+
+struct FPSlices
+{
+  uint64_t count;
+  uint64_t n_blocks;
+  // positions sliced in block b: the longest cprint in it
+  uint32_t *block_len;
+  // block b is words[block_off[b] ..], FPSLICE_CODE_BITS words a position
+  uint64_t *block_off;
+  uint64_t *words;
+  // cprint length of every entry
+  uint32_t *len;
+};
+
+// what match_chromab compares: the index of the lowest set bit
+static inline uint8_t low_code(uint32_t x)
+{
+  return x ? (uint8_t)__builtin_ctz(x) : 32;
+}
+
+static inline uint32_t bits_needed(uint64_t x)
+{
+  return x ? 64 - (uint32_t)__builtin_clzll(x) : 0;
+}
+
+FPSlices *fpslice_build(const FPCorpus *c, int *error)
+{
+  FPSlices *s = calloc(1, sizeof(*s));
+  uint64_t total = 0;
+  uint64_t *w = NULL;
+  const int32_t *cp = NULL;
+  size_t len = 0;
+  uint64_t lane_bit = 0;
+  uint8_t code = 0;
+
+  *error = 0;
+  if (!s)
+  {
+    *error = ENOMEM;
+    return NULL;
+  }
+  s->count = c->count;
+  s->n_blocks = (c->count + FPSLICE_BLOCK - 1) / FPSLICE_BLOCK;
+  s->block_len = calloc(s->n_blocks + 1, sizeof(*s->block_len));
+  s->block_off = calloc(s->n_blocks + 1, sizeof(*s->block_off));
+  s->len = malloc((c->count ? c->count : 1) * sizeof(*s->len));
+  if (!s->block_len || !s->block_off || !s->len)
+    goto error;
+
+  for (uint64_t i = 0; i < c->count; i++)
+  {
+    len = fpcorpus_cprint_len(c, i);
+    if (len > UINT32_MAX)
+      goto error;
+    s->len[i] = (uint32_t)len;
+    if (len > s->block_len[i / FPSLICE_BLOCK])
+      s->block_len[i / FPSLICE_BLOCK] = (uint32_t)len;
+  }
+  for (uint64_t b = 0; b < s->n_blocks; b++)
+  {
+    s->block_off[b] = total;
+    total += (uint64_t)s->block_len[b] * FPSLICE_CODE_BITS;
+  }
+  s->block_off[s->n_blocks] = total;
+
+  // all ones is CODE_NONE: clear the zero bits of every real position
+  if (!(s->words = malloc((total ? total : 1) * sizeof(*s->words))))
+    goto error;
+  memset(s->words, 0xff, total * sizeof(*s->words));
+  for (uint64_t i = 0; i < c->count; i++)
+  {
+    w = &s->words[s->block_off[i / FPSLICE_BLOCK]];
+    lane_bit = (uint64_t)1 << (i % FPSLICE_BLOCK);
+    cp = fpcorpus_cprint(c, i);
+    len = fpcorpus_cprint_len(c, i);
+    for (size_t p = 0; p < len; p++, w += FPSLICE_CODE_BITS)
+    {
+      code = low_code((uint32_t)cp[p]);
+      for (int bit = 0; bit < FPSLICE_CODE_BITS; bit++)
+      {
+        if (!((code >> bit) & 1))
+          w[bit] &= ~lane_bit;
+      }
+    }
+  }
+
+  return s;
+
+error:
+  *error = ENOMEM;
+  fpslice_free(s);
+  return NULL;
+}
+
+void fpslice_free(FPSlices *s)
+{
+  if (!s)
+    return;
+  free(s->block_len);
+  free(s->block_off);
+  free(s->words);
+  free(s->len);
+  free(s);
+}
+
+// matching positions of the query against each entry of block b
+static void block_counts(const FPSlices *s, uint64_t b, const uint8_t *qcode,
+                         size_t q_len, uint32_t *counts)
+{
+  const uint64_t *w = &s->words[s->block_off[b]];
+  size_t len = q_len < s->block_len[b] ? q_len : s->block_len[b];
+  uint64_t planes[MAX_PLANES] = {0};
+  uint32_t n_planes = bits_needed(len);
+  uint64_t diff, carry, t;
+  uint32_t c;
+
+  for (size_t p = 0; p < len; p++, w += FPSLICE_CODE_BITS)
+  {
+    // -(bit) is all ones for a set query bit: a lane differs where any
+    // bit of its code differs from the query's
+    c = qcode[p];
+    diff = (w[0] ^ -(uint64_t)(c & 1)) |
+           (w[1] ^ -(uint64_t)((c >> 1) & 1)) |
+           (w[2] ^ -(uint64_t)((c >> 2) & 1)) |
+           (w[3] ^ -(uint64_t)((c >> 3) & 1)) |
+           (w[4] ^ -(uint64_t)((c >> 4) & 1)) |
+           (w[5] ^ -(uint64_t)((c >> 5) & 1));
+    // add one to the counter of every matching lane, plane by plane; the
+    // carry dies out after two planes on average
+    carry = ~diff;
+    for (uint32_t i = 0; carry; i++)
+    {
+      t = planes[i] & carry;
+      planes[i] ^= carry;
+      carry = t;
+    }
+  }
+
+  for (int lane = 0; lane < FPSLICE_BLOCK; lane++)
+  {
+    c = 0;
+    for (uint32_t i = 0; i < n_planes; i++)
+      c |= (uint32_t)((planes[i] >> lane) & 1) << i;
+    counts[lane] = c;
+  }
+}
+
+static uint8_t *query_codes(const int32_t *cp, size_t cp_len)
+{
+  uint8_t *qcode = malloc(cp_len ? cp_len : 1);
+
+  if (!qcode)
+    return NULL;
+  for (size_t p = 0; p < cp_len; p++)
+    qcode[p] = low_code((uint32_t)cp[p]);
+  return qcode;
+}
+
+// match_chromab from a count of matching positions
+static inline double chromab_score(uint32_t count, size_t q_len, size_t len)
+{
+  if (count == 0 || q_len == 0 || len == 0)
+    return 0.0;
+  return (double)count / (double)(q_len > len ? q_len : len);
+}
+
+void fpslice_match_chromab(const FPSlices *s, const int32_t *cp,
+                           size_t cp_len, double *scores)
+{
+  uint8_t *qcode = query_codes(cp, cp_len);
+  uint32_t counts[FPSLICE_BLOCK];
+  uint64_t i = 0;
+
+  if (!qcode)
+  {
+    memset(scores, 0, s->count * sizeof(*scores));
+    return;
+  }
+  for (uint64_t b = 0; b < s->n_blocks; b++)
+  {
+    block_counts(s, b, qcode, cp_len, counts);
+    for (int lane = 0; lane < FPSLICE_BLOCK && i < s->count; lane++, i++)
+      scores[i] = chromab_score(counts[lane], cp_len, s->len[i]);
+  }
+  free(qcode);
+}
+
+// scores of block b against q, 0.0 for entries failing the songlen gate;
+// returns 0 if no entry of the block passes it
+static int block_scores(const FPSlices *s, const FPCorpus *c, const FPrint *q,
+                        const uint8_t *qcode, uint64_t b, double *scores)
+{
+  uint64_t first = b * FPSLICE_BLOCK;
+  uint64_t n = c->count - first < FPSLICE_BLOCK ? c->count - first : FPSLICE_BLOCK;
+  uint64_t gate = 0;
+  uint32_t counts[FPSLICE_BLOCK];
+  uint64_t i;
+  double fm, cp;
+
+  for (uint64_t lane = 0; lane < n; lane++)
+  {
+    if (FP_SONGLEN_MAY_MATCH(q->songlen, c->songlen[first + lane]))
+      gate |= (uint64_t)1 << lane;
+  }
+  memset(scores, 0, n * sizeof(*scores));
+  if (!gate)
+    return 0;
+
+  block_counts(s, b, qcode, q->cprint_len, counts);
+  for (uint64_t lane = 0; lane < n; lane++)
+  {
+    if (!((gate >> lane) & 1))
+      continue;
+    i = first + lane;
+    fm = match_fooid_fp(q->r, q->dom, &c->r[i * R_SIZE], &c->dom[i * DOM_SIZE]);
+    cp = chromab_score(counts[lane], q->cprint_len, s->len[i]);
+    scores[lane] = match_cpfm_combine(fm, cp);
+  }
+  return 1;
+}
+
+void fpslice_match_all(const FPSlices *s, const FPCorpus *c, const FPrint *q,
+                       double *scores)
+{
+  uint8_t *qcode = NULL;
+
+  // the slices hold whole cprints: a partial query is scored exactly
+  if (fprint_missing(q))
+  {
+    fpcorpus_match_all(c, q, scores);
+    return;
+  }
+  if (!(qcode = query_codes(q->cprint, q->cprint_len)))
+  {
+    memset(scores, 0, c->count * sizeof(*scores));
+    return;
+  }
+  for (uint64_t b = 0; b < s->n_blocks; b++)
+    block_scores(s, c, q, qcode, b, &scores[b * FPSLICE_BLOCK]);
+  free(qcode);
+}
+
+// hits[0 .. n) is a min-heap on score
+static void heap_sift_down(FPCorpusHit *hits, size_t n, size_t i)
+{
+  FPCorpusHit tmp;
+  size_t child;
+
+  while ((child = 2 * i + 1) < n)
+  {
+    if (child + 1 < n && hits[child + 1].score < hits[child].score)
+      child++;
+    if (hits[i].score <= hits[child].score)
+      break;
+    tmp = hits[i];
+    hits[i] = hits[child];
+    hits[child] = tmp;
+    i = child;
+  }
+}
+
+static void heap_sift_up(FPCorpusHit *hits, size_t i)
+{
+  FPCorpusHit tmp;
+
+  while (i > 0 && hits[(i - 1) / 2].score > hits[i].score)
+  {
+    tmp = hits[i];
+    hits[i] = hits[(i - 1) / 2];
+    hits[(i - 1) / 2] = tmp;
+    i = (i - 1) / 2;
+  }
+}
+
+static int cmp_hit_desc(const void *a, const void *b)
+{
+  double sa = ((const FPCorpusHit *)a)->score;
+  double sb = ((const FPCorpusHit *)b)->score;
+  return (sa < sb) - (sa > sb);
+}
+
+size_t fpslice_topk(const FPSlices *s, const FPCorpus *c, const FPrint *q,
+                    size_t k, double min_score, FPCorpusHit *hits)
+{
+  uint8_t *qcode = NULL;
+  double scores[FPSLICE_BLOCK];
+  uint64_t first, n_lanes;
+  size_t n = 0;
+
+  if (fprint_missing(q))
+    return fpcorpus_topk(c, q, k, min_score, hits);
+  if (k == 0 || !(qcode = query_codes(q->cprint, q->cprint_len)))
+    return 0;
+
+  for (uint64_t b = 0; b < s->n_blocks; b++)
+  {
+    if (!block_scores(s, c, q, qcode, b, scores))
+      continue;
+    first = b * FPSLICE_BLOCK;
+    n_lanes = c->count - first < FPSLICE_BLOCK ? c->count - first : FPSLICE_BLOCK;
+    for (uint64_t lane = 0; lane < n_lanes; lane++)
+    {
+      if (scores[lane] <= min_score)
+        continue;
+      if (n < k)
+      {
+        hits[n].ix = first + lane;
+        hits[n].score = scores[lane];
+        heap_sift_up(hits, n++);
+      }
+      else if (scores[lane] > hits[0].score)
+      {
+        hits[0].ix = first + lane;
+        hits[0].score = scores[lane];
+        heap_sift_down(hits, n, 0);
+      }
+    }
+  }
+  free(qcode);
+
+  qsort(hits, n, sizeof(*hits), cmp_hit_desc);
+
+  return n;
+}
@@ -0,0 +1,76 @@
+/*
+ *  fpslice.h
+ *
+ *  bit-sliced copy of a corpus' chromaprints, to scan 64 entries at a time
+ *
+ *  match_chromab counts the positions where two cprints have the same
+ *  lowest set bit, one position of one entry per comparison.  FPSlices
+ *  stores, for each block of 64 entries, cprint position and bit of the
+ *  (6-bit) index of the lowest set bit, one 64-bit word holding that bit for
+ *  all 64 entries.  Comparing a query position against the block is then
+ *  six XORs, and the 64 match counts are kept by bit-sliced adders, so a
+ *  brute-force scan does a fraction of the work per entry.  The scores are
+ *  exactly those of match_chromab and match_cpfm_raw.
+ *
+ *  The slices take 6 bits per cprint value (against 32 in the corpus) and
+ *  are built in memory from an open FPCorpus.
+ *
+ *  Copyright 2010 Zatisfi, LLC. MIT License, 2025
+ */
+
+#ifndef _FPSLICE_H
+#define _FPSLICE_H
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "fplib.h"
+#include "fpcorpus.h"
+
+// entries per block: one per bit of a word
+#define FPSLICE_BLOCK 64
+// bits of the lowest-set-bit index (0..31, 32 for a zero value, 63 for
+// no value past the end of a cprint)
+#define FPSLICE_CODE_BITS 6
+
+  typedef struct FPSlices FPSlices;
+
+  /*! fpslice_build
+   *  \brief slice every cprint of c; returns NULL and sets *error to an
+   *  errno value on failure.  c must stay open while the slices are used
+   *  with it.
+   */
+  FPSlices *fpslice_build(const FPCorpus *c, int *error);
+
+  void fpslice_free(FPSlices *s);
+
+  /*! fpslice_match_chromab
+   *  \brief scores[i] = match_chromab(cp, cp_len, cprint of entry i) for
+   *  every entry
+   */
+  void fpslice_match_chromab(const FPSlices *s, const int32_t *cp,
+                             size_t cp_len, double *scores);
+
+  /*! fpslice_match_all
+   *  \brief scores[i] = fpcorpus_match(c, q, i) for every entry, as
+   *  fpcorpus_match_all; s must be built from c
+   */
+  void fpslice_match_all(const FPSlices *s, const FPCorpus *c,
+                         const FPrint *q, double *scores);
+
+  /*! fpslice_topk
+   *  \brief fpcorpus_topk over the slices of c
+   */
+  size_t fpslice_topk(const FPSlices *s, const FPCorpus *c, const FPrint *q,
+                      size_t k, double min_score, FPCorpusHit *hits);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _FPSLICE_H */
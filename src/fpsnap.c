@@ -0,0 +1,167 @@
+/*
+ *  fpsnap.c
+ *  swap the corpus or index a long-running service queries without
+ *  stopping it
+ *
+ *  Copyright 2010 Zatisfi, LLC. MIT License, 2025
+ *
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "fpcorpus.h"
+#include "fpsnap.h"
+
+#define CACHE_LINE 64
+// polls of the reader counters before the loader starts sleeping, and the
+// longest sleep between polls
+#define SPIN_POLLS 64
+#define MAX_SLEEP_NS 1000000L
+
+typedef struct
+{
+  int64_t n;
+  char pad[CACHE_LINE - sizeof(int64_t)];
+} Stripe;
+
+struct FPSnap
+{
+  // readers inside, by the parity of the epoch they entered in
+  Stripe readers[2][FPSNAP_STRIPES];
+  void *data;
+  uint64_t epoch;
+  uint64_t version;
+  void (*free_data)(void *);
+  // serializes fpsnap_swap
+  pthread_mutex_t swap_lock;
+};
+
+// the stripe of this thread, + 1 (0 until it first enters)
+static __thread uint32_t thread_stripe;
+static uint32_t next_stripe;
+
+FPSnap *fpsnap_new(void *data, void (*free_data)(void *))
+{
+  FPSnap *s = NULL;
+
+  if (posix_memalign((void **)&s, CACHE_LINE, sizeof(*s)) != 0)
+    return NULL;
+  memset(s, 0, sizeof(*s));
+  s->data = data;
+  s->free_data = free_data;
+  pthread_mutex_init(&s->swap_lock, NULL);
+  return s;
+}
+
+void fpsnap_free(FPSnap *s)
+{
+  if (!s)
+    return;
+  if (s->data && s->free_data)
+    s->free_data(s->data);
+  pthread_mutex_destroy(&s->swap_lock);
+  free(s);
+}
+
+void *fpsnap_enter(FPSnap *s, FPSnapRead *read)
+{
+  if (thread_stripe == 0)
+    thread_stripe = __atomic_fetch_add(&next_stripe, 1, __ATOMIC_RELAXED) %
+                        FPSNAP_STRIPES + 1;
+  read->stripe = thread_stripe - 1;
+  read->epoch = (uint32_t)(__atomic_load_n(&s->epoch, __ATOMIC_SEQ_CST) & 1);
+  // counted before the snapshot is loaded: a swap that does not see this
+  // reader published its snapshot before the load below
+  __atomic_add_fetch(&s->readers[read->epoch][read->stripe].n, 1,
+                     __ATOMIC_SEQ_CST);
+  return __atomic_load_n(&s->data, __ATOMIC_SEQ_CST);
+}
+
+void fpsnap_leave(FPSnap *s, const FPSnapRead *read)
+{
+  // release: the reader's last use of the snapshot comes before
+  __atomic_sub_fetch(&s->readers[read->epoch][read->stripe].n, 1,
+                     __ATOMIC_RELEASE);
+}
+
+static int64_t readers_inside(FPSnap *s, int parity)
+{
+  int64_t n = 0;
+
+  for (int i = 0; i < FPSNAP_STRIPES; i++)
+    n += __atomic_load_n(&s->readers[parity][i].n, __ATOMIC_ACQUIRE);
+  return n;
+}
+
+// wait until every reader that entered in an epoch of this parity left
+static void wait_readers(FPSnap *s, int parity)
+{
+  struct timespec ts;
+  long sleep_ns = 1000;
+
+  for (int polls = 0; readers_inside(s, parity) > 0; polls++)
+  {
+    if (polls < SPIN_POLLS)
+    {
+      sched_yield();
+      continue;
+    }
+    ts.tv_sec = 0;
+    ts.tv_nsec = sleep_ns;
+    nanosleep(&ts, NULL);
+    if (sleep_ns < MAX_SLEEP_NS)
+      sleep_ns *= 2;
+  }
+}
+
+void fpsnap_swap(FPSnap *s, void *data)
+{
+  void *old = NULL;
+  uint64_t epoch = 0;
+
+  pthread_mutex_lock(&s->swap_lock);
+  old = __atomic_exchange_n(&s->data, data, __ATOMIC_SEQ_CST);
+  /* A reader that has the old snapshot counted itself before the exchange,
+   * under either parity (it may have read the epoch long before), so both
+   * are waited for.  Flipping the epoch before each wait sends readers
+   * entering meanwhile to the other parity, so the waits end.
+   */
+  for (int round = 0; round < 2; round++)
+  {
+    epoch = __atomic_load_n(&s->epoch, __ATOMIC_RELAXED);
+    __atomic_store_n(&s->epoch, epoch + 1, __ATOMIC_SEQ_CST);
+    wait_readers(s, (int)(epoch & 1));
+  }
+  __atomic_add_fetch(&s->version, 1, __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&s->swap_lock);
+
+  if (old && old != data && s->free_data)
+    s->free_data(old);
+}
+
+uint64_t fpsnap_version(FPSnap *s)
+{
+  return __atomic_load_n(&s->version, __ATOMIC_RELAXED);
+}
+
+void fpsnap_free_corpus(void *corpus)
+{
+  fpcorpus_close((FPCorpus *)corpus);
+}
+
+int fpsnap_reload_corpus(FPSnap *s, const char *path)
+{
+  FPCorpus *c = NULL;
+  int errn = 0;
+
+  if (!(c = fpcorpus_open(path, &errn)))
+    return errn;
+  fpsnap_swap(s, c);
+  return 0;
+}
@@ -0,0 +1,94 @@
+/*
+ *  fpsnap.h
+ *
+ *  swap the corpus or index a long-running service queries without
+ *  stopping it
+ *
+ *  An FPSnap holds the current snapshot: a pointer to whatever the
+ *  readers search (an FPCorpus, an FPIndex, ...), never changed once
+ *  published.  A reader brackets its use of the snapshot with fpsnap_enter
+ *  and fpsnap_leave, which take no lock: entering is an atomic increment
+ *  of a counter private to the reader's thread and one atomic load of the
+ *  snapshot.  A loader builds or maps the next snapshot and publishes it
+ *  with fpsnap_swap.  Readers that enter from then on get the new
+ *  snapshot; the old one is freed as soon as the last reader that had it
+ *  leaves.
+ *
+ *  Readers are counted by epoch, as in sleepable RCU: fpsnap_swap advances
+ *  the epoch and waits for the readers of the old epochs to drain, so a
+ *  reader never waits and only the loader does.  A reader must not call
+ *  fpsnap_swap on the same FPSnap while inside.
+ *
+ *  Copyright 2010 Zatisfi, LLC. MIT License, 2025
+ */
+
+#ifndef _FPSNAP_H
+#define _FPSNAP_H
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+
+// reader counters per epoch, each on its own cache line; threads are
+// spread over them so readers on different cores do not share a line
+#define FPSNAP_STRIPES 64
+
+  typedef struct FPSnap FPSnap;
+
+  // what fpsnap_enter hands the reader, for fpsnap_leave
+  typedef struct FPSnapRead
+  {
+    uint32_t epoch;
+    uint32_t stripe;
+  } FPSnapRead;
+
+  /*! fpsnap_new
+   *  \brief holder of snapshot data (may be NULL), freed with free_data
+   *  (NULL to leave snapshots to the caller) once replaced.  Returns NULL
+   *  if out of memory.
+   */
+  FPSnap *fpsnap_new(void *data, void (*free_data)(void *));
+
+  /*! fpsnap_free
+   *  \brief free s and its current snapshot; no reader may be inside
+   */
+  void fpsnap_free(FPSnap *s);
+
+  /*! fpsnap_enter
+   *  \brief the current snapshot, valid until fpsnap_leave(s, read).
+   *  Wait-free; readers may nest and may leave from another thread.
+   */
+  void *fpsnap_enter(FPSnap *s, FPSnapRead *read);
+
+  void fpsnap_leave(FPSnap *s, const FPSnapRead *read);
+
+  /*! fpsnap_swap
+   *  \brief publish data as the current snapshot, wait until no reader
+   *  has the old one and free it.  Swaps are serialized.
+   */
+  void fpsnap_swap(FPSnap *s, void *data);
+
+  /*! fpsnap_version
+   *  \brief number of swaps so far
+   */
+  uint64_t fpsnap_version(FPSnap *s);
+
+  /*! fpsnap_reload_corpus
+   *  \brief open the corpus at path and swap it in; the FPSnap must free
+   *  its data with fpsnap_free_corpus.  Returns 0, or an errno value and
+   *  keeps the current corpus.
+   */
+  int fpsnap_reload_corpus(FPSnap *s, const char *path);
+
+  // free_data for corpora (fpcorpus_close)
+  void fpsnap_free_corpus(void *corpus);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _FPSNAP_H */
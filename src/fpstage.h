@@ -0,0 +1,134 @@
+/*
+ *  fpstage.h
+ *
+ *  the decode and DSP stages of get_fingerprint, for callers that run
+ *  them on different threads
+ *
+ *  get_fingerprint demuxes and decodes a file, then resamples the PCM and
+ *  feeds it to libfooid and chromaprint, one frame at a time on the
+ *  calling thread.  The same work is split here into an FPDecoder, which
+ *  turns the file into FPFrames of PCM as the codec produced it, and an
+ *  FPDsp, which takes those frames in order and computes the fingerprint.
+ *  An FPDsp may be fed from a different thread than the one decoding, as
+ *  long as only one thread uses it at a time; the frames it is fed then
+ *  have to be copied out of the decoder.  get_fingerprint_opts is these
+ *  stages run back to back, so both give the same fingerprint.
+ *
+ *  Copyright 2010 Zatisfi, LLC. MIT License, 2025
+ */
+
+#ifndef _FPSTAGE_H
+#define _FPSTAGE_H
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "fplib.h"
+
+  struct FPCache;
+
+  typedef struct FPDecoder FPDecoder;
+  typedef struct FPDsp FPDsp;
+
+  /* What fpstage_plan settled for one file: which extractors run over how
+   * many seconds, and where the result is cached.
+   */
+  typedef struct FPStagePlan
+  {
+    int extractors;
+    int duration;
+    // cache the decoded features under feature_key; NULL if not
+    struct FPCache *features;
+    uint64_t feature_key;
+    // cache the fingerprint under print_key; NULL if not
+    struct FPCache *prints;
+    uint64_t print_key;
+  } FPStagePlan;
+
+  // what the DSP stage needs to know about the decoded stream
+  typedef struct FPStreamInfo
+  {
+    int sample_rate;
+    // channels and sample format (enum AVSampleFormat) when the codec was
+    // opened; a frame carries its own channel count
+    int channels;
+    int sample_fmt;
+    // seconds, from the container
+    uint32_t songlen;
+    // kbps from the file size, for codecs that do not report one (FLAC)
+    int32_t est_bit_rate;
+  } FPStreamInfo;
+
+  /* One decoded frame: size bytes of interleaved samples.  bit_rate and
+   * num_errors are the codec's bit rate (bps, 0 if unknown) and the
+   * read and decode errors so far, as of this frame.
+   */
+  typedef struct FPFrame
+  {
+    const int16_t *pcm;
+    int32_t size;
+    int32_t channels;
+    int32_t bit_rate;
+    int32_t num_errors;
+  } FPFrame;
+
+  /*! fpstage_plan
+   *  \brief validate opts (NULL for the defaults) and look filename up in
+   *  opts->cache.  Returns the fingerprint on a cache hit.  Otherwise
+   *  returns NULL, with *error 0 and plan filled in if the file has to be
+   *  decoded, or an error in *error if opts are invalid.
+   */
+  FPrint *fpstage_plan(const char *filename, const FPOptions *opts,
+                       FPStagePlan *plan, int *error);
+
+  /*! fpstage_decoder_open
+   *  \brief open filename and its audio codec, and fill in info.  Returns
+   *  NULL and sets *error on failure.
+   */
+  FPDecoder *fpstage_decoder_open(const char *filename, int verbose,
+                                  FPStreamInfo *info, int *error);
+
+  /*! fpstage_decode
+   *  \brief decode the next frame with samples into frame; frame->pcm is
+   *  valid until the next call.  At the end of the stream sets *eof and
+   *  fills in a frame with no samples, whose num_errors and bit_rate are
+   *  the final ones.  Returns 0 or an error.
+   */
+  int fpstage_decode(FPDecoder *d, FPFrame *frame, int *eof);
+
+  void fpstage_decoder_close(FPDecoder *d);
+
+  /*! fpstage_dsp_new
+   *  \brief resampler and extractors for a stream described by info, set
+   *  up as plan says; NULL and *error set on failure
+   */
+  FPDsp *fpstage_dsp_new(const FPStagePlan *plan, const FPStreamInfo *info,
+                         int *error);
+
+  /*! fpstage_dsp_feed
+   *  \brief resample frame and feed it to the extractors.  Sets *full once
+   *  plan->duration seconds have been fed; further frames are not needed.
+   *  Returns 0 or an error.
+   */
+  int fpstage_dsp_feed(FPDsp *p, const FPFrame *frame, int *full);
+
+  /*! fpstage_dsp_finish
+   *  \brief compute the fingerprint of what was fed, and cache it and its
+   *  features as the plan says; NULL and *error set on failure
+   */
+  FPrint *fpstage_dsp_finish(FPDsp *p, const FPStagePlan *plan,
+                             const FPStreamInfo *info, const char *filename,
+                             int *error);
+
+  void fpstage_dsp_free(FPDsp *p);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _FPSTAGE_H */
@@ -0,0 +1,160 @@
+/*
+ *  Copyright 2010 Zatisfi, LLC. MIT License, 2025
+ */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "chromaw.h"
+#include "fplib.h"
+#include "fpcache.h"
+
+#define MASSERT(expr, msg) \
+  if (!(expr))             \
+    printf(msg);
+
+#define CACHE_PATH "test_cache.fpf"
+// the file header, then the first record
+#define FIRST_RECORD 16
+#define N_SAMPLES 4000
+#define N_ROWS 50
+
+#define KEY_FEATURES 1001
+#define KEY_FPRINT 1002
+#define KEY_AFTER 1003
+
+static int same_fprint(const FPrint *a, const FPrint *b)
+{
+  uint8_t *pa = fprint_to_bytes(a);
+  uint8_t *pb = fprint_to_bytes(b);
+  int same = pa && pb && a->cprint_len == b->cprint_len &&
+             memcmp(pa, pb, PACKED_FP_SIZE(a->cprint_len)) == 0;
+
+  free(pa);
+  free(pb);
+  return same;
+}
+
+static off_t file_size(const char *path)
+{
+  struct stat st;
+
+  return stat(path, &st) == 0 ? st.st_size : -1;
+}
+
+int main(int argc, const char *argv[])
+{
+  int err = 0;
+  int fd = -1;
+  FPCache *c = NULL;
+  FPFeatures *f = NULL;
+  FPFeatures *got = NULL;
+  FPrint *fp = NULL;
+  FPrint *got_fp = NULL;
+  uint8_t *zeros = NULL;
+  off_t first_end = 0;
+
+  remove(CACHE_PATH);
+  f = fpcache_new_features(N_SAMPLES, N_ROWS);
+  fp = new_fprint(948);
+  if (!f || !fp)
+  {
+    printf("error allocating test data\n");
+    return 1;
+  }
+  f->songlen = 61;
+  f->fooid_len = 60;
+  for (size_t i = 0; i < N_SAMPLES; i++)
+    f->fooid_samples[i] = (int16_t)(i * 37);
+  for (size_t i = 0; i < N_ROWS * CHROMA_IMAGE_COLUMNS; i++)
+    f->chroma[i] = (uint16_t)(i * 101);
+  fp->songlen = 61;
+  for (size_t i = 0; i < fp->cprint_len; i++)
+    fp->cprint[i] = (int32_t)(i * 2654435761u);
+
+  c = fpcache_open(CACHE_PATH, &err);
+  if (!c)
+  {
+    printf("error creating cache\n");
+    return 1;
+  }
+  MASSERT(fpcache_put(c, KEY_FEATURES, f) == 0, "error storing features\n");
+  first_end = file_size(CACHE_PATH);
+  MASSERT(fpcache_put_fprint(c, KEY_FPRINT, fp) == 0,
+          "error storing fingerprint\n");
+  got = fpcache_get(c, KEY_FEATURES);
+  MASSERT(got && got->fooid_n_samples == N_SAMPLES &&
+              memcmp(got->chroma, f->chroma,
+                     N_ROWS * CHROMA_IMAGE_COLUMNS * sizeof(uint16_t)) == 0,
+          "stored features do not match\n");
+  fpcache_free_features(got);
+  MASSERT(!fpcache_get(c, KEY_AFTER), "missing key found\n");
+  fpcache_close(c);
+
+  // reopened: both records are indexed from the file
+  c = fpcache_open(CACHE_PATH, &err);
+  MASSERT(c, "error reopening cache\n");
+  got_fp = c ? fpcache_get_fprint(c, KEY_FPRINT) : NULL;
+  MASSERT(got_fp && same_fprint(got_fp, fp),
+          "reopened fingerprint does not match\n");
+  free_fprint(got_fp);
+  fpcache_close(c);
+
+  // a write that never landed leaves zeros; the record after it survives
+  zeros = calloc(1, (size_t)first_end);
+  fd = open(CACHE_PATH, O_WRONLY);
+  MASSERT(fd >= 0 && zeros &&
+              pwrite(fd, zeros, (size_t)(first_end - FIRST_RECORD),
+                     FIRST_RECORD) == first_end - FIRST_RECORD,
+          "error zeroing the first record\n");
+  close(fd);
+  c = fpcache_open(CACHE_PATH, &err);
+  MASSERT(c, "error opening cache with a gap\n");
+  if (c)
+  {
+    MASSERT(!fpcache_get(c, KEY_FEATURES), "zeroed record was loaded\n");
+    got_fp = fpcache_get_fprint(c, KEY_FPRINT);
+    MASSERT(got_fp && same_fprint(got_fp, fp),
+            "record after a gap was lost\n");
+    free_fprint(got_fp);
+    fpcache_close(c);
+  }
+
+  // a torn record at the end is cut off, and puts after it are kept
+  fd = open(CACHE_PATH, O_WRONLY | O_APPEND);
+  MASSERT(fd >= 0 && write(fd, "FPFRtorn", 8) == 8,
+          "error appending a torn record\n");
+  close(fd);
+  c = fpcache_open(CACHE_PATH, &err);
+  MASSERT(c, "error opening cache with a torn tail\n");
+  if (c)
+  {
+    MASSERT(fpcache_put(c, KEY_AFTER, f) == 0, "error storing features\n");
+    fpcache_close(c);
+  }
+  c = fpcache_open(CACHE_PATH, &err);
+  MASSERT(c, "error reopening cache after the torn tail\n");
+  if (c)
+  {
+    got = fpcache_get(c, KEY_AFTER);
+    MASSERT(got && got->songlen == f->songlen,
+            "record after a torn tail was lost\n");
+    fpcache_free_features(got);
+    got_fp = fpcache_get_fprint(c, KEY_FPRINT);
+    MASSERT(got_fp != NULL, "record before a torn tail was lost\n");
+    free_fprint(got_fp);
+    fpcache_close(c);
+  }
+
+  free(zeros);
+  free_fprint(fp);
+  fpcache_free_features(f);
+  remove(CACHE_PATH);
+
+  return 0;
+}
@@ -0,0 +1,351 @@
+/*
+ *  Copyright 2010 Zatisfi, LLC. MIT License, 2025
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "fplib.h"
+#include "fpcorpus.h"
+#include "fpslice.h"
+#include "fphalf.h"
+#include "fpmerge.h"
+#include "fpsnap.h"
+
+#define MASSERT(expr, msg) \
+  if (!(expr))             \
+    printf(msg);
+
+#define CORPUS_PATH "test_corpus.fpc"
+#define MERGED_PATH "test_merged.fpc"
+#define HALF_PATH "test_corpus.fpc.fph"
+#define CORRUPT_PATH "test_corrupt.fpc"
+#define N_ENTRIES 8
+
+static int reload_result = -1;
+
+// fpsnap_reload_corpus waits for readers, so it runs beside the one held
+static void *reload_merged(void *snap)
+{
+  reload_result = fpsnap_reload_corpus((FPSnap *)snap, MERGED_PATH);
+  return NULL;
+}
+
+int main(int argc, const char *argv[])
+{
+  int err = 0;
+  int verbose = 0;
+  FPrint *f1 = NULL;
+  FPrint *f2 = NULL;
+  FPrint *preview = NULL;
+  FPCorpusWriter *w = NULL;
+  FPCorpus *c = NULL;
+  FPCorpusHit hits[N_ENTRIES];
+  FPCorpusPair *pairs = NULL;
+  const char *inputs[2] = {CORPUS_PATH, CORPUS_PATH};
+  FPMergeStats merge_stats;
+  FPCorpus *merged = NULL;
+  FPSnap *snap = NULL;
+  FPSnapRead rd;
+  FPSnapRead rd_new;
+  pthread_t reloader;
+  const FPCorpus *held = NULL;
+  const FPCorpus *cur = NULL;
+  uint64_t held_ids[N_ENTRIES];
+  FPSlices *slices = NULL;
+  FPCorpusHit slice_hits[N_ENTRIES];
+  FPHalf *half = NULL;
+  FPHalfStats half_stats;
+  double scores[N_ENTRIES];
+  size_t n_hits = 0;
+  size_t n_pairs = 0;
+  uint32_t songlen = 0;
+  FPCorpusHeader hdr;
+  uint64_t bad_off = 0;
+  int fd = -1;
+
+  ffmpeg_init();
+
+  f1 = get_fingerprint("blue.mp3", &err, verbose);
+  if (!f1)
+  {
+    printf("error obtaining fingerprint\n");
+    return 1;
+  }
+
+  w = fpcorpus_writer_new(CORPUS_PATH, &err);
+  if (!w)
+  {
+    printf("error creating corpus\n");
+    free_fprint(f1);
+    return 1;
+  }
+  // entry 0 is f1; the rest are far too long to match it or each other
+  songlen = f1->songlen;
+  for (int i = 0; i < N_ENTRIES; i++)
+  {
+    f1->songlen = songlen * (i + 1);
+    if (fpcorpus_writer_add(w, 100 + i, f1) != 0)
+    {
+      printf("error adding entry %d\n", i);
+      fpcorpus_writer_abort(w);
+      free_fprint(f1);
+      return 1;
+    }
+  }
+  f1->songlen = songlen;
+  if (fpcorpus_writer_close(w) != 0)
+  {
+    printf("error writing corpus\n");
+    free_fprint(f1);
+    return 1;
+  }
+
+  c = fpcorpus_open(CORPUS_PATH, &err);
+  if (!c)
+  {
+    printf("error opening corpus\n");
+    free_fprint(f1);
+    return 1;
+  }
+
+  MASSERT(c->count == N_ENTRIES, "count does not match\n");
+  MASSERT(c->ids[3] == 103, "ids do not match\n");
+  MASSERT(c->songlen[0] == f1->songlen, "songlen does not match\n");
+  MASSERT(c->bit_rate[0] == f1->bit_rate, "bit_rate does not match\n");
+  MASSERT(fpcorpus_cprint_len(c, 5) == f1->cprint_len,
+          "cprint_len does not match\n");
+  MASSERT(memcmp(&c->r[5 * R_SIZE], f1->r, R_SIZE) == 0,
+          "r does not match\n");
+  MASSERT(memcmp(&c->dom[5 * DOM_SIZE], f1->dom, DOM_SIZE) == 0,
+          "dom does not match\n");
+
+  f2 = fpcorpus_get(c, 0);
+  MASSERT(f2 && match_cpfm(f1, f2) == fpcorpus_match(c, f1, 0),
+          "fpcorpus_match does not agree with match_cpfm\n");
+
+  n_hits = fpcorpus_topk(c, f1, N_ENTRIES, FP_MATCH_CUTOFF, hits);
+  MASSERT(n_hits == 1 && hits[0].ix == 0, "topk did not find only itself\n");
+
+  slices = fpslice_build(c, &err);
+  MASSERT(slices != NULL, "error slicing corpus\n");
+  if (slices)
+  {
+    fpslice_match_chromab(slices, f1->cprint, f1->cprint_len, scores);
+    MASSERT(scores[0] == match_chromab(f1->cprint, f1->cprint_len,
+                                       fpcorpus_cprint(c, 0),
+                                       fpcorpus_cprint_len(c, 0)),
+            "sliced chromab does not agree with match_chromab\n");
+    fpslice_match_all(slices, c, f1, scores);
+    MASSERT(scores[0] == fpcorpus_match(c, f1, 0) && scores[1] == 0.0,
+            "sliced match does not agree with fpcorpus_match\n");
+    MASSERT(fpslice_topk(slices, c, f1, N_ENTRIES, FP_MATCH_CUTOFF,
+                         slice_hits) == n_hits &&
+                slice_hits[0].ix == hits[0].ix,
+            "sliced topk does not agree with fpcorpus_topk\n");
+    fpslice_free(slices);
+  }
+
+  err = fphalf_write(c, HALF_PATH);
+  MASSERT(err == 0, "error writing half-prints\n");
+  half = fphalf_open(HALF_PATH, c, &err);
+  MASSERT(half != NULL, "error opening half-prints\n");
+  if (half)
+  {
+    MASSERT(fphalf_topk(half, c, f1, N_ENTRIES, FP_MATCH_CUTOFF, slice_hits,
+                        &half_stats) == n_hits &&
+                slice_hits[0].ix == hits[0].ix &&
+                slice_hits[0].score == hits[0].score,
+            "half-print topk does not agree with fpcorpus_topk\n");
+    fphalf_close(half);
+  }
+
+  // a preview query: the first seconds of chroma, no fooid
+  preview = new_fprint((int)min_st(FP_CPRINT_LEN(FP_PREVIEW_DURATION),
+                                   f1->cprint_len));
+  MASSERT(preview != NULL, "error allocating preview\n");
+  if (preview)
+  {
+    preview->songlen = f1->songlen;
+    preview->missing = FP_MISSING_FOOID | FP_MISSING_TAIL;
+    memcpy(preview->cprint, f1->cprint, preview->cprint_len * sizeof(int32_t));
+    MASSERT(fpcorpus_match(c, preview, 0) == match_cpfm(preview, f2) &&
+                fpcorpus_match(c, preview, 0) >= FP_EXACT_CUTOFF,
+            "preview query was scored on parts it does not have\n");
+    n_hits = fpcorpus_topk(c, preview, N_ENTRIES, FP_MATCH_CUTOFF, hits);
+    MASSERT(n_hits == 1 && hits[0].ix == 0, "topk did not find the preview\n");
+    slices = fpslice_build(c, &err);
+    MASSERT(slices && fpslice_topk(slices, c, preview, N_ENTRIES,
+                                   FP_MATCH_CUTOFF, slice_hits) == n_hits &&
+                slice_hits[0].score == hits[0].score,
+            "sliced topk of a preview does not agree with fpcorpus_topk\n");
+    fpslice_free(slices);
+    half = fphalf_open(HALF_PATH, c, &err);
+    MASSERT(half && fphalf_topk(half, c, preview, N_ENTRIES, FP_MATCH_CUTOFF,
+                                slice_hits, &half_stats) == n_hits &&
+                slice_hits[0].score == hits[0].score,
+            "half-print topk of a preview does not agree with fpcorpus_topk\n");
+    fphalf_close(half);
+
+    // 7 of every 10 positions agreeing is far from a match for a complete
+    // pair, and so it is for a chroma-only one
+    for (size_t i = 0; i < preview->cprint_len; i++)
+    {
+      if (i % 10 >= 7)
+        preview->cprint[i] = ~preview->cprint[i];
+    }
+    MASSERT(match_chromab(preview->cprint, preview->cprint_len, f2->cprint,
+                          preview->cprint_len) >= 0.69 &&
+                !FP_ISMATCH(match_cpfm(preview, f2)),
+            "partial score is not on the scale of the cutoffs\n");
+    free_fprint(preview);
+  }
+
+  // a full capture of a track longer than the analysis cap stops at the cap
+  // and is not truncated; a preview of it, or of a track of unknown length,
+  // is
+  preview = new_fprint((int)FP_CPRINT_LEN(FP_DEFAULT_DURATION));
+  MASSERT(preview != NULL, "error allocating long-track print\n");
+  if (preview)
+  {
+    preview->songlen = 5 * FP_DEFAULT_DURATION;
+    preview->missing = FP_MISSING_TAIL;
+    MASSERT(fprint_missing(preview) == 0,
+            "capped print of a long track is flagged truncated\n");
+    preview->cprint_len = FP_CPRINT_LEN(FP_PREVIEW_DURATION);
+    MASSERT(fprint_missing(preview) == FP_MISSING_TAIL,
+            "preview of a long track is not flagged truncated\n");
+    preview->songlen = 0;
+    MASSERT(fprint_missing(preview) == FP_MISSING_TAIL,
+            "preview of a track of unknown length is not flagged truncated\n");
+    free_fprint(preview);
+  }
+
+  pairs = fpcorpus_self_join(c, FP_MATCH_CUTOFF, &n_pairs, &err);
+  MASSERT(err == 0 && n_pairs == 0, "self_join matched different songlens\n");
+
+  // a corpus merged with itself: every entry of the second copy is a
+  // duplicate
+  err = fpmerge_corpora(inputs, 2, MERGED_PATH, NULL, &merge_stats);
+  MASSERT(err == 0 && merge_stats.n_out == N_ENTRIES &&
+              merge_stats.n_dups == N_ENTRIES,
+          "merge did not drop the duplicates\n");
+  merged = fpcorpus_open(MERGED_PATH, &err);
+  MASSERT(merged && merged->count == N_ENTRIES, "error opening merged corpus\n");
+  if (merged)
+  {
+    for (uint64_t i = 1; i < merged->count; i++)
+    {
+      MASSERT(merged->ids[i] == i, "merged ids are not renumbered\n");
+      uint32_t prev = fpmerge_key(merged->songlen[i - 1],
+                                  &merged->dom[(i - 1) * DOM_SIZE]);
+      MASSERT(prev <= fpmerge_key(merged->songlen[i], &merged->dom[i * DOM_SIZE]),
+              "merged entries are not in key order\n");
+    }
+    fpcorpus_close(merged);
+  }
+
+  // a reader keeps the snapshot it entered with across a reload
+  snap = fpsnap_new(fpcorpus_open(CORPUS_PATH, &err), fpsnap_free_corpus);
+  MASSERT(snap, "error creating snapshot\n");
+  if (snap)
+  {
+    merged = fpsnap_enter(snap, &rd);
+    MASSERT(fpsnap_reload_corpus(snap, "no_such_corpus.fpc") != 0 &&
+                fpsnap_version(snap) == 0,
+            "reload of a missing corpus replaced the snapshot\n");
+    fpsnap_leave(snap, &rd);
+
+    held = fpsnap_enter(snap, &rd);
+    memcpy(held_ids, held->ids, N_ENTRIES * sizeof(uint64_t));
+    MASSERT(pthread_create(&reloader, NULL, reload_merged, snap) == 0,
+            "error starting the reload\n");
+    // wait until new readers get the reloaded corpus
+    for (int i = 0; i < 1000; i++)
+    {
+      cur = fpsnap_enter(snap, &rd_new);
+      fpsnap_leave(snap, &rd_new);
+      if (cur != held)
+        break;
+      usleep(1000);
+    }
+    MASSERT(cur != held, "reload did not swap the snapshot\n");
+    MASSERT(fpsnap_version(snap) == 0,
+            "reload finished while a reader held the old snapshot\n");
+    // the old corpus stays mapped until the held reader leaves
+    MASSERT(held->count == N_ENTRIES &&
+                memcmp(held->ids, held_ids, sizeof(held_ids)) == 0 &&
+                fpcorpus_match(held, f1, 0) >= FP_EXACT_CUTOFF,
+            "held reader lost its snapshot\n");
+    fpsnap_leave(snap, &rd);
+    pthread_join(reloader, NULL);
+    MASSERT(reload_result == 0 && fpsnap_version(snap) == 1,
+            "error reloading corpus\n");
+    fpsnap_free(snap);
+    merged = NULL;
+  }
+
+  // offsets that go backwards are refused at open, before any scan
+  system("cp " CORPUS_PATH " " CORRUPT_PATH);
+  fd = open(CORRUPT_PATH, O_RDWR);
+  MASSERT(fd >= 0 && pread(fd, &hdr, sizeof(hdr), 0) == sizeof(hdr),
+          "error reading corpus header\n");
+  bad_off = hdr.cprint_total;
+  MASSERT(pwrite(fd, &bad_off, sizeof(bad_off),
+                 (off_t)(hdr.off_cprint_off + sizeof(uint64_t))) ==
+              sizeof(bad_off),
+          "error corrupting cprint offsets\n");
+  close(fd);
+  merged = fpcorpus_open(CORRUPT_PATH, &err);
+  MASSERT(!merged && err == EINVAL, "corrupt cprint offsets were accepted\n");
+  fpcorpus_close(merged);
+  merged = NULL;
+
+  // a cprint_total whose size in bytes wraps to the real one, with the
+  // last offset to match, would send scans past the end of the mapping
+  system("cp " CORPUS_PATH " " CORRUPT_PATH);
+  fd = open(CORRUPT_PATH, O_RDWR);
+  bad_off = hdr.cprint_total + ((uint64_t)1 << 62);
+  hdr.cprint_total = bad_off;
+  MASSERT(fd >= 0 && pwrite(fd, &hdr, sizeof(hdr), 0) == sizeof(hdr) &&
+              pwrite(fd, &bad_off, sizeof(bad_off),
+                     (off_t)(hdr.off_cprint_off +
+                             hdr.count * sizeof(uint64_t))) == sizeof(bad_off),
+          "error corrupting cprint_total\n");
+  close(fd);
+  merged = fpcorpus_open(CORRUPT_PATH, &err);
+  MASSERT(!merged && err == EINVAL, "overflowing cprint_total was accepted\n");
+  fpcorpus_close(merged);
+  merged = NULL;
+
+  // a column that is not aligned for its element type
+  system("cp " CORPUS_PATH " " CORRUPT_PATH);
+  fd = open(CORRUPT_PATH, O_RDWR);
+  MASSERT(fd >= 0 && pread(fd, &hdr, sizeof(hdr), 0) == sizeof(hdr),
+          "error reading corpus header\n");
+  hdr.off_ids += 4;
+  MASSERT(pwrite(fd, &hdr, sizeof(hdr), 0) == sizeof(hdr),
+          "error misaligning a column\n");
+  close(fd);
+  merged = fpcorpus_open(CORRUPT_PATH, &err);
+  MASSERT(!merged && err == EINVAL, "misaligned column was accepted\n");
+  fpcorpus_close(merged);
+  merged = NULL;
+
+  free(pairs);
+  free_fprint(f2);
+  fpcorpus_close(c);
+  free_fprint(f1);
+  remove(CORPUS_PATH);
+  remove(MERGED_PATH);
+  remove(HALF_PATH);
+  remove(CORRUPT_PATH);
+
+  return 0;
+}
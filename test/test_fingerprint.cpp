@@ -0,0 +1,93 @@
+/*
+ *  Copyright 2010 Zatisfi, LLC. MIT License, 2025
+ */
+
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <system_error>
+#include <utility>
+
+#include "fingerprint.hpp"
+
+#define MASSERT(expr, msg) \
+  if (!(expr))             \
+    printf(msg);
+
+int main(int argc, const char *argv[])
+{
+  using namespace fingerprint;
+
+  ffmpeg_init();
+
+  Context ctx;
+  Fingerprint f1;
+  try
+  {
+    f1 = ctx.fingerprint("blue.mp3");
+  }
+  catch (const std::system_error &e)
+  {
+    printf("error obtaining fingerprint: %s\n", e.what());
+    return 1;
+  }
+
+  // the views alias the FPrint; nothing is copied
+  MASSERT(f1.cprint().data() == f1.get()->cprint &&
+              f1.cprint().size() == f1.get()->cprint_len,
+          "cprint view does not alias the fingerprint\n");
+  MASSERT(f1.r().size() == R_SIZE && f1.dom().size() == DOM_SIZE,
+          "r or dom view has the wrong size\n");
+  MASSERT(match(f1, f1) == match_cpfm(f1.get(), f1.get()),
+          "view match does not agree with match_cpfm\n");
+
+  // moving hands the same FPrint over
+  FPrint *raw = f1.get();
+  Fingerprint f2 = std::move(f1);
+  MASSERT(!f1 && f2.get() == raw, "move did not transfer ownership\n");
+
+  Fingerprint f3 = Fingerprint::from_string(f2.to_string());
+  MASSERT(match(f2, f3) == match_cpfm(f2.get(), f3.get()),
+          "string round trip does not match\n");
+
+  // a string cut before its closing ')' is refused, not read past its end
+  std::string cut = f2.to_string();
+  cut.resize(cut.find(')'));
+  bool refused = false;
+  try
+  {
+    Fingerprint::from_string(cut);
+  }
+  catch (const std::system_error &)
+  {
+    refused = true;
+  }
+  MASSERT(refused, "string without a closing ')' was accepted\n");
+
+  Bytes bytes = f2.to_bytes();
+  Fingerprint f4 = Fingerprint::from_bytes(bytes.get());
+  MASSERT(f4.cprint().size() == f2.cprint().size() &&
+              std::memcmp(f4.cprint().data(), f2.cprint().data(),
+                          f2.cprint().size_bytes()) == 0,
+          "bytes round trip does not match\n");
+
+  // a trimmed copy of the cprint, as a preview would have
+  Fingerprint f5 = Fingerprint::with_cprint_len(f2.cprint().size() / 2);
+  f5.set_songlen(f2.songlen());
+  std::memcpy(f5.cprint().data(), f2.cprint().data(), f5.cprint().size_bytes());
+  MASSERT(match_chromab(f2.cprint().first(f5.cprint().size()), f5.cprint()) == 1.0,
+          "span match of a prefix is not exact\n");
+
+  bool thrown = false;
+  try
+  {
+    ctx.fingerprint("no such file.mp3");
+  }
+  catch (const std::system_error &)
+  {
+    thrown = true;
+  }
+  MASSERT(thrown, "missing file did not throw\n");
+
+  return 0;
+}
@@ -0,0 +1,157 @@
+/*
+ *  Copyright 2010 Zatisfi, LLC. MIT License, 2025
+ */
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+
+#include "fplib.h"
+#include "fpindex.h"
+
+#define MASSERT(expr, msg) \
+  if (!(expr))             \
+    printf(msg);
+
+#define INDEX_PATH "test_index.fpi"
+#define N_ENTRIES 8
+#define N_STRAYS 26
+
+int main(int argc, const char *argv[])
+{
+  int err = 0;
+  int verbose = 0;
+  FPrint *f1 = NULL;
+  FPIndex *ix = NULL;
+  FPIndexHit hits[N_ENTRIES];
+  FPQCacheStats st;
+  size_t n_hits = 0;
+  uint32_t songlen = 0;
+  char stray[64];
+  FILE *out = NULL;
+  struct rlimit fsize;
+  struct rlimit short_fsize;
+
+  ffmpeg_init();
+
+  f1 = get_fingerprint("blue.mp3", &err, verbose);
+  if (!f1)
+  {
+    printf("error obtaining fingerprint\n");
+    return 1;
+  }
+
+  ix = fpindex_open(INDEX_PATH, &err);
+  if (!ix)
+  {
+    printf("error creating index\n");
+    free_fprint(f1);
+    return 1;
+  }
+  // entry 0 is f1; the rest share its terms but are far too long to match
+  songlen = f1->songlen;
+  for (int i = 0; i < N_ENTRIES; i++)
+  {
+    f1->songlen = songlen * (i + 1);
+    MASSERT(fpindex_add(ix, 100 + i, f1) == 0, "error adding entry\n");
+  }
+  f1->songlen = songlen;
+  MASSERT(fpindex_count(ix) == N_ENTRIES, "count does not match\n");
+
+  n_hits = fpindex_query(ix, f1, N_ENTRIES, FP_MATCH_CUTOFF, hits);
+  MASSERT(n_hits == 1 && hits[0].id == 100,
+          "query did not find only itself in memory\n");
+
+  MASSERT(fpindex_flush(ix) == 0, "error flushing index\n");
+  n_hits = fpindex_query(ix, f1, N_ENTRIES, FP_MATCH_CUTOFF, hits);
+  MASSERT(n_hits == 1 && hits[0].id == 100,
+          "query did not find only itself on disk\n");
+
+  // one more in memory only: the log brings it back
+  MASSERT(fpindex_add(ix, 200, f1) == 0, "error adding entry\n");
+  fpindex_close(ix);
+
+  ix = fpindex_open(INDEX_PATH, &err);
+  if (!ix)
+  {
+    printf("error reopening index\n");
+    free_fprint(f1);
+    return 1;
+  }
+  MASSERT(fpindex_count(ix) == N_ENTRIES + 1, "reopened count does not match\n");
+  n_hits = fpindex_query(ix, f1, N_ENTRIES, FP_MATCH_CUTOFF, hits);
+  MASSERT(n_hits == 2 && hits[0].score == hits[1].score,
+          "reopened query did not find both copies\n");
+
+  // the second query is served from the cache, until an add invalidates it
+  MASSERT(fpindex_enable_cache(ix, 16) == 0, "error enabling cache\n");
+  fpindex_query(ix, f1, N_ENTRIES, FP_MATCH_CUTOFF, hits);
+  n_hits = fpindex_query(ix, f1, N_ENTRIES, FP_MATCH_CUTOFF, hits);
+  fpindex_cache_stats(ix, &st);
+  MASSERT(n_hits == 2 && st.hits == 1 && st.misses == 1,
+          "repeated query was not cached\n");
+  MASSERT(fpindex_add(ix, 300, f1) == 0, "error adding entry\n");
+  n_hits = fpindex_query(ix, f1, N_ENTRIES, FP_MATCH_CUTOFF, hits);
+  fpindex_cache_stats(ix, &st);
+  MASSERT(n_hits == 3 && st.stale == 1, "add did not invalidate the cache\n");
+  MASSERT(fpindex_flush(ix) == 0, "error flushing index\n");
+  fpindex_close(ix);
+
+  // temporary files left by a crash; enough that some are listed before a
+  // segment whatever the directory order
+  for (int i = 0; i < N_STRAYS; i++)
+  {
+    snprintf(stray, sizeof(stray), INDEX_PATH "/%c-stray.tmp", 'a' + i);
+    if ((out = fopen(stray, "w")))
+      fclose(out);
+  }
+  ix = fpindex_open(INDEX_PATH, &err);
+  if (!ix)
+  {
+    printf("error reopening index with stray temporary files\n");
+    free_fprint(f1);
+    return 1;
+  }
+  MASSERT(fpindex_count(ix) == N_ENTRIES + 2,
+          "count with stray temporary files does not match\n");
+  for (int i = 0; i < N_STRAYS; i++)
+  {
+    snprintf(stray, sizeof(stray), INDEX_PATH "/%c-stray.tmp", 'a' + i);
+    MASSERT(!(out = fopen(stray, "r")), "stray temporary file was not removed\n");
+    if (out)
+      fclose(out);
+  }
+
+  // an add cut short by a full disk is not logged, and the adds after it
+  // survive a reopen; the new log is empty, so 16 bytes tear the first
+  // record
+  signal(SIGXFSZ, SIG_IGN);
+  getrlimit(RLIMIT_FSIZE, &fsize);
+  short_fsize = fsize;
+  short_fsize.rlim_cur = 16;
+  setrlimit(RLIMIT_FSIZE, &short_fsize);
+  MASSERT(fpindex_add(ix, 400, f1) != 0, "short log write did not fail\n");
+  setrlimit(RLIMIT_FSIZE, &fsize);
+  MASSERT(fpindex_add(ix, 500, f1) == 0, "error adding entry\n");
+  fpindex_close(ix);
+  ix = fpindex_open(INDEX_PATH, &err);
+  if (!ix)
+  {
+    printf("error reopening index after a short log write\n");
+    free_fprint(f1);
+    return 1;
+  }
+  MASSERT(fpindex_count(ix) == N_ENTRIES + 3,
+          "add after a short log write was lost\n");
+  n_hits = fpindex_query(ix, f1, N_ENTRIES, FP_MATCH_CUTOFF, hits);
+  MASSERT(n_hits == 4 && hits[3].id != 400,
+          "failed add was replayed\n");
+  fpindex_close(ix);
+  free_fprint(f1);
+  system("rm -rf " INDEX_PATH);
+
+  return 0;
+}
@@ -0,0 +1,73 @@
+/*
+ *  Copyright 2010 Zatisfi, LLC. MIT License, 2025
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fplib.h"
+#include "fpminhash.h"
+
+#define MASSERT(expr, msg) \
+  if (!(expr))             \
+    printf(msg);
+
+int main(int argc, const char *argv[])
+{
+  int err = 0;
+  int verbose = 0;
+  FPrint *f1 = NULL;
+  FPMinHashIndex *ix = NULL;
+  FPMinHashHit hits[4];
+  uint32_t sig[FPMINHASH_K];
+  uint32_t trimmed[FPMINHASH_K];
+  size_t skip = 0;
+  size_t n_hits = 0;
+  size_t n_candidates = 0;
+
+  ffmpeg_init();
+
+  f1 = get_fingerprint("blue.mp3", &err, verbose);
+  if (!f1)
+  {
+    printf("error obtaining fingerprint\n");
+    return 1;
+  }
+
+  // the same song without its first fifth: a late start
+  skip = f1->cprint_len / 5;
+  fpminhash_sign(f1->cprint, f1->cprint_len, FPMINHASH_MASK, sig);
+  fpminhash_sign(f1->cprint + skip, f1->cprint_len - skip, FPMINHASH_MASK,
+                 trimmed);
+  MASSERT(fpminhash_jaccard(sig, sig) == 1.0, "self similarity is not 1\n");
+  MASSERT(fpminhash_jaccard(sig, trimmed) > 0.5,
+          "trimmed copy is not similar\n");
+  MASSERT(match_chromab(f1->cprint, f1->cprint_len, f1->cprint + skip,
+                        f1->cprint_len - skip) < fpminhash_jaccard(sig, trimmed),
+          "chromab is not hurt by the offset\n");
+
+  ix = fpminhash_index_new(&err);
+  if (!ix)
+  {
+    printf("error creating minhash index\n");
+    free_fprint(f1);
+    return 1;
+  }
+  MASSERT(fpminhash_index_add(ix, 100, sig) == 0, "error adding entry\n");
+  fpminhash_sign(NULL, 0, FPMINHASH_MASK, sig);
+  MASSERT(fpminhash_index_add(ix, 101, sig) == EINVAL,
+          "empty signature was added\n");
+  MASSERT(fpminhash_index_count(ix) == 1, "count does not match\n");
+
+  n_hits = fpminhash_index_query(ix, trimmed, 4, 0.5, hits, &n_candidates);
+  MASSERT(n_hits == 1 && hits[0].id == 100 && n_candidates == 1,
+          "query did not find the trimmed copy\n");
+
+  fpminhash_index_free(ix);
+  free_fprint(f1);
+
+  return 0;
+}